@@ -55,6 +55,53 @@ typedef struct ConnCacheEntry
  */
 static HTAB *ConnectionHash = NULL;
 
+#ifdef META_DRIVER
+/*
+ * Connection not in the cache, handed out by mongo_get_private_connection to
+ * one scan at a time. The scan may leave a fetch running on it in the
+ * background, which has to be over before the connection can be used again,
+ * or stream its documents with an exhaust cursor, which makes the client
+ * unusable for anything else until it is drained. Once the scan releases the
+ * connection it stays open, idle, for the next scan of the same server and
+ * user.
+ */
+typedef struct PrivateConnection
+{
+	ConnCacheKey key;		/* server and user the connection is for */
+	MONGO_CONN *conn;
+	bool		busy;		/* handed out to a scan */
+	MONGO_CURSOR *cursor;	/* cursor of the fetch in flight */
+	struct MongoCursorPrefetch *prefetch;	/* fetch in flight, or NULL */
+	int			level;		/* xact nesting level of the scan using conn */
+} PrivateConnection;
+
+/* private connections of the backend, in TopMemoryContext */
+static List *PrivateConnections = NIL;
+
+static PrivateConnection *mongo_private_connection_entry(MONGO_CONN *conn);
+static void mongo_close_private_connections(int level);
+#endif
+
+/*
+ * Document a scan or modify built and destroys when it ends, remembered so
+ * that the transaction callbacks can destroy it if the query fails first.
+ */
+typedef struct TrackedDocument
+{
+	BSON	   *document;
+	int			level;		/* xact nesting level of the scan or modify */
+} TrackedDocument;
+
+/* documents of the running scans and modifies, in TopMemoryContext */
+static List *TrackedDocuments = NIL;
+static bool CallbacksRegistered = false;
+
+static void mongo_destroy_documents(int level);
+static void mongo_register_callbacks(void);
+static void mongo_xact_callback(XactEvent event, void *arg);
+static void mongo_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+								   SubTransactionId parentSubid, void *arg);
+
 /*
  * mongo_get_connection:
  * 			Get a mong connection which can be used to execute queries on
@@ -135,6 +182,22 @@ mongo_cleanup_connection()
 		MongoDisconnect(entry->conn);
 		entry->conn = NULL;
 	}
+
+#ifdef META_DRIVER
+	while (PrivateConnections != NIL)
+	{
+		PrivateConnection *privateEntry = linitial(PrivateConnections);
+
+		PrivateConnections = list_delete_first(PrivateConnections);
+		elog(DEBUG3, "disconnecting private mongo_fdw connection %p",
+			 privateEntry->conn);
+		if (privateEntry->prefetch != NULL)
+			MongoCursorPrefetchAbandon(privateEntry->prefetch, privateEntry->conn);
+		else
+			MongoDisconnect(privateEntry->conn);
+		pfree(privateEntry);
+	}
+#endif
 }
 
 /*
@@ -148,3 +211,299 @@ mongo_release_connection(MONGO_CONN *conn)
 	 * cleanup on the backend exit.
 	 */
 }
+
+#ifdef META_DRIVER
+/*
+ * mongo_get_private_connection:
+ * 			Get a connection that is not cached, for a scan that wants a client
+ * of its own, so that it can open an exhaust cursor on it, or leave a fetch
+ * running on it while the rest of the query goes on. Statements run or
+ * planned meanwhile, such as those of a PL/pgSQL loop over the scan, use the
+ * cached connection. An idle private connection to the same server for the
+ * same user is reused, and a new one established otherwise. The scan hands it
+ * back with mongo_release_private_connection; if the transaction aborts first,
+ * the transaction callbacks close it.
+ */
+MONGO_CONN *
+mongo_get_private_connection(ForeignServer *server, UserMapping *user,
+							 MongoFdwOptions *opt)
+{
+	PrivateConnection *entry = NULL;
+	ListCell		  *entryCell = NULL;
+	MemoryContext		oldContext;
+	MONGO_CONN		  *conn = NULL;
+
+	mongo_register_callbacks();
+
+	foreach(entryCell, PrivateConnections)
+	{
+		entry = (PrivateConnection *) lfirst(entryCell);
+
+		if (!entry->busy && entry->key.serverid == server->serverid &&
+			entry->key.userid == user->userid)
+		{
+			entry->busy = true;
+			entry->level = GetCurrentTransactionNestLevel();
+			return entry->conn;
+		}
+	}
+
+	/* connect first, so that a failure leaves nothing behind to clean up */
+	conn = MongoConnect(opt->svr_address, opt->svr_port, opt->svr_database, opt->svr_username, opt->svr_password,
+		opt->authenticationDatabase, opt->replicaSet, opt->readPreference,
+		opt->ssl, opt->pem_file, opt->pem_pwd, opt->ca_file, opt->ca_dir, opt->crl_file, opt->weak_cert_validation);
+
+	oldContext = MemoryContextSwitchTo(TopMemoryContext);
+	entry = (PrivateConnection *) palloc0(sizeof(PrivateConnection));
+	entry->key.serverid = server->serverid;
+	entry->key.userid = user->userid;
+	entry->conn = conn;
+	entry->busy = true;
+	entry->level = GetCurrentTransactionNestLevel();
+	PrivateConnections = lappend(PrivateConnections, entry);
+	MemoryContextSwitchTo(oldContext);
+
+	elog(DEBUG3, "new private mongo_fdw connection %p for server \"%s:%d\"",
+		 entry->conn, opt->svr_address, opt->svr_port);
+
+	return entry->conn;
+}
+
+/*
+ * mongo_release_private_connection:
+ * 			Hand back a connection got from mongo_get_private_connection, which
+ * stays open for the next scan. Any fetch started on it must have been
+ * finished, and its cursors destroyed.
+ */
+void
+mongo_release_private_connection(MONGO_CONN *conn)
+{
+	PrivateConnection *entry = mongo_private_connection_entry(conn);
+
+	if (entry == NULL)
+		return;
+
+	Assert(entry->prefetch == NULL);
+	entry->busy = false;
+}
+
+/*
+ * mongo_register_prefetch:
+ * 			Remember the fetch started in the background for the cursor, or
+ * forget it when prefetch is NULL. If the transaction aborts before the scan
+ * waits for the fetch, the transaction callbacks abandon it.
+ */
+void
+mongo_register_prefetch(MONGO_CONN *conn, MONGO_CURSOR *cursor,
+						struct MongoCursorPrefetch *prefetch)
+{
+	PrivateConnection *entry = mongo_private_connection_entry(conn);
+
+	if (entry == NULL)
+		return;
+
+	entry->cursor = (prefetch != NULL) ? cursor : NULL;
+	entry->prefetch = prefetch;
+}
+
+static PrivateConnection *
+mongo_private_connection_entry(MONGO_CONN *conn)
+{
+	ListCell *entryCell = NULL;
+
+	foreach(entryCell, PrivateConnections)
+	{
+		PrivateConnection *entry = (PrivateConnection *) lfirst(entryCell);
+
+		if (entry->conn == conn)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * mongo_close_private_connections:
+ * 			Close the private connections still handed out to scans of the
+ * given transaction nesting level or deeper, which the scans of an aborted
+ * (sub)transaction left behind, possibly in the middle of an exhaust cursor;
+ * their cursors are left to the memory of the driver. A fetch still running on
+ * one is abandoned rather than waited for, as it cannot be interrupted, and
+ * closes the connection itself once it is over. Idle connections stay open.
+ */
+static void
+mongo_close_private_connections(int level)
+{
+	ListCell *entryCell = NULL;
+	List	 *remaining = NIL;
+	MemoryContext oldContext;
+
+	foreach(entryCell, PrivateConnections)
+	{
+		PrivateConnection *entry = (PrivateConnection *) lfirst(entryCell);
+
+		if (!entry->busy || entry->level < level)
+		{
+			oldContext = MemoryContextSwitchTo(TopMemoryContext);
+			remaining = lappend(remaining, entry);
+			MemoryContextSwitchTo(oldContext);
+			continue;
+		}
+
+		elog(DEBUG3, "disconnecting private mongo_fdw connection %p", entry->conn);
+		if (entry->prefetch != NULL)
+			MongoCursorPrefetchAbandon(entry->prefetch, entry->conn);
+		else
+			MongoDisconnect(entry->conn);
+		pfree(entry);
+	}
+
+	list_free(PrivateConnections);
+	PrivateConnections = remaining;
+}
+#endif
+
+/*
+ * mongo_track_document:
+ * 			Remember a document built for a scan or modify started at the given
+ * transaction nesting level, which destroys it with mongo_destroy_document. If
+ * the transaction, or the subtransaction of that level, aborts first, the
+ * transaction callbacks destroy it, as the scan's state is gone by then.
+ */
+void
+mongo_track_document(BSON *document, int level)
+{
+	TrackedDocument *entry;
+	MemoryContext	 oldContext;
+
+	if (document == NULL)
+		return;
+
+	mongo_register_callbacks();
+
+	oldContext = MemoryContextSwitchTo(TopMemoryContext);
+	entry = (TrackedDocument *) palloc(sizeof(TrackedDocument));
+	entry->document = document;
+	entry->level = level;
+	TrackedDocuments = lappend(TrackedDocuments, entry);
+	MemoryContextSwitchTo(oldContext);
+}
+
+/*
+ * mongo_destroy_document:
+ * 			Destroy a document remembered by mongo_track_document.
+ */
+void
+mongo_destroy_document(BSON *document)
+{
+	ListCell *entryCell = NULL;
+
+	foreach(entryCell, TrackedDocuments)
+	{
+		TrackedDocument *entry = (TrackedDocument *) lfirst(entryCell);
+
+		if (entry->document == document)
+		{
+			TrackedDocuments = list_delete_ptr(TrackedDocuments, entry);
+			pfree(entry);
+			break;
+		}
+	}
+
+	BsonDestroy(document);
+}
+
+/*
+ * mongo_destroy_documents:
+ * 			Destroy the documents of the scans and modifies started at the given
+ * transaction nesting level or deeper, which a failed query left behind.
+ */
+static void
+mongo_destroy_documents(int level)
+{
+	ListCell *entryCell = NULL;
+	List	 *remaining = NIL;
+	MemoryContext oldContext;
+
+	foreach(entryCell, TrackedDocuments)
+	{
+		TrackedDocument *entry = (TrackedDocument *) lfirst(entryCell);
+
+		if (entry->level < level)
+		{
+			oldContext = MemoryContextSwitchTo(TopMemoryContext);
+			remaining = lappend(remaining, entry);
+			MemoryContextSwitchTo(oldContext);
+			continue;
+		}
+
+		BsonDestroy(entry->document);
+		pfree(entry);
+	}
+
+	list_free(TrackedDocuments);
+	TrackedDocuments = remaining;
+}
+
+/*
+ * mongo_register_callbacks:
+ * 			Register the transaction callbacks, once per backend.
+ */
+static void
+mongo_register_callbacks(void)
+{
+	if (CallbacksRegistered)
+		return;
+	CallbacksRegistered = true;
+
+	RegisterXactCallback(mongo_xact_callback, NULL);
+	RegisterSubXactCallback(mongo_subxact_callback, NULL);
+}
+
+/*
+ * mongo_xact_callback:
+ * 			At the end of the top-level transaction no executor node is left
+ * using any connection or document, so close the private connections and
+ * destroy the documents of scans that were never shut down.
+ */
+static void
+mongo_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+#if PG_VERSION_NUM >= 90500
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_PARALLEL_ABORT:
+#endif
+			break;
+		default:
+			return;
+	}
+
+	mongo_destroy_documents(1);
+
+#ifdef META_DRIVER
+	mongo_close_private_connections(1);
+#endif
+}
+
+/*
+ * mongo_subxact_callback:
+ * 			On subtransaction abort, close the private connections and destroy
+ * the documents of the scans started inside it.
+ */
+static void
+mongo_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					   SubTransactionId parentSubid, void *arg)
+{
+	if (event != SUBXACT_EVENT_ABORT_SUB)
+		return;
+
+	mongo_destroy_documents(GetCurrentTransactionNestLevel());
+
+#ifdef META_DRIVER
+	mongo_close_private_connections(GetCurrentTransactionNestLevel());
+#endif
+}
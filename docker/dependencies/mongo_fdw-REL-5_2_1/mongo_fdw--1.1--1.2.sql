@@ -0,0 +1,5 @@
+/* mongo_fdw/mongo_fdw--1.1--1.2.sql */
+
+CREATE FUNCTION mongo_oid_time(name)
+  RETURNS timestamptz IMMUTABLE STRICT
+  AS 'MODULE_PATHNAME' LANGUAGE C;
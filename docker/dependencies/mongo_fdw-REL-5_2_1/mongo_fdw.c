@@ -21,14 +21,21 @@
 #include "mongo_fdw.h"
 #include "mongo_query.h"
 
+#include "access/hash.h"
 #include "access/reloptions.h"
+#include "access/skey.h"
+#include "catalog/pg_aggregate.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_namespace.h"
 #include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
 #include "commands/vacuum.h"
+#include "executor/executor.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
 #include "nodes/makefuncs.h"
+#include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
 #include "optimizer/plancat.h"
@@ -43,11 +50,13 @@
 #include "utils/rel.h"
 #include "utils/memutils.h"
 #include "access/sysattr.h"
+#include "access/xact.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
 #include "commands/vacuum.h"
 #include "foreign/fdwapi.h"
 #include "funcapi.h"
+#include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
@@ -57,24 +66,147 @@
 #include "optimizer/planmain.h"
 #include "optimizer/prep.h"
 #include "optimizer/restrictinfo.h"
+#include "optimizer/tlist.h"
 #include "optimizer/var.h"
 #include "parser/parsetree.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
-#include "utils/jsonapi.h"
+#include "utils/pg_locale.h"
+#include "utils/selfuncs.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
 #include "utils/jsonb.h"
 #if PG_VERSION_NUM >= 90300
 	#include "access/htup_details.h"
 #endif
 
+#include <limits.h>
+#include <sys/stat.h>
+
 /*
  * In PG 9.5.1 the number will be 90501,
  * our version is 5.1.0 so number will be 50100
  */
 #define CODE_VERSION   50201
 
+/*
+ * Indexes of the items in the fdw_private list of a foreign scan plan node.
+ */
+enum MongoFdwScanPrivateIndex
+{
+	/* List of Vars of the columns needed by the scan */
+	MongoFdwScanPrivateColumnList,
+
+	/* List of operator expressions pushed down in the query document */
+	MongoFdwScanPrivateOpExpressionList,
+
+	/* Integer node, true if only the needed columns are to be fetched */
+	MongoFdwScanPrivateProjection,
+
+	/* List of column names and sort directions for MongoDB to sort by */
+	MongoFdwScanPrivateSortList,
+
+	/* Integer node, maximum number of documents to fetch or 0 for all */
+	MongoFdwScanPrivateLimit,
+
+	/* List of the keys of the index MongoDB is to use, as in the sort list */
+	MongoFdwScanPrivateHint,
+
+	/*
+	 * Only in the plan of a pushed down aggregation, which has no scan
+	 * relation: Oid of the foreign table, Oid of the user to check access as,
+	 * and the aggregate list.
+	 */
+	MongoFdwScanPrivateRelationId,
+	MongoFdwScanPrivateCheckAsUser,
+	MongoFdwScanPrivateAggregateList
+};
+
+/*
+ * Indexes of the items in the fdw_exprs list of a foreign scan plan node, whose
+ * expressions the planner fixes up as it does the node's quals. The list is NIL
+ * when both items are.
+ */
+enum MongoFdwScanExprIndex
+{
+	/* List of clauses checked locally before the other columns are filled */
+	MongoFdwScanExprFilterQualList,
+
+	/* List of join clauses added to the query document, with parameters */
+	MongoFdwScanExprParamClauseList
+};
+
+/*
+ * Indexes of the items in the fdw_private list of a foreign scan plan node
+ * that runs an UPDATE or DELETE on the server.
+ */
+enum MongoFdwDirectModifyPrivateIndex
+{
+	/* List of operator expressions that select the documents to modify */
+	MongoFdwDirectModifyPrivateOpExpressionList,
+
+	/* Attribute numbers of the updated columns, and their new values */
+	MongoFdwDirectModifyPrivateColumnIdList,
+	MongoFdwDirectModifyPrivateValueList,
+
+	/* Integer node, true if the modified rows count as the command's */
+	MongoFdwDirectModifyPrivateSetProcessed
+};
+
+
+/*
+ * MongoStatsCacheEntry keeps the document count and average document size of
+ * the collection of a foreign table, as last read from the server, so that
+ * planning doesn't need a round trip to the server for every query.
+ */
+typedef struct MongoStatsCacheEntry
+{
+	Oid         foreignTableId;		/* hash key (must be first) */
+	double      documentCount;
+	double      documentSize;		/* 0 if the server didn't tell */
+	TimestampTz readTime;			/* 0 once the entry has been invalidated */
+
+	/* the indexes of the collection, which are read when first needed */
+	List        *indexList;			/* key lists, in indexContext */
+	MemoryContext indexContext;		/* NULL until the indexes are read */
+	TimestampTz indexReadTime;		/* 0 once the entry has been invalidated */
+} MongoStatsCacheEntry;
+
+/*
+ * MongoLookupQuery keeps the documents a scan's query returned, with the
+ * rescan_cache option, for later rescans that run the same query. Queries are
+ * kept in a hash table by the hash of their query document.
+ */
+typedef struct MongoLookupQuery
+{
+	uint32      queryLength;
+	char        *queryData;			/* bytes of the query document */
+	List        *documentList;		/* copies of the documents returned */
+	bool        complete;			/* all of them have been read */
+} MongoLookupQuery;
+
+typedef struct MongoLookupEntry
+{
+	uint32      queryHash;			/* hash key (must be first) */
+	List        *queryList;			/* queries of that hash */
+} MongoLookupEntry;
+
+/* A document kept by the lookup cache */
+typedef struct MongoLookupDocument
+{
+	uint32      length;
+	char        data[FLEXIBLE_ARRAY_MEMBER];
+} MongoLookupDocument;
+
+/* Cached collection statistics, per backend (initialized on first use) */
+static HTAB *StatsCacheHash = NULL;
+
+/* Seconds cached statistics are used for, 0 to read them for every plan */
+static int MongoStatsCacheTtl = 60;
+
 
 /* Local functions forward declarations */
 static void MongoGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel,
@@ -95,6 +227,8 @@ static void MongoExplainForeignScan(ForeignScanState *scanState,
 						ExplainState *explainState);
 static void MongoBeginForeignScan(ForeignScanState *scanState, int executorFlags);
 static TupleTableSlot * MongoIterateForeignScan(ForeignScanState *scanState);
+static void MongoResetTupleContext(ForeignScanState *scanState,
+						MongoFdwModifyState *fmstate);
 static void MongoEndForeignScan(ForeignScanState *scanState);
 static void MongoReScanForeignScan(ForeignScanState *scanState);
 
@@ -134,24 +268,214 @@ MongoExplainForeignModify(ModifyTableState *mtstate,
 						ResultRelInfo *rinfo, List *fdw_private,
 						int subplan_index, ExplainState *es);
 
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
+static void MongoGetForeignUpperPaths(PlannerInfo *root,
+						UpperRelationKind stage,
+						RelOptInfo *inputRel, RelOptInfo *outputRel);
+static bool MongoPlanDirectModify(PlannerInfo *root, ModifyTable *plan,
+						Index resultRelation, int subplan_index);
+static void MongoBeginDirectModify(ForeignScanState *scanState,
+						int executorFlags);
+static TupleTableSlot * MongoIterateDirectModify(ForeignScanState *scanState);
+static void MongoEndDirectModify(ForeignScanState *scanState);
+static void MongoExplainDirectModify(ForeignScanState *scanState,
+						ExplainState *explainState);
+#endif
+
 /* local functions */
+static MongoFdwRelationInfo * MongoRelationInfo(RelOptInfo *baserel,
+						Oid foreignTableId);
 static double ForeignTableDocumentCount(Oid foreignTableId);
-static HTAB * ColumnMappingHash(Oid foreignTableId, List *columnList);
-static void FillTupleSlot(const BSON *bsonDocument, const char *bsonDocumentKey,
-						HTAB *columnMappingHash, Datum *columnValues,
-						bool *columnNulls);
+static double ForeignTablePlanDocumentCount(RelOptInfo *baserel,
+						Oid foreignTableId);
+static double ForeignTableCachedDocumentCount(Oid foreignTableId);
+static void MongoStatsCacheInit(void);
+static void MongoStatsCacheInvalidate(Datum arg, int cacheId, uint32 hashValue);
+#ifdef META_DRIVER
+static List * ForeignTableCachedIndexList(Oid foreignTableId);
+static List * MongoIndexList(BSON *indexDocument);
+#endif
+static bool ForeignTableCollectionStats(Oid foreignTableId, double *documentCount,
+						double *documentSize);
+static bool MongoUseProjection(RelOptInfo *baserel, Oid foreignTableId,
+						List *columnList);
+static List * MongoFilterQualList(RelOptInfo *baserel, Oid foreignTableId,
+						List *clauseList, List *opExpressionList,
+						List *columnList);
+#ifdef META_DRIVER
+static void MongoAddFilePaths(PlannerInfo *root, RelOptInfo *baserel,
+							  MongoFdwRelationInfo *fpinfo);
+static const BSON * MongoScanFileNext(MongoFdwModifyState *fmstate);
+static bool MongoScanFileRange(MongoFdwModifyState *fmstate);
+#endif
+static bool MongoFilterDocument(ForeignScanState *scanState,
+						MongoFdwModifyState *fmstate, const BSON *document);
+static void MongoAddParamPaths(PlannerInfo *root, RelOptInfo *baserel,
+						List *opExpressionList, double documentCount,
+						BlockNumber pageCount);
+static bool MongoEquivalenceMemberMatches(PlannerInfo *root, RelOptInfo *baserel,
+						EquivalenceClass *eclass, EquivalenceMember *member,
+						void *arg);
+static List * MongoParamClauseList(RelOptInfo *baserel, List *restrictInfoList);
+static List * MongoCoveringIndexList(RelOptInfo *baserel, Oid foreignTableId,
+						List *indexList, List *columnList);
+static List * MongoCheapestIndex(PlannerInfo *root, RelOptInfo *baserel,
+						List *clauseList, List *sortList,
+						List *coveringIndexList, double documentCount,
+						BlockNumber pageCount, Cost *accessCost,
+						double *examinedCount);
+static List * MongoIndexClauseList(RelOptInfo *baserel, Oid foreignTableId,
+						List *keyList, List *clauseList, int *equalityCount);
+static bool MongoIndexOrderMatches(List *keyList, int equalityCount,
+						List *sortList);
+static Cost MongoIndexScanCost(PlannerInfo *root, RelOptInfo *baserel,
+						List *indexClauseList, bool covering,
+						double documentCount, BlockNumber pageCount,
+						double *entryCount);
+static char * MongoSortListString(List *sortList);
+static void MongoExplainScanStats(MongoFdwModifyState *fmstate,
+								  ExplainState *explainState);
+static bool MongoContainsParam(Node *node, void *context);
+#ifdef META_DRIVER
+static void MongoExplainRemotePlan(Oid foreignTableId, BSON *queryDocument,
+								   BSON *fieldsDocument, int limitCount,
+								   ExplainState *explainState);
+#endif
+static void MongoScanQueryDocument(ForeignScanState *scanState,
+						MongoFdwModifyState *fmstate);
+static const BSON * MongoScanNextDocument(ForeignScanState *scanState,
+						MongoFdwModifyState *fmstate, BSON *cachedDocument);
+#ifdef META_DRIVER
+static void MongoLookupCacheStart(MongoFdwModifyState *fmstate);
+static const BSON * MongoLookupCacheNext(MongoFdwModifyState *fmstate,
+						BSON *cachedDocument);
+static void MongoLookupCacheAdd(MongoFdwModifyState *fmstate,
+						const BSON *document);
+static void MongoLookupCacheRemove(MongoFdwModifyState *fmstate,
+						MongoLookupQuery *lookupQuery);
+static void MongoLookupCacheDestroy(MongoFdwModifyState *fmstate);
+#endif
+static List * MongoSortList(RelOptInfo *baserel, Oid foreignTableId,
+						List *pathkeyList);
+static bool MongoColumnBracketed(RelOptInfo *baserel, Var *column);
+static int MongoLimitCount(PlannerInfo *root, RelOptInfo *baserel);
+static ColumnMappingTree * ColumnMappingTreeCreate(Oid foreignTableId,
+						List *columnList);
+static void ColumnMappingNodeSort(ColumnMappingNode *node);
+static int ColumnMappingNodeCompare(const void *a, const void *b);
+static void FillTupleSlot(const BSON *bsonDocument,
+						ColumnMappingTree *columnMappingTree,
+						Datum *columnValues, bool *columnNulls);
+static bool FillTupleSlotNode(BSON_ITERATOR *bsonIterator,
+						ColumnMappingNode *parentNode,
+						ColumnMappingTree *columnMappingTree,
+						Datum *columnValues, bool *columnNulls);
+static void ColumnConvertersResolve(Oid columnTypeId, ColumnConverter *converters);
+static inline ColumnConverter ColumnConverterLookup(ColumnConverter *converters,
+						BSON_TYPE bsonType);
 static bool ColumnTypesCompatible(BSON_TYPE bsonType, Oid columnTypeId);
-static Datum ColumnValueArray(BSON_ITERATOR *bsonIterator, Oid valueTypeId);
+static Datum ColumnValueArray(BSON_ITERATOR *bsonIterator,
+							  ColumnMapping *columnMapping);
 static Datum ColumnValue(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
 						 int32 columnTypeMod);
+static Datum ColumnValueInt16(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueInt32(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueInt64(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueFloat4(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueFloat8(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueNumericFromInteger(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueNumericFromDouble(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueBool(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueBoolFromNumber(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueBpchar(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueVarchar(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueText(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueName(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueBytea(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+#ifdef META_DRIVER
+static Datum ColumnValueByteaFromOid(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+#endif
+static Datum ColumnValueDate(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueTimestamp(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueJson(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueJsonb(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
+static Datum ColumnValueUnsupported(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						 int32 columnTypeMod);
 static void MongoFreeScanState(MongoFdwModifyState *fmstate);
+static void MongoAppendColumnValues(BSON *document, MongoFdwModifyState *fmstate,
+									TupleTableSlot *slot);
+static bool MongoSelectorDocument(MongoFdwModifyState *fmstate,
+								  TupleTableSlot *planSlot);
+static bool MongoScanCursorCreate(MongoFdwModifyState *fmstate);
+static void MongoScanCursorDestroy(MongoFdwModifyState *fmstate);
+static bool MongoScanCursorNext(MongoFdwModifyState *fmstate);
+static void MongoScanStatsCount(MongoScanStats *stats, const BSON *document);
+static void MongoScanStatsAddTime(instr_time *totalTime, instr_time startTime);
+#ifdef META_DRIVER
+static bool MongoScanCursorFinishPrefetch(MongoFdwModifyState *fmstate);
+#endif
 static bool MongoAnalyzeForeignTable(Relation relation,
 						AcquireSampleRowsFunc *acquireSampleRowsFunc,
 						BlockNumber *totalPageCount);
 static int MongoAcquireSampleRows(Relation relation, int errorLevel,
 						HeapTuple *sampleRows, int targetRowCount,
 						double *totalRowCount, double *totalDeadRowCount);
+#ifdef META_DRIVER
+static int MongoServerSampleRows(MongoFdwModifyState *fmstate,
+						TupleDesc tupleDescriptor, MemoryContext tupleContext,
+						Datum *columnValues, bool *columnNulls,
+						HeapTuple *sampleRows, int targetRowCount);
+#endif
 static void mongo_fdw_exit(int code, Datum arg);
+static Oid MongoScanRelationId(ForeignScanState *scanState);
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
+static List * MongoAggregateEntry(Expr *expression, RelOptInfo *inputRel,
+						Oid foreignTableId, List *groupExpressionList);
+static char * MongoAggregateColumnName(Expr *expression, RelOptInfo *inputRel,
+						Oid foreignTableId);
+static bool MongoAggregateTypeSupported(MongoAggregateKind kind, Oid typeId);
+static ForeignScan * MongoGetForeignAggregatePlan(RelOptInfo *groupedRel,
+						List *targetList);
+static TupleTableSlot * MongoIterateAggregateScan(ForeignScanState *scanState);
+static int MongoParallelWorkers(double documentCount);
+static bool MongoIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel,
+										   RangeTblEntry *rte);
+static bool MongoContainsExecParam(Node *node, void *context);
+static Size MongoEstimateDSMForeignScan(ForeignScanState *scanState,
+										ParallelContext *pcxt);
+static void MongoInitializeDSMForeignScan(ForeignScanState *scanState,
+										  ParallelContext *pcxt,
+										  void *coordinate);
+#if PG_VERSION_NUM >= 100000
+static void MongoReInitializeDSMForeignScan(ForeignScanState *scanState,
+											ParallelContext *pcxt,
+											void *coordinate);
+#endif
+static void MongoInitializeWorkerForeignScan(ForeignScanState *scanState,
+											 shm_toc *toc, void *coordinate);
+static void FillAggregateSlot(const BSON *bsonDocument, List *aggregateList,
+						TupleDesc tupleDescriptor,
+						Datum *columnValues, bool *columnNulls);
+#endif
 
 extern PGDLLEXPORT void _PG_init(void);
 
@@ -159,18 +483,12 @@ const char * EscapeJsonString(const char *string);
 
 void BsonToJsonString(StringInfo output, BSON_ITERATOR iter, bool isArray);
 
-/* the null action object used for pure validation */
-static JsonSemAction nullSemAction =
-{
-	NULL, NULL, NULL, NULL, NULL,
-	NULL, NULL, NULL, NULL, NULL
-};
-
 /* declarations for dynamic loading */
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(mongo_fdw_handler);
 PG_FUNCTION_INFO_V1(mongo_fdw_version);
+PG_FUNCTION_INFO_V1(mongo_oid_time);
 
 /*
  * Library load-time initalization, sets on_proc_exit() callback for
@@ -179,6 +497,17 @@ PG_FUNCTION_INFO_V1(mongo_fdw_version);
 void
 _PG_init(void)
 {
+	DefineCustomIntVariable("mongo_fdw.stats_cache_ttl",
+							"Sets how long collection statistics read for planning are reused.",
+							"Tables that have been analyzed are planned from their "
+							"ANALYZE statistics instead. Zero reads the statistics for "
+							"every plan.",
+							&MongoStatsCacheTtl,
+							60, 0, INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+
 	on_proc_exit(&mongo_fdw_exit, PointerGetDatum(NULL));
 }
 
@@ -214,6 +543,27 @@ mongo_fdw_handler(PG_FUNCTION_ARGS)
 	/* support for ANALYSE */
 	fdwRoutine->AnalyzeForeignTable = MongoAnalyzeForeignTable;
 
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
+	/* support for aggregate pushdown */
+	fdwRoutine->GetForeignUpperPaths = MongoGetForeignUpperPaths;
+
+	/* support for UPDATE and DELETE run on the server */
+	fdwRoutine->PlanDirectModify = MongoPlanDirectModify;
+	fdwRoutine->BeginDirectModify = MongoBeginDirectModify;
+	fdwRoutine->IterateDirectModify = MongoIterateDirectModify;
+	fdwRoutine->EndDirectModify = MongoEndDirectModify;
+	fdwRoutine->ExplainDirectModify = MongoExplainDirectModify;
+
+	/* support for parallel scans */
+	fdwRoutine->IsForeignScanParallelSafe = MongoIsForeignScanParallelSafe;
+	fdwRoutine->EstimateDSMForeignScan = MongoEstimateDSMForeignScan;
+	fdwRoutine->InitializeDSMForeignScan = MongoInitializeDSMForeignScan;
+#if PG_VERSION_NUM >= 100000
+	fdwRoutine->ReInitializeDSMForeignScan = MongoReInitializeDSMForeignScan;
+#endif
+	fdwRoutine->InitializeWorkerForeignScan = MongoInitializeWorkerForeignScan;
+#endif
+
 	PG_RETURN_POINTER(fdwRoutine);
 }
 
@@ -233,7 +583,46 @@ mongo_fdw_exit(int code, Datum arg)
 static void
 MongoGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreignTableId)
 {
-	double documentCount = ForeignTableDocumentCount(foreignTableId);
+	MongoFdwRelationInfo *fpinfo = MongoRelationInfo(baserel, foreignTableId);
+	ListCell *opExpressionCell = NULL;
+	double documentCount = 0.0;
+
+	/*
+	 * Remember which quals go into the query document, and whether MongoDB
+	 * evaluates all of them exactly, in which case the scan's rows need not be
+	 * rechecked and aggregates over them can be computed remotely.
+	 */
+	fpinfo->opExpressionList = ApplicableOpExpressionList(baserel);
+	fpinfo->remoteQualsExact = (list_length(fpinfo->opExpressionList) ==
+								list_length(baserel->baserestrictinfo));
+	foreach(opExpressionCell, fpinfo->opExpressionList)
+	{
+		if (!ClauseIsExact((Expr *) lfirst(opExpressionCell)))
+			fpinfo->remoteQualsExact = false;
+	}
+
+#ifdef META_DRIVER
+	/*
+	 * A table with the filename option reads a mongodump file instead of a
+	 * collection. Its query document only spares converting the documents it
+	 * rejects, and nothing else is computed outside of PostgreSQL.
+	 */
+	if (fpinfo->options->filename != NULL)
+	{
+		struct stat fileStat;
+
+		if (stat(fpinfo->options->filename, &fileStat) == 0)
+			fpinfo->fileSize = (double) fileStat.st_size;
+		fpinfo->remoteQualsExact = false;
+	}
+#endif
+
+	documentCount = ForeignTablePlanDocumentCount(baserel, foreignTableId);
+	fpinfo->documentCount = documentCount;
+#ifdef META_DRIVER
+	if (fpinfo->options->filename == NULL)
+		fpinfo->indexList = ForeignTableCachedIndexList(foreignTableId);
+#endif
 	if (documentCount > 0.0)
 	{
 		/*
@@ -257,14 +646,17 @@ MongoGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreignTableI
 
 
 /*
- * MongoGetForeignPaths creates the only scan path used to execute the query.
- * Note that MongoDB may decide to use an underlying index for this scan, but
- * that decision isn't deterministic or visible to us. We therefore create a
- * single table scan path.
+ * MongoGetForeignPaths creates the scan paths used to execute the query: a
+ * table scan path, a partial path for parallel scans of large collections, a
+ * path sorted by MongoDB if the query wants an order MongoDB can produce, and
+ * parameterized paths for nested loop joins. Paths are costed with the indexes
+ * of the collection where their definitions could be read; MongoDB picks the
+ * index it uses itself, unless we hint one.
  */
 static void
 MongoGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreignTableId)
 {
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
 	double           tupleFilterCost = baserel->baserestrictcost.per_tuple;
 	double           inputRowCount = 0.0;
 	double           documentSelectivity = 0.0;
@@ -278,18 +670,36 @@ MongoGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreignTableId)
 	double           connectionCost = 0.0;
 	double           documentCount = 0.0;
 	List             *opExpressionList = NIL;
+	List             *coveringIndexList = NIL;
+	List             *indexKeyList = NIL;
+	Cost             indexAccessCost = 0.0;
+	double           examinedCount = 0.0;
 	Cost             startupCost = 0.0;
 	Cost             totalCost = 0.0;
 	Path             *foreignPath = NULL;
+	List             *sortList = NIL;
+	int              limitCount = 0;
+	int              unsortedLimitCount = 0;
+	double           rowCount = 0.0;
+	Cost             pathStartupCost = 0.0;
+	Cost             pathTotalCost = 0.0;
+
+#ifdef META_DRIVER
+	if (fpinfo->options->filename != NULL)
+	{
+		MongoAddFilePaths(root, baserel, fpinfo);
+		return;
+	}
+#endif
 
-	documentCount = ForeignTableDocumentCount(foreignTableId);
+	documentCount = fpinfo->documentCount;
 	if (documentCount > 0.0)
 	{
 		/*
 		 * We estimate the number of rows returned after restriction qualifiers
 		 * are applied by MongoDB.
 		 */
-		opExpressionList = ApplicableOpExpressionList(baserel);
+		opExpressionList = fpinfo->opExpressionList;
 		documentSelectivity = clauselist_selectivity(root, opExpressionList,
 													 0, JOIN_INNER, NULL);
 		inputRowCount = clamp_row_est(documentCount * documentSelectivity);
@@ -317,6 +727,38 @@ MongoGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreignTableId)
 		connectionCost = MONGO_CONNECTION_COST_MULTIPLIER * seq_page_cost;
 		startupCost = baserel->baserestrictcost.startup + connectionCost;
 		totalCost = startupCost + totalDiskAccessCost + totalCpuCost;
+
+		/*
+		 * With an index whose leading keys the query document compares with
+		 * values, MongoDB only examines the documents of the matching index
+		 * entries. An index that holds all the columns the scan needs can also
+		 * answer the query by itself; we hint MongoDB to use it then, with a
+		 * projection that leaves out _id, to have it run a covered query.
+		 */
+		coveringIndexList = MongoCoveringIndexList(baserel, foreignTableId,
+												   fpinfo->indexList,
+												   ColumnList(baserel));
+		indexKeyList = MongoCheapestIndex(root, baserel, opExpressionList, NIL,
+										  coveringIndexList, documentCount,
+										  pageCount, &indexAccessCost,
+										  &examinedCount);
+		if (indexKeyList != NIL)
+		{
+			Cost indexTotalCost = startupCost + indexAccessCost +
+								  (cpuCostPerDoc * examinedCount) +
+								  (cpuCostPerRow * inputRowCount);
+
+			if (indexTotalCost < totalCost)
+			{
+				totalCost = indexTotalCost;
+
+				/* MongoDB finds the index by itself if it needn't cover */
+				if (!list_member_ptr(coveringIndexList, indexKeyList))
+					indexKeyList = NIL;
+			}
+			else
+				indexKeyList = NIL;
+		}
 	}
 	else
 	{
@@ -324,1568 +766,5278 @@ MongoGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreignTableId)
 						 errhint("Falling back to default estimates in planning")));
 	}
 
+	/*
+	 * A LIMIT of the query can be sent to MongoDB if its rows come straight
+	 * from this scan, in the order of the query; so an unsorted path only gets
+	 * it if the query has no ORDER BY.
+	 */
+	limitCount = MongoLimitCount(root, baserel);
+	if (root->query_pathkeys == NIL)
+		unsortedLimitCount = limitCount;
+
 	/* create a foreign path node */
+	rowCount = baserel->rows;
+	pathTotalCost = totalCost;
+	if (unsortedLimitCount > 0 && unsortedLimitCount < rowCount)
+	{
+		pathTotalCost = startupCost +
+			(totalCost - startupCost) * unsortedLimitCount / rowCount;
+		rowCount = unsortedLimitCount;
+	}
 
 	foreignPath = (Path *) create_foreignscan_path(root, baserel,
 #if PG_VERSION_NUM >= 90600
 				NULL,          /* default pathtarget */
 #endif
-				baserel->rows,
+				rowCount,
 				startupCost,
-				totalCost,
+				pathTotalCost,
 				NIL,   /* no pathkeys */
 				NULL,  /* no outer rel either */
 #if PG_VERSION_NUM >= 90500
 				NULL,  /* no extra plan */
 #endif
-				NULL);        /* no fdw_private data */
+				list_make3(NIL, makeInteger(unsortedLimitCount), indexKeyList));
 
-	/* add foreign path as the only possible path */
 	add_path(baserel, foreignPath);
-}
-
-
-/*
- * MongoGetForeignPlan creates a foreign scan plan node for scanning the MongoDB
- * collection. Note that MongoDB may decide to use an underlying index for this
- * scan, but that decision isn't deterministic or visible to us.
- */
-static ForeignScan *
-MongoGetForeignPlan(PlannerInfo *root,
-				RelOptInfo *baserel,
-				Oid foreigntableid,
-				ForeignPath *best_path,
-				List *targetList,
-				List *restrictionClauses,
-				Plan *outer_plan)
-
-{
-	Index                scanRangeTableIndex = baserel->relid;
-	ForeignScan          *foreignScan = NULL;
-	List                 *foreignPrivateList = NIL;
-	List                 *opExpressionList = NIL;
-	BSON                 *queryDocument = NULL;
-	List                 *columnList = NIL;
 
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
 	/*
-	 * We push down applicable restriction clauses to MongoDB, but for simplicity
-	 * we currently put all the restrictionClauses into the plan node's qual
-	 * list for the executor to re-check. So all we have to do here is strip
-	 * RestrictInfo nodes from the clauses and ignore pseudoconstants (which
-	 * will be handled elsewhere).
+	 * For a large collection we also add a partial path, whose processes each
+	 * scan some of the _id ranges the collection is split into. The server
+	 * does the same work, but the conversion of documents is spread among the
+	 * processes, as for a parallel sequential scan.
 	 */
-	restrictionClauses = extract_actual_clauses(restrictionClauses, false);
+	if (baserel->consider_parallel && documentCount > 0.0)
+	{
+		int parallelWorkers = MongoParallelWorkers(documentCount);
+
+		if (parallelWorkers > 0)
+		{
+			double parallelDivisor = parallelWorkers;
+			double leaderContribution = 1.0 - (0.3 * parallelWorkers);
+
+			if (leaderContribution > 0)
+				parallelDivisor += leaderContribution;
+
+			foreignPath = (Path *) create_foreignscan_path(root, baserel,
+						NULL,          /* default pathtarget */
+						clamp_row_est(baserel->rows / parallelDivisor),
+						startupCost,
+						startupCost + totalDiskAccessCost +
+						totalCpuCost / parallelDivisor,
+						NIL,   /* no pathkeys */
+						NULL,  /* no outer rel either */
+						NULL,  /* no extra plan */
+						list_make3(NIL, makeInteger(0), NIL));
+			foreignPath->parallel_aware = true;
+			foreignPath->parallel_workers = parallelWorkers;
+
+			add_partial_path(baserel, foreignPath);
+		}
+	}
+#endif
 
 	/*
-	 * We construct the query document to have MongoDB filter its rows. We could
-	 * also construct a column name document here to retrieve only the needed
-	 * columns. However, we found this optimization to degrade performance on
-	 * the MongoDB server-side, so we instead filter out columns on our side.
+	 * If MongoDB can sort the documents in the order the query wants, we also
+	 * add a sorted path, so that the planner can do without a local sort. We
+	 * cost it as a sort of the matching documents before the first one is
+	 * returned, unless an index has keys in that order, after those compared
+	 * for equality. MongoDB then returns the documents in the order of the
+	 * index entries, and we hint it to use that index.
 	 */
-	opExpressionList = ApplicableOpExpressionList(baserel);
-	queryDocument = QueryDocument(foreigntableid, opExpressionList, NULL);
-
-	/* we don't need to serialize column list as lists are copiable */
-	columnList = ColumnList(baserel);
+	sortList = MongoSortList(baserel, foreignTableId, root->query_pathkeys);
+	if (sortList != NIL)
+	{
+		double sortInputCount = Max(inputRowCount, 2.0);
+		Cost   sortCost = 2.0 * cpu_operator_cost * sortInputCount *
+						  (log(sortInputCount) / log(2.0));
+
+		rowCount = baserel->rows;
+		pathStartupCost = startupCost + sortCost;
+		pathTotalCost = totalCost + sortCost;
+
+		indexKeyList = NIL;
+		if (documentCount > 0.0)
+			indexKeyList = MongoCheapestIndex(root, baserel, opExpressionList,
+											  sortList, coveringIndexList,
+											  documentCount, pageCount,
+											  &indexAccessCost, &examinedCount);
+		if (indexKeyList != NIL)
+		{
+			Cost indexTotalCost = startupCost + indexAccessCost +
+								  (cpuCostPerDoc * examinedCount) +
+								  (cpuCostPerRow * inputRowCount);
 
-	/* construct foreign plan with query document and column list */
-	foreignPrivateList = list_make2(columnList, opExpressionList);
+			if (indexTotalCost < pathTotalCost)
+			{
+				pathStartupCost = startupCost;
+				pathTotalCost = indexTotalCost;
+			}
+			else
+				indexKeyList = NIL;
+		}
 
-	/* only clean up the query struct */
-	BsonDestroy(queryDocument);
+		if (limitCount > 0 && limitCount < rowCount)
+		{
+			pathTotalCost = pathStartupCost +
+				(pathTotalCost - pathStartupCost) * limitCount / rowCount;
+			rowCount = limitCount;
+		}
 
-	/* create the foreign scan node */
-	foreignScan =  make_foreignscan(targetList, restrictionClauses,
-									scanRangeTableIndex,
-									NIL, /* no expressions to evaluate */
-									foreignPrivateList
+		foreignPath = (Path *) create_foreignscan_path(root, baserel,
+#if PG_VERSION_NUM >= 90600
+					NULL,          /* default pathtarget */
+#endif
+					rowCount,
+					pathStartupCost,
+					pathTotalCost,
+					root->query_pathkeys,
+					NULL,  /* no outer rel either */
 #if PG_VERSION_NUM >= 90500
-									,NIL
-									,NIL
-									,NULL
+					NULL,  /* no extra plan */
 #endif
-                               );
+					list_make3(sortList, makeInteger(limitCount),
+							   indexKeyList));
 
-	return foreignScan;
+		add_path(baserel, foreignPath);
+	}
+
+	if (documentCount > 0.0)
+		MongoAddParamPaths(root, baserel, opExpressionList, documentCount,
+						   pageCount);
 }
 
 
+#ifdef META_DRIVER
 /*
- * MongoExplainForeignScan produces extra output for the Explain command.
+ * MongoAddFilePaths adds the paths of a scan of a mongodump file: one that reads
+ * the whole file, and for a large file, a partial path whose processes each read
+ * some of the byte ranges the file is split into. The file is read sequentially,
+ * and every document is checked with the query document, but only those that
+ * pass are converted. Sorts, limits and joins are left to PostgreSQL.
  */
 static void
-MongoExplainForeignScan(ForeignScanState *scanState, ExplainState *explainState)
+MongoAddFilePaths(PlannerInfo *root, RelOptInfo *baserel,
+				  MongoFdwRelationInfo *fpinfo)
 {
-	MongoFdwOptions        *options = NULL;
-	StringInfo             namespaceName = NULL;
-	Oid                    foreignTableId = InvalidOid;
+	double      documentCount = Max(fpinfo->documentCount, 1.0);
+	double      documentSelectivity = 0.0;
+	double      inputRowCount = 0.0;
+	BlockNumber pageCount = 0;
+	Cost        startupCost = 0.0;
+	Cost        diskAccessCost = 0.0;
+	Cost        cpuCost = 0.0;
+	Path        *foreignPath = NULL;
+
+	documentSelectivity = clauselist_selectivity(root, fpinfo->opExpressionList,
+												 0, JOIN_INNER, NULL);
+	inputRowCount = clamp_row_est(documentCount * documentSelectivity);
+
+	pageCount = (BlockNumber) ceil(fpinfo->fileSize / BLCKSZ);
+	diskAccessCost = seq_page_cost * pageCount;
+
+	cpuCost = (cpu_tuple_cost * documentCount) +
+			  ((cpu_tuple_cost * MONGO_TUPLE_COST_MULTIPLIER +
+				baserel->baserestrictcost.per_tuple) * inputRowCount);
+	startupCost = baserel->baserestrictcost.startup;
 
-	foreignTableId = RelationGetRelid(scanState->ss.ss_currentRelation);
-	options = mongo_get_options(foreignTableId);
+	foreignPath = (Path *) create_foreignscan_path(root, baserel,
+#if PG_VERSION_NUM >= 90600
+				NULL,          /* default pathtarget */
+#endif
+				baserel->rows,
+				startupCost,
+				startupCost + diskAccessCost + cpuCost,
+				NIL,   /* no pathkeys */
+				NULL,  /* no outer rel either */
+#if PG_VERSION_NUM >= 90500
+				NULL,  /* no extra plan */
+#endif
+				list_make3(NIL, makeInteger(0), NIL));
 
-	/* construct fully qualified collection name */
-	namespaceName = makeStringInfo();
-	appendStringInfo(namespaceName, "%s.%s", options->svr_database,
-					 options->collectionName);
+	add_path(baserel, foreignPath);
 
-	mongo_free_options(options);
+#if PG_VERSION_NUM >= 90600
+	if (baserel->consider_parallel)
+	{
+		int parallelWorkers = MongoParallelWorkers(documentCount);
 
-	ExplainPropertyText("Foreign Namespace", namespaceName->data, explainState);
+		if (parallelWorkers > 0)
+		{
+			double parallelDivisor = parallelWorkers;
+			double leaderContribution = 1.0 - (0.3 * parallelWorkers);
+
+			if (leaderContribution > 0)
+				parallelDivisor += leaderContribution;
+
+			foreignPath = (Path *) create_foreignscan_path(root, baserel,
+						NULL,          /* default pathtarget */
+						clamp_row_est(baserel->rows / parallelDivisor),
+						startupCost,
+						startupCost + (diskAccessCost + cpuCost) / parallelDivisor,
+						NIL,   /* no pathkeys */
+						NULL,  /* no outer rel either */
+						NULL,  /* no extra plan */
+						list_make3(NIL, makeInteger(0), NIL));
+			foreignPath->parallel_aware = true;
+			foreignPath->parallel_workers = parallelWorkers;
+
+			add_partial_path(baserel, foreignPath);
+		}
+	}
+#endif
 }
+#endif
 
+
+/*
+ * MongoAddParamPaths adds parameterized paths, with which a nested loop join
+ * passes the values of the outer row's columns to the scan, and MongoDB only
+ * returns the documents that join with that row. The join clauses are equality
+ * comparisons of a column with expressions of other relations, found in the
+ * equivalence classes of the query and among its other join clauses. There is
+ * one path for each set of outer relations the clauses need.
+ */
 static void
-MongoExplainForeignModify(ModifyTableState *mtstate,
-							ResultRelInfo *rinfo,
-							List *fdw_private,
-							int subplan_index,
-							ExplainState *es)
+MongoAddParamPaths(PlannerInfo *root, RelOptInfo *baserel,
+				   List *opExpressionList, double documentCount,
+				   BlockNumber pageCount)
 {
-	MongoFdwOptions       *options = NULL;
-	StringInfo            namespaceName = NULL;
-	Oid                   foreignTableId = InvalidOid;
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+	List     *joinClauseList = NIL;
+	List     *outerRelidsList = NIL;
+	ListCell *clauseCell = NULL;
+	ListCell *outerRelidsCell = NULL;
 
-	foreignTableId = RelationGetRelid(rinfo->ri_RelationDesc);
-	options = mongo_get_options(foreignTableId);
+	foreach(clauseCell, baserel->joininfo)
+	{
+		RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(clauseCell);
 
-	/* construct fully qualified collection name */
-	namespaceName = makeStringInfo();
-	appendStringInfo(namespaceName, "%s.%s", options->svr_database,
-					 options->collectionName);
+#if PG_VERSION_NUM >= 90500
+		if (!join_clause_is_movable_to(restrictInfo, baserel))
+#else
+		if (!join_clause_is_movable_to(restrictInfo, baserel->relid))
+#endif
+			continue;
 
-	mongo_free_options(options);
-	ExplainPropertyText("Foreign Namespace", namespaceName->data, es);
-}
+		if (JoinClauseIsApplicable(restrictInfo->clause, baserel))
+			joinClauseList = lappend(joinClauseList, restrictInfo);
+	}
 
+	if (baserel->has_eclass_joins)
+	{
+		List *columnList = NIL;
+		ListCell *classCell = NULL;
+		ListCell *columnCell = NULL;
 
-/*
- * MongoBeginForeignScan connects to the MongoDB server, and opens a cursor that
- * uses the database name, collection name, and the remote query to send to the
- * server. The function also creates a hash table that maps referenced column
- * names to column index and type information.
- */
-static void
-MongoBeginForeignScan(ForeignScanState *scanState, int executorFlags)
-{
-	MONGO_CONN               *mongoConnection = NULL;
-	MONGO_CURSOR             *mongoCursor = NULL;
-	Oid                      foreignTableId = InvalidOid;
-	List                     *columnList = NIL;
-	HTAB                     *columnMappingHash = NULL;
-	ForeignScan              *foreignScan = NULL;
-	List                     *foreignPrivateList = NIL;
-	BSON                     *queryDocument = NULL;
-	MongoFdwOptions          *options = NULL;
-	MongoFdwModifyState      *fmstate = NULL;
-	List                     *opExpressionList = NIL;
-	RangeTblEntry            *rte;
-	EState                   *estate = scanState->ss.ps.state;
-	ForeignScan              *fsplan = (ForeignScan *) scanState->ss.ps.plan;
-	Oid                      userid;
-	ForeignServer            *server;
-	UserMapping              *user;
-	ForeignTable             *table;
+		/* find the columns of this table that are joined through a class */
+		foreach(classCell, root->eq_classes)
+		{
+			EquivalenceClass *eclass = (EquivalenceClass *) lfirst(classCell);
+			ListCell         *memberCell = NULL;
 
+			if (eclass->ec_has_volatile || list_length(eclass->ec_members) < 2)
+				continue;
 
-	/* if Explain with no Analyze, do nothing */
-	if (executorFlags & EXEC_FLAG_EXPLAIN_ONLY)
-		return;
+			foreach(memberCell, eclass->ec_members)
+			{
+				EquivalenceMember *member = (EquivalenceMember *) lfirst(memberCell);
+				Var               *column = (Var *) member->em_expr;
 
-	foreignTableId = RelationGetRelid(scanState->ss.ss_currentRelation);
-	options = mongo_get_options(foreignTableId);
+				if (IsA(column, Var) && column->varno == baserel->relid &&
+					column->varattno > 0 && column->varlevelsup == 0)
+					columnList = list_append_unique(columnList, column);
+			}
+		}
 
-	fmstate = (MongoFdwModifyState *) palloc0(sizeof(MongoFdwModifyState));
-	/*
-	 * Identify which user to do the remote access as.  This should match what
-	 * ExecCheckRTEPerms() does.
-	 */
-	rte = rt_fetch(fsplan->scan.scanrelid, estate->es_range_table);
-	userid = rte->checkAsUser ? rte->checkAsUser : GetUserId();
+		foreach(columnCell, columnList)
+		{
+			List *classClauseList = NIL;
 
-	/* Get info about foreign table. */
-	fmstate->rel = scanState->ss.ss_currentRelation;
-	table = GetForeignTable(RelationGetRelid(fmstate->rel));
-	server = GetForeignServer(table->serverid);
-	user = GetUserMapping(userid, server->serverid);
+			classClauseList = generate_implied_equalities_for_column(root, baserel,
+									MongoEquivalenceMemberMatches,
+									lfirst(columnCell),
+									baserel->lateral_referencers);
+			foreach(clauseCell, classClauseList)
+			{
+				RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(clauseCell);
 
-	/*
-	 * Get connection to the foreign server. Connection manager will
-	 * establish new connection if necessary.
-	 */
-	mongoConnection = mongo_get_connection(server, user, options);
+				if (JoinClauseIsApplicable(restrictInfo->clause, baserel))
+					joinClauseList = lappend(joinClauseList, restrictInfo);
+			}
+		}
+	}
 
-	foreignScan = (ForeignScan *) scanState->ss.ps.plan;
-	foreignPrivateList = foreignScan->fdw_private;
-	Assert(list_length(foreignPrivateList) == 2);
+	foreach(clauseCell, joinClauseList)
+	{
+		RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(clauseCell);
+		Relids       requiredOuter = NULL;
+		bool         found = false;
+
+		requiredOuter = bms_union(restrictInfo->clause_relids,
+								  baserel->lateral_relids);
+		requiredOuter = bms_del_members(requiredOuter, baserel->relids);
+		if (bms_is_empty(requiredOuter))
+			continue;
 
-	columnList = list_nth(foreignPrivateList, 0);
-	opExpressionList = list_nth(foreignPrivateList, 1);
+		foreach(outerRelidsCell, outerRelidsList)
+		{
+			if (bms_equal((Relids) lfirst(outerRelidsCell), requiredOuter))
+				found = true;
+		}
+		if (!found)
+			outerRelidsList = lappend(outerRelidsList, requiredOuter);
+	}
 
-	queryDocument = QueryDocument(foreignTableId, opExpressionList, scanState);
+	foreach(outerRelidsCell, outerRelidsList)
+	{
+		Relids        requiredOuter = (Relids) lfirst(outerRelidsCell);
+		ParamPathInfo *paramInfo = NULL;
+		List          *paramClauseList = NIL;
+		List          *lookupClauseList = NIL;
+		double        lookupCount = 0.0;
+		double        examinedCount = 0.0;
+		Cost          accessCost = 0.0;
+		Cost          startupCost = 0.0;
+		Cost          totalCost = 0.0;
+		Path          *foreignPath = NULL;
+
+		paramInfo = get_baserel_parampathinfo(root, baserel, requiredOuter);
+		paramClauseList = MongoParamClauseList(baserel, paramInfo->ppi_clauses);
+		if (paramClauseList == NIL)
+			continue;
 
-	columnMappingHash = ColumnMappingHash(foreignTableId, columnList);
+		/*
+		 * Each rescan costs a round trip. The server finds the matching
+		 * documents with an index on the join columns if there is one, and
+		 * otherwise reads the whole collection for every outer row. If we
+		 * couldn't read the indexes, we assume there is one, with which each
+		 * document is read from a page of its own.
+		 */
+		lookupClauseList = list_concat(list_copy(opExpressionList),
+									   paramClauseList);
+		lookupCount = clamp_row_est(documentCount *
+									clauselist_selectivity(root, lookupClauseList,
+														   baserel->relid,
+														   JOIN_INNER, NULL));
+
+		startupCost = baserel->baserestrictcost.startup +
+			MONGO_CONNECTION_COST_MULTIPLIER * seq_page_cost;
+		totalCost = startupCost +
+			(cpu_tuple_cost * MONGO_TUPLE_COST_MULTIPLIER +
+			 baserel->baserestrictcost.per_tuple) * lookupCount;
+
+		if (fpinfo->indexList == NIL)
+			totalCost += random_page_cost * Min(lookupCount, (double) Max(pageCount, 1)) +
+				cpu_tuple_cost * lookupCount;
+		else if (MongoCheapestIndex(root, baserel, lookupClauseList, NIL, NIL,
+									documentCount, pageCount, &accessCost,
+									&examinedCount) != NIL)
+			totalCost += accessCost + cpu_tuple_cost * examinedCount;
+		else
+			totalCost += seq_page_cost * pageCount + cpu_tuple_cost * documentCount;
 
-	/* create cursor for collection name and set query */
-	mongoCursor = MongoCursorCreate(mongoConnection, options->svr_database, options->collectionName, queryDocument);
+		foreignPath = (Path *) create_foreignscan_path(root, baserel,
+#if PG_VERSION_NUM >= 90600
+					NULL,          /* default pathtarget */
+#endif
+					paramInfo->ppi_rows,
+					startupCost,
+					totalCost,
+					NIL,   /* no pathkeys */
+					requiredOuter,
+#if PG_VERSION_NUM >= 90500
+					NULL,  /* no extra plan */
+#endif
+					list_make3(NIL, makeInteger(0), NIL));
 
-	/* create and set foreign execution state */
-	fmstate->columnMappingHash = columnMappingHash;
-	fmstate->mongoConnection = mongoConnection;
-	fmstate->mongoCursor = mongoCursor;
-	fmstate->queryDocument = queryDocument;
-	fmstate->options = options;
+#if PG_VERSION_NUM >= 90600
+		/* the values of the outer rows are parameters set by the executor */
+		foreignPath->parallel_safe = false;
+#endif
 
-	scanState->fdw_state = (void *) fmstate;
+		add_path(baserel, foreignPath);
+	}
 }
 
 
 /*
- * MongoIterateForeignScan reads the next document from MongoDB, converts it to
- * a PostgreSQL tuple, and stores the converted tuple into the ScanTupleSlot as
- * a virtual tuple.
+ * MongoEquivalenceMemberMatches tells generate_implied_equalities_for_column
+ * whether the member is the column given as argument.
  */
-static TupleTableSlot *
-MongoIterateForeignScan(ForeignScanState *scanState)
+static bool
+MongoEquivalenceMemberMatches(PlannerInfo *root, RelOptInfo *baserel,
+							  EquivalenceClass *eclass,
+							  EquivalenceMember *member, void *arg)
 {
-	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
-	TupleTableSlot      *tupleSlot = scanState->ss.ss_ScanTupleSlot;
-	MONGO_CURSOR        *mongoCursor = fmstate->mongoCursor;
-	HTAB                *columnMappingHash = fmstate->columnMappingHash;
-	TupleDesc           tupleDescriptor = tupleSlot->tts_tupleDescriptor;
-	Datum               *columnValues = tupleSlot->tts_values;
-	bool                *columnNulls = tupleSlot->tts_isnull;
-	int32               columnCount = tupleDescriptor->natts;
+	return equal(member->em_expr, arg);
+}
 
-	/*
-	 * We execute the protocol to load a virtual tuple into a slot. We first
-	 * call ExecClearTuple, then fill in values / isnull arrays, and last call
-	 * ExecStoreVirtualTuple. If we are done fetching documents from Mongo, we
-	 * just return an empty slot as required.
-	 */
-	ExecClearTuple(tupleSlot);
 
-	/* initialize all values for this row to null */
-	memset(columnValues, 0, columnCount * sizeof(Datum));
-	memset(columnNulls, true, columnCount * sizeof(bool));
+/*
+ * MongoParamClauseList returns the clauses of the given restriction infos that
+ * a parameterized scan adds to its query document.
+ */
+static List *
+MongoParamClauseList(RelOptInfo *baserel, List *restrictInfoList)
+{
+	List     *paramClauseList = NIL;
+	ListCell *restrictInfoCell = NULL;
 
-	if (MongoCursorNext(mongoCursor, NULL))
+	foreach(restrictInfoCell, restrictInfoList)
 	{
-		const BSON *bsonDocument = MongoCursorBson(mongoCursor);
-		const char *bsonDocumentKey = NULL; /* top level document */
+		RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(restrictInfoCell);
 
-		FillTupleSlot(bsonDocument, bsonDocumentKey,
-					  columnMappingHash, columnValues, columnNulls);
-
-		ExecStoreVirtualTuple(tupleSlot);
+		if (!restrictInfo->pseudoconstant &&
+			JoinClauseIsApplicable(restrictInfo->clause, baserel))
+			paramClauseList = lappend(paramClauseList, restrictInfo->clause);
 	}
-	return tupleSlot;
+
+	return paramClauseList;
 }
 
 
 /*
- * MongoEndForeignScan finishes scanning the foreign table, closes the cursor
- * and the connection to MongoDB, and reclaims scan related resources.
+ * MongoCoveringIndexList returns the indexes of the given list that hold all the
+ * given columns, with which MongoDB can answer the query from the index alone,
+ * if the projection leaves out the other fields. So there are none if the
+ * projection option is off. MongoDB still reads the documents if the index has
+ * array values, which we can't tell; the query is then just not any faster.
  */
-static void
-MongoEndForeignScan(ForeignScanState *scanState)
+static List *
+MongoCoveringIndexList(RelOptInfo *baserel, Oid foreignTableId, List *indexList,
+					   List *columnList)
 {
-	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+	List                 *coveringIndexList = NIL;
+	ListCell             *indexCell = NULL;
 
-	/* if we executed a query, reclaim mongo related resources */
-	if (fmstate != NULL)
+	if (indexList == NIL || fpinfo->options->projection == MONGO_PROJECTION_OFF)
+		return NIL;
+
+	foreach(indexCell, indexList)
 	{
-		if (fmstate->options)
+		List     *keyList = (List *) lfirst(indexCell);
+		ListCell *columnCell = NULL;
+		bool     covering = true;
+
+		foreach(columnCell, columnList)
 		{
-			mongo_free_options(fmstate->options);
-			fmstate->options = NULL;
+			Var      *column = (Var *) lfirst(columnCell);
+			char     *columnName = get_relid_attribute_name(foreignTableId,
+															column->varattno);
+			ListCell *keyCell = NULL;
+			bool     found = false;
+
+			foreach(keyCell, keyList)
+			{
+				List *keyEntry = (List *) lfirst(keyCell);
+
+				if (strcmp(strVal(linitial(keyEntry)), columnName) == 0)
+					found = true;
+			}
+
+			if (!found)
+			{
+				covering = false;
+				break;
+			}
 		}
-		MongoFreeScanState(fmstate);
+
+		if (covering)
+			coveringIndexList = lappend(coveringIndexList, keyList);
 	}
+
+	return coveringIndexList;
 }
 
 
 /*
- * MongoReScanForeignScan rescans the foreign table. Note that rescans in Mongo
- * end up being notably more expensive than what the planner expects them to be,
- * since MongoDB cursors don't provide reset/rewind functionality.
+ * MongoCheapestIndex returns the keys of the index with which MongoDB finds the
+ * documents that match the given clauses at the lowest cost, or NIL if no index
+ * helps. An index helps if the clauses compare its leading keys with values,
+ * or if it is one of the given covering indexes. With a sort list, only indexes
+ * whose keys give that order are considered, and those help in any case. The
+ * function sets *accessCost to the cost of reading the index and documents, and
+ * *examinedCount to the number of documents examined.
  */
-static void
-MongoReScanForeignScan(ForeignScanState *scanState)
+static List *
+MongoCheapestIndex(PlannerInfo *root, RelOptInfo *baserel, List *clauseList,
+				   List *sortList, List *coveringIndexList,
+				   double documentCount, BlockNumber pageCount,
+				   Cost *accessCost, double *examinedCount)
 {
-	MongoFdwModifyState      *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
-	MONGO_CONN               *mongoConnection = fmstate->mongoConnection;
-	MongoFdwOptions          *options = NULL;
-	Oid                      foreignTableId = InvalidOid;
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+	List                 *cheapestKeyList = NIL;
+	ListCell             *indexCell = NULL;
 
-	/* close down the old cursor */
-	MongoCursorDestroy(fmstate->mongoCursor);
+	foreach(indexCell, fpinfo->indexList)
+	{
+		List   *keyList = (List *) lfirst(indexCell);
+		List   *indexClauseList = NIL;
+		int    equalityCount = 0;
+		bool   covering = list_member_ptr(coveringIndexList, keyList);
+		double entryCount = 0.0;
+		Cost   indexCost = 0.0;
+
+		indexClauseList = MongoIndexClauseList(baserel, fpinfo->foreignTableId,
+											   keyList, clauseList,
+											   &equalityCount);
+		if (sortList != NIL)
+		{
+			if (!MongoIndexOrderMatches(keyList, equalityCount, sortList))
+				continue;
+		}
+		else if (indexClauseList == NIL && !covering)
+			continue;
 
-	/* reconstruct full collection name */
-	foreignTableId = RelationGetRelid(scanState->ss.ss_currentRelation);
-	options = mongo_get_options(foreignTableId);
+		indexCost = MongoIndexScanCost(root, baserel, indexClauseList, covering,
+									   documentCount, pageCount, &entryCount);
+		if (cheapestKeyList == NIL || indexCost < *accessCost)
+		{
+			cheapestKeyList = keyList;
+			*accessCost = indexCost;
+			*examinedCount = covering ? 0.0 : entryCount;
+		}
+	}
 
-	/* reconstruct cursor for collection name and set query */
-	fmstate->mongoCursor = MongoCursorCreate(mongoConnection,
-													fmstate->options->svr_database,
-													fmstate->options->collectionName,
-													fmstate->queryDocument);
-	mongo_free_options(options);
+	return cheapestKeyList;
 }
 
+
+/*
+ * MongoIndexClauseList returns the clauses of the given list with which MongoDB
+ * looks up entries of the index with the given keys: those that compare the
+ * first keys for equality, and those that compare the key after them in other
+ * ways. It sets *equalityCount to the number of keys compared for equality.
+ */
 static List *
-MongoPlanForeignModify(PlannerInfo *root,
-				ModifyTable *plan,
-				Index resultRelation,
-				int subplan_index)
+MongoIndexClauseList(RelOptInfo *baserel, Oid foreignTableId, List *keyList,
+					 List *clauseList, int *equalityCount)
 {
-	CmdType         operation = plan->operation;
-	RangeTblEntry   *rte = planner_rt_fetch(resultRelation, root);
-	Relation        rel;
-	List            *targetAttrs = NIL;
+	List     *indexClauseList = NIL;
+	ListCell *keyCell = NULL;
 
-	/*
-	 * Core code already has some lock on each rel being planned, so we can
-	 * use NoLock here.
-	 */
-	rel = heap_open(rte->relid, NoLock);
-
-	if (operation == CMD_INSERT)
+	*equalityCount = 0;
+	foreach(keyCell, keyList)
 	{
-		TupleDesc tupdesc = RelationGetDescr(rel);
-		int attnum;
+		char     *keyName = strVal(linitial((List *) lfirst(keyCell)));
+		ListCell *clauseCell = NULL;
+		bool     keyCompared = false;
+		bool     keyEquality = false;
 
-		for (attnum = 1; attnum <= tupdesc->natts; attnum++)
+		foreach(clauseCell, clauseList)
 		{
-			Form_pg_attribute attr = tupdesc->attrs[attnum - 1];
+			Expr *clause = (Expr *) lfirst(clauseCell);
+			bool equality = false;
+			char *fieldName = ClauseIndexField(clause, baserel, foreignTableId,
+											   &equality);
 
-			if (!attr->attisdropped)
-				targetAttrs = lappend_int(targetAttrs, attnum);
+			if (fieldName == NULL || strcmp(fieldName, keyName) != 0)
+				continue;
+
+			indexClauseList = lappend(indexClauseList, clause);
+			keyCompared = true;
+			if (equality)
+				keyEquality = true;
 		}
-	}
-	else if (operation == CMD_UPDATE)
-	{
-#if PG_VERSION_NUM >= 90500
-                Bitmapset *tmpset = bms_copy(rte->updatedCols);
-#else
-                Bitmapset *tmpset = bms_copy(rte->modifiedCols);
-#endif
-		AttrNumber	col;
 
-		while ((col = bms_first_member(tmpset)) >= 0)
-		{
-			col += FirstLowInvalidHeapAttributeNumber;
-			if (col <= InvalidAttrNumber)		/* shouldn't happen */
-				elog(ERROR, "system-column update is not supported");
-			/*
-			 * We also disallow updates to the first column which
-			 * happens to be the row identifier in MongoDb (_id)
-			 */
-			if (col == 1)	/* shouldn't happen */
-				elog(ERROR, "row identifier column update is not supported");
+		if (!keyCompared || !keyEquality)
+			break;
 
-			targetAttrs = lappend_int(targetAttrs, col);
-		}
-		/* We also want the rowid column to be available for the update */
-		targetAttrs = lcons_int(1, targetAttrs);
+		(*equalityCount)++;
 	}
-	else
-	{
-		targetAttrs = lcons_int(1, targetAttrs);
-	}
-	/*
-	 * RETURNING list not supported
-	 */
-	if (plan->returningLists)
-		elog(ERROR, "RETURNING is not supported by this FDW");
-
-	heap_close(rel, NoLock);
 
-	return list_make1(targetAttrs);
+	return indexClauseList;
 }
 
 
 /*
- * Begin an insert/update/delete operation on a foreign table
+ * MongoIndexOrderMatches tells whether MongoDB returns the entries of the index
+ * with the given keys in the order of the sort list, when the given number of
+ * first keys are compared for equality. The index may be read backwards.
  */
-static void
-MongoBeginForeignModify(ModifyTableState *mtstate,
-					ResultRelInfo *resultRelInfo,
-					List *fdw_private,
-					int subplan_index,
-					int eflags)
+static bool
+MongoIndexOrderMatches(List *keyList, int equalityCount, List *sortList)
 {
-	MongoFdwModifyState       *fmstate = NULL;
-	Relation                  rel = resultRelInfo->ri_RelationDesc;
-	AttrNumber                n_params = 0;
-	Oid                       typefnoid = InvalidOid;
-	bool                      isvarlena = false;
-	ListCell                  *lc = NULL;
-	Oid                       foreignTableId = InvalidOid;
-
-	/*
-	 * Do nothing in EXPLAIN (no ANALYZE) case. resultRelInfo->ri_FdwState
-	 * stays NULL.
-	 */
-	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
-		return;
-
-	foreignTableId = RelationGetRelid(rel);
+	ListCell *sortCell = NULL;
+	int      keyIndex = equalityCount;
+	int      indexDirection = 0;
 
-	/* Begin constructing MongoFdwModifyState. */
-	fmstate = (MongoFdwModifyState *) palloc0(sizeof(MongoFdwModifyState));
+	foreach(sortCell, sortList)
+	{
+		List *sortEntry = (List *) lfirst(sortCell);
+		List *keyEntry = NIL;
+		int  direction = 0;
+
+		if (keyIndex >= list_length(keyList))
+			return false;
+
+		keyEntry = (List *) list_nth(keyList, keyIndex++);
+		if (strcmp(strVal(linitial(sortEntry)), strVal(linitial(keyEntry))) != 0)
+			return false;
+
+		direction = intVal(lsecond(sortEntry)) * intVal(lsecond(keyEntry));
+		if (indexDirection == 0)
+			indexDirection = direction;
+		else if (direction != indexDirection)
+			return false;
+	}
 
-	fmstate->rel = rel;
-	fmstate->options = mongo_get_options(foreignTableId);
+	return true;
+}
 
-	fmstate->target_attrs = (List *) list_nth(fdw_private, 0);
 
-	n_params = list_length(fmstate->target_attrs) + 1;
-	fmstate->p_flinfo = (FmgrInfo *) palloc0(sizeof(FmgrInfo) * n_params);
-	fmstate->p_nums = 0;
+/*
+ * MongoIndexScanCost estimates the cost for MongoDB to read the entries of an
+ * index the given clauses select, and unless the index covers the scan, the
+ * documents they point to, which are scattered over the collection. Entries
+ * are taken to be as wide as the columns the scan needs. The function sets
+ * *entryCount to the number of entries read.
+ */
+static Cost
+MongoIndexScanCost(PlannerInfo *root, RelOptInfo *baserel, List *indexClauseList,
+				   bool covering, double documentCount, BlockNumber pageCount,
+				   double *entryCount)
+{
+	double indexSelectivity = 0.0;
+	double indexPageCount = 0.0;
+	Cost   indexCost = 0.0;
+#if PG_VERSION_NUM >= 90600
+	int32  entryWidth = baserel->reltarget->width;
+#else
+	int32  entryWidth = baserel->width;
+#endif
 
-	/* Set up for remaining transmittable parameters */
-	foreach(lc, fmstate->target_attrs)
-	{
-		int attnum = lfirst_int(lc);
-		Form_pg_attribute attr = RelationGetDescr(rel)->attrs[attnum - 1];
+	indexSelectivity = clauselist_selectivity(root, indexClauseList,
+											  baserel->relid, JOIN_INNER, NULL);
+	*entryCount = clamp_row_est(documentCount * indexSelectivity);
+	indexPageCount = ceil(*entryCount * Max(entryWidth, 1) / BLCKSZ);
 
-		Assert(!attr->attisdropped);
+	/* one descent of the index, then a sequential read of its entries */
+	indexCost = random_page_cost + seq_page_cost * indexPageCount +
+		cpu_index_tuple_cost * (*entryCount);
 
-		getTypeOutputInfo(attr->atttypid, &typefnoid, &isvarlena);
-		fmgr_info(typefnoid, &fmstate->p_flinfo[fmstate->p_nums]);
-		fmstate->p_nums++;
-	}
-	Assert(fmstate->p_nums <= n_params);
+	if (!covering)
+		indexCost += random_page_cost *
+			index_pages_fetched(*entryCount, Max(pageCount, 1), indexPageCount,
+								root);
 
-	resultRelInfo->ri_FdwState = fmstate;
+	return indexCost;
 }
 
 
 /*
- * Insert one row into a foreign table.
+ * MongoGetForeignPlan creates a foreign scan plan node for scanning the MongoDB
+ * collection. Note that MongoDB decides which index to use for this scan unless
+ * the chosen path hints one, and that decision isn't visible to us.
  */
-static TupleTableSlot *
-MongoExecForeignInsert(EState *estate,
-					ResultRelInfo *resultRelInfo,
-					TupleTableSlot *slot,
-					TupleTableSlot *planSlot)
-{
-	MongoFdwOptions           *options = NULL;
-	MONGO_CONN                *mongoConnection = NULL;
-	Oid                       foreignTableId = InvalidOid;
-	BSON                      *b = NULL;
-	Oid                       typoid;
-	Datum                     value;
-	bool                      isnull = false;
-	Oid                       userid;
-	ForeignServer             *server;
-	UserMapping               *user;
-	ForeignTable              *table;
-
-	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
-
-	foreignTableId = RelationGetRelid(resultRelInfo->ri_RelationDesc);
-
-	userid = GetUserId();
+static ForeignScan *
+MongoGetForeignPlan(PlannerInfo *root,
+				RelOptInfo *baserel,
+				Oid foreigntableid,
+				ForeignPath *best_path,
+				List *targetList,
+				List *restrictionClauses,
+				Plan *outer_plan)
 
-	/* Get info about foreign table. */
-	table = GetForeignTable(RelationGetRelid(fmstate->rel));
-	server = GetForeignServer(table->serverid);
-	user = GetUserMapping(userid, server->serverid);
+{
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+	Index                scanRangeTableIndex = baserel->relid;
+	ForeignScan          *foreignScan = NULL;
+	List                 *foreignPrivateList = NIL;
+	List                 *opExpressionList = NIL;
+	BSON                 *queryDocument = NULL;
+	List                 *columnList = NIL;
+	List                 *filterQualList = NIL;
+	List                 *paramClauseList = NIL;
+	List                 *foreignExprList = NIL;
+	List                 *hintList = NIL;
+	bool                 projection = false;
+
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
+	if (baserel->reloptkind == RELOPT_UPPER_REL)
+		return MongoGetForeignAggregatePlan(baserel, targetList);
+#endif
 
 	/*
-	 * Get connection to the foreign server. Connection manager will
-	 * establish new connection if necessary.
+	 * We push down applicable restriction clauses to MongoDB, but for simplicity
+	 * we currently put all the restrictionClauses into the plan node's qual
+	 * list for the executor to re-check. So all we have to do here is strip
+	 * RestrictInfo nodes from the clauses and ignore pseudoconstants (which
+	 * will be handled elsewhere).
 	 */
-	options = fmstate->options;
-	mongoConnection = mongo_get_connection(server, user, options);
-
-	b = BsonCreate();
-
-	typoid = get_atttype(foreignTableId, 1);
+	restrictionClauses = extract_actual_clauses(restrictionClauses, false);
 
-	/* get following parameters from slot */
-	if (slot != NULL && fmstate->target_attrs != NIL)
-	{
-		ListCell *lc;
+	/* we construct the query document to have MongoDB filter its rows */
+	opExpressionList = fpinfo->opExpressionList;
+	queryDocument = QueryDocument(foreigntableid, opExpressionList, NULL);
 
-		foreach(lc, fmstate->target_attrs)
-		{
-			int attnum = lfirst_int(lc);
-			value = slot_getattr(slot, attnum, &isnull);
+	/*
+	 * A parameterized path also sends its join clauses. They go into fdw_exprs,
+	 * where the planner replaces the outer columns by the parameters the
+	 * nested loop sets for each outer row.
+	 */
+	if (best_path->path.param_info != NULL)
+		paramClauseList = MongoParamClauseList(baserel,
+											   best_path->path.param_info->ppi_clauses);
 
-			/* first column of MongoDB's foreign table must be _id */
-			if (strcmp(slot->tts_tupleDescriptor->attrs[0]->attname.data, "_id") != 0)
-				elog(ERROR, "first column of MongoDB's foreign table must be \"_id\"");
+	/* we don't need to serialize column list as lists are copiable */
+	columnList = ColumnList(baserel);
 
-			if (typoid != NAMEOID)
-				elog(ERROR, "type of first column of MongoDB's foreign table must be \"NAME\"");
+	/*
+	 * Asking MongoDB for only the needed columns costs the server some work,
+	 * which we found to degrade performance when most of each document is
+	 * needed anyway. So we only do so when the projection option asks for it.
+	 */
+	projection = MongoUseProjection(baserel, foreigntableid, columnList);
+
+	/* a covered query needs one, to leave out the fields not in the index */
+	hintList = (List *) lthird(best_path->fdw_private);
+	if (hintList != NIL &&
+		MongoCoveringIndexList(baserel, foreigntableid, list_make1(hintList),
+							   columnList) != NIL)
+		projection = true;
+
+	/* checking the other clauses early saves converting rejected documents */
+	filterQualList = MongoFilterQualList(baserel, foreigntableid,
+										 restrictionClauses,
+										 list_concat(list_copy(opExpressionList),
+													 paramClauseList),
+										 columnList);
+	if (filterQualList != NIL || paramClauseList != NIL)
+		foreignExprList = list_make2(filterQualList, paramClauseList);
 
-			if (strcmp(slot->tts_tupleDescriptor->attrs[0]->attname.data, "__doc") == 0)
-				continue;
+	/* construct foreign plan with query document and column list */
+	foreignPrivateList = list_make3(columnList, opExpressionList,
+									makeInteger(projection));
 
-			if (attnum == 1)
-			{
-				/*
-				 * Ignore the value of first column which is row identifier in MongoDb (_id)
-				 * and let MongoDB to insert the unique value for that column.
-				 */
-			}
-			else
-			{
-				AppenMongoValue(b, slot->tts_tupleDescriptor->attrs[attnum - 1]->attname.data, value,
-						isnull, slot->tts_tupleDescriptor->attrs[attnum -1]->atttypid);
-			}
-		}
-	}
-	BsonFinish(b);
+	/* add the sort, the limit and the index hint of the chosen path */
+	foreignPrivateList = list_concat(foreignPrivateList,
+									 list_copy(best_path->fdw_private));
 
-	/* Now we are ready to insert tuple / document into MongoDB */
-	MongoInsert(mongoConnection, options->svr_database, options->collectionName, b);
+	/* only clean up the query struct */
+	BsonDestroy(queryDocument);
 
-	BsonDestroy(b);
+	/* create the foreign scan node */
+	foreignScan =  make_foreignscan(targetList, restrictionClauses,
+									scanRangeTableIndex,
+									foreignExprList,
+									foreignPrivateList
+#if PG_VERSION_NUM >= 90500
+									,NIL
+									,NIL
+									,NULL
+#endif
+                               );
 
-	return slot;
+	return foreignScan;
 }
 
 
 /*
- * Add column(s) needed for update/delete on a foreign table, we are using
- * first column as row identification column, so we are adding that into target
- * list.
+ * MongoExplainForeignScan produces extra output for the Explain command.
  */
 static void
-MongoAddForeignUpdateTargets(Query *parsetree,
-						RangeTblEntry *target_rte,
-						Relation target_relation)
+MongoExplainForeignScan(ForeignScanState *scanState, ExplainState *explainState)
 {
-	Var                 *var = NULL;
-	const char          *attrname = NULL;
-	TargetEntry         *tle = NULL;
-
-	/*
-	 * What we need is the rowid which is the first column
-	 */
-	Form_pg_attribute attr =
-				RelationGetDescr(target_relation)->attrs[0];
-
-	/* Make a Var representing the desired value */
-	var = makeVar(parsetree->resultRelation,
-				1,
-				attr->atttypid,
-				attr->atttypmod,
-				InvalidOid,
-				0);
+	MongoFdwOptions        *options = NULL;
+	StringInfo             namespaceName = NULL;
+	Oid                    foreignTableId = InvalidOid;
 
-	/* Wrap it in a TLE with the right name ... */
-	attrname = NameStr(attr->attname);
+	foreignTableId = MongoScanRelationId(scanState);
+	options = mongo_get_options(foreignTableId);
 
-	tle = makeTargetEntry((Expr *) var,
-						list_length(parsetree->targetList) + 1,
-						pstrdup(attrname),
-						true);
+#ifdef META_DRIVER
+	if (options->filename != NULL)
+		ExplainPropertyText("Foreign File", options->filename, explainState);
+	else
+#endif
+	{
+		/* construct fully qualified collection name */
+		namespaceName = makeStringInfo();
+		appendStringInfo(namespaceName, "%s.%s", options->svr_database,
+						 options->collectionName);
 
-	/* ... and add it to the query's targetlist */
-	parsetree->targetList = lappend(parsetree->targetList, tle);
-}
+		ExplainPropertyText("Foreign Namespace", namespaceName->data,
+							explainState);
+	}
 
+	mongo_free_options(options);
 
-static TupleTableSlot *
-MongoExecForeignUpdate(EState *estate,
-					ResultRelInfo *resultRelInfo,
-					TupleTableSlot *slot,
-					TupleTableSlot *planSlot)
-{
-	MongoFdwOptions            *options = NULL;
-	MONGO_CONN                 *mongoConnection = NULL;
-	Datum                      datum = 0;
-	bool                       isNull = false;
-	Oid                        foreignTableId = InvalidOid;
-	char                       *columnName = NULL;
-	Oid                        typoid = InvalidOid;
-	BSON                       *b = NULL;
-	BSON                       *op = NULL;
-	BSON                       set;
-	Oid                        userid = GetUserId();
-	ForeignServer              *server;
-	UserMapping                *user;
-	ForeignTable               *table;
+#if PG_VERSION_NUM >= 90600
+	/* show the most memory the values of a tuple took, in kilobytes */
+	if (explainState->analyze && scanState->fdw_state != NULL)
+	{
+		MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+		long                peakSpace = (fmstate->tupleMemoryPeak + 1023) / 1024;
 
+		if (explainState->format == EXPLAIN_FORMAT_TEXT)
+		{
+			appendStringInfoSpaces(explainState->str, explainState->indent * 2);
+			appendStringInfo(explainState->str, "Peak Tuple Memory: %ldkB\n",
+							 peakSpace);
+		}
+		else
+			ExplainPropertyLong("Peak Tuple Memory", peakSpace, explainState);
+	}
+#endif
 
-	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
+#ifdef META_DRIVER
+	/* show how often the rescan cache spared a query */
+	if (explainState->analyze && scanState->fdw_state != NULL)
+	{
+		MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
 
-	foreignTableId = RelationGetRelid(resultRelInfo->ri_RelationDesc);
+		if (fmstate->lookupHits + fmstate->lookupMisses > 0)
+		{
+			ExplainPropertyLong("Rescan Cache Hits", fmstate->lookupHits,
+								explainState);
+			ExplainPropertyLong("Rescan Cache Misses", fmstate->lookupMisses,
+								explainState);
+		}
+	}
+#endif
 
-	/* resolve foreign table options; and connect to mongo server */
-	options = fmstate->options;
+	/* show what the scan fetched, and where its time went */
+	if (explainState->analyze && scanState->fdw_state != NULL)
+		MongoExplainScanStats((MongoFdwModifyState *) scanState->fdw_state,
+							  explainState);
 
-	/* Get info about foreign table. */
-	table = GetForeignTable(foreignTableId);
-	server = GetForeignServer(table->serverid);
-	user = GetUserMapping(userid, server->serverid);
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
+	/* show the pipeline of a pushed down aggregation */
+	if (scanState->ss.ss_currentRelation == NULL)
+	{
+		ForeignScan *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+		List        *foreignPrivateList = foreignScan->fdw_private;
+		BSON        *pipelineDocument = NULL;
+		char        *pipelineString = NULL;
+
+		pipelineDocument = AggregatePipeline(foreignTableId,
+								list_nth(foreignPrivateList,
+										 MongoFdwScanPrivateOpExpressionList),
+								list_nth(foreignPrivateList,
+										 MongoFdwScanPrivateAggregateList),
+								NULL);
+		pipelineString = BsonAsJson(pipelineDocument);
+		ExplainPropertyText("Foreign Pipeline", pipelineString, explainState);
+
+		bson_free(pipelineString);
+		BsonDestroy(pipelineDocument);
+		return;
+	}
+#endif
 
 	/*
-	 * Get connection to the foreign server. Connection manager will
-	 * establish new connection if necessary.
+	 * Show the query document, sort, index hint, limit and fetched columns we
+	 * send, if any. The query document is the one sent last, or without
+	 * ANALYZE, the one the scan would send, unless it depends on parameters.
 	 */
-	mongoConnection = mongo_get_connection(server, user, options);
+	if (explainState->verbose)
+	{
+		MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+		ForeignScan *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+		List        *foreignPrivateList = foreignScan->fdw_private;
+		List        *sortList = NIL;
+		List        *hintList = NIL;
+		int         limitCount = 0;
+		List        *columnList = NIL;
+		ListCell    *columnCell = NULL;
+		StringInfo  projectionString = NULL;
+		List        *opExpressionList = NIL;
+		BSON        *queryDocument = NULL;
+		BSON        *builtDocument = NULL;
+		BSON        *fieldsDocument = NULL;
+
+		sortList = list_nth(foreignPrivateList, MongoFdwScanPrivateSortList);
+		hintList = list_nth(foreignPrivateList, MongoFdwScanPrivateHint);
+		limitCount = intVal(list_nth(foreignPrivateList, MongoFdwScanPrivateLimit));
+		columnList = list_nth(foreignPrivateList, MongoFdwScanPrivateColumnList);
+
+		opExpressionList = list_nth(foreignPrivateList,
+									MongoFdwScanPrivateOpExpressionList);
+
+		if (fmstate != NULL && fmstate->queryDocument != NULL)
+			queryDocument = fmstate->queryDocument;
+		else if (bms_is_empty(foreignScan->scan.plan.extParam) &&
+				 !MongoContainsParam((Node *) opExpressionList, NULL) &&
+				 !contain_mutable_functions((Node *) opExpressionList))
+		{
+			builtDocument = QueryDocument(foreignTableId, opExpressionList, NULL);
+			if (sortList != NIL || hintList != NIL)
+				builtDocument = OrderedQueryDocument(builtDocument, sortList,
+													 hintList);
+			queryDocument = builtDocument;
+		}
 
-	/* Get the id that was passed up as a resjunk column */
-	datum = ExecGetJunkAttribute(planSlot, 1, &isNull);
+		if (queryDocument != NULL)
+		{
+			char *queryString = BsonAsJson(queryDocument);
 
-	columnName = get_relid_attribute_name(foreignTableId, 1);
+			ExplainPropertyText("Foreign Query", queryString, explainState);
+#ifdef META_DRIVER
+			bson_free(queryString);
+#endif
+		}
 
-	typoid = get_atttype(foreignTableId, 1);
+		if (sortList != NIL)
+			ExplainPropertyText("Foreign Sort", MongoSortListString(sortList),
+								explainState);
 
-	b = BsonCreate();
-	BsonAppendStartObject(b, "$set", &set);
+		if (hintList != NIL)
+			ExplainPropertyText("Foreign Index Hint",
+								MongoSortListString(hintList), explainState);
 
-	/* get following parameters from slot */
-	if (slot != NULL && fmstate->target_attrs != NIL)
-	{
-		ListCell *lc;
+		if (limitCount > 0)
+			ExplainPropertyLong("Foreign Limit", limitCount, explainState);
 
-		foreach(lc, fmstate->target_attrs)
+		if (intVal(list_nth(foreignPrivateList, MongoFdwScanPrivateProjection)))
 		{
-			int attnum = lfirst_int(lc);
-			Datum value;
-			bool isnull;
+			projectionString = makeStringInfo();
+			foreach(columnCell, columnList)
+			{
+				Var *column = (Var *) lfirst(columnCell);
 
-			if (strcmp("_id", slot->tts_tupleDescriptor->attrs[attnum - 1]->attname.data) == 0)
-				continue;
+				if (projectionString->len > 0)
+					appendStringInfoString(projectionString, ", ");
+				appendStringInfoString(projectionString,
+									   get_relid_attribute_name(foreignTableId,
+																column->varattno));
+			}
+			if (projectionString->len == 0 && hintList != NIL)
+				appendStringInfoString(projectionString,
+									   strVal(linitial((List *) linitial(hintList))));
+			else if (projectionString->len == 0)
+				appendStringInfoString(projectionString, "_id");
 
-			if (strcmp("__doc", slot->tts_tupleDescriptor->attrs[attnum - 1]->attname.data) == 0)
-				elog(ERROR, "system column '__doc' update is not supported");
+			ExplainPropertyText("Foreign Projection", projectionString->data,
+								explainState);
+
+			if (fmstate != NULL)
+				fieldsDocument = fmstate->fieldsDocument;
+			else
+				fieldsDocument = ProjectionDocument(foreignTableId, columnList,
+													hintList);
+		}
 
-			value = slot_getattr(slot, attnum, &isnull);
 #ifdef META_DRIVER
-			AppenMongoValue(&set, slot->tts_tupleDescriptor->attrs[attnum - 1]->attname.data, value,
-							isnull ? true : false, slot->tts_tupleDescriptor->attrs[attnum - 1]->atttypid);
-#else
-			AppenMongoValue(b, slot->tts_tupleDescriptor->attrs[attnum - 1]->attname.data, value,
-							isnull ? true : false, slot->tts_tupleDescriptor->attrs[attnum - 1]->atttypid);
+		/* with the remote_explain option, show the plan the server picks */
+		if (queryDocument != NULL)
+			MongoExplainRemotePlan(foreignTableId, queryDocument, fieldsDocument,
+								   limitCount, explainState);
 #endif
-		}
-	}
-	BsonAppendFinishObject(b, &set);
-	BsonFinish(b);
 
-	op = BsonCreate();
-	if (!AppenMongoValue(op, columnName, datum, false, typoid))
-	{
-		BsonDestroy(b);
-		return NULL;
+		if (builtDocument != NULL)
+			BsonDestroy(builtDocument);
+		if (fieldsDocument != NULL && fmstate == NULL)
+			BsonDestroy(fieldsDocument);
 	}
-	BsonFinish(op);
-
-	/* We are ready to update the row into MongoDB */
-	MongoUpdate(mongoConnection, options->svr_database, options->collectionName, op, b);
-
-	BsonDestroy(op);
-	BsonDestroy(b);
-
-	/* Return NULL if nothing was updated on the remote end */
-	return slot;
 }
 
+
 /*
- * MongoExecForeignDelete
- *		Delete one row from a foreign table
+ * MongoExplainScanStats shows how many documents the scan fetched, in how many
+ * batches and how many bytes of BSON, and if it was timed, how long it waited
+ * for them and how long it took to fill tuples from them, including the part of
+ * that spent converting values. The times are in milliseconds.
  */
-static TupleTableSlot *
-MongoExecForeignDelete(EState *estate,
-					ResultRelInfo *resultRelInfo,
-					TupleTableSlot *slot,
-					TupleTableSlot *planSlot)
+static void
+MongoExplainScanStats(MongoFdwModifyState *fmstate, ExplainState *explainState)
 {
-	MongoFdwOptions           *options = NULL;
-	MONGO_CONN                *mongoConnection = NULL;
-	Datum                     datum = 0;
-	bool                      isNull = false;
-	Oid                       foreignTableId = InvalidOid;
-	char                      *columnName = NULL;
-	Oid                       typoid = InvalidOid;
-	BSON                      *b = NULL;
-	Oid                       userid = GetUserId();
-	ForeignServer             *server;
-	UserMapping               *user;
-	ForeignTable              *table;
-
-
-	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
-
-	foreignTableId = RelationGetRelid(resultRelInfo->ri_RelationDesc);
-
-	/* resolve foreign table options; and connect to mongo server */
-	options = fmstate->options;
+	MongoScanStats *stats = &fmstate->stats;
+	double          fetchTime = INSTR_TIME_GET_MILLISEC(stats->fetchTime);
+	double          fillTime = INSTR_TIME_GET_MILLISEC(stats->fillTime);
+	double          convertTime = INSTR_TIME_GET_MILLISEC(stats->convertTime);
 
-	/* Get info about foreign table. */
-	table = GetForeignTable(foreignTableId);
-	server = GetForeignServer(table->serverid);
-	user = GetUserMapping(userid, server->serverid);
+	if (explainState->format == EXPLAIN_FORMAT_TEXT)
+	{
+		appendStringInfoSpaces(explainState->str, explainState->indent * 2);
+		appendStringInfo(explainState->str,
+						 "Fetched: documents=%ld batches=%ld bytes=%ld\n",
+						 stats->documentCount, stats->batchCount,
+						 stats->byteCount);
+		if (stats->timing)
+		{
+			appendStringInfoSpaces(explainState->str, explainState->indent * 2);
+			appendStringInfo(explainState->str,
+							 "Fetch Timings: wait=%.3f fill=%.3f conversion=%.3f\n",
+							 fetchTime, fillTime, convertTime);
+		}
+	}
+	else
+	{
+		ExplainPropertyLong("Documents Fetched", stats->documentCount,
+							explainState);
+		ExplainPropertyLong("Batches Fetched", stats->batchCount, explainState);
+		ExplainPropertyLong("Bytes Fetched", stats->byteCount, explainState);
+		if (stats->timing)
+		{
+			ExplainPropertyFloat("Fetch Wait Time", fetchTime, 3, explainState);
+			ExplainPropertyFloat("Tuple Fill Time", fillTime, 3, explainState);
+			ExplainPropertyFloat("Conversion Time", convertTime, 3, explainState);
+		}
+	}
+}
 
-	/*
-	 * Get connection to the foreign server. Connection manager will
-	 * establish new connection if necessary.
-	 */
-	mongoConnection = mongo_get_connection(server, user, options);
 
-	/* Get the id that was passed up as a resjunk column */
-	datum = ExecGetJunkAttribute(planSlot, 1, &isNull);
+#ifdef META_DRIVER
+/*
+ * MongoExplainRemotePlan shows the plan MongoDB picks for the given query, if
+ * the remote_explain option is set. The explain command is sent on a connection
+ * of its own, as a cursor of the scan may still be open on the shared one.
+ */
+static void
+MongoExplainRemotePlan(Oid foreignTableId, BSON *queryDocument,
+					   BSON *fieldsDocument, int limitCount,
+					   ExplainState *explainState)
+{
+	MongoFdwOptions *options = mongo_get_options(foreignTableId);
+	MONGO_CONN      *mongoConnection = NULL;
+	ForeignServer   *server = NULL;
+	UserMapping     *user = NULL;
+	char            *planString = NULL;
 
-	columnName = get_relid_attribute_name(foreignTableId, 1);
+	if (!options->remote_explain || options->filename != NULL)
+	{
+		mongo_free_options(options);
+		return;
+	}
 
-	typoid = get_atttype(foreignTableId, 1);
+	server = GetForeignServer(GetForeignTable(foreignTableId)->serverid);
+	user = GetUserMapping(GetUserId(), server->serverid);
+	mongoConnection = mongo_get_private_connection(server, user, options);
+	planString = MongoExplainQuery(mongoConnection, options->svr_database,
+								   options->collectionName, queryDocument,
+								   fieldsDocument, limitCount);
+	mongo_release_private_connection(mongoConnection);
+	mongo_free_options(options);
 
-	b = BsonCreate();
-	if (!AppenMongoValue(b,columnName, datum, false, typoid))
+	if (planString != NULL)
 	{
-		BsonDestroy(b);
-		return NULL;
+		ExplainPropertyText("Remote Plan", planString, explainState);
+		bson_free(planString);
 	}
-	BsonFinish(b);
+}
+#endif
 
-	/* Now we are ready to delete a single document from MongoDB */
-	MongoDelete(mongoConnection, options->svr_database, options->collectionName, b);
 
-	BsonDestroy(b);
+/*
+ * MongoContainsParam tells whether the given expression uses a parameter of
+ * any kind, such as one of a generic plan, whose value isn't known yet.
+ */
+static bool
+MongoContainsParam(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
 
-	/* Return NULL if nothing was updated on the remote end */
-	return slot;
+	if (IsA(node, Param))
+		return true;
+
+	return expression_tree_walker(node, MongoContainsParam, context);
 }
 
-/*
- * MongoEndForeignModify
- *		Finish an insert/update/delete operation on a foreign table
- */
 static void
-MongoEndForeignModify(EState *estate, ResultRelInfo *resultRelInfo)
-{
-	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
-	if (fmstate)
-	{
-		if (fmstate->options)
-		{
-			mongo_free_options(fmstate->options);
-			fmstate->options = NULL;
-		}
-		MongoFreeScanState(fmstate);
-		pfree(fmstate);
-	}
-}
-
-/*
- * ForeignTableDocumentCount connects to the MongoDB server, and queries it for
- * the number of documents in the foreign collection. On success, the function
- * returns the document count. On failure, the function returns -1.0.
- */
-static double
-ForeignTableDocumentCount(Oid foreignTableId)
+MongoExplainForeignModify(ModifyTableState *mtstate,
+							ResultRelInfo *rinfo,
+							List *fdw_private,
+							int subplan_index,
+							ExplainState *es)
 {
-	MongoFdwOptions         *options = NULL;
-	MONGO_CONN              *mongoConnection = NULL;
-	const BSON              *emptyQuery = NULL;
-	double                  documentCount = 0.0;
-	Oid		        userid = GetUserId();
-	ForeignServer           *server;
-	UserMapping             *user;
-	ForeignTable            *table;
-
-
-	/* Get info about foreign table. */
-	table = GetForeignTable(foreignTableId);
-	server = GetForeignServer(table->serverid);
-	user = GetUserMapping(userid, server->serverid);
+	MongoFdwOptions       *options = NULL;
+	StringInfo            namespaceName = NULL;
+	Oid                   foreignTableId = InvalidOid;
 
-	/* resolve foreign table options; and connect to mongo server */
+	foreignTableId = RelationGetRelid(rinfo->ri_RelationDesc);
 	options = mongo_get_options(foreignTableId);
 
-	/*
-	 * Get connection to the foreign server. Connection manager will
-	 * establish new connection if necessary.
-	 */
-	mongoConnection = mongo_get_connection(server, user, options);
-
-
-	documentCount = MongoAggregateCount(mongoConnection, options->svr_database, options->collectionName, emptyQuery);
+	/* construct fully qualified collection name */
+	namespaceName = makeStringInfo();
+	appendStringInfo(namespaceName, "%s.%s", options->svr_database,
+					 options->collectionName);
 
 	mongo_free_options(options);
-
-	return documentCount;
+	ExplainPropertyText("Foreign Namespace", namespaceName->data, es);
 }
 
 
 /*
- * ColumnMappingHash creates a hash table that maps column names to column index
- * and types. This table helps us quickly translate BSON document key/values to
- * the corresponding PostgreSQL columns.
+ * MongoBeginForeignScan connects to the MongoDB server, and builds the remote
+ * query to send to the server. The cursor itself is opened on the first fetch,
+ * unless the async option has the query sent right away. The function also
+ * creates a hash table that maps referenced column names to column index and
+ * type information.
  */
-static HTAB *
-ColumnMappingHash(Oid foreignTableId, List *columnList)
+static void
+MongoBeginForeignScan(ForeignScanState *scanState, int executorFlags)
 {
-	ListCell              *columnCell = NULL;
-	const long            hashTableSize = 2048;
-	HTAB                  *columnMappingHash = NULL;
+	MONGO_CONN               *mongoConnection = NULL;
+	Oid                      foreignTableId = InvalidOid;
+	List                     *columnList = NIL;
+	ColumnMappingTree        *columnMappingTree = NULL;
+	ForeignScan              *foreignScan = NULL;
+	List                     *foreignPrivateList = NIL;
+	MongoFdwOptions          *options = NULL;
+	MongoFdwModifyState      *fmstate = NULL;
+	List                     *opExpressionList = NIL;
+	List                     *filterQualList = NIL;
+	List                     *paramClauseList = NIL;
+	RangeTblEntry            *rte;
+	EState                   *estate = scanState->ss.ps.state;
+	ForeignScan              *fsplan = (ForeignScan *) scanState->ss.ps.plan;
+	Oid                      userid;
+	ForeignServer            *server;
+	UserMapping              *user;
+	ForeignTable             *table;
+#ifdef META_DRIVER
+	bool                     async = false;
+#endif
 
-	/* create hash table */
-	HASHCTL hashInfo;
-	memset(&hashInfo, 0, sizeof(hashInfo));
-	hashInfo.keysize = NAMEDATALEN;
-	hashInfo.entrysize = sizeof(ColumnMapping);
-	hashInfo.hash = string_hash;
-	hashInfo.hcxt = CurrentMemoryContext;
 
-	columnMappingHash = hash_create("Column Mapping Hash", hashTableSize, &hashInfo,
-									(HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT));
-	Assert(columnMappingHash != NULL);
+	/* if Explain with no Analyze, do nothing */
+	if (executorFlags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
 
-	foreach(columnCell, columnList)
-	{
-		Var *column = (Var *) lfirst(columnCell);
-		AttrNumber columnId = column->varattno;
+	foreignTableId = MongoScanRelationId(scanState);
+	options = mongo_get_options(foreignTableId);
 
-		ColumnMapping *columnMapping = NULL;
-		char *columnName = NULL;
-		bool handleFound = false;
-		void *hashKey = NULL;
+	fmstate = (MongoFdwModifyState *) palloc0(sizeof(MongoFdwModifyState));
+	foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+	foreignPrivateList = foreignScan->fdw_private;
 
-		columnName = get_relid_attribute_name(foreignTableId, columnId);
-		hashKey = (void *) columnName;
+	/* the node's instrumentation is set up after this, so ask the executor */
+	fmstate->stats.timing = estate != NULL &&
+							(estate->es_instrument & INSTRUMENT_TIMER) != 0;
 
-		columnMapping = (ColumnMapping *) hash_search(columnMappingHash, hashKey,
-													  HASH_ENTER, &handleFound);
-		Assert(columnMapping != NULL);
+	/* converted values live until the next fetch, so scans use flat memory */
+	fmstate->temp_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											  "mongo_fdw tuple data",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
 
-		columnMapping->columnIndex = columnId - 1;
-		columnMapping->columnTypeId = column->vartype;
-		columnMapping->columnTypeMod = column->vartypmod;
-		columnMapping->columnArrayTypeId = get_element_type(column->vartype);
+	/* the documents the scan builds are destroyed on abort if it fails */
+	fmstate->xactLevel = GetCurrentTransactionNestLevel();
+
+	/*
+	 * Identify which user to do the remote access as.  This should match what
+	 * ExecCheckRTEPerms() does. A pushed down aggregation has no scan relation,
+	 * and keeps the user in its private list instead. ANALYZE scans without an
+	 * executor state, as the current user.
+	 */
+	if (scanState->ss.ss_currentRelation == NULL)
+	{
+		userid = (Oid) intVal(list_nth(foreignPrivateList,
+									   MongoFdwScanPrivateCheckAsUser));
+		if (!OidIsValid(userid))
+			userid = GetUserId();
+	}
+	else if (estate != NULL)
+	{
+		rte = rt_fetch(fsplan->scan.scanrelid, estate->es_range_table);
+		userid = rte->checkAsUser ? rte->checkAsUser : GetUserId();
 	}
+	else
+		userid = GetUserId();
 
-	return columnMappingHash;
-}
+	/* Get info about foreign table. */
+	fmstate->rel = scanState->ss.ss_currentRelation;
+	table = GetForeignTable(foreignTableId);
+	server = GetForeignServer(table->serverid);
+	user = GetUserMapping(userid, server->serverid);
 
+#ifdef META_DRIVER
+	/*
+	 * With the async option, a plain scan run by the executor sends its query
+	 * before returning, and fetches the first batch in the background while
+	 * the other nodes of the query start. The fetch needs a client that no
+	 * other node uses meanwhile, so the scan gets a connection of its own.
+	 * Where a parallel scan starts is only known later, and so are the values
+	 * of parameters set by nested loops and subplans.
+	 */
+	async = options->async && estate != NULL &&
+			scanState->ss.ss_currentRelation != NULL &&
+			options->filename == NULL &&
+			bms_is_empty(fsplan->scan.plan.extParam);
+#if PG_VERSION_NUM >= 90600
+	if (fsplan->scan.plan.parallel_aware)
+		async = false;
+#endif
 
-/*
- * FillTupleSlot walks over all key/value pairs in the given document. For each
- * pair, the function checks if the key appears in the column mapping hash, and
- * if the value type is compatible with the one specified for the column. If so,
- * the function converts the value and fills the corresponding tuple position.
- * The bsonDocumentKey parameter is used for recursion, and should always be
- * passed as NULL.
- */
-static void
-FillTupleSlot(const BSON *bsonDocument, const char *bsonDocumentKey,
-			  HTAB *columnMappingHash, Datum *columnValues, bool *columnNulls)
-{
-	ColumnMapping*       columnMapping = NULL;
-	bool                 handleFound = false;
-	void*                hashKey = NULL;
-	BSON_ITERATOR        bsonIterator = { NULL, 0 };
+	/*
+	 * The exhaust cursor of the prefetch option ties up its client until it
+	 * is drained, while other statements may use the cached connection to
+	 * the same server, so it is only opened on a connection of its own too.
+	 */
+	fmstate->privateConnection = async ||
+		(options->prefetch && estate != NULL &&
+		 scanState->ss.ss_currentRelation != NULL &&
+		 options->filename == NULL);
+#endif
 
-	if (BsonIterInit(&bsonIterator, (BSON*)bsonDocument) == false)
-		elog(ERROR, "failed to initialize BSON iterator");
+	/*
+	 * Get connection to the foreign server. Connection manager will
+	 * establish new connection if necessary. A mongodump file is opened
+	 * instead.
+	 */
+#ifdef META_DRIVER
+	if (options->filename != NULL)
+		fmstate->file = MongoFileOpen(options->filename);
+	else if (fmstate->privateConnection)
+		mongoConnection = mongo_get_private_connection(server, user, options);
+	else
+#endif
+		mongoConnection = mongo_get_connection(server, user, options);
 
-	hashKey = "__doc";
-	columnMapping = (ColumnMapping *) hash_search(columnMappingHash, hashKey,
-												HASH_FIND, &handleFound);
+	columnList = list_nth(foreignPrivateList, MongoFdwScanPrivateColumnList);
+	opExpressionList = list_nth(foreignPrivateList,
+								MongoFdwScanPrivateOpExpressionList);
 
-	if (columnMapping != NULL && handleFound == true && columnValues[columnMapping->columnIndex] == 0)
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
+	if (scanState->ss.ss_currentRelation == NULL)
 	{
-		JsonLexContext* lex = NULL;
-		text*           result = NULL;
-		Datum           columnValue = 0;
-		char            *str;
+		ListCell *aggregateCell = NULL;
 
-		str = BsonAsJson(bsonDocument);
-		result = cstring_to_text_with_len(str, strlen(str));
-		lex = makeJsonLexContext(result, false);
-		pg_parse_json(lex, &nullSemAction);
-		columnValue = PointerGetDatum(result);
-
-		switch (columnMapping->columnTypeId)
+		Assert(list_length(foreignPrivateList) == 9);
+		fmstate->aggregateList = list_nth(foreignPrivateList,
+										  MongoFdwScanPrivateAggregateList);
+		foreach(aggregateCell, fmstate->aggregateList)
 		{
-			case BOOLOID:
-			case INT2OID:
-			case INT4OID:
-			case INT8OID:
-			case BOXOID:
-			case BYTEAOID:
-			case CHAROID:
-			case VARCHAROID:
-			case NAMEOID:
-			case JSONOID:
-			case XMLOID:
-			case POINTOID:
-			case LSEGOID:
-			case LINEOID:
-			case UUIDOID:
-			case LSNOID:
-			case TEXTOID:
-			case CASHOID:
-			case DATEOID:
-			case MACADDROID:
-			case TIMESTAMPOID:
-			case TIMESTAMPTZOID:
-			case BPCHAROID:
-				columnValue =  PointerGetDatum(result);
-				break;
-
-			case JSONBOID:
-				columnValue =  DirectFunctionCall1(jsonb_in, PointerGetDatum(str));
-				break;
-
-			default:
-				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-								errmsg("un-supported type for column __doc"),
-								errhint("Column type: %u", (uint32) columnMapping->columnTypeId)));
-				break;
+			List *aggregateEntry = (List *) lfirst(aggregateCell);
+			if (intVal(linitial(aggregateEntry)) == MONGO_AGGREGATE_GROUP)
+				fmstate->aggregateGrouped = true;
 		}
 
-		columnValues[columnMapping->columnIndex] = columnValue;
-		columnNulls[columnMapping->columnIndex] = false;
+		fmstate->mongoConnection = mongoConnection;
+		fmstate->queryDocument = AggregatePipeline(foreignTableId,
+												   opExpressionList,
+												   fmstate->aggregateList,
+												   scanState);
+		mongo_track_document(fmstate->queryDocument, fmstate->xactLevel);
+		fmstate->options = options;
 
+		scanState->fdw_state = (void *) fmstate;
 		return;
 	}
+#endif
+	Assert(list_length(foreignPrivateList) == 6);
 
-
-	while (BsonIterNext(&bsonIterator))
+	if (foreignScan->fdw_exprs != NIL)
 	{
-		const char *bsonKey = BsonIterKey(&bsonIterator);
-		BSON_TYPE bsonType = BsonIterType(&bsonIterator);
-		Oid columnTypeId = InvalidOid;
-		Oid columnArrayTypeId = InvalidOid;
-		bool compatibleTypes = false;
-		bool handleFound = false;
-		const char *bsonFullKey = NULL;
-		void *hashKey = NULL;
-
-		columnMapping = NULL;
-		if (bsonDocumentKey != NULL)
-		{
-			/*
-			 * For fields in nested BSON objects, we use fully qualified field
-			 * name to check the column mapping.
-			 */
-			StringInfo bsonFullKeyString = makeStringInfo();
-			appendStringInfo(bsonFullKeyString, "%s.%s", bsonDocumentKey, bsonKey);
-			bsonFullKey = bsonFullKeyString->data;
-		}
-		else
-		{
-			bsonFullKey = bsonKey;
-		}
+		filterQualList = list_nth(foreignScan->fdw_exprs,
+								  MongoFdwScanExprFilterQualList);
+		paramClauseList = list_nth(foreignScan->fdw_exprs,
+								   MongoFdwScanExprParamClauseList);
+	}
 
-		/* look up the corresponding column for this bson key */
-		hashKey = (void *) bsonFullKey;
-		columnMapping = (ColumnMapping *) hash_search(columnMappingHash, hashKey,
-													  HASH_FIND, &handleFound);
-		if (columnMapping != NULL)
-		{
-			columnTypeId = columnMapping->columnTypeId;
-			columnArrayTypeId = columnMapping->columnArrayTypeId;
-		}
+	fmstate->queryClauseList = list_concat(list_copy(opExpressionList),
+										   paramClauseList);
+	fmstate->sortList = list_nth(foreignPrivateList, MongoFdwScanPrivateSortList);
+	fmstate->hintList = list_nth(foreignPrivateList, MongoFdwScanPrivateHint);
+	fmstate->query_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											   "mongo_fdw query data",
+											   ALLOCSET_SMALL_MINSIZE,
+											   ALLOCSET_SMALL_INITSIZE,
+											   ALLOCSET_SMALL_MAXSIZE);
 
-		/* recurse into nested objects */
-		if (bsonType == BSON_TYPE_DOCUMENT)
-		{
-			if (columnTypeId != JSONOID)
-			{
-				BSON subObject;
-				BsonIterSubObject(&bsonIterator, &subObject);
-				FillTupleSlot(&subObject, bsonFullKey,
-						  columnMappingHash, columnValues, columnNulls);
-				continue;
-			}
-		}
+	/*
+	 * The query document is built with the current values of the parameters
+	 * its clauses compare columns with. Those that nested loops and subplans
+	 * set are only known once the scan is run or rescanned, so a scan that may
+	 * depend on them builds its document on the first fetch, and again after
+	 * rescans that change them.
+	 */
+	fmstate->queryParameterized = !bms_is_empty(fsplan->scan.plan.extParam);
+	if (!fmstate->queryParameterized)
+		MongoScanQueryDocument(scanState, fmstate);
 
-		/* if no corresponding column or null BSON value, continue */
-		if (columnMapping == NULL || bsonType == BSON_TYPE_NULL)
-		{
-			continue;
-		}
+	fmstate->limit = intVal(list_nth(foreignPrivateList,
+									 MongoFdwScanPrivateLimit));
 
-		/* check if columns have compatible types */
+	if (intVal(list_nth(foreignPrivateList, MongoFdwScanPrivateProjection)))
+	{
+		fmstate->fieldsDocument = ProjectionDocument(foreignTableId, columnList,
+													 fmstate->hintList);
+		mongo_track_document(fmstate->fieldsDocument, fmstate->xactLevel);
+	}
 
-		if (OidIsValid(columnArrayTypeId) && bsonType == BSON_TYPE_ARRAY)
-		{
-			compatibleTypes = true;
-		}
-		else
+	/*
+	 * The columns the locally checked clauses reference are filled first, to
+	 * check the clauses on them before filling the rest.
+	 */
+	if (filterQualList != NIL)
+	{
+		Bitmapset *qualAttributes = NULL;
+		List      *filterColumnList = NIL;
+		List      *otherColumnList = NIL;
+		ListCell  *columnCell = NULL;
+
+		pull_varattnos((Node *) filterQualList, foreignScan->scan.scanrelid,
+					   &qualAttributes);
+		foreach(columnCell, columnList)
 		{
-			compatibleTypes = ColumnTypesCompatible(bsonType, columnTypeId);
+			Var *column = (Var *) lfirst(columnCell);
+
+			if (bms_is_member(column->varattno - FirstLowInvalidHeapAttributeNumber,
+							  qualAttributes))
+				filterColumnList = lappend(filterColumnList, column);
+			else
+				otherColumnList = lappend(otherColumnList, column);
 		}
 
+		fmstate->filterMappingTree = ColumnMappingTreeCreate(foreignTableId,
+															 filterColumnList);
+#if PG_VERSION_NUM >= 100000
+		fmstate->filterQual = ExecInitQual(filterQualList,
+										   (PlanState *) scanState);
+#else
+		fmstate->filterQual = (List *) ExecInitExpr((Expr *) filterQualList,
+													(PlanState *) scanState);
+#endif
+		columnList = otherColumnList;
+	}
 
-		/* if types are incompatible, leave this column null */
-		if (!compatibleTypes)
-		{
-			continue;
-		}
+	columnMappingTree = ColumnMappingTreeCreate(foreignTableId, columnList);
+	if (fmstate->stats.timing)
+	{
+		columnMappingTree->stats = &fmstate->stats;
+		if (fmstate->filterMappingTree != NULL)
+			fmstate->filterMappingTree->stats = &fmstate->stats;
+	}
 
-		/* fill in corresponding column value and null flag */
-		if (OidIsValid(columnArrayTypeId))
-		{
-			int32 columnIndex = columnMapping->columnIndex;
+	/* create and set foreign execution state */
+	fmstate->columnMappingTree = columnMappingTree;
+	fmstate->mongoConnection = mongoConnection;
+	fmstate->mongoCursor = NULL;
+	fmstate->options = options;
 
-			columnValues[columnIndex] = ColumnValueArray(&bsonIterator,
-														 columnArrayTypeId);
-			columnNulls[columnIndex] = false;
-		}
-		else
-		{
-			int32 columnIndex = columnMapping->columnIndex;
-			Oid columnTypeMod = columnMapping->columnTypeMod;
+	scanState->fdw_state = (void *) fmstate;
 
-			columnValues[columnIndex] = ColumnValue(&bsonIterator,
-													columnTypeId, columnTypeMod);
-			columnNulls[columnIndex] = false;
-		}
+#ifdef META_DRIVER
+	/* rescans with the query of an earlier one are served from the cache */
+	if (options->rescan_cache && estate != NULL && fmstate->file == NULL
+#if PG_VERSION_NUM >= 90600
+		&& !fsplan->scan.plan.parallel_aware
+#endif
+		)
+	{
+		HASHCTL hashInfo;
+
+		fmstate->lookupContext = AllocSetContextCreate(CurrentMemoryContext,
+													   "mongo_fdw rescan cache",
+													   ALLOCSET_DEFAULT_MINSIZE,
+													   ALLOCSET_DEFAULT_INITSIZE,
+													   ALLOCSET_DEFAULT_MAXSIZE);
+
+		memset(&hashInfo, 0, sizeof(hashInfo));
+		hashInfo.keysize = sizeof(uint32);
+		hashInfo.entrysize = sizeof(MongoLookupEntry);
+		hashInfo.hash = tag_hash;
+		hashInfo.hcxt = fmstate->lookupContext;
+		fmstate->lookupCache = hash_create("mongo_fdw rescan cache", 64,
+										   &hashInfo,
+										   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	}
+#endif
+
+#ifdef META_DRIVER
+	if (async)
+	{
+		MongoScanCursorCreate(fmstate);
+		fmstate->prefetch = MongoCursorPrefetchStart(fmstate->mongoCursor);
+		mongo_register_prefetch(mongoConnection, fmstate->mongoCursor,
+								fmstate->prefetch);
 	}
+#endif
 }
 
 
 /*
- * ColumnTypesCompatible checks if the given BSON type can be converted to the
- * given PostgreSQL type. In this check, the function also uses its knowledge of
- * internal conversions applied by BSON APIs.
+ * MongoIterateForeignScan reads the next document from MongoDB, converts it to
+ * a PostgreSQL tuple, and stores the converted tuple into the ScanTupleSlot as
+ * a virtual tuple.
  */
-static bool
-ColumnTypesCompatible(BSON_TYPE bsonType, Oid columnTypeId)
+static TupleTableSlot *
+MongoIterateForeignScan(ForeignScanState *scanState)
 {
-	bool compatibleTypes = false;
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+	TupleTableSlot      *tupleSlot = scanState->ss.ss_ScanTupleSlot;
+	ColumnMappingTree   *columnMappingTree = fmstate->columnMappingTree;
+	TupleDesc           tupleDescriptor = tupleSlot->tts_tupleDescriptor;
+	Datum               *columnValues = tupleSlot->tts_values;
+	bool                *columnNulls = tupleSlot->tts_isnull;
+	int32               columnCount = tupleDescriptor->natts;
+	MemoryContext       oldContext = NULL;
+	const BSON          *document = NULL;
+	BSON                cachedDocument;
+	instr_time          startTime;
 
-	/* we consider the PostgreSQL column type as authoritative */
-	switch(columnTypeId)
+	/* the values of the tuple returned last are no longer needed */
+	MongoResetTupleContext(scanState, fmstate);
+
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
+	if (fmstate->aggregateList != NIL)
+		return MongoIterateAggregateScan(scanState);
+#endif
+
+	/*
+	 * We execute the protocol to load a virtual tuple into a slot. We first
+	 * call ExecClearTuple, then fill in values / isnull arrays, and last call
+	 * ExecStoreVirtualTuple. If we are done fetching documents from Mongo, we
+	 * just return an empty slot as required.
+	 */
+	ExecClearTuple(tupleSlot);
+
+	/* initialize all values for this row to null */
+	memset(columnValues, 0, columnCount * sizeof(Datum));
+	memset(columnNulls, true, columnCount * sizeof(bool));
+
+	for (;;)
 	{
-		case INT2OID: case INT4OID:
-		case INT8OID: case FLOAT4OID:
-		case FLOAT8OID: case NUMERICOID:
-		{
-			if (bsonType == BSON_TYPE_INT32 || bsonType == BSON_TYPE_INT64 ||
-				bsonType == BSON_TYPE_DOUBLE)
-			{
-				compatibleTypes = true;
-			}
-			break;
-		}
-		case BOOLOID:
-		{
-			if (bsonType == BSON_TYPE_INT32 || bsonType == BSON_TYPE_INT64 ||
-				bsonType == BSON_TYPE_DOUBLE || bsonType == BSON_TYPE_BOOL)
-			{
-				compatibleTypes = true;
-			}
-			break;
-		}
-		case BPCHAROID:
-		case VARCHAROID:
-		case TEXTOID:
-		{
-			if (bsonType == BSON_TYPE_UTF8)
-			{
-				compatibleTypes = true;
-			}
+		document = MongoScanNextDocument(scanState, fmstate, &cachedDocument);
+		if (document == NULL)
+			return tupleSlot;
+
+		if (fmstate->filterMappingTree == NULL ||
+			MongoFilterDocument(scanState, fmstate, document))
 			break;
-		}
-		case BYTEAOID:
-		{
-			if (bsonType == BSON_TYPE_BINDATA)
-			{
-				compatibleTypes = true;
-			}
+	}
+
+	if (fmstate->stats.timing)
+		INSTR_TIME_SET_CURRENT(startTime);
+
+	oldContext = MemoryContextSwitchTo(fmstate->temp_cxt);
+	FillTupleSlot(document, columnMappingTree, columnValues, columnNulls);
+	MemoryContextSwitchTo(oldContext);
+	ExecStoreVirtualTuple(tupleSlot);
+
+	if (fmstate->stats.timing)
+		MongoScanStatsAddTime(&fmstate->stats.fillTime, startTime);
+
+	return tupleSlot;
+}
+
+
 #ifdef META_DRIVER
-			if (bsonType == BSON_TYPE_OID)
-			{
-				compatibleTypes = true;
-			}
-#endif
-			break;
-		}
-		case NAMEOID:
-		{
-			/*
-			 * We currently overload the NAMEOID type to represent the BSON
-			 * object identifier. We can safely overload this 64-byte data type
-			 * since it's reserved for internal use in PostgreSQL.
-			 */
-			if (bsonType == BSON_TYPE_OID)
-			{
-				compatibleTypes = true;
-			}
-			break;
-		}
-		case DATEOID:
-		case TIMESTAMPOID:
-		case TIMESTAMPTZOID:
-		{
-			if (bsonType == BSON_TYPE_DATE_TIME)
-			{
-				compatibleTypes = true;
-			}
-			break;
-		}
-		case NUMERICARRAY_OID:
-		{
-			if (bsonType == BSON_TYPE_ARRAY)
-				compatibleTypes = true;
-			break;
-		}
-		case JSONOID:
-		{
-			if (bsonType == BSON_TYPE_DOCUMENT || bsonType == BSON_TYPE_ARRAY)
-			{
-				compatibleTypes = true;
-			}
-			break;
-		}
-		default:
+/*
+ * MongoLookupCacheStart looks up the query of the scan, which starts or has just
+ * been rescanned, in the rescan cache. If an earlier scan read all documents of
+ * the same query, they are returned from the cache; otherwise the query is run,
+ * and its documents are added to the cache as they are read.
+ */
+static void
+MongoLookupCacheStart(MongoFdwModifyState *fmstate)
+{
+	const char       *queryData = (const char *) bson_get_data(fmstate->queryDocument);
+	uint32           queryLength = fmstate->queryDocument->len;
+	uint32           queryHash = 0;
+	MongoLookupEntry *lookupEntry = NULL;
+	MongoLookupQuery *lookupQuery = NULL;
+	ListCell         *queryCell = NULL;
+	MemoryContext    oldContext = NULL;
+	bool             found = false;
+
+	queryHash = DatumGetUInt32(hash_any((const unsigned char *) queryData,
+										(int) queryLength));
+	lookupEntry = (MongoLookupEntry *) hash_search(fmstate->lookupCache,
+												   &queryHash, HASH_ENTER,
+												   &found);
+	if (!found)
+		lookupEntry->queryList = NIL;
+
+	foreach(queryCell, lookupEntry->queryList)
+	{
+		MongoLookupQuery *entryQuery = (MongoLookupQuery *) lfirst(queryCell);
+
+		if (entryQuery->queryLength == queryLength &&
+			memcmp(entryQuery->queryData, queryData, queryLength) == 0)
 		{
-			/*
-			 * We currently error out on other data types. Some types such as
-			 * byte arrays are easy to add, but they need testing. Other types
-			 * such as money or inet, do not have equivalents in MongoDB.
-			 */
-			ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-							errmsg("cannot convert BSON type to column type"),
-							errhint("Column type: %u", (uint32) columnTypeId)));
+			lookupQuery = entryQuery;
 			break;
 		}
 	}
 
-	return compatibleTypes;
+	if (lookupQuery != NULL)
+	{
+		Assert(lookupQuery->complete);
+		fmstate->lookupQuery = lookupQuery;
+		fmstate->lookupReplay = true;
+		fmstate->lookupCell = list_head(lookupQuery->documentList);
+		fmstate->lookupHits++;
+		return;
+	}
+
+	oldContext = MemoryContextSwitchTo(fmstate->lookupContext);
+	lookupQuery = (MongoLookupQuery *) palloc0(sizeof(MongoLookupQuery));
+	lookupQuery->queryLength = queryLength;
+	lookupQuery->queryData = palloc(queryLength);
+	memcpy(lookupQuery->queryData, queryData, queryLength);
+	lookupEntry->queryList = lappend(lookupEntry->queryList, lookupQuery);
+	MemoryContextSwitchTo(oldContext);
+
+	fmstate->lookupSpace += queryLength;
+	fmstate->lookupQuery = lookupQuery;
+	fmstate->lookupReplay = false;
+	fmstate->lookupMisses++;
 }
 
 
 /*
- * ColumnValueArray uses array element type id to read the current array pointed
- * to by the BSON iterator, and converts each array element (with matching type)
- * to the corresponding PostgreSQL datum. Then, the function constructs an array
- * datum from element datums, and returns the array datum.
+ * MongoLookupCacheNext returns the next document of the query from the rescan
+ * cache, in the given document, or NULL if there are no more.
  */
-static Datum
-ColumnValueArray(BSON_ITERATOR *bsonIterator, Oid valueTypeId)
+static const BSON *
+MongoLookupCacheNext(MongoFdwModifyState *fmstate, BSON *cachedDocument)
 {
-	Datum          *columnValueArray = palloc0(INITIAL_ARRAY_CAPACITY * sizeof(Datum));
-	uint32         arrayCapacity = INITIAL_ARRAY_CAPACITY;
-	uint32         arrayGrowthFactor = 2;
-	uint32         arrayIndex = 0;
+	MongoLookupDocument *lookupDocument = NULL;
 
-	ArrayType      *columnValueObject = NULL;
-	Datum          columnValueDatum = 0;
-	bool           typeByValue = false;
-	char           typeAlignment = 0;
-	int16          typeLength = 0;
+	if (fmstate->lookupCell == NULL)
+		return NULL;
 
-	BSON_ITERATOR bsonSubIterator = { NULL, 0 };
-	BsonIterSubIter(bsonIterator, &bsonSubIterator);
-	while (BsonIterNext(&bsonSubIterator))
-	{
-		BSON_TYPE bsonType = BsonIterType(&bsonSubIterator);
-		bool compatibleTypes = false;
+	lookupDocument = (MongoLookupDocument *) lfirst(fmstate->lookupCell);
+	fmstate->lookupCell = lnext(fmstate->lookupCell);
 
-		compatibleTypes = ColumnTypesCompatible(bsonType, valueTypeId);
-		if (bsonType == BSON_TYPE_NULL || !compatibleTypes)
-		{
-			continue;
-		}
+	bson_init_static(cachedDocument, (const uint8_t *) lookupDocument->data,
+					 lookupDocument->length);
+	return cachedDocument;
+}
 
-		if (arrayIndex >= arrayCapacity)
-		{
-			arrayCapacity *= arrayGrowthFactor;
-			columnValueArray = repalloc(columnValueArray, arrayCapacity * sizeof(Datum));
-		}
 
-		/* use default type modifier (0) to convert column value */
-		columnValueArray[arrayIndex] = ColumnValue(&bsonSubIterator, valueTypeId, 0);
-		arrayIndex++;
+/*
+ * MongoLookupCacheAdd adds a copy of the document just read to those of the
+ * query in the rescan cache. If the cache grows beyond work_mem, caching is
+ * given up for the rest of the scan.
+ */
+static void
+MongoLookupCacheAdd(MongoFdwModifyState *fmstate, const BSON *document)
+{
+	MongoLookupQuery    *lookupQuery = fmstate->lookupQuery;
+	MongoLookupDocument *lookupDocument = NULL;
+	MemoryContext       oldContext = NULL;
+
+	fmstate->lookupSpace += document->len;
+	if (fmstate->lookupSpace > (Size) work_mem * 1024L)
+	{
+		elog(DEBUG1, "rescan cache of mongo_fdw scan exceeds work_mem, not caching");
+		MongoLookupCacheDestroy(fmstate);
+		return;
 	}
 
-	get_typlenbyvalalign(valueTypeId, &typeLength, &typeByValue, &typeAlignment);
-	columnValueObject = construct_array(columnValueArray, arrayIndex, valueTypeId,
-										typeLength, typeByValue, typeAlignment);
+	oldContext = MemoryContextSwitchTo(fmstate->lookupContext);
+	lookupDocument = (MongoLookupDocument *)
+		palloc(offsetof(MongoLookupDocument, data) + document->len);
+	lookupDocument->length = document->len;
+	memcpy(lookupDocument->data, bson_get_data(document), document->len);
+	lookupQuery->documentList = lappend(lookupQuery->documentList, lookupDocument);
+	MemoryContextSwitchTo(oldContext);
+}
 
-	columnValueDatum = PointerGetDatum(columnValueObject);
-	return columnValueDatum;
+
+/*
+ * MongoLookupCacheRemove removes a query and its documents from the rescan
+ * cache, as when a rescan comes before all of them have been read.
+ */
+static void
+MongoLookupCacheRemove(MongoFdwModifyState *fmstate, MongoLookupQuery *lookupQuery)
+{
+	MongoLookupEntry *lookupEntry = NULL;
+	ListCell         *documentCell = NULL;
+	uint32           queryHash = 0;
+
+	queryHash = DatumGetUInt32(hash_any((const unsigned char *) lookupQuery->queryData,
+										(int) lookupQuery->queryLength));
+	lookupEntry = (MongoLookupEntry *) hash_search(fmstate->lookupCache,
+												   &queryHash, HASH_FIND, NULL);
+	if (lookupEntry != NULL)
+		lookupEntry->queryList = list_delete_ptr(lookupEntry->queryList,
+												 lookupQuery);
+
+	foreach(documentCell, lookupQuery->documentList)
+	{
+		MongoLookupDocument *lookupDocument = (MongoLookupDocument *) lfirst(documentCell);
+
+		fmstate->lookupSpace -= lookupDocument->length;
+		pfree(lookupDocument);
+	}
+	fmstate->lookupSpace -= lookupQuery->queryLength;
+
+	list_free(lookupQuery->documentList);
+	pfree(lookupQuery->queryData);
+	pfree(lookupQuery);
 }
 
 
 /*
- * ColumnValue uses column type information to read the current value pointed to
- * by the BSON iterator, and converts this value to the corresponding PostgreSQL
- * datum. The function then returns this datum.
+ * MongoLookupCacheDestroy frees the rescan cache, and stops using it.
  */
-static Datum
-ColumnValue(BSON_ITERATOR *bsonIterator, Oid columnTypeId, int32 columnTypeMod)
+static void
+MongoLookupCacheDestroy(MongoFdwModifyState *fmstate)
 {
-	Datum columnValue = 0;
+	MemoryContextDelete(fmstate->lookupContext);
+	fmstate->lookupContext = NULL;
+	fmstate->lookupCache = NULL;
+	fmstate->lookupQuery = NULL;
+	fmstate->lookupReplay = false;
+	fmstate->lookupCell = NULL;
+	fmstate->lookupSpace = 0;
+}
+#endif
 
-	switch(columnTypeId)
-	{
-		case INT2OID:
-		{
-			int16 value = (int16) BsonIterInt32(bsonIterator);
-			columnValue = Int16GetDatum(value);
-			break;
-		}
-		case INT4OID:
-		{
-			int32 value = BsonIterInt32(bsonIterator);
-			columnValue = Int32GetDatum(value);
-			break;
-		}
-		case INT8OID:
-		{
-			int64 value = BsonIterInt64(bsonIterator);
-			columnValue = Int64GetDatum(value);
-			break;
-		}
-		case FLOAT4OID:
-		{
-			float4 value = (float4) BsonIterDouble(bsonIterator);
-			columnValue = Float4GetDatum(value);
-			break;
-		}
-		case FLOAT8OID:
-		{
-			float8 value = BsonIterDouble(bsonIterator);
-			columnValue = Float8GetDatum(value);
-			break;
-		}
-		case NUMERICOID:
-		{
-			float8 value = BsonIterDouble(bsonIterator);
-			Datum valueDatum = Float8GetDatum(value);
 
-			/* overlook type modifiers for numeric */
-			columnValue = DirectFunctionCall1(float8_numeric, valueDatum);
-			break;
-		}
-		case BOOLOID:
-		{
-			bool value = BsonIterBool(bsonIterator);
-			columnValue = BoolGetDatum(value);
-			break;
-		}
-		case BPCHAROID:
-		{
-			const char *value = BsonIterString(bsonIterator);
-			Datum valueDatum = CStringGetDatum(value);
+/*
+ * MongoScanNextDocument returns the next document of the scan, or NULL if there
+ * are no more. The cursor is opened on the first fetch after the scan starts or
+ * is rescanned, unless the documents of the query are in the rescan cache, in
+ * which case they are returned from there into the given document.
+ */
+static const BSON *
+MongoScanNextDocument(ForeignScanState *scanState, MongoFdwModifyState *fmstate,
+					  BSON *cachedDocument)
+{
+	MONGO_CURSOR *mongoCursor = NULL;
 
-			columnValue = DirectFunctionCall3(bpcharin, valueDatum,
-											  ObjectIdGetDatum(InvalidOid),
-											  Int32GetDatum(columnTypeMod));
-			break;
-		}
-		case VARCHAROID:
-		{
-			const char *value = BsonIterString(bsonIterator);
-			Datum valueDatum = CStringGetDatum(value);
+	if (fmstate->queryDocument == NULL)
+		MongoScanQueryDocument(scanState, fmstate);
 
-			columnValue = DirectFunctionCall3(varcharin, valueDatum,
-											  ObjectIdGetDatum(InvalidOid),
-											  Int32GetDatum(columnTypeMod));
-			break;
-		}
-		case TEXTOID:
-		{
-			const char *value = BsonIterString(bsonIterator);
-			columnValue = CStringGetTextDatum(value);
-			break;
-		}
-		case NAMEOID:
-		{
-			char value[NAMEDATALEN];
-			Datum valueDatum = 0;
+#ifdef META_DRIVER
+	if (fmstate->file != NULL)
+		return MongoScanFileNext(fmstate);
 
-			bson_oid_t *bsonObjectId = (bson_oid_t*) BsonIterOid(bsonIterator);
-			bson_oid_to_string(bsonObjectId, value);
+	if (fmstate->lookupCache != NULL)
+	{
+		if (fmstate->lookupQuery == NULL)
+			MongoLookupCacheStart(fmstate);
+		if (fmstate->lookupReplay)
+			return MongoLookupCacheNext(fmstate, cachedDocument);
+	}
+#endif
 
-			valueDatum = CStringGetDatum(value);
-			columnValue = DirectFunctionCall3(namein, valueDatum,
-											  ObjectIdGetDatum(InvalidOid),
-											  Int32GetDatum(columnTypeMod));
-			break;
-		}
-		case BYTEAOID:
-		{
-			int value_len;
-			char *value;
-			bytea *result;
+	/*
+	 * Open the cursor on first fetch. A parallel scan opens one for each _id
+	 * range it claims, until no ranges are left.
+	 */
+	if (fmstate->mongoCursor == NULL && !MongoScanCursorCreate(fmstate))
+		return NULL;
+	mongoCursor = fmstate->mongoCursor;
+
+	while (!MongoScanCursorNext(fmstate))
+	{
 #ifdef META_DRIVER
-			switch (BsonIterType(bsonIterator))
-			{
-				case BSON_TYPE_OID:
-					value = (char*) BsonIterOid(bsonIterator);
-					value_len = 12;
-					break;
-				default:
-					value = (char*)BsonIterBinData(bsonIterator, (uint32_t *)&value_len);
-					break;
-			}
+		bson_error_t error;
+		if (mongoc_cursor_error(mongoCursor, &error))
+			ereport(ERROR, (errmsg("could not iterate over mongo collection"),
+					errhint("Mongo driver error: %s", error.message)));
 #else
-			value_len = BsonIterBinLen(bsonIterator);
-			value = (char*)BsonIterBinData(bsonIterator);
+		mongo_cursor_error_t errorCode = mongoCursor->err;
+		if (errorCode != MONGO_CURSOR_EXHAUSTED)
+			ereport(ERROR, (errmsg("could not iterate over mongo collection"),
+					errhint("Mongo driver cursor error code: %d", errorCode)));
 #endif
-			result = (bytea *)palloc(value_len + VARHDRSZ);
-			memcpy(VARDATA(result), value, value_len);
-			SET_VARSIZE(result, value_len + VARHDRSZ);
-			columnValue = PointerGetDatum(result);
-			break;
-		}
-		case DATEOID:
-		{
-			int64 valueMillis = BsonIterDate(bsonIterator);
-			int64 timestamp = (valueMillis * 1000L) - POSTGRES_TO_UNIX_EPOCH_USECS;
-			Datum timestampDatum = TimestampGetDatum(timestamp);
 
-			columnValue = DirectFunctionCall1(timestamp_date, timestampDatum);
-			break;
-		}
-		case TIMESTAMPOID:
-		case TIMESTAMPTZOID:
+		if (fmstate->parallelState == NULL)
 		{
-			int64 valueMillis = BsonIterDate(bsonIterator);
-			int64 timestamp = (valueMillis * 1000L) - POSTGRES_TO_UNIX_EPOCH_USECS;
-
-			/* overlook type modifiers for timestamp */
-			columnValue = TimestampGetDatum(timestamp);
-			break;
+#ifdef META_DRIVER
+			/* the cache now has all documents of the query */
+			if (fmstate->lookupQuery != NULL)
+				fmstate->lookupQuery->complete = true;
+#endif
+			return NULL;
 		}
-		case JSONOID:
-		{
-			JsonLexContext *lex;
-			text           *result;
-			StringInfo     buffer = makeStringInfo();
 
-			BSON_TYPE type = BSON_ITER_TYPE(bsonIterator);
-			if (type != BSON_TYPE_ARRAY && type != BSON_TYPE_DOCUMENT)
-				ereport(ERROR, (errmsg("cannot convert scolar to json")));
+		MongoScanCursorDestroy(fmstate);
+		if (!MongoScanCursorCreate(fmstate))
+			return NULL;
+		mongoCursor = fmstate->mongoCursor;
+	}
 
 #ifdef META_DRIVER
-			/* Convert BSON to JSON value */
-			BsonToJsonStringValue(buffer, bsonIterator, BSON_TYPE_ARRAY == type);
-#else
-			/* Convert BSON to JSON value */
-			BsonToJsonString(buffer, *bsonIterator, BSON_TYPE_ARRAY == type);
+	if (fmstate->lookupQuery != NULL)
+		MongoLookupCacheAdd(fmstate, MongoCursorBson(mongoCursor));
 #endif
-			result = cstring_to_text_with_len(buffer->data, buffer->len);
-			lex = makeJsonLexContext(result, false);
-			pg_parse_json(lex, &nullSemAction);
-			columnValue = PointerGetDatum(result);
-			break;
-		}
-		default:
-		{
-			ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-							errmsg("cannot convert BSON type to column type"),
-							errhint("Column type: %u", (uint32) columnTypeId)));
-			break;
-		}
-	}
 
-	return columnValue;
+	return MongoCursorBson(mongoCursor);
 }
 
-void
-BsonToJsonString(StringInfo output, BSON_ITERATOR i, bool isArray)
+
+/*
+ * MongoScanQueryDocument builds the query document of the scan from its clauses
+ * and sort, with the current values of the parameters the clauses use. The
+ * memory used to build it is freed right away, as rescans may build it often.
+ */
+static void
+MongoScanQueryDocument(ForeignScanState *scanState, MongoFdwModifyState *fmstate)
 {
-	const char       *key = NULL;
-	bool             isFirstElement;
-	char             beginSymbol = '{';
-	char             endSymbol = '}';
-	BSON_TYPE        t;
+	MemoryContext oldContext = NULL;
+	BSON          *queryDocument = NULL;
+
+	oldContext = MemoryContextSwitchTo(fmstate->query_cxt);
+	queryDocument = QueryDocument(MongoScanRelationId(scanState),
+								  fmstate->queryClauseList, scanState);
+	if (fmstate->sortList != NIL || fmstate->hintList != NIL)
+		queryDocument = OrderedQueryDocument(queryDocument, fmstate->sortList,
+											 fmstate->hintList);
+	MemoryContextSwitchTo(oldContext);
+	MemoryContextReset(fmstate->query_cxt);
 
-	if (isArray)
+	fmstate->queryDocument = queryDocument;
+	mongo_track_document(queryDocument, fmstate->xactLevel);
+
+#ifdef META_DRIVER
+	/* documents of a file are checked with the query here */
+	if (fmstate->file != NULL)
 	{
-		beginSymbol = '[';
-		endSymbol = ']';
+		if (fmstate->matcher != NULL)
+			MongoMatcherDestroy(fmstate->matcher);
+		fmstate->matcher = MongoMatcherCreate(queryDocument);
 	}
+#endif
+}
 
-#ifndef META_DRIVER
+
+#ifdef META_DRIVER
+/*
+ * MongoScanFileNext returns the next document of a mongodump file that the
+ * query document matches, or NULL after the last one. Documents are returned
+ * where they lie in the file's read buffer. A parallel scan reads the byte ranges it
+ * claims, until no ranges are left. The query document is only checked as far
+ * as the driver's matcher understands it, and the scan's quals are checked on
+ * the rows anyway.
+ */
+static const BSON *
+MongoScanFileNext(MongoFdwModifyState *fmstate)
+{
+	MongoScanStats *stats = &fmstate->stats;
+	const BSON     *document = NULL;
+	instr_time      startTime;
+
+	for (;;)
 	{
-		char *bsonData = bson_iterator_value(&i);
-		bson_iterator_from_buffer(&i, bsonData);
+		if (!fmstate->fileRangeOpen && !MongoScanFileRange(fmstate))
+			return NULL;
+
+		if (stats->timing)
+			INSTR_TIME_SET_CURRENT(startTime);
+
+		document = MongoFileNext(fmstate->file);
+		if (document != NULL)
+		{
+			stats->documentCount++;
+			stats->byteCount += BsonSize(document);
+		}
+
+		if (stats->timing)
+			MongoScanStatsAddTime(&stats->fetchTime, startTime);
+
+		if (document == NULL)
+			fmstate->fileRangeOpen = false;
+		else if (fmstate->matcher == NULL ||
+				 MongoMatcherMatch(fmstate->matcher, document))
+			return document;
+	}
+}
+
+
+/*
+ * MongoScanFileRange starts reading the next byte range of a mongodump file:
+ * the whole file for a serial scan, and for a parallel scan, the next range
+ * between the split points the leader found. Each range read counts as a
+ * batch. The function returns false if no ranges are left.
+ */
+static bool
+MongoScanFileRange(MongoFdwModifyState *fmstate)
+{
+	size_t start = 0;
+	size_t end = MongoFileSize(fmstate->file);
+
+#if PG_VERSION_NUM >= 90600
+	if (fmstate->parallelState != NULL)
+	{
+		MongoParallelScanState *parallelState = fmstate->parallelState;
+		uint32                  rangeIndex = 0;
+		BSON                    splitPoints;
+		BSON_ITERATOR           splitIterator;
+		char                    key[12];
+
+		rangeIndex = pg_atomic_fetch_add_u32(&parallelState->nextRange, 1);
+		if (rangeIndex >= parallelState->rangeCount)
+			return false;
+
+		bson_init_static(&splitPoints,
+						 (const uint8_t *) parallelState->splitPoints,
+						 parallelState->splitPointsLength);
+		snprintf(key, sizeof(key), "%u", rangeIndex - 1);
+		if (rangeIndex > 0 &&
+			bson_iter_init_find(&splitIterator, &splitPoints, key))
+			start = (size_t) bson_iter_int64(&splitIterator);
+		snprintf(key, sizeof(key), "%u", rangeIndex);
+		if (bson_iter_init_find(&splitIterator, &splitPoints, key))
+			end = (size_t) bson_iter_int64(&splitIterator);
+	}
+	else
+#endif
+	{
+		if (fmstate->fileScanned)
+			return false;
+		fmstate->fileScanned = true;
+	}
+
+	MongoFileSeek(fmstate->file, start, end);
+	fmstate->fileRangeOpen = true;
+	fmstate->stats.batchCount++;
+
+	return true;
+}
+#endif
+
+
+/*
+ * MongoFilterDocument fills the columns the locally checked clauses of the scan
+ * reference from the given document, and checks the clauses on them. If the
+ * document passes, the caller fills the other columns; if not, the function
+ * clears the values, so that the caller can move on to the next document.
+ */
+static bool
+MongoFilterDocument(ForeignScanState *scanState, MongoFdwModifyState *fmstate,
+					const BSON *document)
+{
+	TupleTableSlot *tupleSlot = scanState->ss.ss_ScanTupleSlot;
+	ExprContext    *econtext = scanState->ss.ps.ps_ExprContext;
+	int32          columnCount = tupleSlot->tts_tupleDescriptor->natts;
+	MemoryContext  oldContext = NULL;
+	bool           passed = false;
+	instr_time     startTime;
+
+	if (fmstate->stats.timing)
+		INSTR_TIME_SET_CURRENT(startTime);
+
+	oldContext = MemoryContextSwitchTo(fmstate->temp_cxt);
+	FillTupleSlot(document, fmstate->filterMappingTree,
+				  tupleSlot->tts_values, tupleSlot->tts_isnull);
+	MemoryContextSwitchTo(oldContext);
+	ExecStoreVirtualTuple(tupleSlot);
+
+	if (fmstate->stats.timing)
+		MongoScanStatsAddTime(&fmstate->stats.fillTime, startTime);
+
+	econtext->ecxt_scantuple = tupleSlot;
+#if PG_VERSION_NUM >= 100000
+	passed = ExecQual(fmstate->filterQual, econtext);
+#else
+	passed = ExecQual(fmstate->filterQual, econtext, false);
+#endif
+	ResetExprContext(econtext);
+
+	/* the values stay in the slot; it is stored again once complete */
+	ExecClearTuple(tupleSlot);
+
+	if (!passed)
+	{
+		InstrCountFiltered1(scanState, 1);
+		MongoResetTupleContext(scanState, fmstate);
+
+		memset(tupleSlot->tts_values, 0, columnCount * sizeof(Datum));
+		memset(tupleSlot->tts_isnull, true, columnCount * sizeof(bool));
+	}
+
+	return passed;
+}
+
+
+/*
+ * MongoResetTupleContext frees the values converted for the last tuple. When
+ * the scan is instrumented, as under EXPLAIN ANALYZE, the function first notes
+ * how much memory they took, to report the most any tuple took.
+ */
+static void
+MongoResetTupleContext(ForeignScanState *scanState, MongoFdwModifyState *fmstate)
+{
+#if PG_VERSION_NUM >= 90600
+	if (scanState->ss.ps.instrument != NULL)
+	{
+		MemoryContext         context = fmstate->temp_cxt;
+		MemoryContextCounters counters;
+		Size                  usedSpace = 0;
+
+		memset(&counters, 0, sizeof(counters));
+#if PG_VERSION_NUM >= 100000
+		context->methods->stats(context, NULL, NULL, &counters);
+#else
+		context->methods->stats(context, 0, false, &counters);
+#endif
+		usedSpace = counters.totalspace - counters.freespace;
+		if (usedSpace > fmstate->tupleMemoryPeak)
+			fmstate->tupleMemoryPeak = usedSpace;
+	}
+#endif
+
+	MemoryContextReset(fmstate->temp_cxt);
+}
+
+
+/*
+ * MongoEndForeignScan finishes scanning the foreign table, closes the cursor
+ * and the connection to MongoDB, and reclaims scan related resources.
+ */
+static void
+MongoEndForeignScan(ForeignScanState *scanState)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+
+	/* if we executed a query, reclaim mongo related resources */
+	if (fmstate != NULL)
+	{
+		if (fmstate->options)
+		{
+			mongo_free_options(fmstate->options);
+			fmstate->options = NULL;
+		}
+		MongoFreeScanState(fmstate);
+	}
+}
+
+
+/*
+ * MongoReScanForeignScan rescans the foreign table. Note that rescans in Mongo
+ * end up being notably more expensive than what the planner expects them to be,
+ * since MongoDB cursors don't provide reset/rewind functionality.
+ */
+static void
+MongoReScanForeignScan(ForeignScanState *scanState)
+{
+	MongoFdwModifyState      *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+
+	/*
+	 * Close down the old cursor; the next fetch reopens it. An unfinished
+	 * exhaust cursor can only be stopped by dropping the connection, so we
+	 * don't prefetch once the scan has been rescanned.
+	 */
+	MongoScanCursorDestroy(fmstate);
+	fmstate->rescanned = true;
+	fmstate->aggregateReturned = false;
+
+#ifdef META_DRIVER
+	/* documents of a query that wasn't read to the end can't be reused */
+	if (fmstate->lookupQuery != NULL && !fmstate->lookupQuery->complete)
+		MongoLookupCacheRemove(fmstate, fmstate->lookupQuery);
+	fmstate->lookupQuery = NULL;
+	fmstate->lookupReplay = false;
+
+	/* a file is read again from its start */
+	fmstate->fileRangeOpen = false;
+	fmstate->fileScanned = false;
+#endif
+
+	/* the next fetch builds the query with the new parameter values */
+	if (fmstate->queryParameterized && scanState->ss.ps.chgParam != NULL &&
+		fmstate->queryDocument != NULL)
+	{
+		mongo_destroy_document(fmstate->queryDocument);
+		fmstate->queryDocument = NULL;
+	}
+}
+
+static List *
+MongoPlanForeignModify(PlannerInfo *root,
+				ModifyTable *plan,
+				Index resultRelation,
+				int subplan_index)
+{
+	CmdType         operation = plan->operation;
+	RangeTblEntry   *rte = planner_rt_fetch(resultRelation, root);
+	Relation        rel;
+	List            *targetAttrs = NIL;
+
+	/*
+	 * Core code already has some lock on each rel being planned, so we can
+	 * use NoLock here.
+	 */
+	rel = heap_open(rte->relid, NoLock);
+
+#ifdef META_DRIVER
+	{
+		MongoFdwOptions *options = mongo_get_options(rte->relid);
+
+		if (options->filename != NULL)
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot modify foreign table \"%s\"",
+								   RelationGetRelationName(rel)),
+							errdetail("The table reads the mongodump file \"%s\".",
+									  options->filename)));
+		mongo_free_options(options);
+	}
+#endif
+
+	if (operation == CMD_INSERT)
+	{
+		TupleDesc tupdesc = RelationGetDescr(rel);
+		int attnum;
+
+		for (attnum = 1; attnum <= tupdesc->natts; attnum++)
+		{
+			Form_pg_attribute attr = tupdesc->attrs[attnum - 1];
+
+			if (!attr->attisdropped)
+				targetAttrs = lappend_int(targetAttrs, attnum);
+		}
 	}
+	else if (operation == CMD_UPDATE)
+	{
+#if PG_VERSION_NUM >= 90500
+                Bitmapset *tmpset = bms_copy(rte->updatedCols);
+#else
+                Bitmapset *tmpset = bms_copy(rte->modifiedCols);
 #endif
+		AttrNumber	col;
+
+		while ((col = bms_first_member(tmpset)) >= 0)
+		{
+			col += FirstLowInvalidHeapAttributeNumber;
+			if (col <= InvalidAttrNumber)		/* shouldn't happen */
+				elog(ERROR, "system-column update is not supported");
+			/*
+			 * We also disallow updates to the first column which
+			 * happens to be the row identifier in MongoDb (_id)
+			 */
+			if (col == 1)	/* shouldn't happen */
+				elog(ERROR, "row identifier column update is not supported");
+
+			targetAttrs = lappend_int(targetAttrs, col);
+		}
+		/* We also want the rowid column to be available for the update */
+		targetAttrs = lcons_int(1, targetAttrs);
+	}
+	else
+	{
+		targetAttrs = lcons_int(1, targetAttrs);
+	}
+	/*
+	 * RETURNING list not supported
+	 */
+	if (plan->returningLists)
+		elog(ERROR, "RETURNING is not supported by this FDW");
+
+	heap_close(rel, NoLock);
+
+	return list_make1(targetAttrs);
+}
+
+
+/*
+ * Begin an insert/update/delete operation on a foreign table. The connection,
+ * the key and encoder of each column sent, and the documents each row is built
+ * in are all set up here, so that rows only need their values encoded.
+ */
+static void
+MongoBeginForeignModify(ModifyTableState *mtstate,
+					ResultRelInfo *resultRelInfo,
+					List *fdw_private,
+					int subplan_index,
+					int eflags)
+{
+	MongoFdwModifyState       *fmstate = NULL;
+	Relation                  rel = resultRelInfo->ri_RelationDesc;
+	TupleDesc                 tupleDescriptor = RelationGetDescr(rel);
+	CmdType                   operation = mtstate->operation;
+	ListCell                  *lc = NULL;
+	Oid                       foreignTableId = InvalidOid;
+	ForeignServer             *server;
+	UserMapping               *user;
+	ForeignTable              *table;
+
+	/*
+	 * Do nothing in EXPLAIN (no ANALYZE) case. resultRelInfo->ri_FdwState
+	 * stays NULL.
+	 */
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	foreignTableId = RelationGetRelid(rel);
+
+	/* first column of MongoDB's foreign table must be _id */
+	if (operation == CMD_INSERT)
+	{
+		if (strcmp(NameStr(tupleDescriptor->attrs[0]->attname), "_id") != 0)
+			elog(ERROR, "first column of MongoDB's foreign table must be \"_id\"");
+
+		if (tupleDescriptor->attrs[0]->atttypid != NAMEOID)
+			elog(ERROR, "type of first column of MongoDB's foreign table must be \"NAME\"");
+	}
+
+	/* Begin constructing MongoFdwModifyState. */
+	fmstate = (MongoFdwModifyState *) palloc0(sizeof(MongoFdwModifyState));
+
+	fmstate->rel = rel;
+	fmstate->options = mongo_get_options(foreignTableId);
+
+	/* connect now, as scans do in their Begin callback */
+	table = GetForeignTable(foreignTableId);
+	server = GetForeignServer(table->serverid);
+	user = GetUserMapping(GetUserId(), server->serverid);
+
+	fmstate->mongoConnection = mongo_get_connection(server, user, fmstate->options);
+
+	fmstate->target_attrs = (List *) list_nth(fdw_private, 0);
+
+	/*
+	 * Resolve the columns whose values are sent. The first column is the row
+	 * identifier in MongoDB (_id): MongoDB fills it in for inserts, and updates
+	 * use it to select the row. The __doc column holds the whole document, and
+	 * is left out of inserts.
+	 */
+	fmstate->columnEncodings = (ColumnEncoding *)
+		palloc0(sizeof(ColumnEncoding) * list_length(fmstate->target_attrs));
+	foreach(lc, fmstate->target_attrs)
+	{
+		int attnum = lfirst_int(lc);
+		Form_pg_attribute attr = tupleDescriptor->attrs[attnum - 1];
+		ColumnEncoding *encoding = NULL;
+
+		Assert(!attr->attisdropped);
+
+		if (attnum == 1 || strcmp(NameStr(attr->attname), "_id") == 0)
+			continue;
+
+		if (strcmp(NameStr(attr->attname), "__doc") == 0)
+		{
+			if (operation == CMD_UPDATE)
+				elog(ERROR, "system column '__doc' update is not supported");
+			continue;
+		}
+
+		encoding = &fmstate->columnEncodings[fmstate->columnEncodingCount++];
+		encoding->attributeNumber = attnum;
+		strlcpy(encoding->key, NameStr(attr->attname), NAMEDATALEN);
+		encoding->typeId = attr->atttypid;
+		encoding->encoder = ColumnEncoderLookup(attr->atttypid);
+	}
+
+	if (operation == CMD_UPDATE || operation == CMD_DELETE)
+	{
+		Form_pg_attribute attr = tupleDescriptor->attrs[0];
+		ColumnEncoding *encoding = (ColumnEncoding *) palloc0(sizeof(ColumnEncoding));
+
+		encoding->attributeNumber = 1;
+		strlcpy(encoding->key, NameStr(attr->attname), NAMEDATALEN);
+		encoding->typeId = attr->atttypid;
+		encoding->encoder = ColumnEncoderLookup(attr->atttypid);
+		fmstate->idEncoding = encoding;
+		fmstate->selectorDocument = BsonCreate();
+	}
+
+	if (operation != CMD_DELETE)
+		fmstate->modifyDocument = BsonCreate();
+
+	/* the documents rows are encoded into are destroyed on abort if it fails */
+	fmstate->xactLevel = GetCurrentTransactionNestLevel();
+	mongo_track_document(fmstate->selectorDocument, fmstate->xactLevel);
+	mongo_track_document(fmstate->modifyDocument, fmstate->xactLevel);
+
+	/* values encoded for a row are freed once its document is sent */
+	fmstate->temp_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											  "mongo_fdw modify data",
+											  ALLOCSET_SMALL_MINSIZE,
+											  ALLOCSET_SMALL_INITSIZE,
+											  ALLOCSET_SMALL_MAXSIZE);
+
+	resultRelInfo->ri_FdwState = fmstate;
+}
+
+
+/*
+ * MongoAppendColumnValues appends the values the slot holds for the columns the
+ * modify sends to the given document, with the encoders resolved when the
+ * modify began.
+ */
+static void
+MongoAppendColumnValues(BSON *document, MongoFdwModifyState *fmstate,
+						TupleTableSlot *slot)
+{
+	int encodingIndex = 0;
+
+	for (encodingIndex = 0; encodingIndex < fmstate->columnEncodingCount;
+		 encodingIndex++)
+	{
+		ColumnEncoding *encoding = &fmstate->columnEncodings[encodingIndex];
+		Datum           value = 0;
+		bool            isNull = false;
+
+		value = slot_getattr(slot, encoding->attributeNumber, &isNull);
+		if (isNull)
+			BsonAppendNull(document, encoding->key);
+		else
+			encoding->encoder(document, encoding->key, value, encoding->typeId);
+	}
+}
+
+
+/*
+ * MongoSelectorDocument builds the document that selects the row to update or
+ * delete by its _id, passed up as a resjunk column, into the selector document
+ * of the modify. The function returns false if the _id can't be encoded.
+ */
+static bool
+MongoSelectorDocument(MongoFdwModifyState *fmstate, TupleTableSlot *planSlot)
+{
+	ColumnEncoding *encoding = fmstate->idEncoding;
+	BSON           *selectorDocument = fmstate->selectorDocument;
+	Datum          datum = 0;
+	bool           isNull = false;
+
+	datum = ExecGetJunkAttribute(planSlot, 1, &isNull);
+
+	BsonReinit(selectorDocument);
+	if (!encoding->encoder(selectorDocument, encoding->key, datum,
+						   encoding->typeId))
+		return false;
+	BsonFinish(selectorDocument);
+
+	return true;
+}
+
+
+/*
+ * Insert one row into a foreign table. With the meta driver the document is
+ * queued on a bulk write, which is sent once insert_batch_size documents have
+ * accumulated and at the end of the modify. The bulk write keeps a copy of the
+ * document, so the same one is built again for the next row.
+ */
+static TupleTableSlot *
+MongoExecForeignInsert(EState *estate,
+					ResultRelInfo *resultRelInfo,
+					TupleTableSlot *slot,
+					TupleTableSlot *planSlot)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
+	MongoFdwOptions     *options = fmstate->options;
+	BSON                *b = fmstate->modifyDocument;
+	MemoryContext       oldContext = NULL;
+
+	oldContext = MemoryContextSwitchTo(fmstate->temp_cxt);
+
+	BsonReinit(b);
+	if (slot != NULL)
+		MongoAppendColumnValues(b, fmstate, slot);
+	BsonFinish(b);
+
+	/* Now we are ready to insert tuple / document into MongoDB */
+#ifdef META_DRIVER
+	if (fmstate->bulk == NULL)
+		fmstate->bulk = MongoBulkCreate(fmstate->mongoConnection, options->svr_database,
+										options->collectionName, options->ordered,
+										options->write_concern, options->journal);
+	MongoBulkInsert(fmstate->bulk, b);
+	fmstate->bulkCount++;
+
+	if (fmstate->bulkCount >= options->insert_batch_size)
+	{
+		MONGO_BULK *bulk = fmstate->bulk;
+
+		fmstate->bulk = NULL;
+		fmstate->bulkCount = 0;
+		MongoBulkExecute(bulk);
+	}
+#else
+	MongoInsert(fmstate->mongoConnection, options->svr_database, options->collectionName, b);
+#endif
+
+	MemoryContextSwitchTo(oldContext);
+	MemoryContextReset(fmstate->temp_cxt);
+
+	return slot;
+}
+
+
+/*
+ * Add column(s) needed for update/delete on a foreign table, we are using
+ * first column as row identification column, so we are adding that into target
+ * list.
+ */
+static void
+MongoAddForeignUpdateTargets(Query *parsetree,
+						RangeTblEntry *target_rte,
+						Relation target_relation)
+{
+	Var                 *var = NULL;
+	const char          *attrname = NULL;
+	TargetEntry         *tle = NULL;
+
+	/*
+	 * What we need is the rowid which is the first column
+	 */
+	Form_pg_attribute attr =
+				RelationGetDescr(target_relation)->attrs[0];
+
+	/* Make a Var representing the desired value */
+	var = makeVar(parsetree->resultRelation,
+				1,
+				attr->atttypid,
+				attr->atttypmod,
+				InvalidOid,
+				0);
+
+	/* Wrap it in a TLE with the right name ... */
+	attrname = NameStr(attr->attname);
+
+	tle = makeTargetEntry((Expr *) var,
+						list_length(parsetree->targetList) + 1,
+						pstrdup(attrname),
+						true);
+
+	/* ... and add it to the query's targetlist */
+	parsetree->targetList = lappend(parsetree->targetList, tle);
+}
+
+
+static TupleTableSlot *
+MongoExecForeignUpdate(EState *estate,
+					ResultRelInfo *resultRelInfo,
+					TupleTableSlot *slot,
+					TupleTableSlot *planSlot)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
+	MongoFdwOptions     *options = fmstate->options;
+	BSON                *b = fmstate->modifyDocument;
+	BSON                set;
+	MemoryContext       oldContext = NULL;
+
+	oldContext = MemoryContextSwitchTo(fmstate->temp_cxt);
+
+	if (!MongoSelectorDocument(fmstate, planSlot))
+	{
+		MemoryContextSwitchTo(oldContext);
+		MemoryContextReset(fmstate->temp_cxt);
+		return NULL;
+	}
+
+	BsonReinit(b);
+	BsonAppendStartObject(b, "$set", &set);
+
+	/* get following parameters from slot */
+	if (slot != NULL)
+	{
+#ifdef META_DRIVER
+		MongoAppendColumnValues(&set, fmstate, slot);
+#else
+		MongoAppendColumnValues(b, fmstate, slot);
+#endif
+	}
+	BsonAppendFinishObject(b, &set);
+	BsonFinish(b);
+
+	/* We are ready to update the row into MongoDB */
+	MongoUpdate(fmstate->mongoConnection, options->svr_database,
+				options->collectionName, fmstate->selectorDocument, b);
+
+	MemoryContextSwitchTo(oldContext);
+	MemoryContextReset(fmstate->temp_cxt);
+
+	/* Return NULL if nothing was updated on the remote end */
+	return slot;
+}
+
+/*
+ * MongoExecForeignDelete
+ *		Delete one row from a foreign table
+ */
+static TupleTableSlot *
+MongoExecForeignDelete(EState *estate,
+					ResultRelInfo *resultRelInfo,
+					TupleTableSlot *slot,
+					TupleTableSlot *planSlot)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
+	MongoFdwOptions     *options = fmstate->options;
+	MemoryContext       oldContext = NULL;
+
+	oldContext = MemoryContextSwitchTo(fmstate->temp_cxt);
+
+	if (!MongoSelectorDocument(fmstate, planSlot))
+	{
+		MemoryContextSwitchTo(oldContext);
+		MemoryContextReset(fmstate->temp_cxt);
+		return NULL;
+	}
+
+	/* Now we are ready to delete a single document from MongoDB */
+	MongoDelete(fmstate->mongoConnection, options->svr_database,
+				options->collectionName, fmstate->selectorDocument);
+
+	MemoryContextSwitchTo(oldContext);
+	MemoryContextReset(fmstate->temp_cxt);
+
+	/* Return NULL if nothing was updated on the remote end */
+	return slot;
+}
+
+/*
+ * MongoEndForeignModify
+ *		Finish an insert/update/delete operation on a foreign table
+ */
+static void
+MongoEndForeignModify(EState *estate, ResultRelInfo *resultRelInfo)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) resultRelInfo->ri_FdwState;
+	if (fmstate)
+	{
+#ifdef META_DRIVER
+		/* send the inserts still queued */
+		if (fmstate->bulk != NULL)
+		{
+			MONGO_BULK *bulk = fmstate->bulk;
+
+			fmstate->bulk = NULL;
+			fmstate->bulkCount = 0;
+			MongoBulkExecute(bulk);
+		}
+#endif
+		if (fmstate->options)
+		{
+			mongo_free_options(fmstate->options);
+			fmstate->options = NULL;
+		}
+		MongoFreeScanState(fmstate);
+		pfree(fmstate);
+	}
+}
+
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
+/*
+ * MongoPlanDirectModify decides whether an UPDATE or DELETE can run on the
+ * server as a single multi-document update or remove, instead of fetching the
+ * rows and modifying them one at a time by _id. This is the case when the rows
+ * come straight from a scan of the foreign table whose quals MongoDB evaluates
+ * exactly, the statement has no RETURNING, and every new value is the same for
+ * all rows. The core code has already checked that there are no row triggers.
+ */
+static bool
+MongoPlanDirectModify(PlannerInfo *root, ModifyTable *plan,
+					  Index resultRelation, int subplan_index)
+{
+	CmdType              operation = plan->operation;
+	Plan                 *subplan = (Plan *) list_nth(plan->plans, subplan_index);
+	ForeignScan          *foreignScan = NULL;
+	RelOptInfo           *baserel = NULL;
+	MongoFdwRelationInfo *fpinfo = NULL;
+	List                 *columnIdList = NIL;
+	List                 *valueList = NIL;
+	ListCell             *qualCell = NULL;
+
+	if (operation != CMD_UPDATE && operation != CMD_DELETE)
+		return false;
+
+	if (plan->returningLists != NIL)
+		return false;
+
+	if (!IsA(subplan, ForeignScan))
+		return false;
+
+	foreignScan = (ForeignScan *) subplan;
+	if (foreignScan->scan.scanrelid != resultRelation ||
+		list_length(foreignScan->fdw_private) != 6)
+		return false;
+
+	/*
+	 * MongoDB must select exactly the rows all the quals let through, so each
+	 * of them has to be one of the pushed down restrictions, and not a join
+	 * clause of a parameterized scan.
+	 */
+	baserel = find_base_rel(root, resultRelation);
+	fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+	if (fpinfo == NULL || !fpinfo->remoteQualsExact)
+		return false;
+
+	foreach(qualCell, foreignScan->scan.plan.qual)
+	{
+		if (!list_member(fpinfo->opExpressionList, lfirst(qualCell)))
+			return false;
+	}
+
+	if (operation == CMD_UPDATE)
+	{
+		RangeTblEntry *rte = planner_rt_fetch(resultRelation, root);
+		Bitmapset     *updatedColumns = bms_copy(rte->updatedCols);
+		AttrNumber    columnId;
+
+		while ((columnId = bms_first_member(updatedColumns)) >= 0)
+		{
+			TargetEntry *targetEntry = NULL;
+
+			/* the row-by-row path refuses updates of _id and __doc */
+			columnId += FirstLowInvalidHeapAttributeNumber;
+			if (columnId <= 1 ||
+				strcmp(get_relid_attribute_name(rte->relid, columnId), "__doc") == 0)
+				return false;
+
+			targetEntry = get_tle_by_resno(subplan->targetlist, columnId);
+			if (targetEntry == NULL || !ValueIsScanConstant(targetEntry->expr))
+				return false;
+
+			columnIdList = lappend_int(columnIdList, columnId);
+			valueList = lappend(valueList, targetEntry->expr);
+		}
+	}
+
+	/* all quals are evaluated by MongoDB, and no rows come back to check */
+	foreignScan->operation = operation;
+	foreignScan->scan.plan.qual = NIL;
+	foreignScan->fdw_private = list_make4(fpinfo->opExpressionList,
+										  columnIdList, valueList,
+										  makeInteger(plan->canSetTag));
+
+	return true;
+}
+
+
+/*
+ * MongoBeginDirectModify connects to the MongoDB server, and builds the query
+ * document that selects the rows to modify and, for an UPDATE, the document of
+ * their new values.
+ */
+static void
+MongoBeginDirectModify(ForeignScanState *scanState, int executorFlags)
+{
+	ForeignScan          *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+	List                 *foreignPrivateList = foreignScan->fdw_private;
+	EState               *estate = scanState->ss.ps.state;
+	MongoFdwModifyState  *fmstate = NULL;
+	RangeTblEntry        *rte = NULL;
+	Oid                  foreignTableId = InvalidOid;
+	Oid                  userid = InvalidOid;
+	ForeignServer        *server;
+	UserMapping          *user;
+	ForeignTable         *table;
+
+	/* if Explain with no Analyze, do nothing */
+	if (executorFlags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	fmstate = (MongoFdwModifyState *) palloc0(sizeof(MongoFdwModifyState));
+	fmstate->rel = scanState->ss.ss_currentRelation;
+	foreignTableId = RelationGetRelid(fmstate->rel);
+	fmstate->options = mongo_get_options(foreignTableId);
+
+	/* identify which user to do the remote access as, as for a scan */
+	rte = rt_fetch(foreignScan->scan.scanrelid, estate->es_range_table);
+	userid = rte->checkAsUser ? rte->checkAsUser : GetUserId();
+
+	table = GetForeignTable(foreignTableId);
+	server = GetForeignServer(table->serverid);
+	user = GetUserMapping(userid, server->serverid);
+
+	fmstate->mongoConnection = mongo_get_connection(server, user, fmstate->options);
+
+	fmstate->xactLevel = GetCurrentTransactionNestLevel();
+	fmstate->queryDocument = QueryDocument(foreignTableId,
+								list_nth(foreignPrivateList,
+										 MongoFdwDirectModifyPrivateOpExpressionList),
+								scanState);
+	if (foreignScan->operation == CMD_UPDATE)
+		fmstate->updateDocument = UpdateDocument(foreignTableId,
+								list_nth(foreignPrivateList,
+										 MongoFdwDirectModifyPrivateColumnIdList),
+								list_nth(foreignPrivateList,
+										 MongoFdwDirectModifyPrivateValueList),
+								scanState);
+	mongo_track_document(fmstate->queryDocument, fmstate->xactLevel);
+	mongo_track_document(fmstate->updateDocument, fmstate->xactLevel);
+	fmstate->setProcessed = intVal(list_nth(foreignPrivateList,
+										MongoFdwDirectModifyPrivateSetProcessed));
+
+	scanState->fdw_state = (void *) fmstate;
+}
+
+
+/*
+ * MongoIterateDirectModify sends the update or remove to the server on its
+ * first call, and adds the number of rows it matched to the command's count.
+ * No rows are returned, as RETURNING isn't supported.
+ */
+static TupleTableSlot *
+MongoIterateDirectModify(ForeignScanState *scanState)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+	MongoFdwOptions     *options = fmstate->options;
+	EState              *estate = scanState->ss.ps.state;
+	MONGO_BULK          *bulk = NULL;
+	double              rowCount = 0;
+
+	if (!fmstate->directModified)
+	{
+		fmstate->directModified = true;
+
+		bulk = MongoBulkCreate(fmstate->mongoConnection, options->svr_database,
+							   options->collectionName, true,
+							   options->write_concern, options->journal);
+		if (fmstate->updateDocument != NULL)
+			MongoBulkUpdate(bulk, fmstate->queryDocument, fmstate->updateDocument);
+		else
+			MongoBulkRemove(bulk, fmstate->queryDocument);
+
+		rowCount = MongoBulkExecute(bulk);
+		if (fmstate->setProcessed)
+			estate->es_processed += (uint64) rowCount;
+	}
+
+	return ExecClearTuple(scanState->ss.ss_ScanTupleSlot);
+}
+
+
+/*
+ * MongoEndDirectModify releases the connection and the documents.
+ */
+static void
+MongoEndDirectModify(ForeignScanState *scanState)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+
+	if (fmstate != NULL)
+	{
+		if (fmstate->options)
+		{
+			mongo_free_options(fmstate->options);
+			fmstate->options = NULL;
+		}
+		MongoFreeScanState(fmstate);
+	}
+}
+
+
+/*
+ * MongoExplainDirectModify shows the collection, and with VERBOSE the query
+ * and update documents sent to the server.
+ */
+static void
+MongoExplainDirectModify(ForeignScanState *scanState, ExplainState *explainState)
+{
+	ForeignScan     *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+	List            *foreignPrivateList = foreignScan->fdw_private;
+	MongoFdwOptions *options = NULL;
+	StringInfo      namespaceName = NULL;
+	Oid             foreignTableId = InvalidOid;
+
+	foreignTableId = RelationGetRelid(scanState->ss.ss_currentRelation);
+	options = mongo_get_options(foreignTableId);
+
+	/* construct fully qualified collection name */
+	namespaceName = makeStringInfo();
+	appendStringInfo(namespaceName, "%s.%s", options->svr_database,
+					 options->collectionName);
+
+	mongo_free_options(options);
+	ExplainPropertyText("Foreign Namespace", namespaceName->data, explainState);
+
+	/* values only known at execution are left out */
+	if (explainState->verbose)
+	{
+		BSON *queryDocument = NULL;
+		char *queryString = NULL;
+
+		queryDocument = QueryDocument(foreignTableId,
+								list_nth(foreignPrivateList,
+										 MongoFdwDirectModifyPrivateOpExpressionList),
+								NULL);
+		queryString = BsonAsJson(queryDocument);
+		ExplainPropertyText("Foreign Query", queryString, explainState);
+		bson_free(queryString);
+		BsonDestroy(queryDocument);
+	}
+}
+#endif
+
+
+/*
+ * MongoRelationInfo returns the planner information of the foreign table, and
+ * creates it with the table's options on first use. IsForeignScanParallelSafe
+ * may be called before GetForeignRelSize.
+ */
+static MongoFdwRelationInfo *
+MongoRelationInfo(RelOptInfo *baserel, Oid foreignTableId)
+{
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+
+	if (fpinfo == NULL)
+	{
+		fpinfo = (MongoFdwRelationInfo *) palloc0(sizeof(MongoFdwRelationInfo));
+		fpinfo->foreignTableId = foreignTableId;
+		fpinfo->options = mongo_get_options(foreignTableId);
+		baserel->fdw_private = (void *) fpinfo;
+	}
+
+	return fpinfo;
+}
+
+
+/*
+ * ForeignTableDocumentCount connects to the MongoDB server, and queries it for
+ * the number of documents in the foreign collection. On success, the function
+ * returns the document count. On failure, the function returns -1.0.
+ */
+static double
+ForeignTableDocumentCount(Oid foreignTableId)
+{
+	MongoFdwOptions         *options = NULL;
+	MONGO_CONN              *mongoConnection = NULL;
+	const BSON              *emptyQuery = NULL;
+	double                  documentCount = 0.0;
+	Oid		        userid = GetUserId();
+	ForeignServer           *server;
+	UserMapping             *user;
+	ForeignTable            *table;
+
+
+	/* Get info about foreign table. */
+	table = GetForeignTable(foreignTableId);
+	server = GetForeignServer(table->serverid);
+	user = GetUserMapping(userid, server->serverid);
+
+	/* resolve foreign table options; and connect to mongo server */
+	options = mongo_get_options(foreignTableId);
+
+	/*
+	 * Get connection to the foreign server. Connection manager will
+	 * establish new connection if necessary.
+	 */
+	mongoConnection = mongo_get_connection(server, user, options);
+
+
+	documentCount = MongoAggregateCount(mongoConnection, options->svr_database, options->collectionName, emptyQuery);
+
+	mongo_free_options(options);
+
+	return documentCount;
+}
+
+
+/*
+ * ForeignTablePlanDocumentCount returns the number of documents in the foreign
+ * collection to plan a scan with. After ANALYZE, that is the row count it
+ * recorded, as for local tables. Otherwise it is the cached count of the
+ * collection, or for a mongodump file, an estimate from its size.
+ */
+static double
+ForeignTablePlanDocumentCount(RelOptInfo *baserel, Oid foreignTableId)
+{
+#ifdef META_DRIVER
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+#endif
+
+	if (baserel->pages > 0 && baserel->tuples > 0)
+		return baserel->tuples;
+
+#ifdef META_DRIVER
+	/* as file_fdw does, take a file for rows of the expected width */
+	if (fpinfo->options->filename != NULL)
+		return clamp_row_est(fpinfo->fileSize /
+							 Max(get_relation_data_width(foreignTableId,
+														 baserel->attr_widths), 1));
+#endif
+
+	return ForeignTableCachedDocumentCount(foreignTableId);
+}
+
+
+/*
+ * ForeignTableCachedDocumentCount returns the number of documents in the
+ * foreign collection. The count is read from the server with collStats, or with
+ * a count command if that fails, and cached for the number of seconds set by
+ * mongo_fdw.stats_cache_ttl. The function returns -1.0 if the server can't tell.
+ */
+static double
+ForeignTableCachedDocumentCount(Oid foreignTableId)
+{
+	MongoStatsCacheEntry *entry = NULL;
+	TimestampTz          now = GetCurrentTimestamp();
+	double               documentCount = 0.0;
+	double               documentSize = 0.0;
+	bool                 found = false;
+
+	MongoStatsCacheInit();
+
+	entry = hash_search(StatsCacheHash, &foreignTableId, HASH_FIND, NULL);
+	if (entry != NULL && entry->readTime != 0 &&
+		!TimestampDifferenceExceeds(entry->readTime, now,
+									MongoStatsCacheTtl * 1000))
+		return entry->documentCount;
+
+	if (!ForeignTableCollectionStats(foreignTableId, &documentCount,
+									 &documentSize))
+	{
+		documentCount = ForeignTableDocumentCount(foreignTableId);
+		documentSize = 0.0;
+	}
+
+	/* failures aren't cached, the server may be back for the next plan */
+	if (documentCount < 0.0 || MongoStatsCacheTtl == 0)
+		return documentCount;
+
+	entry = hash_search(StatsCacheHash, &foreignTableId, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->indexList = NIL;
+		entry->indexContext = NULL;
+		entry->indexReadTime = 0;
+	}
+	entry->documentCount = documentCount;
+	entry->documentSize = documentSize;
+	entry->readTime = now;
+
+	return documentCount;
+}
+
+
+/*
+ * MongoStatsCacheInit creates the hash table of cached collection statistics,
+ * the first time it is needed.
+ */
+static void
+MongoStatsCacheInit(void)
+{
+	HASHCTL ctl;
+
+	if (StatsCacheHash != NULL)
+		return;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(MongoStatsCacheEntry);
+	ctl.hash = oid_hash;
+	ctl.hcxt = CacheMemoryContext;
+	StatsCacheHash = hash_create("mongo_fdw collection statistics", 64,
+								 &ctl,
+								 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	/* options of the table or its server may point it elsewhere */
+	CacheRegisterSyscacheCallback(FOREIGNTABLEREL,
+								  MongoStatsCacheInvalidate, (Datum) 0);
+	CacheRegisterSyscacheCallback(FOREIGNSERVEROID,
+								  MongoStatsCacheInvalidate, (Datum) 0);
+}
+
+
+/*
+ * MongoStatsCacheInvalidate has the statistics and indexes of all foreign
+ * tables read again when the options of any foreign table or server change.
+ */
+static void
+MongoStatsCacheInvalidate(Datum arg, int cacheId, uint32 hashValue)
+{
+	HASH_SEQ_STATUS      scan;
+	MongoStatsCacheEntry *entry;
+
+	hash_seq_init(&scan, StatsCacheHash);
+	while ((entry = (MongoStatsCacheEntry *) hash_seq_search(&scan)))
+	{
+		entry->readTime = 0;
+		entry->indexReadTime = 0;
+	}
+}
+
+
+#ifdef META_DRIVER
+/*
+ * ForeignTableCachedIndexList returns the indexes of the foreign collection as
+ * lists of their keys, each a list of the field name and the direction of the
+ * key, as in sort lists. The indexes are read from the server with listIndexes,
+ * and cached as the collection statistics are. The function returns NIL if the
+ * server can't tell.
+ */
+static List *
+ForeignTableCachedIndexList(Oid foreignTableId)
+{
+	MongoStatsCacheEntry *entry = NULL;
+	TimestampTz          now = GetCurrentTimestamp();
+	MongoFdwOptions      *options = NULL;
+	MONGO_CONN           *mongoConnection = NULL;
+	BSON                 *indexDocument = NULL;
+	ForeignServer        *server = NULL;
+	UserMapping          *user = NULL;
+	ForeignTable         *table = NULL;
+	MemoryContext        oldContext = NULL;
+	List                 *indexList = NIL;
+	bool                 found = false;
+
+	MongoStatsCacheInit();
+
+	/* the list is copied, as the cached one may be replaced while planning */
+	entry = hash_search(StatsCacheHash, &foreignTableId, HASH_FIND, NULL);
+	if (entry != NULL && entry->indexReadTime != 0 &&
+		!TimestampDifferenceExceeds(entry->indexReadTime, now,
+									MongoStatsCacheTtl * 1000))
+		return copyObject(entry->indexList);
+
+	table = GetForeignTable(foreignTableId);
+	server = GetForeignServer(table->serverid);
+	user = GetUserMapping(GetUserId(), server->serverid);
+
+	options = mongo_get_options(foreignTableId);
+	mongoConnection = mongo_get_connection(server, user, options);
+	indexDocument = MongoCollectionIndexes(mongoConnection, options->svr_database,
+										   options->collectionName);
+	mongo_free_options(options);
+
+	/* failures aren't cached, the server may be back for the next plan */
+	if (indexDocument == NULL)
+		return NIL;
+
+	if (MongoStatsCacheTtl == 0)
+	{
+		indexList = MongoIndexList(indexDocument);
+		BsonDestroy(indexDocument);
+		return indexList;
+	}
+
+	entry = hash_search(StatsCacheHash, &foreignTableId, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->documentCount = 0.0;
+		entry->documentSize = 0.0;
+		entry->readTime = 0;
+		entry->indexContext = NULL;
+	}
+
+	if (entry->indexContext == NULL)
+		entry->indexContext = AllocSetContextCreate(CacheMemoryContext,
+													"mongo_fdw index definitions",
+													ALLOCSET_SMALL_MINSIZE,
+													ALLOCSET_SMALL_INITSIZE,
+													ALLOCSET_SMALL_MAXSIZE);
+	else
+		MemoryContextReset(entry->indexContext);
+
+	oldContext = MemoryContextSwitchTo(entry->indexContext);
+	entry->indexList = MongoIndexList(indexDocument);
+	MemoryContextSwitchTo(oldContext);
+	entry->indexReadTime = now;
+
+	BsonDestroy(indexDocument);
+
+	return copyObject(entry->indexList);
+}
+
+
+/*
+ * MongoIndexList turns the index key patterns read by MongoCollectionIndexes
+ * into lists of index keys. Indexes with keys that aren't ascending or
+ * descending, such as text, hashed and geospatial keys, are left out.
+ */
+static List *
+MongoIndexList(BSON *indexDocument)
+{
+	BSON_ITERATOR indexIterator;
+	List          *indexList = NIL;
+
+	BsonIterInit(&indexIterator, indexDocument);
+	while (BsonIterNext(&indexIterator))
+	{
+		BSON_ITERATOR keyIterator;
+		List          *keyList = NIL;
+		bool          ordered = true;
+
+		if (!BsonIterSubIter(&indexIterator, &keyIterator))
+			continue;
+
+		while (BsonIterNext(&keyIterator))
+		{
+			int    keyType = BsonIterType(&keyIterator);
+			double direction = 0.0;
+
+			if (keyType == BSON_TYPE_INT32 || keyType == BSON_TYPE_INT64 ||
+				keyType == BSON_TYPE_DOUBLE)
+				direction = BsonIterDouble(&keyIterator);
+
+			if (direction == 0.0)
+			{
+				ordered = false;
+				break;
+			}
+
+			keyList = lappend(keyList,
+							  list_make2(makeString(pstrdup(BsonIterKey(&keyIterator))),
+										 makeInteger(direction > 0.0 ? 1 : -1)));
+		}
+
+		if (ordered && keyList != NIL)
+			indexList = lappend(indexList, keyList);
+	}
+
+	return indexList;
+}
+#endif
+
+
+/*
+ * ForeignTableCollectionStats connects to the MongoDB server, and queries it
+ * for the number of documents in the foreign collection and their average size
+ * in bytes. The function returns false if the server can't tell.
+ */
+static bool
+ForeignTableCollectionStats(Oid foreignTableId, double *documentCount,
+							double *documentSize)
+{
+	MongoFdwOptions         *options = NULL;
+	MONGO_CONN              *mongoConnection = NULL;
+	bool                    found = false;
+	ForeignServer           *server;
+	UserMapping             *user;
+	ForeignTable            *table;
+
+	/* Get info about foreign table. */
+	table = GetForeignTable(foreignTableId);
+	server = GetForeignServer(table->serverid);
+	user = GetUserMapping(GetUserId(), server->serverid);
+
+	/* resolve foreign table options; and connect to mongo server */
+	options = mongo_get_options(foreignTableId);
+	mongoConnection = mongo_get_connection(server, user, options);
+
+	found = MongoCollectionStats(mongoConnection, options->svr_database,
+								 options->collectionName,
+								 documentCount, documentSize);
+
+	mongo_free_options(options);
+
+	return found;
+}
+
+
+/*
+ * MongoUseProjection decides whether the scan asks MongoDB for only the columns
+ * in the column list. In auto mode, we compare the expected width of these
+ * columns with the average document size that ANALYZE recorded through relpages
+ * and reltuples, or else with the one cached for planning; without these
+ * statistics we fetch whole documents.
+ */
+static bool
+MongoUseProjection(RelOptInfo *baserel, Oid foreignTableId, List *columnList)
+{
+	MongoFdwRelationInfo    *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+	MongoProjectionMode     projection = fpinfo->options->projection;
+	ListCell                *columnCell = NULL;
+	double                  documentWidth = 0.0;
+	double                  columnWidth = 0.0;
+
+#ifdef META_DRIVER
+	/* documents of a mongodump file are read whole anyway */
+	if (fpinfo->options->filename != NULL)
+		return false;
+#endif
+
+	if (projection != MONGO_PROJECTION_AUTO)
+		return (projection == MONGO_PROJECTION_ON);
+
+	if (baserel->pages > 0 && baserel->tuples > 0)
+	{
+		documentWidth = (double) baserel->pages * BLCKSZ / baserel->tuples;
+	}
+	else
+	{
+		/* otherwise use the average size read along with the count, if any */
+		MongoStatsCacheEntry *entry = NULL;
+
+		if (StatsCacheHash != NULL)
+			entry = hash_search(StatsCacheHash, &foreignTableId, HASH_FIND, NULL);
+		if (entry == NULL || entry->readTime == 0 || entry->documentSize <= 0)
+			return false;
+
+		documentWidth = entry->documentSize;
+	}
+
+	foreach(columnCell, columnList)
+	{
+		Var   *column = (Var *) lfirst(columnCell);
+		int32 width = get_attavgwidth(foreignTableId, column->varattno);
+
+		if (width <= 0)
+			width = get_typavgwidth(column->vartype, column->vartypmod);
+
+		columnWidth += width;
+	}
+
+	return (columnWidth <= documentWidth * MONGO_PROJECTION_WIDTH_FRACTION);
+}
+
+
+/*
+ * MongoFilterQualList returns the restriction clauses MongoDB doesn't evaluate,
+ * for the scan to check on each document after converting only the columns they
+ * reference. Documents they reject are then skipped without converting their
+ * other columns. The clauses are still rechecked with the plan's quals, so the
+ * function leaves out those that may give another result the second time, and
+ * returns NIL if they reference every needed column, as nothing is saved then.
+ */
+static List *
+MongoFilterQualList(RelOptInfo *baserel, Oid foreignTableId,
+					List *clauseList, List *opExpressionList, List *columnList)
+{
+	List      *filterQualList = NIL;
+	Bitmapset *qualAttributes = NULL;
+	ListCell  *clauseCell = NULL;
+	ListCell  *columnCell = NULL;
+	bool      columnUnreferenced = false;
+
+	foreach(clauseCell, clauseList)
+	{
+		Node *clause = (Node *) lfirst(clauseCell);
+
+		if (list_member_ptr(opExpressionList, clause) ||
+			contain_volatile_functions(clause) || contain_subplans(clause))
+			continue;
+
+		filterQualList = lappend(filterQualList, clause);
+		pull_varattnos(clause, baserel->relid, &qualAttributes);
+	}
+
+	if (filterQualList == NIL)
+		return NIL;
+
+	/* whole-row and system columns aren't filled from the column mapping */
+	if (bms_first_member(bms_copy(qualAttributes)) +
+		FirstLowInvalidHeapAttributeNumber <= InvalidAttrNumber)
+		return NIL;
+
+	foreach(columnCell, columnList)
+	{
+		Var  *column = (Var *) lfirst(columnCell);
+		char *columnName = get_relid_attribute_name(foreignTableId,
+													column->varattno);
+
+		/* a __doc column is filled alone */
+		if (strcmp(columnName, "__doc") == 0)
+			return NIL;
+
+		if (!bms_is_member(column->varattno - FirstLowInvalidHeapAttributeNumber,
+						   qualAttributes))
+			columnUnreferenced = true;
+	}
+
+	return columnUnreferenced ? filterQualList : NIL;
+}
+
+
+/*
+ * MongoSortList returns the column names and directions that have MongoDB sort
+ * documents in the order of the given pathkeys, or NIL if it can't. MongoDB
+ * sorts numbers, dates and object ids as PostgreSQL does, and strings bytewise
+ * as the C collation does, but orders values of different types by their BSON
+ * type and puts nulls and missing fields first. So we only sort by columns
+ * whose values the quals keep to the column's type, which also makes the null
+ * ordering moot.
+ */
+static List *
+MongoSortList(RelOptInfo *baserel, Oid foreignTableId, List *pathkeyList)
+{
+	List     *sortList = NIL;
+	ListCell *pathkeyCell = NULL;
+
+	foreach(pathkeyCell, pathkeyList)
+	{
+		PathKey          *pathkey = (PathKey *) lfirst(pathkeyCell);
+		EquivalenceClass *eclass = pathkey->pk_eclass;
+		ListCell         *memberCell = NULL;
+		Var              *column = NULL;
+		char             *columnName = NULL;
+		Oid              opclassId = InvalidOid;
+		bool             ascending = (pathkey->pk_strategy == BTLessStrategyNumber);
+
+		if (eclass->ec_has_volatile)
+			return NIL;
+
+		/* find a column of this table to sort by */
+		foreach(memberCell, eclass->ec_members)
+		{
+			EquivalenceMember *member = (EquivalenceMember *) lfirst(memberCell);
+			Expr              *expression = member->em_expr;
+
+			if (IsA(expression, RelabelType))
+				expression = ((RelabelType *) expression)->arg;
+
+			if (IsA(expression, Var) &&
+				((Var *) expression)->varno == baserel->relid &&
+				((Var *) expression)->varlevelsup == 0 &&
+				((Var *) expression)->varattno > 0)
+			{
+				column = (Var *) expression;
+				break;
+			}
+		}
+
+		if (column == NULL)
+			return NIL;
+
+		columnName = get_relid_attribute_name(foreignTableId, column->varattno);
+		if (strcmp(columnName, "__doc") == 0)
+			return NIL;
+
+		switch (column->vartype)
+		{
+			case INT2OID: case INT4OID:
+			case INT8OID: case FLOAT4OID:
+			case FLOAT8OID: case NUMERICOID:
+			case DATEOID: case TIMESTAMPOID:
+			case TIMESTAMPTZOID: case NAMEOID:
+				break;
+			case TEXTOID: case VARCHAROID:
+			{
+				if (!lc_collate_is_c(eclass->ec_collation))
+					return NIL;
+				break;
+			}
+			default:
+				return NIL;
+		}
+
+		/* the sort must use the default ordering of the type */
+		opclassId = GetDefaultOpClass(column->vartype, BTREE_AM_OID);
+		if (!OidIsValid(opclassId) ||
+			get_opclass_family(opclassId) != pathkey->pk_opfamily)
+		{
+			return NIL;
+		}
+
+		if (!MongoColumnBracketed(baserel, column))
+			return NIL;
+
+		sortList = lappend(sortList, list_make2(makeString(columnName),
+												makeInteger(ascending ? 1 : -1)));
+	}
+
+	return sortList;
+}
+
+
+/*
+ * MongoSortListString returns the column names of the given sort list, or of
+ * the keys of an index, followed by DESC for descending ones, for EXPLAIN.
+ */
+static char *
+MongoSortListString(List *sortList)
+{
+	StringInfo sortString = makeStringInfo();
+	ListCell   *sortCell = NULL;
+
+	foreach(sortCell, sortList)
+	{
+		List *sortEntry = (List *) lfirst(sortCell);
+
+		if (sortString->len > 0)
+			appendStringInfoString(sortString, ", ");
+		appendStringInfoString(sortString, strVal(linitial(sortEntry)));
+		if (intVal(lsecond(sortEntry)) < 0)
+			appendStringInfoString(sortString, " DESC");
+	}
+
+	return sortString->data;
+}
+
+
+/*
+ * MongoColumnBracketed tells whether all documents the scan returns have a value
+ * of the column's type for the given column, because a pushed down clause that
+ * MongoDB evaluates exactly compares it with a value of that type. The other
+ * documents, and those where the field is null or missing, don't reach the sort.
+ */
+static bool
+MongoColumnBracketed(RelOptInfo *baserel, Var *column)
+{
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+	ListCell             *opExpressionCell = NULL;
+
+	if (fpinfo == NULL)
+		return false;
+
+	foreach(opExpressionCell, fpinfo->opExpressionList)
+	{
+		Expr *clause = (Expr *) lfirst(opExpressionCell);
+
+		if (ClauseBracketsColumn(clause, column->varattno))
+			return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * MongoLimitCount returns the number of rows the query needs from this scan,
+ * if it has a LIMIT that can be sent to MongoDB, and 0 otherwise. The planner
+ * only sets limit_tuples when no grouping, aggregation or DISTINCT comes
+ * between the scan and the LIMIT; we also need the rows to come straight from
+ * this table, and to be filtered by MongoDB exactly as by the quals. Since the
+ * executor still applies the OFFSET, we fetch the skipped rows as well.
+ */
+static int
+MongoLimitCount(PlannerInfo *root, RelOptInfo *baserel)
+{
+	MongoFdwRelationInfo *fpinfo = (MongoFdwRelationInfo *) baserel->fdw_private;
+
+	if (root->limit_tuples < 1.0 || root->limit_tuples >= (double) INT_MAX)
+		return 0;
+
+	if (baserel->reloptkind != RELOPT_BASEREL ||
+		!bms_equal(root->all_baserels, baserel->relids))
+	{
+		return 0;
+	}
+
+	if (fpinfo == NULL || !fpinfo->remoteQualsExact)
+		return 0;
+
+	/* set-returning functions in the target list emit more rows than they get */
+	if (expression_returns_set((Node *) root->parse->targetList))
+		return 0;
+
+	return (int) root->limit_tuples;
+}
+
+
+/*
+ * ColumnMappingTreeCreate compiles the referenced columns into a tree of column
+ * paths, splitting nested column names on dots. This tree helps us quickly
+ * translate BSON document key/values to the corresponding PostgreSQL columns.
+ */
+static ColumnMappingTree *
+ColumnMappingTreeCreate(Oid foreignTableId, List *columnList)
+{
+	ListCell              *columnCell = NULL;
+	ColumnMappingTree     *columnMappingTree = NULL;
+
+	columnMappingTree = (ColumnMappingTree *) palloc0(sizeof(ColumnMappingTree));
+
+	foreach(columnCell, columnList)
+	{
+		Var *column = (Var *) lfirst(columnCell);
+		AttrNumber columnId = column->varattno;
+
+		ColumnMapping *columnMapping = NULL;
+		ColumnMappingNode *node = NULL;
+		char *columnName = NULL;
+		char *pathKey = NULL;
+		char *nextKey = NULL;
+
+		columnName = get_relid_attribute_name(foreignTableId, columnId);
+
+		columnMapping = (ColumnMapping *) palloc0(sizeof(ColumnMapping));
+		strlcpy(columnMapping->columnName, columnName, NAMEDATALEN);
+		columnMapping->columnIndex = columnId - 1;
+		columnMapping->columnTypeId = column->vartype;
+		columnMapping->columnTypeMod = column->vartypmod;
+		columnMapping->columnArrayTypeId = get_element_type(column->vartype);
+
+		/* resolve how to convert values once, instead of for each value */
+		if (OidIsValid(columnMapping->columnArrayTypeId))
+		{
+			ColumnConvertersResolve(columnMapping->columnArrayTypeId,
+									columnMapping->converters);
+			get_typlenbyvalalign(columnMapping->columnArrayTypeId,
+								 &columnMapping->elementTypeLength,
+								 &columnMapping->elementTypeByValue,
+								 &columnMapping->elementTypeAlignment);
+		}
+		else
+			ColumnConvertersResolve(columnMapping->columnTypeId,
+									columnMapping->converters);
+
+		if (strcmp(columnName, "__doc") == 0)
+		{
+			columnMappingTree->documentMapping = columnMapping;
+			continue;
+		}
+
+		/* walk down the path, adding nodes for keys we haven't seen yet */
+		node = &columnMappingTree->root;
+		for (pathKey = pstrdup(columnName); pathKey != NULL; pathKey = nextKey)
+		{
+			int childIndex = 0;
+
+			nextKey = strchr(pathKey, '.');
+			if (nextKey != NULL)
+				*nextKey++ = '\0';
+
+			for (childIndex = 0; childIndex < node->childCount; childIndex++)
+			{
+				if (strcmp(node->children[childIndex].key, pathKey) == 0)
+					break;
+			}
+
+			if (childIndex == node->childCount)
+			{
+				if (node->childCount == 0)
+					node->children = palloc0(sizeof(ColumnMappingNode));
+				else
+					node->children = repalloc(node->children,
+											  (node->childCount + 1) * sizeof(ColumnMappingNode));
+
+				memset(&node->children[childIndex], 0, sizeof(ColumnMappingNode));
+				node->children[childIndex].key = pathKey;
+				node->childCount++;
+			}
+
+			node = &node->children[childIndex];
+		}
+
+		/* a column listed twice maps to the same path only once */
+		if (node->columnMapping == NULL)
+			columnMappingTree->mappingCount++;
+		node->columnMapping = columnMapping;
+	}
+
+	ColumnMappingNodeSort(&columnMappingTree->root);
+
+	return columnMappingTree;
+}
+
+
+/*
+ * ColumnMappingNodeSort sorts the children of every node in the subtree by key.
+ */
+static void
+ColumnMappingNodeSort(ColumnMappingNode *node)
+{
+	int childIndex = 0;
+
+	if (node->childCount > 1)
+		qsort(node->children, node->childCount, sizeof(ColumnMappingNode),
+			  ColumnMappingNodeCompare);
+
+	for (childIndex = 0; childIndex < node->childCount; childIndex++)
+		ColumnMappingNodeSort(&node->children[childIndex]);
+}
+
+
+/* qsort and bsearch comparator for column mapping nodes */
+static int
+ColumnMappingNodeCompare(const void *a, const void *b)
+{
+	const ColumnMappingNode *nodeA = (const ColumnMappingNode *) a;
+	const ColumnMappingNode *nodeB = (const ColumnMappingNode *) b;
+
+	return strcmp(nodeA->key, nodeB->key);
+}
+
+
+/*
+ * ColumnMappingChild looks up the child of the node for the given document key.
+ */
+static inline ColumnMappingNode *
+ColumnMappingChild(ColumnMappingNode *node, const char *key)
+{
+	ColumnMappingNode searchNode;
+
+	if (node->childCount == 0)
+		return NULL;
+
+	searchNode.key = (char *) key;
+	return (ColumnMappingNode *) bsearch(&searchNode, node->children,
+										 node->childCount,
+										 sizeof(ColumnMappingNode),
+										 ColumnMappingNodeCompare);
+}
+
+
+/*
+ * FillTupleSlot walks over the key/value pairs in the given document. For each
+ * pair, the function checks if the key appears in the column mapping tree, and
+ * if the value type is compatible with the one specified for the column. If so,
+ * the function converts the value and fills the corresponding tuple position.
+ */
+static void
+FillTupleSlot(const BSON *bsonDocument, ColumnMappingTree *columnMappingTree,
+			  Datum *columnValues, bool *columnNulls)
+{
+	ColumnMapping*       columnMapping = columnMappingTree->documentMapping;
+	BSON_ITERATOR        bsonIterator = { NULL, 0 };
+	instr_time           startTime;
+
+	if (BsonIterInit(&bsonIterator, (BSON*)bsonDocument) == false)
+		elog(ERROR, "failed to initialize BSON iterator");
+
+	if (columnMapping != NULL)
+	{
+		Datum           columnValue = 0;
+		char            *str = NULL;
+
+		if (columnMappingTree->stats != NULL)
+			INSTR_TIME_SET_CURRENT(startTime);
+
+		switch (columnMapping->columnTypeId)
+		{
+			case BOOLOID:
+			case INT2OID:
+			case INT4OID:
+			case INT8OID:
+			case BOXOID:
+			case BYTEAOID:
+			case CHAROID:
+			case VARCHAROID:
+			case NAMEOID:
+			case JSONOID:
+			case XMLOID:
+			case POINTOID:
+			case LSEGOID:
+			case LINEOID:
+			case UUIDOID:
+			case LSNOID:
+			case TEXTOID:
+			case CASHOID:
+			case DATEOID:
+			case MACADDROID:
+			case TIMESTAMPOID:
+			case TIMESTAMPTZOID:
+			case BPCHAROID:
+				str = BsonAsJson(bsonDocument);
+				columnValue = CStringGetTextDatum(pg_any_to_server(str, strlen(str),
+																   PG_UTF8));
+#ifdef META_DRIVER
+				bson_free(str);
+#endif
+				break;
+
+			/* build jsonb from the document, without going through text */
+			case JSONBOID:
+				columnValue = BsonAsJsonb(bsonDocument);
+				break;
+
+			default:
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+								errmsg("un-supported type for column __doc"),
+								errhint("Column type: %u", (uint32) columnMapping->columnTypeId)));
+				break;
+		}
+
+		columnValues[columnMapping->columnIndex] = columnValue;
+		columnNulls[columnMapping->columnIndex] = false;
+
+		if (columnMappingTree->stats != NULL)
+			MongoScanStatsAddTime(&columnMappingTree->stats->convertTime,
+								  startTime);
+		return;
+	}
+
+	if (columnMappingTree->mappingCount == 0)
+		return;
+
+	columnMappingTree->generation++;
+	columnMappingTree->unseenCount = columnMappingTree->mappingCount;
+
+	FillTupleSlotNode(&bsonIterator, &columnMappingTree->root, columnMappingTree,
+					  columnValues, columnNulls);
+}
+
+
+/*
+ * FillTupleSlotNode fills the columns mapped below the given tree node from the
+ * (sub-)document the iterator walks over. Sub-documents are only recursed into
+ * when a column maps into them. The function returns false once every mapped
+ * key of the document has been seen, so that callers stop walking it.
+ */
+static bool
+FillTupleSlotNode(BSON_ITERATOR *bsonIterator, ColumnMappingNode *parentNode,
+				  ColumnMappingTree *columnMappingTree,
+				  Datum *columnValues, bool *columnNulls)
+{
+	while (BsonIterNext(bsonIterator))
+	{
+		const char *bsonKey = BsonIterKey(bsonIterator);
+		BSON_TYPE bsonType = BsonIterType(bsonIterator);
+		ColumnMappingNode *node = NULL;
+		ColumnMapping *columnMapping = NULL;
+		Oid columnTypeId = InvalidOid;
+		Oid columnArrayTypeId = InvalidOid;
+		instr_time startTime;
+
+		/* look up the corresponding column for this bson key */
+		node = ColumnMappingChild(parentNode, bsonKey);
+		if (node == NULL)
+			continue;
+
+		columnMapping = node->columnMapping;
+		if (columnMapping != NULL)
+		{
+			columnTypeId = columnMapping->columnTypeId;
+			columnArrayTypeId = columnMapping->columnArrayTypeId;
+
+			if (columnMapping->generation != columnMappingTree->generation)
+			{
+				columnMapping->generation = columnMappingTree->generation;
+				columnMappingTree->unseenCount--;
+			}
+		}
+
+		/* recurse into nested objects */
+		if (bsonType == BSON_TYPE_DOCUMENT && columnTypeId != JSONOID &&
+			columnTypeId != JSONBOID)
+		{
+			if (node->childCount > 0)
+			{
+				BSON_ITERATOR subIterator;
+
+				BsonIterSubIter(bsonIterator, &subIterator);
+				if (!FillTupleSlotNode(&subIterator, node, columnMappingTree,
+									   columnValues, columnNulls))
+					return false;
+			}
+			continue;
+		}
+
+		/* if no corresponding column or null BSON value, continue */
+		if (columnMapping == NULL || bsonType == BSON_TYPE_NULL)
+		{
+			if (columnMappingTree->unseenCount == 0)
+				return false;
+			continue;
+		}
+
+		if (columnMappingTree->stats != NULL)
+			INSTR_TIME_SET_CURRENT(startTime);
+
+		/* if types are compatible, fill in column value and null flag */
+		if (OidIsValid(columnArrayTypeId))
+		{
+			if (bsonType == BSON_TYPE_ARRAY)
+			{
+				int32 columnIndex = columnMapping->columnIndex;
+
+				columnValues[columnIndex] = ColumnValueArray(bsonIterator,
+															 columnMapping);
+				columnNulls[columnIndex] = false;
+			}
+		}
+		else
+		{
+			ColumnConverter converter = NULL;
+
+			converter = ColumnConverterLookup(columnMapping->converters, bsonType);
+			if (converter != NULL)
+			{
+				int32 columnIndex = columnMapping->columnIndex;
+
+				columnValues[columnIndex] = converter(bsonIterator, columnTypeId,
+													  columnMapping->columnTypeMod);
+				columnNulls[columnIndex] = false;
+			}
+		}
+
+		if (columnMappingTree->stats != NULL)
+			MongoScanStatsAddTime(&columnMappingTree->stats->convertTime,
+								  startTime);
+
+		if (columnMappingTree->unseenCount == 0)
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * ColumnConvertersResolve looks up the function that converts values of each
+ * BSON type to the given PostgreSQL type, and sets it in the converters array.
+ * A BSON type that can't be converted gets no function. In choosing functions,
+ * we also use our knowledge of internal conversions applied by BSON APIs.
+ */
+static void
+ColumnConvertersResolve(Oid columnTypeId, ColumnConverter *converters)
+{
+	memset(converters, 0, MONGO_BSON_TYPE_COUNT * sizeof(ColumnConverter));
+
+	/* we consider the PostgreSQL column type as authoritative */
+	switch(columnTypeId)
+	{
+		case INT2OID:
+			converters[BSON_TYPE_INT32] = ColumnValueInt16;
+			converters[BSON_TYPE_INT64] = ColumnValueInt16;
+			converters[BSON_TYPE_DOUBLE] = ColumnValueInt16;
+			break;
+		case INT4OID:
+			converters[BSON_TYPE_INT32] = ColumnValueInt32;
+			converters[BSON_TYPE_INT64] = ColumnValueInt32;
+			converters[BSON_TYPE_DOUBLE] = ColumnValueInt32;
+			break;
+		case INT8OID:
+			converters[BSON_TYPE_INT32] = ColumnValueInt64;
+			converters[BSON_TYPE_INT64] = ColumnValueInt64;
+			converters[BSON_TYPE_DOUBLE] = ColumnValueInt64;
+			break;
+		case FLOAT4OID:
+			converters[BSON_TYPE_INT32] = ColumnValueFloat4;
+			converters[BSON_TYPE_INT64] = ColumnValueFloat4;
+			converters[BSON_TYPE_DOUBLE] = ColumnValueFloat4;
+			break;
+		case FLOAT8OID:
+			converters[BSON_TYPE_INT32] = ColumnValueFloat8;
+			converters[BSON_TYPE_INT64] = ColumnValueFloat8;
+			converters[BSON_TYPE_DOUBLE] = ColumnValueFloat8;
+			break;
+		case NUMERICOID:
+			converters[BSON_TYPE_INT32] = ColumnValueNumericFromInteger;
+			converters[BSON_TYPE_INT64] = ColumnValueNumericFromInteger;
+			converters[BSON_TYPE_DOUBLE] = ColumnValueNumericFromDouble;
+			break;
+		case BOOLOID:
+			converters[BSON_TYPE_INT32] = ColumnValueBoolFromNumber;
+			converters[BSON_TYPE_INT64] = ColumnValueBoolFromNumber;
+			converters[BSON_TYPE_DOUBLE] = ColumnValueBoolFromNumber;
+			converters[BSON_TYPE_BOOL] = ColumnValueBool;
+			break;
+		case BPCHAROID:
+			converters[BSON_TYPE_UTF8] = ColumnValueBpchar;
+			break;
+		case VARCHAROID:
+			converters[BSON_TYPE_UTF8] = ColumnValueVarchar;
+			break;
+		case TEXTOID:
+			converters[BSON_TYPE_UTF8] = ColumnValueText;
+			break;
+		case BYTEAOID:
+			converters[BSON_TYPE_BINDATA] = ColumnValueBytea;
+#ifdef META_DRIVER
+			converters[BSON_TYPE_OID] = ColumnValueByteaFromOid;
+#endif
+			break;
+		case NAMEOID:
+			/*
+			 * We currently overload the NAMEOID type to represent the BSON
+			 * object identifier. We can safely overload this 64-byte data type
+			 * since it's reserved for internal use in PostgreSQL.
+			 */
+			converters[BSON_TYPE_OID] = ColumnValueName;
+			break;
+		case DATEOID:
+			converters[BSON_TYPE_DATE_TIME] = ColumnValueDate;
+			break;
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			converters[BSON_TYPE_DATE_TIME] = ColumnValueTimestamp;
+			break;
+		case JSONOID:
+			converters[BSON_TYPE_DOCUMENT] = ColumnValueJson;
+			converters[BSON_TYPE_ARRAY] = ColumnValueJson;
+			break;
+		case JSONBOID:
+			converters[BSON_TYPE_DOCUMENT] = ColumnValueJsonb;
+			converters[BSON_TYPE_ARRAY] = ColumnValueJsonb;
+			break;
+		default:
+		{
+			/*
+			 * We currently error out on other data types, once we see a value
+			 * for them. Some types such as byte arrays are easy to add, but
+			 * they need testing. Other types such as money or inet, do not
+			 * have equivalents in MongoDB.
+			 */
+			int bsonType = 0;
+
+			for (bsonType = 0; bsonType < MONGO_BSON_TYPE_COUNT; bsonType++)
+				converters[bsonType] = ColumnValueUnsupported;
+			converters[BSON_TYPE_NULL] = NULL;
+			break;
+		}
+	}
+}
+
+
+/*
+ * ColumnConverterLookup returns the converter for the given BSON type, or NULL
+ * if values of the type can't be converted.
+ */
+static inline ColumnConverter
+ColumnConverterLookup(ColumnConverter *converters, BSON_TYPE bsonType)
+{
+	if ((unsigned int) bsonType >= MONGO_BSON_TYPE_COUNT)
+		return NULL;
+
+	return converters[bsonType];
+}
+
+
+/*
+ * ColumnTypesCompatible checks if the given BSON type can be converted to the
+ * given PostgreSQL type. Scans use the converters resolved for their columns
+ * instead; this is for values whose type is only known as they are read.
+ */
+static bool
+ColumnTypesCompatible(BSON_TYPE bsonType, Oid columnTypeId)
+{
+	ColumnConverter converters[MONGO_BSON_TYPE_COUNT];
+
+	ColumnConvertersResolve(columnTypeId, converters);
+
+	return ColumnConverterLookup(converters, bsonType) != NULL;
+}
+
+
+/*
+ * ColumnValueArray reads the current array pointed to by the BSON iterator, and
+ * converts each array element (with matching type) to the corresponding
+ * PostgreSQL datum with the element converters of the column. Then, the
+ * function constructs an array datum from element datums, and returns the array
+ * datum.
+ */
+static Datum
+ColumnValueArray(BSON_ITERATOR *bsonIterator, ColumnMapping *columnMapping)
+{
+	Datum          *columnValueArray = palloc0(INITIAL_ARRAY_CAPACITY * sizeof(Datum));
+	uint32         arrayCapacity = INITIAL_ARRAY_CAPACITY;
+	uint32         arrayGrowthFactor = 2;
+	uint32         arrayIndex = 0;
+	Oid            valueTypeId = columnMapping->columnArrayTypeId;
+
+	ArrayType      *columnValueObject = NULL;
+	Datum          columnValueDatum = 0;
+
+	BSON_ITERATOR bsonSubIterator = { NULL, 0 };
+	BsonIterSubIter(bsonIterator, &bsonSubIterator);
+	while (BsonIterNext(&bsonSubIterator))
+	{
+		BSON_TYPE bsonType = BsonIterType(&bsonSubIterator);
+		ColumnConverter converter = NULL;
+
+		converter = ColumnConverterLookup(columnMapping->converters, bsonType);
+		if (converter == NULL)
+		{
+			continue;
+		}
+
+		if (arrayIndex >= arrayCapacity)
+		{
+			arrayCapacity *= arrayGrowthFactor;
+			columnValueArray = repalloc(columnValueArray, arrayCapacity * sizeof(Datum));
+		}
+
+		/* use default type modifier (0) to convert column value */
+		columnValueArray[arrayIndex] = converter(&bsonSubIterator, valueTypeId, 0);
+		arrayIndex++;
+	}
+
+	columnValueObject = construct_array(columnValueArray, arrayIndex, valueTypeId,
+										columnMapping->elementTypeLength,
+										columnMapping->elementTypeByValue,
+										columnMapping->elementTypeAlignment);
+
+	columnValueDatum = PointerGetDatum(columnValueObject);
+	return columnValueDatum;
+}
+
+
+/*
+ * ColumnValue uses column type information to read the current value pointed to
+ * by the BSON iterator, and converts this value to the corresponding PostgreSQL
+ * datum. The function then returns this datum. The caller must have checked
+ * that the types are compatible.
+ */
+static Datum
+ColumnValue(BSON_ITERATOR *bsonIterator, Oid columnTypeId, int32 columnTypeMod)
+{
+	ColumnConverter converters[MONGO_BSON_TYPE_COUNT];
+	ColumnConverter converter = NULL;
+
+	ColumnConvertersResolve(columnTypeId, converters);
+	converter = ColumnConverterLookup(converters, BsonIterType(bsonIterator));
+	Assert(converter != NULL);
+
+	return converter(bsonIterator, columnTypeId, columnTypeMod);
+}
+
+
+/*
+ * The functions below are the column converters. Each reads the current value
+ * pointed to by the BSON iterator, for the BSON types it is resolved for, and
+ * returns the corresponding PostgreSQL datum.
+ */
+static Datum
+ColumnValueInt16(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				 int32 columnTypeMod)
+{
+	return Int16GetDatum((int16) BsonIterInt32(bsonIterator));
+}
+
+static Datum
+ColumnValueInt32(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				 int32 columnTypeMod)
+{
+	return Int32GetDatum(BsonIterInt32(bsonIterator));
+}
+
+static Datum
+ColumnValueInt64(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				 int32 columnTypeMod)
+{
+	return Int64GetDatum(BsonIterInt64(bsonIterator));
+}
+
+static Datum
+ColumnValueFloat4(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				  int32 columnTypeMod)
+{
+	return Float4GetDatum((float4) BsonIterDouble(bsonIterator));
+}
+
+static Datum
+ColumnValueFloat8(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				  int32 columnTypeMod)
+{
+	return Float8GetDatum(BsonIterDouble(bsonIterator));
+}
+
+/* integers convert exactly, without printing a float8 first; overlook typmods */
+static Datum
+ColumnValueNumericFromInteger(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+							  int32 columnTypeMod)
+{
+	return DirectFunctionCall1(int8_numeric,
+							   Int64GetDatum(BsonIterInt64(bsonIterator)));
+}
+
+static Datum
+ColumnValueNumericFromDouble(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+							 int32 columnTypeMod)
+{
+	return DirectFunctionCall1(float8_numeric,
+							   Float8GetDatum(BsonIterDouble(bsonIterator)));
+}
+
+static Datum
+ColumnValueBool(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				int32 columnTypeMod)
+{
+	return BoolGetDatum(BsonIterBool(bsonIterator));
+}
+
+static Datum
+ColumnValueBoolFromNumber(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						  int32 columnTypeMod)
+{
+	return BoolGetDatum(BsonIterDouble(bsonIterator) != 0.0);
+}
+
+/*
+ * BSON strings are UTF-8, and are converted to the server encoding, which also
+ * checks that they are valid, as text input from clients is.
+ */
+static Datum
+ColumnValueBpchar(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				  int32 columnTypeMod)
+{
+	const char *value = BsonIterString(bsonIterator);
+	size_t     valueLength = 0;
+	size_t     charLength = 0;
+	size_t     maxLength = 0;
+	BpChar     *result = NULL;
+
+	value = pg_any_to_server(value, strlen(value), PG_UTF8);
+	valueLength = strlen(value);
+
+	/* without a length, the value is kept as it is */
+	if (columnTypeMod < (int32) VARHDRSZ)
+		return PointerGetDatum(cstring_to_text_with_len(value, valueLength));
+
+	/* longer values are truncated as bpcharin does, and shorter ones padded */
+	maxLength = columnTypeMod - VARHDRSZ;
+	charLength = pg_mbstrlen_with_len(value, valueLength);
+	if (charLength > maxLength)
+	{
+		size_t clippedLength = pg_mbcharcliplen(value, valueLength, maxLength);
+		size_t charIndex = 0;
+
+		/* only trailing spaces may be truncated */
+		for (charIndex = clippedLength; charIndex < valueLength; charIndex++)
+		{
+			if (value[charIndex] != ' ')
+				ereport(ERROR,
+						(errcode(ERRCODE_STRING_DATA_RIGHT_TRUNCATION),
+						 errmsg("value too long for type character(%d)",
+								(int) maxLength)));
+		}
+
+		return PointerGetDatum(cstring_to_text_with_len(value, clippedLength));
+	}
+
+	result = (BpChar *) palloc(VARHDRSZ + valueLength + (maxLength - charLength));
+	SET_VARSIZE(result, VARHDRSZ + valueLength + (maxLength - charLength));
+	memcpy(VARDATA(result), value, valueLength);
+	memset(VARDATA(result) + valueLength, ' ', maxLength - charLength);
+
+	return PointerGetDatum(result);
+}
+
+/*
+ * ColumnValueVarchar applies the length limit of the type modifier as varcharin
+ * does, but only looks at the characters when the value is longer in bytes.
+ */
+static Datum
+ColumnValueVarchar(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				   int32 columnTypeMod)
+{
+	const char *value = BsonIterString(bsonIterator);
+	size_t     valueLength = 0;
+	size_t     maxLength = 0;
+
+	value = pg_any_to_server(value, strlen(value), PG_UTF8);
+	valueLength = strlen(value);
+
+	if (columnTypeMod >= (int32) VARHDRSZ &&
+		valueLength > (maxLength = columnTypeMod - VARHDRSZ))
+	{
+		size_t clippedLength = pg_mbcharcliplen(value, valueLength, maxLength);
+		size_t charIndex = 0;
+
+		/* only trailing spaces may be truncated */
+		for (charIndex = clippedLength; charIndex < valueLength; charIndex++)
+		{
+			if (value[charIndex] != ' ')
+				ereport(ERROR,
+						(errcode(ERRCODE_STRING_DATA_RIGHT_TRUNCATION),
+						 errmsg("value too long for type character varying(%d)",
+								(int) maxLength)));
+		}
+		valueLength = clippedLength;
+	}
+
+	return PointerGetDatum(cstring_to_text_with_len(value, valueLength));
+}
+
+static Datum
+ColumnValueText(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				int32 columnTypeMod)
+{
+	const char *value = BsonIterString(bsonIterator);
+
+	return CStringGetTextDatum(pg_any_to_server(value, strlen(value), PG_UTF8));
+}
+
+/* the object identifier is written in hex right into the name */
+static Datum
+ColumnValueName(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				int32 columnTypeMod)
+{
+	Name value = (Name) palloc0(NAMEDATALEN);
+
+	bson_oid_to_string((bson_oid_t *) BsonIterOid(bsonIterator), NameStr(*value));
+
+	return NameGetDatum(value);
+}
+
+static Datum
+ColumnValueBytea(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				 int32 columnTypeMod)
+{
+	int value_len;
+	char *value;
+	bytea *result;
+
+#ifdef META_DRIVER
+	value = (char*) BsonIterBinData(bsonIterator, (uint32_t *) &value_len);
+#else
+	value_len = BsonIterBinLen(bsonIterator);
+	value = (char*) BsonIterBinData(bsonIterator);
+#endif
+	result = (bytea *) palloc(value_len + VARHDRSZ);
+	memcpy(VARDATA(result), value, value_len);
+	SET_VARSIZE(result, value_len + VARHDRSZ);
+
+	return PointerGetDatum(result);
+}
+
+#ifdef META_DRIVER
+static Datum
+ColumnValueByteaFromOid(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+						int32 columnTypeMod)
+{
+	bytea *result = (bytea *) palloc(12 + VARHDRSZ);
+
+	memcpy(VARDATA(result), BsonIterOid(bsonIterator), 12);
+	SET_VARSIZE(result, 12 + VARHDRSZ);
+
+	return PointerGetDatum(result);
+}
+#endif
+
+static Datum
+ColumnValueDate(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				int32 columnTypeMod)
+{
+	int64 valueMillis = BsonIterDate(bsonIterator);
+	int64 timestamp = (valueMillis * 1000L) - POSTGRES_TO_UNIX_EPOCH_USECS;
+
+	return DirectFunctionCall1(timestamp_date, TimestampGetDatum(timestamp));
+}
+
+/* overlook type modifiers for timestamp */
+static Datum
+ColumnValueTimestamp(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+					 int32 columnTypeMod)
+{
+	int64 valueMillis = BsonIterDate(bsonIterator);
+	int64 timestamp = (valueMillis * 1000L) - POSTGRES_TO_UNIX_EPOCH_USECS;
+
+	return TimestampGetDatum(timestamp);
+}
+
+static Datum
+ColumnValueJson(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				int32 columnTypeMod)
+{
+	StringInfo     buffer = makeStringInfo();
+	BSON_TYPE      type = BSON_ITER_TYPE(bsonIterator);
+
+#ifdef META_DRIVER
+	/* Convert BSON to JSON value */
+	BsonToJsonStringValue(buffer, bsonIterator, BSON_TYPE_ARRAY == type);
+#else
+	/* Convert BSON to JSON value */
+	BsonToJsonString(buffer, *bsonIterator, BSON_TYPE_ARRAY == type);
+#endif
+
+	return CStringGetTextDatum(pg_any_to_server(buffer->data, buffer->len,
+												PG_UTF8));
+}
+
+static Datum
+ColumnValueJsonb(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+				 int32 columnTypeMod)
+{
+#ifdef META_DRIVER
+	return BsonIterJsonb(bsonIterator);
+#else
+	StringInfo     buffer = makeStringInfo();
+	BSON_TYPE      type = BSON_ITER_TYPE(bsonIterator);
+
+	BsonToJsonString(buffer, *bsonIterator, BSON_TYPE_ARRAY == type);
+	return DirectFunctionCall1(jsonb_in,
+							   CStringGetDatum(pg_any_to_server(buffer->data,
+																buffer->len,
+																PG_UTF8)));
+#endif
+}
+
+static Datum
+ColumnValueUnsupported(BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+					   int32 columnTypeMod)
+{
+	ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+					errmsg("cannot convert BSON type to column type"),
+					errhint("Column type: %u", (uint32) columnTypeId)));
+
+	return (Datum) 0;
+}
+
+void
+BsonToJsonString(StringInfo output, BSON_ITERATOR i, bool isArray)
+{
+	const char       *key = NULL;
+	bool             isFirstElement;
+	char             beginSymbol = '{';
+	char             endSymbol = '}';
+	BSON_TYPE        t;
+
+	if (isArray)
+	{
+		beginSymbol = '[';
+		endSymbol = ']';
+	}
+
+#ifndef META_DRIVER
+	{
+		char *bsonData = bson_iterator_value(&i);
+		bson_iterator_from_buffer(&i, bsonData);
+	}
+#endif
+
+	appendStringInfoChar(output, beginSymbol);
+
+	isFirstElement = true;
+	while (BsonIterNext(&i))
+	{
+		if (!isFirstElement)
+			appendStringInfoChar(output, ',');
+
+		t = BsonIterType(&i);
+		if (t == 0)
+			break;
+
+		key = BsonIterKey(&i);
+
+		if (!isArray)
+			appendStringInfo(output, "\"%s\":", key);
+
+		switch (t)
+		{
+			case BSON_TYPE_DOUBLE:
+				appendStringInfo(output, "%f", BsonIterDouble(&i));
+				break;
+			case BSON_TYPE_UTF8:
+				appendStringInfo(output, "\"%s\"",
+						EscapeJsonString(BsonIterString(&i)));
+				break;
+			case BSON_TYPE_SYMBOL:
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+								errmsg("`symbol` BSON type is deprecated and "
+									   "unsupported"),
+								errhint("Symbol: %s", BsonIterString(&i))));
+				break;
+			case BSON_TYPE_OID:
+			{
+				char oidhex[25];
+				BsonOidToString(BsonIterOid(&i), (char**)&oidhex);
+				appendStringInfo(output, "{\"$oid\":\"%s\"}", oidhex);
+				break;
+			}
+			case BSON_TYPE_BOOL:
+				appendStringInfoString(
+						output, BsonIterBool(&i) ? "true" : "false");
+				break;
+			case BSON_TYPE_DATE_TIME:
+				appendStringInfo(output, "{\"$date\":%ld}",
+						(long int)BsonIterDate(&i));
+				break;
+			case BSON_TYPE_BINDATA:
+				/* It's possible to encode the data with base64 here. */
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+								errmsg("support for `binary data` BSON type "
+									   "is not implemented")));
+				break;
+			case BSON_TYPE_UNDEFINED:
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+								errmsg("`undefined` BSON type is deprecated "
+									   "and unsupported")));
+				break;
+			case BSON_TYPE_NULL:
+				appendStringInfoString(output, "null");
+				break;
+			case BSON_TYPE_REGEX:
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+								errmsg("support for `regex` BSON type is "
+									   "not implemented"),
+								errhint("Regex: %s", BsonIterRegex(&i))));
+				break;
+			case BSON_TYPE_CODE:
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+								errmsg("support for `code` BSON type is "
+									   "not implemented"),
+								errhint("Code: %s", BsonIterCode(&i))));
+				break;
+			case BSON_TYPE_CODEWSCOPE:
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+								errmsg("support for `code with scope` BSON "
+									   "type is not implemented")));
+				break;
+			case BSON_TYPE_INT32:
+				appendStringInfo(output, "%d", BsonIterInt32(&i));
+				break;
+			case BSON_TYPE_INT64:
+				appendStringInfo(output, "%lu", (uint64_t)BsonIterInt64(&i));
+				break;
+			case BSON_TYPE_TIMESTAMP:
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+								errmsg("internal `timestamp` BSON type is "
+									   "and unsupported")));
+				break;
+			case BSON_TYPE_DOCUMENT:
+				BsonToJsonString(output, i, false);
+				break;
+			case BSON_TYPE_ARRAY:
+				BsonToJsonString(output, i, true);
+				break;
+			default:
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+								errmsg("unsupported BSON type: %x", t)));
+		}
+		isFirstElement = false;
+	}
+	appendStringInfoChar(output, endSymbol);
+}
+
+/*
+ * EscapeJsonString escapes a string for safe inclusion in JSON.
+ */
+const char *
+EscapeJsonString(const char *string)
+{
+	StringInfo   buffer;
+	const char   *ptr;
+	int          i, segmentStartIdx, len;
+
+	bool needsEscaping = false;
+	for (ptr = string; *ptr; ++ptr) {
+		if (*ptr == '"' || *ptr == '\r' || *ptr == '\n' || *ptr == '\t'\
+				|| *ptr == '\\') {
+			needsEscaping = true;
+		}
+	}
+
+	if (!needsEscaping) return string;
+
+	buffer = makeStringInfo();
+	len = strlen(string);
+	segmentStartIdx = 0;
+	for (i = 0; i < len; ++i) {
+		if (string[i] == '"' || string[i] == '\r' || string[i] == '\n'
+				|| string[i] == '\t' || string[i] == '\\') {
+			if (segmentStartIdx < i) {
+				appendBinaryStringInfo(buffer, string + segmentStartIdx,
+						i - segmentStartIdx);
+			}
+
+			appendStringInfoChar(buffer, '\\');
+			if (string[i] == '"') appendStringInfoChar(buffer, '"');
+			else if (string[i] == '\r') appendStringInfoChar(buffer, 'r');
+			else if (string[i] == '\n') appendStringInfoChar(buffer, 'n');
+			else if (string[i] == '\t') appendStringInfoChar(buffer, 't');
+			else if (string[i] == '\\') appendStringInfoChar(buffer, '\\');
+
+			segmentStartIdx = i + 1;
+		}
+	}
+	if (segmentStartIdx < len) {
+		appendBinaryStringInfo(buffer, string + segmentStartIdx,
+				len - segmentStartIdx);
+	}
+	return buffer->data;
+}
+
+
+/*
+ * MongoScanRelationId returns the Oid of the foreign table a scan reads. The
+ * plan of a pushed down aggregation has no scan relation, and keeps the Oid in
+ * its private list.
+ */
+static Oid
+MongoScanRelationId(ForeignScanState *scanState)
+{
+	ForeignScan *foreignScan = (ForeignScan *) scanState->ss.ps.plan;
+
+	if (scanState->ss.ss_currentRelation != NULL)
+		return RelationGetRelid(scanState->ss.ss_currentRelation);
+
+	return (Oid) intVal(list_nth(foreignScan->fdw_private,
+								 MongoFdwScanPrivateRelationId));
+}
+
+
+#if PG_VERSION_NUM >= 90600 && defined(META_DRIVER)
+/*
+ * MongoGetForeignUpperPaths adds a path that computes the grouping and the
+ * aggregates of a query over a single foreign table in MongoDB, with a $group
+ * stage of an aggregation pipeline. We only do so when MongoDB filters the
+ * documents exactly as the quals would, and when every grouping target is a
+ * GROUP BY column or an aggregate we know how to compute remotely.
+ */
+static void
+MongoGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
+						  RelOptInfo *inputRel, RelOptInfo *outputRel)
+{
+	MongoFdwRelationInfo *inputInfo = (MongoFdwRelationInfo *) inputRel->fdw_private;
+	MongoFdwRelationInfo *groupedInfo = NULL;
+	Query                *parse = root->parse;
+	PathTarget           *groupingTarget = NULL;
+	List                 *groupExpressionList = NIL;
+	List                 *groupedTargetList = NIL;
+	List                 *aggregateList = NIL;
+	ListCell             *targetCell = NULL;
+	double               groupCount = 0.0;
+	Cost                 startupCost = 0.0;
+	Cost                 totalCost = 0.0;
+	ForeignPath          *aggregatePath = NULL;
+
+	if (stage != UPPERREL_GROUP_AGG || outputRel->fdw_private != NULL)
+		return;
+
+	if (inputRel->reloptkind != RELOPT_BASEREL || inputInfo == NULL ||
+		!inputInfo->remoteQualsExact)
+	{
+		return;
+	}
+
+	/* we don't compute grouping sets or HAVING quals remotely */
+	if (parse->groupingSets != NIL || parse->havingQual != NULL)
+		return;
+
+	groupingTarget = root->upper_targets[UPPERREL_GROUP_AGG];
+	groupExpressionList = get_sortgrouplist_exprs(parse->groupClause,
+												  parse->targetList);
+
+	/* the aggregation returns the grouping target and all GROUP BY columns */
+	groupedTargetList = add_to_flat_tlist(NIL, groupingTarget->exprs);
+	groupedTargetList = add_to_flat_tlist(groupedTargetList, groupExpressionList);
+	apply_pathtarget_labeling_to_tlist(groupedTargetList, groupingTarget);
+
+	foreach(targetCell, groupedTargetList)
+	{
+		TargetEntry *targetEntry = (TargetEntry *) lfirst(targetCell);
+		List        *aggregateEntry = NIL;
+
+		aggregateEntry = MongoAggregateEntry(targetEntry->expr, inputRel,
+											 inputInfo->foreignTableId,
+											 groupExpressionList);
+		if (aggregateEntry == NIL)
+			return;
+
+		aggregateList = lappend(aggregateList, aggregateEntry);
+	}
+
+	groupedInfo = (MongoFdwRelationInfo *) palloc0(sizeof(MongoFdwRelationInfo));
+	groupedInfo->foreignTableId = inputInfo->foreignTableId;
+	groupedInfo->checkAsUser = planner_rt_fetch(inputRel->relid, root)->checkAsUser;
+	groupedInfo->opExpressionList = inputInfo->opExpressionList;
+	groupedInfo->remoteQualsExact = true;
+	groupedInfo->groupedTargetList = groupedTargetList;
+	groupedInfo->aggregateList = aggregateList;
+	outputRel->fdw_private = (void *) groupedInfo;
+
+	if (groupExpressionList == NIL)
+		groupCount = 1.0;
+	else
+		groupCount = estimate_num_groups(root, groupExpressionList,
+										 inputRel->rows, NULL);
+
+	/*
+	 * MongoDB reads all matching documents before it returns the first group,
+	 * but we only transfer and convert the groups.
+	 */
+	startupCost = MONGO_CONNECTION_COST_MULTIPLIER * seq_page_cost +
+		(cpu_operator_cost * list_length(aggregateList) * inputRel->rows);
+	totalCost = startupCost +
+		(cpu_tuple_cost * MONGO_TUPLE_COST_MULTIPLIER * groupCount);
+
+	aggregatePath = create_foreignscan_path(root, outputRel, groupingTarget,
+											groupCount, startupCost, totalCost,
+											NIL,   /* no pathkeys */
+											NULL,  /* no outer rel either */
+											NULL,  /* no extra plan */
+											NIL);  /* no fdw_private data */
+
+	add_path(outputRel, (Path *) aggregatePath);
+}
+
+
+/*
+ * MongoAggregateEntry returns the aggregate list entry that computes the given
+ * grouping target expression, or NIL if we can't compute it remotely.
+ */
+static List *
+MongoAggregateEntry(Expr *expression, RelOptInfo *inputRel, Oid foreignTableId,
+					List *groupExpressionList)
+{
+	MongoAggregateKind kind = MONGO_AGGREGATE_GROUP;
+	Aggref             *aggregate = NULL;
+	Expr               *argument = NULL;
+	char               *functionName = NULL;
+	char               *columnName = NULL;
+	Oid                typeId = InvalidOid;
+
+	if (IsA(expression, Var))
+	{
+		if (!list_member(groupExpressionList, expression))
+			return NIL;
+
+		columnName = MongoAggregateColumnName(expression, inputRel,
+											  foreignTableId);
+		typeId = ((Var *) expression)->vartype;
+		if (columnName == NULL ||
+			!MongoAggregateTypeSupported(MONGO_AGGREGATE_GROUP, typeId))
+		{
+			return NIL;
+		}
+
+		return list_make3(makeInteger(MONGO_AGGREGATE_GROUP),
+						  makeString(columnName), makeInteger(typeId));
+	}
+
+	if (!IsA(expression, Aggref))
+		return NIL;
+
+	aggregate = (Aggref *) expression;
+	if (aggregate->aggdistinct != NIL || aggregate->aggorder != NIL ||
+		aggregate->aggfilter != NULL || aggregate->aggkind != AGGKIND_NORMAL ||
+		aggregate->agglevelsup != 0 || aggregate->aggvariadic)
+	{
+		return NIL;
+	}
+
+	if (get_func_namespace(aggregate->aggfnoid) != PG_CATALOG_NAMESPACE)
+		return NIL;
+
+	functionName = get_func_name(aggregate->aggfnoid);
+	if (aggregate->aggstar)
+	{
+		if (strcmp(functionName, "count") != 0)
+			return NIL;
+
+		return list_make3(makeInteger(MONGO_AGGREGATE_COUNT_STAR),
+						  makeString(""), makeInteger(InvalidOid));
+	}
+
+	if (strcmp(functionName, "count") == 0)
+		kind = MONGO_AGGREGATE_COUNT;
+	else if (strcmp(functionName, "sum") == 0)
+		kind = MONGO_AGGREGATE_SUM;
+	else if (strcmp(functionName, "avg") == 0)
+		kind = MONGO_AGGREGATE_AVG;
+	else if (strcmp(functionName, "min") == 0)
+		kind = MONGO_AGGREGATE_MIN;
+	else if (strcmp(functionName, "max") == 0)
+		kind = MONGO_AGGREGATE_MAX;
+	else
+		return NIL;
+
+	if (list_length(aggregate->args) != 1)
+		return NIL;
+
+	argument = ((TargetEntry *) linitial(aggregate->args))->expr;
+	columnName = MongoAggregateColumnName(argument, inputRel, foreignTableId);
+	if (columnName == NULL)
+		return NIL;
+
+	typeId = ((Var *) argument)->vartype;
+	if (!MongoAggregateTypeSupported(kind, typeId))
+		return NIL;
+
+	return list_make3(makeInteger(kind), makeString(columnName),
+					  makeInteger(typeId));
+}
+
+
+/*
+ * MongoAggregateColumnName returns the name of the column if the given
+ * expression is a plain column of the foreign table, and NULL otherwise.
+ */
+static char *
+MongoAggregateColumnName(Expr *expression, RelOptInfo *inputRel,
+						 Oid foreignTableId)
+{
+	Var  *column = (Var *) expression;
+	char *columnName = NULL;
+
+	if (!IsA(expression, Var) || column->varno != inputRel->relid ||
+		column->varlevelsup != 0 || column->varattno <= 0)
+	{
+		return NULL;
+	}
+
+	/* the __doc column holds the whole document */
+	columnName = get_relid_attribute_name(foreignTableId, column->varattno);
+	if (strcmp(columnName, "__doc") == 0)
+		return NULL;
+
+	return columnName;
+}
+
+
+/*
+ * MongoAggregateTypeSupported tells whether the given entry of an aggregation
+ * over a column of the given type gives the same result in MongoDB as in
+ * PostgreSQL. We leave out types that PostgreSQL reads from several BSON types,
+ * like booleans, and types whose conversion merges distinct BSON values, like
+ * dates. Sums and averages are left to PostgreSQL for numeric columns, as
+ * MongoDB adds them up in double precision.
+ *
+ * Integer and float4 columns also merge distinct numbers, as PostgreSQL
+ * truncates or rounds the doubles it reads into them: MongoDB would put 5 and
+ * 5.7 into two groups where PostgreSQL has one, and add up the fractions. So
+ * only counts, minimums and maximums, which the conversion doesn't reorder,
+ * are computed over them. MongoDB would also sum int64 values that overflow
+ * in double precision, where sum(int8) is exact.
+ */
+static bool
+MongoAggregateTypeSupported(MongoAggregateKind kind, Oid typeId)
+{
+	switch (typeId)
+	{
+		case INT2OID: case INT4OID:
+		case INT8OID: case FLOAT4OID:
+			return (kind != MONGO_AGGREGATE_GROUP &&
+					kind != MONGO_AGGREGATE_SUM && kind != MONGO_AGGREGATE_AVG);
+		case FLOAT8OID:
+			return true;
+		case NUMERICOID:
+			return (kind != MONGO_AGGREGATE_SUM && kind != MONGO_AGGREGATE_AVG);
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return (kind != MONGO_AGGREGATE_SUM && kind != MONGO_AGGREGATE_AVG);
+		case TEXTOID:
+		case VARCHAROID:
+			return (kind == MONGO_AGGREGATE_GROUP || kind == MONGO_AGGREGATE_COUNT);
+		default:
+			return false;
+	}
+}
+
+
+/*
+ * MongoGetForeignAggregatePlan creates the foreign scan plan node of a pushed
+ * down aggregation. The node has no scan relation; it returns the entries of
+ * the grouped target list.
+ */
+static ForeignScan *
+MongoGetForeignAggregatePlan(RelOptInfo *groupedRel, List *targetList)
+{
+	MongoFdwRelationInfo *groupedInfo = (MongoFdwRelationInfo *) groupedRel->fdw_private;
+	List                 *foreignPrivateList = NIL;
+
+	foreignPrivateList = list_make3(NIL, groupedInfo->opExpressionList,
+									makeInteger(false));
+	foreignPrivateList = lappend(foreignPrivateList, NIL);
+	foreignPrivateList = lappend(foreignPrivateList, makeInteger(0));
+	foreignPrivateList = lappend(foreignPrivateList, NIL);
+	foreignPrivateList = lappend(foreignPrivateList,
+								 makeInteger(groupedInfo->foreignTableId));
+	foreignPrivateList = lappend(foreignPrivateList,
+								 makeInteger(groupedInfo->checkAsUser));
+	foreignPrivateList = lappend(foreignPrivateList, groupedInfo->aggregateList);
+
+	/* all quals are computed remotely */
+	return make_foreignscan(targetList, NIL, 0, NIL, foreignPrivateList,
+							groupedInfo->groupedTargetList, NIL, NULL);
+}
+
+
+/*
+ * MongoIterateAggregateScan reads the next group computed by MongoDB. Without
+ * GROUP BY columns, PostgreSQL returns a row even if no documents match, while
+ * $group returns none; so we make up that row ourselves.
+ */
+static TupleTableSlot *
+MongoIterateAggregateScan(ForeignScanState *scanState)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+	TupleTableSlot      *tupleSlot = scanState->ss.ss_ScanTupleSlot;
+	TupleDesc           tupleDescriptor = tupleSlot->tts_tupleDescriptor;
+	MemoryContext       oldContext = NULL;
+	bson_error_t        error;
+
+	ExecClearTuple(tupleSlot);
+
+	/* open the cursor on first fetch */
+	if (fmstate->mongoCursor == NULL)
+		MongoScanCursorCreate(fmstate);
+
+	if (MongoScanCursorNext(fmstate))
+	{
+		oldContext = MemoryContextSwitchTo(fmstate->temp_cxt);
+		FillAggregateSlot(MongoCursorBson(fmstate->mongoCursor),
+						  fmstate->aggregateList, tupleDescriptor,
+						  tupleSlot->tts_values, tupleSlot->tts_isnull);
+		MemoryContextSwitchTo(oldContext);
+		ExecStoreVirtualTuple(tupleSlot);
+	}
+	else if (mongoc_cursor_error(fmstate->mongoCursor, &error))
+	{
+		ereport(ERROR, (errmsg("could not run aggregation on mongo collection"),
+				errhint("Mongo driver error: %s", error.message)));
+	}
+	else if (!fmstate->aggregateGrouped && !fmstate->aggregateReturned)
+	{
+		oldContext = MemoryContextSwitchTo(fmstate->temp_cxt);
+		FillAggregateSlot(NULL, fmstate->aggregateList, tupleDescriptor,
+						  tupleSlot->tts_values, tupleSlot->tts_isnull);
+		MemoryContextSwitchTo(oldContext);
+		ExecStoreVirtualTuple(tupleSlot);
+	}
+
+	if (!TupIsNull(tupleSlot))
+		fmstate->aggregateReturned = true;
+
+	return tupleSlot;
+}
+
+
+/*
+ * FillAggregateSlot converts a group returned by the pipeline built with
+ * AggregatePipeline into the values of the scan tuple, or fills in the values
+ * of an aggregation over no documents if the group is NULL.
+ */
+static void
+FillAggregateSlot(const BSON *bsonDocument, List *aggregateList,
+				  TupleDesc tupleDescriptor, Datum *columnValues, bool *columnNulls)
+{
+	int           entryCount = list_length(aggregateList);
+	BSON_ITERATOR *valueIterators = palloc0(entryCount * sizeof(BSON_ITERATOR));
+	bool          *valueFound = palloc0(entryCount * sizeof(bool));
+	int64         *inputCounts = palloc0(entryCount * sizeof(int64));
+	BSON_ITERATOR documentIterator;
+	BSON_ITERATOR keyIterator;
+	BSON_ITERATOR *fieldIterator = &documentIterator;
+	bool          inKey = false;
+	ListCell      *aggregateCell = NULL;
+	int           entryIndex = 0;
+
+	/* find the fields of the entries, group keys being in _id */
+	if (bsonDocument != NULL)
+		BsonIterInit(&documentIterator, (BSON *) bsonDocument);
+
+	while (bsonDocument != NULL)
+	{
+		const char *fieldName = NULL;
+		int        fieldIndex = 0;
 
-	appendStringInfoChar(output, beginSymbol);
+		if (!BsonIterNext(fieldIterator))
+		{
+			if (!inKey)
+				break;
 
-	isFirstElement = true;
-	while (BsonIterNext(&i))
-	{
-		if (!isFirstElement)
-			appendStringInfoChar(output, ',');
+			fieldIterator = &documentIterator;
+			inKey = false;
+			continue;
+		}
 
-		t = BsonIterType(&i);
-		if (t == 0)
-			break;
+		fieldName = BsonIterKey(fieldIterator);
+		if (!inKey && strcmp(fieldName, "_id") == 0)
+		{
+			if (BsonIterType(fieldIterator) == BSON_TYPE_DOCUMENT)
+			{
+				BsonIterSubIter(fieldIterator, &keyIterator);
+				fieldIterator = &keyIterator;
+				inKey = true;
+			}
+			continue;
+		}
 
-		key = BsonIterKey(&i);
+		if ((fieldName[0] != 'f' && fieldName[0] != 'n') ||
+			fieldName[1] < '0' || fieldName[1] > '9')
+		{
+			continue;
+		}
 
-		if (!isArray)
-			appendStringInfo(output, "\"%s\":", key);
+		fieldIndex = atoi(fieldName + 1);
+		if (fieldIndex >= entryCount)
+			continue;
 
-		switch (t)
+		if (fieldName[0] == 'n')
 		{
-			case BSON_TYPE_DOUBLE:
-				appendStringInfo(output, "%f", BsonIterDouble(&i));
-				break;
-			case BSON_TYPE_UTF8:
-				appendStringInfo(output, "\"%s\"",
-						EscapeJsonString(BsonIterString(&i)));
-				break;
-			case BSON_TYPE_SYMBOL:
-				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-								errmsg("`symbol` BSON type is deprecated and "
-									   "unsupported"),
-								errhint("Symbol: %s", BsonIterString(&i))));
-				break;
-			case BSON_TYPE_OID:
+			inputCounts[fieldIndex] = BsonIterInt64(fieldIterator);
+		}
+		else
+		{
+			valueIterators[fieldIndex] = *fieldIterator;
+			valueFound[fieldIndex] = true;
+		}
+	}
+
+	foreach(aggregateCell, aggregateList)
+	{
+		List               *aggregateEntry = (List *) lfirst(aggregateCell);
+		MongoAggregateKind kind = intVal(linitial(aggregateEntry));
+		Oid                resultTypeId = tupleDescriptor->attrs[entryIndex]->atttypid;
+		int32              resultTypeMod = tupleDescriptor->attrs[entryIndex]->atttypmod;
+		BSON_ITERATOR      *valueIterator = &valueIterators[entryIndex];
+		BSON_TYPE          bsonType = BSON_TYPE_NULL;
+
+		columnValues[entryIndex] = (Datum) 0;
+		columnNulls[entryIndex] = true;
+
+		if (valueFound[entryIndex])
+			bsonType = BsonIterType(valueIterator);
+
+		switch (kind)
+		{
+			case MONGO_AGGREGATE_COUNT_STAR:
+			case MONGO_AGGREGATE_COUNT:
 			{
-				char oidhex[25];
-				BsonOidToString(BsonIterOid(&i), (char**)&oidhex);
-				appendStringInfo(output, "{\"$oid\":\"%s\"}", oidhex);
+				int64 count = 0;
+
+				if (valueFound[entryIndex])
+					count = BsonIterInt64(valueIterator);
+
+				columnValues[entryIndex] = Int64GetDatum(count);
+				columnNulls[entryIndex] = false;
 				break;
 			}
-			case BSON_TYPE_BOOL:
-				appendStringInfoString(
-						output, BsonIterBool(&i) ? "true" : "false");
-				break;
-			case BSON_TYPE_DATE_TIME:
-				appendStringInfo(output, "{\"$date\":%ld}",
-						(long int)BsonIterDate(&i));
-				break;
-			case BSON_TYPE_BINDATA:
-				/* It's possible to encode the data with base64 here. */
-				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-								errmsg("support for `binary data` BSON type "
-									   "is not implemented")));
-				break;
-			case BSON_TYPE_UNDEFINED:
-				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-								errmsg("`undefined` BSON type is deprecated "
-									   "and unsupported")));
-				break;
-			case BSON_TYPE_NULL:
-				appendStringInfoString(output, "null");
-				break;
-			case BSON_TYPE_REGEX:
-				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-								errmsg("support for `regex` BSON type is "
-									   "not implemented"),
-								errhint("Regex: %s", BsonIterRegex(&i))));
-				break;
-			case BSON_TYPE_CODE:
-				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-								errmsg("support for `code` BSON type is "
-									   "not implemented"),
-								errhint("Code: %s", BsonIterCode(&i))));
-				break;
-			case BSON_TYPE_CODEWSCOPE:
-				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-								errmsg("support for `code with scope` BSON "
-									   "type is not implemented")));
-				break;
-			case BSON_TYPE_INT32:
-				appendStringInfo(output, "%d", BsonIterInt32(&i));
-				break;
-			case BSON_TYPE_INT64:
-				appendStringInfo(output, "%lu", (uint64_t)BsonIterInt64(&i));
-				break;
-			case BSON_TYPE_TIMESTAMP:
-				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-								errmsg("internal `timestamp` BSON type is "
-									   "and unsupported")));
-				break;
-			case BSON_TYPE_DOCUMENT:
-				BsonToJsonString(output, i, false);
-				break;
-			case BSON_TYPE_ARRAY:
-				BsonToJsonString(output, i, true);
+			case MONGO_AGGREGATE_SUM:
+			case MONGO_AGGREGATE_AVG:
+			{
+				int64 count = inputCounts[entryIndex];
+
+				/* only float8 columns are summed remotely */
+				if (count == 0 || !ColumnTypesCompatible(bsonType, FLOAT8OID))
+					break;
+
+				if (kind == MONGO_AGGREGATE_AVG)
+				{
+					columnValues[entryIndex] =
+						Float8GetDatum(BsonIterDouble(valueIterator) / count);
+				}
+				else
+				{
+					columnValues[entryIndex] = ColumnValue(valueIterator,
+														   resultTypeId,
+														   resultTypeMod);
+				}
+				columnNulls[entryIndex] = false;
 				break;
+			}
 			default:
-				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-								errmsg("unsupported BSON type: %x", t)));
+			{
+				/* GROUP BY columns, minimums and maximums */
+				if (!valueFound[entryIndex] || bsonType == BSON_TYPE_NULL ||
+					!ColumnTypesCompatible(bsonType, resultTypeId))
+				{
+					break;
+				}
+
+				columnValues[entryIndex] = ColumnValue(valueIterator,
+													   resultTypeId,
+													   resultTypeMod);
+				columnNulls[entryIndex] = false;
+				break;
+			}
 		}
-		isFirstElement = false;
+		entryIndex++;
+	}
+
+	pfree(valueIterators);
+	pfree(valueFound);
+	pfree(inputCounts);
+}
+
+
+/*
+ * MongoParallelWorkers decides how many workers to plan a parallel scan of a
+ * collection with the given number of documents with. As for heap tables, the
+ * collection gets one worker once it reaches a threshold size, and one more
+ * each time it triples in size.
+ */
+static int
+MongoParallelWorkers(double documentCount)
+{
+	double threshold = MONGO_PARALLEL_DOCUMENT_THRESHOLD;
+	int    parallelWorkers = 0;
+
+	while (documentCount >= threshold &&
+		   parallelWorkers < max_parallel_workers_per_gather)
+	{
+		parallelWorkers++;
+		threshold *= 3;
+	}
+
+	return parallelWorkers;
+}
+
+
+/*
+ * MongoIsForeignScanParallelSafe tells the planner whether the foreign table
+ * can be scanned in parallel workers, each of which opens its own connection.
+ * Scans with the prefetch or async options keep a connection of their own busy
+ * with an exhaust cursor or a fetch in the background, which we don't set up
+ * in workers; tables read from a mongodump file use neither. Conditions with
+ * the values of subplans depend on what the leader evaluated.
+ */
+static bool
+MongoIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel,
+							   RangeTblEntry *rte)
+{
+	MongoFdwRelationInfo *fpinfo = MongoRelationInfo(rel, rte->relid);
+	ListCell             *restrictInfoCell = NULL;
+
+	if (fpinfo->options->filename == NULL &&
+		(fpinfo->options->prefetch || fpinfo->options->async))
+		return false;
+
+	foreach(restrictInfoCell, rel->baserestrictinfo)
+	{
+		RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(restrictInfoCell);
+
+		if (MongoContainsExecParam((Node *) restrictInfo->clause, NULL))
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * MongoContainsExecParam tells whether the given expression uses a parameter
+ * set by the executor, such as the value of a subplan.
+ */
+static bool
+MongoContainsExecParam(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Param) && ((Param *) node)->paramkind == PARAM_EXEC)
+		return true;
+
+	return expression_tree_walker(node, MongoContainsExecParam, context);
+}
+
+
+/*
+ * MongoEstimateDSMForeignScan finds, in the leader of a parallel scan, the _id
+ * values that split the collection into ranges for its processes to scan, and
+ * returns the size of the shared state that holds them. If no split points can
+ * be found, the whole collection is a single range. A mongodump file is split
+ * at the offsets of documents instead.
+ */
+static Size
+MongoEstimateDSMForeignScan(ForeignScanState *scanState, ParallelContext *pcxt)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+	MongoFdwOptions     *options = NULL;
+	Size                 splitPointsLength = 0;
+
+	/* PostgreSQL 9.6 also calls us for scans that aren't parallel aware */
+	if (fmstate == NULL || !scanState->ss.ps.plan->parallel_aware)
+		return 0;
+
+	options = fmstate->options;
+	if (fmstate->splitPoints == NULL)
+	{
+		int rangeCount = (pcxt->nworkers + 1) * MONGO_PARALLEL_RANGES_PER_PROCESS;
+
+		if (fmstate->file != NULL)
+			fmstate->splitPoints = MongoFileSplitPoints(fmstate->file, rangeCount,
+														&fmstate->splitPointCount);
+		else
+			fmstate->splitPoints = MongoSplitPoints(fmstate->mongoConnection,
+													options->svr_database,
+													options->collectionName,
+													rangeCount,
+													&fmstate->splitPointCount);
+		mongo_track_document(fmstate->splitPoints, fmstate->xactLevel);
+	}
+
+	if (fmstate->splitPoints != NULL)
+		splitPointsLength = fmstate->splitPoints->len;
+
+	return offsetof(MongoParallelScanState, splitPoints) + splitPointsLength;
+}
+
+
+/*
+ * MongoInitializeDSMForeignScan sets up the shared state of a parallel scan in
+ * the leader.
+ */
+static void
+MongoInitializeDSMForeignScan(ForeignScanState *scanState, ParallelContext *pcxt,
+							  void *coordinate)
+{
+	MongoFdwModifyState    *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+	MongoParallelScanState *parallelState = (MongoParallelScanState *) coordinate;
+
+	if (fmstate == NULL || !scanState->ss.ps.plan->parallel_aware)
+		return;
+
+	pg_atomic_init_u32(&parallelState->nextRange, 0);
+	parallelState->rangeCount = 1;
+	parallelState->splitPointCount = 0;
+	parallelState->splitPointsLength = 0;
+
+	/* _id values of other types than the split points' get a range of their own */
+	if (fmstate->splitPoints != NULL)
+	{
+		parallelState->rangeCount = fmstate->splitPointCount +
+									(fmstate->file != NULL ? 1 : 2);
+		parallelState->splitPointCount = fmstate->splitPointCount;
+		parallelState->splitPointsLength = fmstate->splitPoints->len;
+		memcpy(parallelState->splitPoints, bson_get_data(fmstate->splitPoints),
+			   fmstate->splitPoints->len);
+	}
+
+	fmstate->parallelState = parallelState;
+}
+
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * MongoReInitializeDSMForeignScan makes all ranges of a parallel scan
+ * available again before it is rescanned.
+ */
+static void
+MongoReInitializeDSMForeignScan(ForeignScanState *scanState, ParallelContext *pcxt,
+								void *coordinate)
+{
+	MongoParallelScanState *parallelState = (MongoParallelScanState *) coordinate;
+
+	if (scanState->fdw_state == NULL || !scanState->ss.ps.plan->parallel_aware)
+		return;
+
+	pg_atomic_write_u32(&parallelState->nextRange, 0);
+}
+#endif
+
+
+/*
+ * MongoInitializeWorkerForeignScan attaches a parallel worker to the shared
+ * state of the scan.
+ */
+static void
+MongoInitializeWorkerForeignScan(ForeignScanState *scanState, shm_toc *toc,
+								 void *coordinate)
+{
+	MongoFdwModifyState *fmstate = (MongoFdwModifyState *) scanState->fdw_state;
+
+	if (fmstate == NULL || !scanState->ss.ps.plan->parallel_aware)
+		return;
+
+	fmstate->parallelState = (MongoParallelScanState *) coordinate;
+}
+#endif
+
+
+/*
+ * MongoFreeScanState closes the cursor and connection to MongoDB, and reclaims
+ * all Mongo related resources allocated for the foreign scan.
+ */
+static void
+MongoFreeScanState(MongoFdwModifyState *fmstate)
+{
+	if (fmstate == NULL)
+		return;
+
+	if (fmstate->queryDocument)
+	{
+		mongo_destroy_document(fmstate->queryDocument);
+		fmstate->queryDocument = NULL;
+	}
+
+	if (fmstate->fieldsDocument)
+	{
+		mongo_destroy_document(fmstate->fieldsDocument);
+		fmstate->fieldsDocument = NULL;
+	}
+
+#ifdef META_DRIVER
+	if (fmstate->updateDocument)
+	{
+		mongo_destroy_document(fmstate->updateDocument);
+		fmstate->updateDocument = NULL;
+	}
+#endif
+
+	if (fmstate->splitPoints)
+	{
+		mongo_destroy_document(fmstate->splitPoints);
+		fmstate->splitPoints = NULL;
+	}
+
+	if (fmstate->modifyDocument)
+	{
+		mongo_destroy_document(fmstate->modifyDocument);
+		fmstate->modifyDocument = NULL;
+	}
+
+	if (fmstate->selectorDocument)
+	{
+		mongo_destroy_document(fmstate->selectorDocument);
+		fmstate->selectorDocument = NULL;
+	}
+
+	MongoScanCursorDestroy(fmstate);
+
+#ifdef META_DRIVER
+	if (fmstate->lookupCache != NULL)
+		MongoLookupCacheDestroy(fmstate);
+
+	if (fmstate->matcher != NULL)
+	{
+		MongoMatcherDestroy(fmstate->matcher);
+		fmstate->matcher = NULL;
 	}
-	appendStringInfoChar(output, endSymbol);
+
+	if (fmstate->file != NULL)
+	{
+		MongoFileClose(fmstate->file);
+		fmstate->file = NULL;
+	}
+#endif
+
+	/* Release remote connection */
+#ifdef META_DRIVER
+	if (fmstate->privateConnection)
+		mongo_release_private_connection(fmstate->mongoConnection);
+	else
+#endif
+		mongo_release_connection(fmstate->mongoConnection);
 }
 
+
 /*
- * EscapeJsonString escapes a string for safe inclusion in JSON.
+ * MongoScanCursorCreate opens the cursor for the scan's query document. With
+ * the prefetch option the cursor is opened in exhaust mode, so the server
+ * streams the following batches without waiting for a getMore request from us,
+ * and the next batch arrives while we are still converting the current one.
+ * An exhaust cursor ties up the client until it is drained, so we only use it
+ * on the private connection the scan got for it. The function returns false
+ * if a parallel scan has no ranges left to scan.
  */
-const char *
-EscapeJsonString(const char *string)
+static bool
+MongoScanCursorCreate(MongoFdwModifyState *fmstate)
 {
-	StringInfo   buffer;
-	const char   *ptr;
-	int          i, segmentStartIdx, len;
+	MongoFdwOptions *options = fmstate->options;
+	BSON            *queryDocument = fmstate->queryDocument;
+	BSON            *rangeDocument = NULL;
+	int              batchSize = 0;
+	bool             exhaust = false;
 
-	bool needsEscaping = false;
-	for (ptr = string; *ptr; ++ptr) {
-		if (*ptr == '"' || *ptr == '\r' || *ptr == '\n' || *ptr == '\t'\
-				|| *ptr == '\\') {
-			needsEscaping = true;
-		}
-	}
+#ifdef META_DRIVER
+	batchSize = options->batch_size;
 
-	if (!needsEscaping) return string;
+	/* the query document of an aggregation is its pipeline */
+	if (fmstate->aggregateList != NIL)
+	{
+		fmstate->mongoCursor = MongoAggregateCursorCreate(fmstate->mongoConnection,
+														  options->svr_database,
+														  options->collectionName,
+														  fmstate->queryDocument,
+														  batchSize);
+		return true;
+	}
 
-	buffer = makeStringInfo();
-	len = strlen(string);
-	segmentStartIdx = 0;
-	for (i = 0; i < len; ++i) {
-		if (string[i] == '"' || string[i] == '\r' || string[i] == '\n'
-				|| string[i] == '\t' || string[i] == '\\') {
-			if (segmentStartIdx < i) {
-				appendBinaryStringInfo(buffer, string + segmentStartIdx,
-						i - segmentStartIdx);
-			}
+#if PG_VERSION_NUM >= 90600
+	/* a parallel scan claims the next _id range to scan, if any are left */
+	if (fmstate->parallelState != NULL)
+	{
+		MongoParallelScanState *parallelState = fmstate->parallelState;
+		uint32                  rangeIndex = 0;
 
-			appendStringInfoChar(buffer, '\\');
-			if (string[i] == '"') appendStringInfoChar(buffer, '"');
-			else if (string[i] == '\r') appendStringInfoChar(buffer, 'r');
-			else if (string[i] == '\n') appendStringInfoChar(buffer, 'n');
-			else if (string[i] == '\t') appendStringInfoChar(buffer, 't');
-			else if (string[i] == '\\') appendStringInfoChar(buffer, '\\');
+		rangeIndex = pg_atomic_fetch_add_u32(&parallelState->nextRange, 1);
+		if (rangeIndex >= parallelState->rangeCount)
+			return false;
 
-			segmentStartIdx = i + 1;
+		if (parallelState->splitPointCount > 0)
+		{
+			BSON splitPoints;
+
+			bson_init_static(&splitPoints,
+							 (const uint8_t *) parallelState->splitPoints,
+							 parallelState->splitPointsLength);
+			rangeDocument = RangeQueryDocument(fmstate->queryDocument,
+											   &splitPoints,
+											   parallelState->splitPointCount,
+											   (int) rangeIndex);
+			queryDocument = rangeDocument;
 		}
 	}
-	if (segmentStartIdx < len) {
-		appendBinaryStringInfo(buffer, string + segmentStartIdx,
-				len - segmentStartIdx);
-	}
-	return buffer->data;
+#endif
+
+	exhaust = options->prefetch && fmstate->privateConnection &&
+			  !fmstate->rescanned;
+#endif
+
+	fmstate->mongoCursor = MongoCursorCreate(fmstate->mongoConnection,
+											 options->svr_database,
+											 options->collectionName,
+											 queryDocument,
+											 fmstate->fieldsDocument,
+											 fmstate->limit,
+											 batchSize, &exhaust);
+	fmstate->exhaust = exhaust;
+	fmstate->stats.documentEnd = NULL;
+
+	/* the cursor keeps its own copy of the query */
+	if (rangeDocument != NULL)
+		BsonDestroy(rangeDocument);
+
+	return true;
 }
 
 
 /*
- * MongoFreeScanState closes the cursor and connection to MongoDB, and reclaims
- * all Mongo related resources allocated for the foreign scan.
+ * MongoScanCursorDestroy closes the scan's cursor, if one is open.
  */
 static void
-MongoFreeScanState(MongoFdwModifyState *fmstate)
+MongoScanCursorDestroy(MongoFdwModifyState *fmstate)
 {
-	if (fmstate == NULL)
+	if (fmstate->mongoCursor == NULL)
 		return;
 
-	if (fmstate->queryDocument)
-	{
-		BsonDestroy(fmstate->queryDocument);
-		fmstate->queryDocument = NULL;
-	}
+#ifdef META_DRIVER
+	/* a fetch in the background must be over before the cursor goes away */
+	if (fmstate->prefetch != NULL)
+		(void) MongoScanCursorFinishPrefetch(fmstate);
+#endif
 
-	if (fmstate->mongoCursor)
-	{
-		MongoCursorDestroy(fmstate->mongoCursor);
-		fmstate->mongoCursor = NULL;
-	}
+	MongoCursorDestroy(fmstate->mongoCursor);
+	fmstate->mongoCursor = NULL;
+	fmstate->exhaust = false;
+}
 
-	/* Release remote connection */
-	mongo_release_connection(fmstate->mongoConnection);
+
+/*
+ * MongoScanCursorNext moves the scan's cursor to its next document, and returns
+ * false when there are no more. The first document of an async scan may have
+ * been fetched in the background already. The document is counted in the
+ * scan's statistics, and the wait for it timed if they are.
+ */
+static bool
+MongoScanCursorNext(MongoFdwModifyState *fmstate)
+{
+	MongoScanStats *stats = &fmstate->stats;
+	instr_time      startTime;
+	bool            found = false;
+
+	if (stats->timing)
+		INSTR_TIME_SET_CURRENT(startTime);
+
+#ifdef META_DRIVER
+	if (fmstate->prefetch != NULL)
+		found = MongoScanCursorFinishPrefetch(fmstate);
+	else
+#endif
+		found = MongoCursorNext(fmstate->mongoCursor, NULL);
+
+	if (stats->timing)
+		MongoScanStatsAddTime(&stats->fetchTime, startTime);
+
+	if (found)
+		MongoScanStatsCount(stats, MongoCursorBson(fmstate->mongoCursor));
+
+	return found;
+}
+
+
+/*
+ * MongoScanStatsCount counts the given document, just fetched, in the scan's
+ * statistics. The drivers don't tell when the cursor reads another reply, so
+ * a document that doesn't follow the last one in the reply buffer is counted
+ * as the start of a new batch.
+ */
+static void
+MongoScanStatsCount(MongoScanStats *stats, const BSON *document)
+{
+	const char *documentData = BsonData(document);
+	int         documentSize = BsonSize(document);
+
+	if (stats->documentEnd == NULL || documentData < stats->documentEnd ||
+		documentData > stats->documentEnd + MONGO_BATCH_DOCUMENT_GAP)
+		stats->batchCount++;
+
+	stats->documentCount++;
+	stats->byteCount += documentSize;
+	stats->documentEnd = documentData + documentSize;
+}
+
+
+/*
+ * MongoScanStatsAddTime adds the time since the given start to the total.
+ */
+static void
+MongoScanStatsAddTime(instr_time *totalTime, instr_time startTime)
+{
+	instr_time endTime;
+
+	INSTR_TIME_SET_CURRENT(endTime);
+	INSTR_TIME_ACCUM_DIFF(*totalTime, endTime, startTime);
+}
+
+
+#ifdef META_DRIVER
+/*
+ * MongoScanCursorFinishPrefetch waits for the first fetch of an async scan,
+ * which leaves its document, if any, as the current one of the cursor.
+ */
+static bool
+MongoScanCursorFinishPrefetch(MongoFdwModifyState *fmstate)
+{
+	bool found = MongoCursorPrefetchFinish(fmstate->prefetch);
+
+	fmstate->prefetch = NULL;
+	mongo_register_prefetch(fmstate->mongoConnection, NULL, NULL);
+
+	return found;
 }
+#endif
 
 
 /*
@@ -1902,13 +6054,47 @@ MongoAnalyzeForeignTable(Relation relation,
 	Oid                foreignTableId = InvalidOid;
 	int32              documentWidth = 0;
 	double             documentCount = 0.0;
+	double             documentSize = 0.0;
 	double             foreignTableSize = 0;
+#ifdef META_DRIVER
+	MongoFdwOptions    *options = NULL;
+	char               *filename = NULL;
+#endif
 
 	foreignTableId = RelationGetRelid(relation);
 
-	documentCount = ForeignTableDocumentCount(foreignTableId);
+#ifdef META_DRIVER
+	options = mongo_get_options(foreignTableId);
+	filename = options->filename;
+	mongo_free_options(options);
+#endif
 
-	if (documentCount > 0.0)
+	/*
+	 * We record the collection size as the page count, so that the planner can
+	 * work out the average document size from relpages and reltuples. For a
+	 * mongodump file, that is the size of the file.
+	 */
+#ifdef META_DRIVER
+	if (filename != NULL)
+	{
+		struct stat fileStat;
+
+		if (stat(filename, &fileStat) < 0)
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not stat file \"%s\": %m", filename)));
+
+		pageCount = (BlockNumber) ceil((double) fileStat.st_size / BLCKSZ);
+	}
+	else
+#endif
+	if (ForeignTableCollectionStats(foreignTableId, &documentCount, &documentSize) &&
+		documentCount > 0.0 && documentSize > 0.0)
+	{
+		foreignTableSize = documentCount * documentSize;
+
+		pageCount = (BlockNumber) ceil(foreignTableSize / BLCKSZ);
+	}
+	else if ((documentCount = ForeignTableDocumentCount(foreignTableId)) > 0.0)
 	{
 		attributeCount = RelationGetNumberOfAttributes(relation);
 		attributeWidths = (int32 *)	palloc0((attributeCount + 1) * sizeof(int32));
@@ -1943,7 +6129,8 @@ MongoAnalyzeForeignTable(Relation relation,
  * which must have at least target row count entries. The actual number of rows
  * selected is returned as the function result. We also count the number of rows
  * in the collection and return it in total row count. We also always set dead
- * row count to zero.
+ * row count to zero. With the meta driver, the server picks the sample for
+ * collections larger than it, and the row count is the cached document count.
  *
  * Note that the returned list of rows is not always in order by physical
  * position in the MongoDB collection. Therefore, correlation estimates
@@ -1967,7 +6154,7 @@ MongoAcquireSampleRows(Relation relation, int errorLevel,
 	Form_pg_attribute        *attributesPtr = NULL;
 	AttrNumber               columnCount = 0;
 	AttrNumber               columnId = 0;
-	HTAB                     *columnMappingHash = NULL;
+	ColumnMappingTree        *columnMappingTree = NULL;
 	MONGO_CURSOR             *mongoCursor = NULL;
 	BSON                     *queryDocument = NULL;
 	List                     *columnList = NIL;
@@ -1979,6 +6166,9 @@ MongoAcquireSampleRows(Relation relation, int errorLevel,
 	int                      executorFlags = 0;
 	MemoryContext            oldContext = CurrentMemoryContext;
 	MemoryContext            tupleContext = NULL;
+#ifdef META_DRIVER
+	double                   documentCount = 0.0;
+#endif
 
 	/* create list of columns in the relation */
 	tupleDescriptor = RelationGetDescr(relation);
@@ -2003,7 +6193,10 @@ MongoAcquireSampleRows(Relation relation, int errorLevel,
 
 	foreignTableId = RelationGetRelid(relation);
 	queryDocument = QueryDocument(foreignTableId, NIL, NULL);
-	foreignPrivateList = list_make2(columnList, NULL);
+	foreignPrivateList = list_make3(columnList, NIL, makeInteger(false));
+	foreignPrivateList = lappend(foreignPrivateList, NIL);
+	foreignPrivateList = lappend(foreignPrivateList, makeInteger(0));
+	foreignPrivateList = lappend(foreignPrivateList, NIL);
 
 	/* only clean up the query struct, but not its data */
 	BsonDestroy(queryDocument);
@@ -2016,8 +6209,7 @@ MongoAcquireSampleRows(Relation relation, int errorLevel,
 	MongoBeginForeignScan(scanState, executorFlags);
 
 	fmstate = (MongoFdwModifyState *) scanState->fdw_state;
-	mongoCursor = fmstate->mongoCursor;
-	columnMappingHash = fmstate->columnMappingHash;
+	columnMappingTree = fmstate->columnMappingTree;
 
 	/*
 	 * Use per-tuple memory context to prevent leak of memory used to read
@@ -2035,96 +6227,142 @@ MongoAcquireSampleRows(Relation relation, int errorLevel,
 	columnValues = (Datum *) palloc0(columnCount * sizeof(Datum));
 	columnNulls = (bool *) palloc0(columnCount * sizeof(bool));
 
-	for (;;)
-	{
-		/* check for user-requested abort or sleep */
-		vacuum_delay_point();
+#ifdef META_DRIVER
+	/*
+	 * Have the server pick the sample when the collection holds more documents
+	 * than we need, instead of reading all of them. The cached document count
+	 * then stands for the row count. A mongodump file is read whole.
+	 */
+	if (fmstate->file == NULL)
+		documentCount = ForeignTableCachedDocumentCount(foreignTableId);
+	if (documentCount > targetRowCount)
+		sampleRowCount = MongoServerSampleRows(fmstate, tupleDescriptor,
+											   tupleContext, columnValues,
+											   columnNulls, sampleRows,
+											   targetRowCount);
+	if (sampleRowCount > 0)
+		rowCount = documentCount;
+#endif
 
-		/* initialize all values for this row to null */
-		memset(columnValues, 0, columnCount * sizeof(Datum));
-		memset(columnNulls, true, columnCount * sizeof(bool));
+	/* otherwise, scan all documents and sample them as they pass by */
+	if (sampleRowCount == 0)
+	{
+#ifdef META_DRIVER
+		if (fmstate->file == NULL)
+#endif
+		{
+			MongoScanCursorCreate(fmstate);
+			mongoCursor = fmstate->mongoCursor;
+		}
 
-		if(MongoCursorNext(mongoCursor, NULL))
+		for (;;)
 		{
-			const BSON *bsonDocument = MongoCursorBson(mongoCursor);
-			const char *bsonDocumentKey = NULL; /* top level document */
+			/* check for user-requested abort or sleep */
+			vacuum_delay_point();
 
-			/* fetch next tuple */
-			MemoryContextReset(tupleContext);
-			MemoryContextSwitchTo(tupleContext);
+			/* initialize all values for this row to null */
+			memset(columnValues, 0, columnCount * sizeof(Datum));
+			memset(columnNulls, true, columnCount * sizeof(bool));
 
-			FillTupleSlot(bsonDocument, bsonDocumentKey,
-						  columnMappingHash, columnValues, columnNulls);
+#ifdef META_DRIVER
+			if (fmstate->file != NULL)
+			{
+				const BSON *bsonDocument = MongoScanFileNext(fmstate);
 
-			MemoryContextSwitchTo(oldContext);
-		}
-		else
-		{
-			#ifdef META_DRIVER
-			bson_error_t error;
-			if (mongoc_cursor_error (mongoCursor, &error))
+				if (bsonDocument == NULL)
+					break;
+
+				MemoryContextReset(tupleContext);
+				MemoryContextSwitchTo(tupleContext);
+
+				FillTupleSlot(bsonDocument, columnMappingTree,
+							  columnValues, columnNulls);
+
+				MemoryContextSwitchTo(oldContext);
+			}
+			else
+#endif
+			if(MongoCursorNext(mongoCursor, NULL))
 			{
-				MongoFreeScanState(fmstate);
-				ereport(ERROR, (errmsg("could not iterate over mongo collection"),
-						errhint("Mongo driver error: %s", error.message)));
+				const BSON *bsonDocument = MongoCursorBson(mongoCursor);
+
+				/* fetch next tuple */
+				MemoryContextReset(tupleContext);
+				MemoryContextSwitchTo(tupleContext);
+
+				FillTupleSlot(bsonDocument, columnMappingTree,
+							  columnValues, columnNulls);
+
+				MemoryContextSwitchTo(oldContext);
 			}
-			#else
-				mongo_cursor_error_t errorCode = mongoCursor->err;
-				if (errorCode != MONGO_CURSOR_EXHAUSTED)
+			else
+			{
+				#ifdef META_DRIVER
+				bson_error_t error;
+				if (mongoc_cursor_error (mongoCursor, &error))
 				{
 					MongoFreeScanState(fmstate);
 					ereport(ERROR, (errmsg("could not iterate over mongo collection"),
-							errhint("Mongo driver cursor error code: %d", errorCode)));
+							errhint("Mongo driver error: %s", error.message)));
 				}
-			#endif
-			break;
-		}
+				#else
+					mongo_cursor_error_t errorCode = mongoCursor->err;
+					if (errorCode != MONGO_CURSOR_EXHAUSTED)
+					{
+						MongoFreeScanState(fmstate);
+						ereport(ERROR, (errmsg("could not iterate over mongo collection"),
+								errhint("Mongo driver cursor error code: %d", errorCode)));
+					}
+				#endif
+				break;
+			}
 
-		/*
-		 * The first targetRowCount sample rows are simply copied into the
-		 * reservoir. Then we start replacing tuples in the sample until we
-		 * reach the end of the relation. This algorithm is from Jeff Vitter's
-		 * paper (see more info in commands/analyze.c).
-		 */
-		if (sampleRowCount < targetRowCount)
-		{
-			sampleRows[sampleRowCount++] = heap_form_tuple(tupleDescriptor,
-														   columnValues,
-														   columnNulls);
-		}
-		else
-		{
 			/*
-			 * t in Vitter's paper is the number of records already processed.
-			 * If we need to compute a new S value, we must use the "not yet
-			 * incremented" value of rowCount as t.
+			 * The first targetRowCount sample rows are simply copied into the
+			 * reservoir. Then we start replacing tuples in the sample until we
+			 * reach the end of the relation. This algorithm is from Jeff Vitter's
+			 * paper (see more info in commands/analyze.c).
 			 */
-			if (rowCountToSkip < 0)
+			if (sampleRowCount < targetRowCount)
 			{
-				rowCountToSkip = anl_get_next_S(rowCount, targetRowCount,
-												&randomState);
+				sampleRows[sampleRowCount++] = heap_form_tuple(tupleDescriptor,
+															   columnValues,
+															   columnNulls);
 			}
-
-			if (rowCountToSkip <= 0)
+			else
 			{
 				/*
-				 * Found a suitable tuple, so save it, replacing one old tuple
-				 * at random.
+				 * t in Vitter's paper is the number of records already processed.
+				 * If we need to compute a new S value, we must use the "not yet
+				 * incremented" value of rowCount as t.
 				 */
-				int rowIndex = (int) (targetRowCount * anl_random_fract());
-				Assert(rowIndex >= 0);
-				Assert(rowIndex < targetRowCount);
+				if (rowCountToSkip < 0)
+				{
+					rowCountToSkip = anl_get_next_S(rowCount, targetRowCount,
+													&randomState);
+				}
 
-				heap_freetuple(sampleRows[rowIndex]);
-				sampleRows[rowIndex] = heap_form_tuple(tupleDescriptor,
-													   columnValues,
-													   columnNulls);
+				if (rowCountToSkip <= 0)
+				{
+					/*
+					 * Found a suitable tuple, so save it, replacing one old tuple
+					 * at random.
+					 */
+					int rowIndex = (int) (targetRowCount * anl_random_fract());
+					Assert(rowIndex >= 0);
+					Assert(rowIndex < targetRowCount);
+
+					heap_freetuple(sampleRows[rowIndex]);
+					sampleRows[rowIndex] = heap_form_tuple(tupleDescriptor,
+														   columnValues,
+														   columnNulls);
+				}
+
+				rowCountToSkip -= 1;
 			}
 
-			rowCountToSkip -= 1;
+			rowCount += 1;
 		}
-
-		rowCount += 1;
 	}
 
 	/* clean up */
@@ -2145,8 +6383,137 @@ MongoAcquireSampleRows(Relation relation, int errorLevel,
 	return sampleRowCount;
 }
 
+#ifdef META_DRIVER
+/*
+ * MongoServerSampleRows has the MongoDB server pick a random sample of target
+ * row count documents with the $sample aggregation stage, and forms the sample
+ * rows from them. The function returns the number of rows it sampled, or 0 if
+ * the server can't sample, as servers before 3.2 can't; the caller then falls
+ * back to sampling all documents itself.
+ */
+static int
+MongoServerSampleRows(MongoFdwModifyState *fmstate, TupleDesc tupleDescriptor,
+					  MemoryContext tupleContext, Datum *columnValues,
+					  bool *columnNulls, HeapTuple *sampleRows,
+					  int targetRowCount)
+{
+	MongoFdwOptions *options = fmstate->options;
+	MemoryContext    oldContext = CurrentMemoryContext;
+	MONGO_CURSOR    *mongoCursor = NULL;
+	BSON            *pipelineDocument = NULL;
+	BSON             stageArray;
+	BSON             stageDocument;
+	BSON             sampleDocument;
+	int              columnCount = tupleDescriptor->natts;
+	int              sampleRowCount = 0;
+	bson_error_t     error;
+
+	pipelineDocument = BsonCreate();
+	BsonAppendStartArray(pipelineDocument, "pipeline", &stageArray);
+	BsonAppendStartObject(&stageArray, "0", &stageDocument);
+	BsonAppendStartObject(&stageDocument, "$sample", &sampleDocument);
+	BsonAppendInt32(&sampleDocument, "size", targetRowCount);
+	BsonAppendFinishObject(&stageDocument, &sampleDocument);
+	BsonAppendFinishObject(&stageArray, &stageDocument);
+	BsonAppendFinishArray(pipelineDocument, &stageArray);
+	BsonFinish(pipelineDocument);
+
+	mongoCursor = MongoAggregateCursorCreate(fmstate->mongoConnection,
+											 options->svr_database,
+											 options->collectionName,
+											 pipelineDocument,
+											 options->batch_size);
+	BsonDestroy(pipelineDocument);
+
+	while (sampleRowCount < targetRowCount && MongoCursorNext(mongoCursor, NULL))
+	{
+		const BSON *bsonDocument = MongoCursorBson(mongoCursor);
+
+		/* check for user-requested abort or sleep */
+		vacuum_delay_point();
+
+		/* initialize all values for this row to null */
+		memset(columnValues, 0, columnCount * sizeof(Datum));
+		memset(columnNulls, true, columnCount * sizeof(bool));
+
+		MemoryContextReset(tupleContext);
+		MemoryContextSwitchTo(tupleContext);
+
+		FillTupleSlot(bsonDocument, fmstate->columnMappingTree,
+					  columnValues, columnNulls);
+
+		MemoryContextSwitchTo(oldContext);
+
+		sampleRows[sampleRowCount++] = heap_form_tuple(tupleDescriptor,
+													   columnValues,
+													   columnNulls);
+	}
+
+	if (mongoc_cursor_error(mongoCursor, &error))
+	{
+		MongoCursorDestroy(mongoCursor);
+
+		/* an unknown $sample stage fails the first batch already */
+		if (sampleRowCount == 0)
+		{
+			elog(DEBUG1, "could not sample collection \"%s\" on the server: %s",
+				 options->collectionName, error.message);
+			return 0;
+		}
+
+		MongoFreeScanState(fmstate);
+		ereport(ERROR, (errmsg("could not iterate over mongo collection"),
+						errhint("Mongo driver error: %s", error.message)));
+	}
+
+	MongoCursorDestroy(mongoCursor);
+
+	return sampleRowCount;
+}
+#endif
+
+
 Datum
 mongo_fdw_version(PG_FUNCTION_ARGS)
 {
 	PG_RETURN_INT32(CODE_VERSION);
 }
+
+
+/*
+ * mongo_oid_time returns the time at which the given ObjectId was generated,
+ * which its first four bytes hold in seconds since the Unix epoch. Comparisons
+ * of it with timestamptz constants are pushed down as ranges of ObjectIds.
+ */
+Datum
+mongo_oid_time(PG_FUNCTION_ARGS)
+{
+	const char *objectId = NameStr(*PG_GETARG_NAME(0));
+	int64 seconds = 0;
+	int characterIndex = 0;
+
+	for (characterIndex = 0; characterIndex < 24; characterIndex++)
+	{
+		if (!isxdigit((unsigned char) objectId[characterIndex]))
+		{
+			break;
+		}
+	}
+	if (characterIndex != 24 || objectId[characterIndex] != '\0')
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+						errmsg("invalid ObjectId: \"%s\"", objectId)));
+	}
+
+	for (characterIndex = 0; characterIndex < 8; characterIndex++)
+	{
+		char character = objectId[characterIndex];
+		int digit = isdigit((unsigned char) character) ? character - '0' :
+					pg_ascii_tolower((unsigned char) character) - 'a' + 10;
+
+		seconds = seconds * 16 + digit;
+	}
+
+	PG_RETURN_TIMESTAMPTZ((TimestampTz) (seconds * USECS_PER_SEC -
+										 POSTGRES_TO_UNIX_EPOCH_USECS));
+}
@@ -38,7 +38,11 @@
 #include "access/reloptions.h"
 #include "catalog/pg_type.h"
 #include "commands/defrem.h"
+#if PG_VERSION_NUM >= 90600
+	#include "port/atomics.h"
+#endif
 #include "commands/explain.h"
+#include "portability/instr_time.h"
 #include "commands/vacuum.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
@@ -63,6 +67,8 @@
 	#define BSON_ITERATOR bson_iter_t
 	#define MONGO_CONN mongoc_client_t
 	#define MONGO_CURSOR mongoc_cursor_t
+	#define MONGO_BULK mongoc_bulk_operation_t
+	#define MONGO_MATCHER mongoc_matcher_t
 	#define BSON_TYPE_DOCUMENT BSON_TYPE_DOCUMENT
 	#define BSON_TYPE_NULL BSON_TYPE_NULL
 	#define BSON_TYPE_ARRAY BSON_TYPE_ARRAY
@@ -148,6 +154,8 @@
 #define OPTION_NAME_COLLECTION "collection"
 #define OPTION_NAME_USERNAME "username"
 #define OPTION_NAME_PASSWORD "password"
+#define OPTION_NAME_PROJECTION "projection"
+#define OPTION_NAME_ID_TIME "_id_time"
 #ifdef META_DRIVER
 #define OPTION_NAME_READ_PREFERENCE "read_preference"
 #define OPTION_NAME_AUTHENTICATION_DATABASE "authentication_database"
@@ -159,18 +167,57 @@
 #define OPTION_NAME_CA_DIR "ca_dir"
 #define OPTION_NAME_CRL_FILE "crl_file"
 #define OPTION_NAME_WEAK_CERT "weak_cert_validation"
+#define OPTION_NAME_BATCH_SIZE "batch_size"
+#define OPTION_NAME_PREFETCH "prefetch"
+#define OPTION_NAME_ASYNC "async"
+#define OPTION_NAME_RESCAN_CACHE "rescan_cache"
+#define OPTION_NAME_REMOTE_EXPLAIN "remote_explain"
+#define OPTION_NAME_INSERT_BATCH_SIZE "insert_batch_size"
+#define OPTION_NAME_ORDERED "ordered"
+#define OPTION_NAME_WRITE_CONCERN "write_concern"
+#define OPTION_NAME_JOURNAL "journal"
+#define OPTION_NAME_FILENAME "filename"
 #endif
 
 /* Default values for option parameters */
 #define DEFAULT_IP_ADDRESS "127.0.0.1"
 #define DEFAULT_PORT_NUMBER 27017
 #define DEFAULT_DATABASE_NAME "test"
+#define DEFAULT_BATCH_SIZE 0		/* let the server pick the batch size */
+#define DEFAULT_INSERT_BATCH_SIZE 1000
 
 /* Defines for sending queries and converting types */
 #define EQUALITY_OPERATOR_NAME "="
+#define OBJECT_ID_TIME_FUNCTION_NAME "mongo_oid_time"
 #define INITIAL_ARRAY_CAPACITY 8
+#define MONGO_BSON_TYPE_COUNT (BSON_TYPE_INT64 + 1)
 #define MONGO_TUPLE_COST_MULTIPLIER 5
 #define MONGO_CONNECTION_COST_MULTIPLIER 5
+
+/*
+ * In auto projection mode, we send a projection when the columns we need are
+ * expected to take up at most this fraction of the average document.
+ */
+#define MONGO_PROJECTION_WIDTH_FRACTION 0.25
+
+/*
+ * The documents of a reply follow each other in the buffer the drivers read it
+ * into, those of a find command's batch with an array element header of a few
+ * bytes between them. A fetched document that doesn't start within this many
+ * bytes after the last one is counted as the start of a new batch.
+ */
+#define MONGO_BATCH_DOCUMENT_GAP 16
+
+/*
+ * A parallel scan is planned for collections of at least this many documents,
+ * with one more worker each time the collection triples in size. Each process
+ * gets about this many _id ranges to scan, so that they finish at about the
+ * same time; and when the split points are taken from a sample, we sample this
+ * many _id values per range.
+ */
+#define MONGO_PARALLEL_DOCUMENT_THRESHOLD 100000
+#define MONGO_PARALLEL_RANGES_PER_PROCESS 4
+#define MONGO_SPLIT_SAMPLE_FACTOR 10
 #define POSTGRES_TO_UNIX_EPOCH_DAYS (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)
 #define POSTGRES_TO_UNIX_EPOCH_USECS (POSTGRES_TO_UNIX_EPOCH_DAYS * USECS_PER_DAY)
 
@@ -190,9 +237,9 @@ typedef struct MongoValidOption
 
 /* Array of options that are valid for mongo_fdw */
 #ifdef META_DRIVER
-static const uint32 ValidOptionCount = 16;
+static const uint32 ValidOptionCount = 37;
 #else
-static const uint32 ValidOptionCount = 6;
+static const uint32 ValidOptionCount = 8;
 #endif
 static const MongoValidOption ValidOptionArray[] =
 {
@@ -211,11 +258,34 @@ static const MongoValidOption ValidOptionArray[] =
 	{ OPTION_NAME_CA_DIR, ForeignServerRelationId },
 	{ OPTION_NAME_CRL_FILE, ForeignServerRelationId },
 	{ OPTION_NAME_WEAK_CERT, ForeignServerRelationId },
+	{ OPTION_NAME_BATCH_SIZE, ForeignServerRelationId },
+	{ OPTION_NAME_PREFETCH, ForeignServerRelationId },
+	{ OPTION_NAME_ASYNC, ForeignServerRelationId },
+	{ OPTION_NAME_RESCAN_CACHE, ForeignServerRelationId },
+	{ OPTION_NAME_REMOTE_EXPLAIN, ForeignServerRelationId },
+	{ OPTION_NAME_INSERT_BATCH_SIZE, ForeignServerRelationId },
+	{ OPTION_NAME_ORDERED, ForeignServerRelationId },
+	{ OPTION_NAME_WRITE_CONCERN, ForeignServerRelationId },
+	{ OPTION_NAME_JOURNAL, ForeignServerRelationId },
 #endif
 
 	/* foreign table options */
 	{ OPTION_NAME_DATABASE, ForeignTableRelationId },
 	{ OPTION_NAME_COLLECTION, ForeignTableRelationId },
+	{ OPTION_NAME_PROJECTION, ForeignTableRelationId },
+	{ OPTION_NAME_ID_TIME, ForeignTableRelationId },
+#ifdef META_DRIVER
+	{ OPTION_NAME_BATCH_SIZE, ForeignTableRelationId },
+	{ OPTION_NAME_PREFETCH, ForeignTableRelationId },
+	{ OPTION_NAME_ASYNC, ForeignTableRelationId },
+	{ OPTION_NAME_RESCAN_CACHE, ForeignTableRelationId },
+	{ OPTION_NAME_REMOTE_EXPLAIN, ForeignTableRelationId },
+	{ OPTION_NAME_INSERT_BATCH_SIZE, ForeignTableRelationId },
+	{ OPTION_NAME_ORDERED, ForeignTableRelationId },
+	{ OPTION_NAME_WRITE_CONCERN, ForeignTableRelationId },
+	{ OPTION_NAME_JOURNAL, ForeignTableRelationId },
+	{ OPTION_NAME_FILENAME, ForeignTableRelationId },
+#endif
 
 	/* User mapping options */
 	{ OPTION_NAME_USERNAME, UserMappingRelationId },
@@ -224,6 +294,15 @@ static const MongoValidOption ValidOptionArray[] =
 };
 
 
+/* Values of the projection option */
+typedef enum MongoProjectionMode
+{
+	MONGO_PROJECTION_OFF,		/* always fetch whole documents */
+	MONGO_PROJECTION_ON,		/* always fetch only the needed columns */
+	MONGO_PROJECTION_AUTO		/* decide from the statistics of ANALYZE */
+} MongoProjectionMode;
+
+
 /*
  * MongoFdwOptions holds the option values to be used when connecting to Mongo.
  * To resolve these values, we first check foreign table's options, and if not
@@ -237,6 +316,7 @@ typedef struct MongoFdwOptions
 	char *collectionName;
 	char *svr_username;
 	char *svr_password;
+	MongoProjectionMode projection;
 #ifdef META_DRIVER
 	char *readPreference;
 	char *authenticationDatabase;
@@ -248,10 +328,39 @@ typedef struct MongoFdwOptions
  	char *ca_dir;
  	char *crl_file;
  	bool weak_cert_validation;
+	int32 batch_size;		/* documents per reply, 0 for server default */
+	bool prefetch;			/* stream batches with an exhaust cursor */
+	bool async;				/* send the query when the scan starts */
+	bool rescan_cache;		/* keep the documents of each rescan's query */
+	bool remote_explain;	/* EXPLAIN VERBOSE shows the server's plan */
+	int32 insert_batch_size;	/* inserted documents sent per bulk write */
+	bool ordered;			/* stop a bulk write at its first error */
+	char *write_concern;	/* "w" of inserts, or NULL for the default */
+	bool journal;			/* have inserts wait for the journal */
+	char *filename;			/* mongodump file read instead of a collection */
 #endif
 } MongoFdwOptions;
 
 
+/*
+ * MongoScanStats counts the documents a scan fetched from MongoDB. With timing,
+ * as under EXPLAIN ANALYZE, it also measures how long the scan waited for them,
+ * and how long it took to fill tuples from them, most of which is spent in
+ * converting values.
+ */
+typedef struct MongoScanStats
+{
+	bool			timing;				/* measure the times below */
+	long			documentCount;		/* documents fetched */
+	long			batchCount;			/* replies they came in */
+	long			byteCount;			/* their size in BSON */
+	const char		*documentEnd;		/* end of the last one in its reply */
+	instr_time		fetchTime;			/* waiting for the next document */
+	instr_time		fillTime;			/* filling tuples from documents */
+	instr_time		convertTime;		/* converting values, while filling */
+} MongoScanStats;
+
+
 /*
  * MongoFdwExecState keeps foreign data wrapper specific execution state that we
  * create and hold onto when executing the query.
@@ -264,28 +373,120 @@ typedef struct MongoFdwModifyState
 	Relation		rel;				/* relcache entry for the foreign table */
 	List			*target_attrs;		/* list of target attribute numbers */
 
-	/* info about parameters for prepared statement */
-	int				p_nums;				/* number of parameters to transmit */
-	FmgrInfo		*p_flinfo;			/* output conversion functions for them */
+	/* columns an INSERT or UPDATE sends, resolved when the modify begins */
+	struct ColumnEncoding *columnEncodings;
+	int				columnEncodingCount;
+	struct ColumnEncoding *idEncoding;	/* the _id column of UPDATE and DELETE */
+	BSON			*modifyDocument;	/* document of the row, reused */
+	BSON			*selectorDocument;	/* _id selector of the row, reused */
 
-	struct HTAB		*columnMappingHash;
+	struct ColumnMappingTree *columnMappingTree;
+
+	/* locally checked clauses, checked before the other columns are filled */
+	struct ColumnMappingTree *filterMappingTree;	/* their columns, or NULL */
+#if PG_VERSION_NUM >= 100000
+	ExprState		*filterQual;
+#else
+	List			*filterQual;
+#endif
 
 	MONGO_CONN		*mongoConnection;	/* MongoDB connection */
 	MONGO_CURSOR	*mongoCursor;		/* MongoDB cursor */
-	BSON			*queryDocument;		/* Bson Document */
+	BSON			*queryDocument;		/* Bson Document, or NULL until built */
+	List			*queryClauseList;	/* clauses it is built from */
+	List			*sortList;			/* sort it asks for, or NIL */
+	List			*hintList;			/* keys of the index it hints, or NIL */
+	bool			queryParameterized;	/* it depends on parameters of rescans */
+	MemoryContext	query_cxt;			/* context for building it */
+	BSON			*fieldsDocument;	/* projection, or NULL for all fields */
+	bool			exhaust;			/* mongoCursor is an exhaust cursor */
+	bool			rescanned;			/* cursor has been reopened by rescan */
+	int				limit;				/* documents to fetch, 0 for all */
+#ifdef META_DRIVER
+	bool			privateConnection;	/* mongoConnection is the scan's own */
+	struct MongoCursorPrefetch *prefetch;	/* first fetch in flight, or NULL */
+
+	/* documents of the queries run by rescans, with the rescan_cache option */
+	HTAB			*lookupCache;		/* cached queries, or NULL */
+	MemoryContext	lookupContext;		/* memory of their documents */
+	Size			lookupSpace;		/* how much of it they take */
+	struct MongoLookupQuery *lookupQuery;	/* query of this rescan, or NULL */
+	bool			lookupReplay;		/* its documents come from the cache */
+	ListCell		*lookupCell;		/* next of them to return */
+	long			lookupHits;			/* rescans served from the cache */
+	long			lookupMisses;		/* rescans that ran their query */
+
+	/* scan of a mongodump file, with the filename option */
+	struct MongoFile *file;				/* the open file, or NULL */
+	MONGO_MATCHER	*matcher;			/* checks the query document, or NULL */
+	bool			fileRangeOpen;		/* a range of the file is being read */
+	bool			fileScanned;		/* a serial scan has read the file */
+
+	MONGO_BULK		*bulk;				/* inserts not sent yet, or NULL */
+	int				bulkCount;			/* number of them */
+
+	/* UPDATE or DELETE run on the server; queryDocument selects the rows */
+	BSON			*updateDocument;	/* $set document of an UPDATE */
+	bool			setProcessed;		/* count the rows as the command's */
+	bool			directModified;		/* the command has been sent */
+#endif
+
+	/* pushed down aggregation; queryDocument then holds the pipeline */
+	List			*aggregateList;		/* entries of the aggregation output */
+	bool			aggregateGrouped;	/* aggregation has GROUP BY columns */
+	bool			aggregateReturned;	/* a group has been returned */
+
+	/* parallel scan */
+	struct MongoParallelScanState *parallelState;	/* shared state, or NULL */
+	BSON			*splitPoints;		/* _id split points found by the leader */
+	int				splitPointCount;
 
 	MongoFdwOptions	*options;
+	int				xactLevel;			/* xact nesting level it started at */
 
 	/* working memory context */
 	MemoryContext	temp_cxt;			/* context for per-tuple temporary data */
+	Size			tupleMemoryPeak;	/* most of it a tuple took, if measured */
+
+	MongoScanStats	stats;				/* for EXPLAIN ANALYZE */
 } MongoFdwModifyState;
 
 
 /*
- * ColumnMapping reprents a hash table entry that maps a column name to column
- * related information. We construct these hash table entries to speed up the
- * conversion from BSON documents to PostgreSQL tuples; and each hash entry maps
- * the column name to the column's tuple index and its type-related information.
+ * ColumnConverter converts the BSON value the iterator points to into a datum of
+ * the given PostgreSQL type.
+ */
+typedef Datum (*ColumnConverter) (BSON_ITERATOR *bsonIterator, Oid columnTypeId,
+								  int32 columnTypeMod);
+
+/*
+ * ColumnEncoder appends a non-null datum of the given PostgreSQL type to a BSON
+ * document under the given key.
+ */
+typedef bool (*ColumnEncoder) (BSON *document, const char *keyName, Datum value,
+							   Oid columnTypeId);
+
+/*
+ * ColumnEncoding holds what an INSERT, UPDATE or DELETE needs to append the
+ * values of a column to the documents it sends: the column's attribute number,
+ * its key, its type, and the encoder for that type. These are resolved when the
+ * modify begins, so that no catalog lookups are done for each row.
+ */
+typedef struct ColumnEncoding
+{
+	AttrNumber attributeNumber;
+	char key[NAMEDATALEN];
+	Oid typeId;
+	ColumnEncoder encoder;
+} ColumnEncoding;
+
+/*
+ * ColumnMapping maps a column name to column related information. We construct
+ * these entries to speed up the conversion from BSON documents to PostgreSQL
+ * tuples; and each entry maps the column name to the column's tuple index and
+ * its type-related information. The converters for the column's type, or for
+ * its element type for arrays, are looked up once by BSON type; a BSON type the
+ * column can't hold has none.
  */
 typedef struct ColumnMapping
 {
@@ -294,11 +495,102 @@ typedef struct ColumnMapping
 	Oid columnTypeId;
 	int32 columnTypeMod;
 	Oid columnArrayTypeId;
+	int16 elementTypeLength;
+	bool elementTypeByValue;
+	char elementTypeAlignment;
+	ColumnConverter converters[MONGO_BSON_TYPE_COUNT];
+	uint32 generation;		/* last document in which the key was seen */
 } ColumnMapping;
 
+/*
+ * ColumnMappingNode is one key of a column path in the column mapping tree. A
+ * column named "a.b.c" is reached from the root through the nodes "a", "b" and
+ * "c". Children are sorted by key so that lookups can use binary search.
+ */
+typedef struct ColumnMappingNode
+{
+	char *key;
+	ColumnMapping *columnMapping;	/* column mapped to this path, or NULL */
+	int childCount;
+	struct ColumnMappingNode *children;
+} ColumnMappingNode;
+
+/*
+ * ColumnMappingTree holds the compiled column paths of a scan. It lets us skip
+ * sub-documents no column maps into, and stop walking a document once every
+ * mapped key has been seen.
+ */
+typedef struct ColumnMappingTree
+{
+	ColumnMappingNode root;
+	ColumnMapping *documentMapping;	/* the __doc column, or NULL */
+	int mappingCount;				/* columns mapped below root */
+	int unseenCount;				/* of those, not yet seen in document */
+	uint32 generation;				/* number of documents walked */
+	MongoScanStats *stats;			/* to time conversions in, or NULL */
+} ColumnMappingTree;
+
+/*
+ * MongoAggregateKind tells how an entry of the output of a pushed down
+ * aggregation is computed. Each entry is kept in the aggregate list as a list
+ * of its kind, the name of its column, and the type of that column.
+ */
+typedef enum MongoAggregateKind
+{
+	MONGO_AGGREGATE_GROUP,			/* a GROUP BY column */
+	MONGO_AGGREGATE_COUNT_STAR,
+	MONGO_AGGREGATE_COUNT,
+	MONGO_AGGREGATE_SUM,
+	MONGO_AGGREGATE_AVG,
+	MONGO_AGGREGATE_MIN,
+	MONGO_AGGREGATE_MAX
+} MongoAggregateKind;
+
+/*
+ * MongoFdwRelationInfo keeps the planner's information about a foreign table
+ * scan, or about an aggregation over one, in the fdw_private field of the
+ * relation.
+ */
+typedef struct MongoFdwRelationInfo
+{
+	Oid foreignTableId;
+	Oid checkAsUser;			/* user to connect as, or InvalidOid */
+	MongoFdwOptions *options;	/* options of the foreign table */
+	List *opExpressionList;		/* quals sent in the query document */
+	bool remoteQualsExact;		/* query document filters all quals exactly */
+	double documentCount;		/* documents in the collection, or -1 */
+	List *indexList;			/* key lists of the collection's indexes */
+#ifdef META_DRIVER
+	double fileSize;			/* size of its mongodump file, in bytes */
+#endif
+
+	/* for an aggregation */
+	List *groupedTargetList;	/* target list of the aggregation output */
+	List *aggregateList;		/* how each of its entries is computed */
+} MongoFdwRelationInfo;
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * MongoParallelScanState is kept in dynamic shared memory for a parallel scan.
+ * The leader finds _id values that split the collection into ranges, and the
+ * processes of the scan take turns claiming the next range to scan. Split
+ * points are stored as a BSON document with keys "0", "1", ... For a scan of a
+ * mongodump file, they are the byte offsets of documents in the file.
+ */
+typedef struct MongoParallelScanState
+{
+	pg_atomic_uint32 nextRange;		/* next range to be claimed */
+	uint32 rangeCount;
+	int splitPointCount;
+	Size splitPointsLength;
+	char splitPoints[FLEXIBLE_ARRAY_MEMBER];
+} MongoParallelScanState;
+#endif
+
 /* options.c */
 extern MongoFdwOptions * mongo_get_options(Oid foreignTableId);
 extern void mongo_free_options(MongoFdwOptions *options);
+extern char * mongo_get_id_time_column(Oid foreignTableId);
 extern StringInfo mongo_option_names_string(Oid currentContextId);
 
 /* connection.c */
@@ -306,12 +598,40 @@ MONGO_CONN* mongo_get_connection(ForeignServer *server, UserMapping *user, Mongo
 
 extern void mongo_cleanup_connection(void);
 extern void mongo_release_connection(MONGO_CONN* conn);
+extern void mongo_track_document(BSON *document, int level);
+extern void mongo_destroy_document(BSON *document);
+#ifdef META_DRIVER
+extern MONGO_CONN *mongo_get_private_connection(ForeignServer *server,
+												UserMapping *user,
+												MongoFdwOptions *opt);
+extern void mongo_release_private_connection(MONGO_CONN *conn);
+extern void mongo_register_prefetch(MONGO_CONN *conn, MONGO_CURSOR *cursor,
+									struct MongoCursorPrefetch *prefetch);
+#endif
 
 /* Function declarations related to creating the mongo query */
 extern List * ApplicableOpExpressionList(RelOptInfo *baserel);
 extern BSON * QueryDocument(Oid relationId, List *opExpressionList,
 				ForeignScanState *scanStateNode);
 extern List * ColumnList(RelOptInfo *baserel);
+extern BSON * ProjectionDocument(Oid relationId, List *columnList,
+				List *hintList);
+extern BSON * OrderedQueryDocument(BSON *queryDocument, List *sortList,
+				List *hintList);
+extern bool ClauseIsExact(Expr *clause);
+extern bool ClauseBracketsColumn(Expr *clause, AttrNumber columnId);
+extern bool JoinClauseIsApplicable(Expr *clause, RelOptInfo *baserel);
+extern char * ClauseIndexField(Expr *clause, RelOptInfo *baserel,
+				Oid relationId, bool *equality);
+extern bool ValueIsScanConstant(Expr *value);
+#ifdef META_DRIVER
+extern BSON * UpdateDocument(Oid relationId, List *columnIdList, List *valueList,
+				ForeignScanState *scanStateNode);
+extern BSON * AggregatePipeline(Oid relationId, List *opExpressionList,
+				List *aggregateList, ForeignScanState *scanStateNode);
+extern BSON * RangeQueryDocument(BSON *queryDocument, const BSON *splitPoints,
+				int splitPointCount, int rangeIndex);
+#endif
 
 /* Function declarations for foreign data wrapper */
 extern Datum mongo_fdw_handler(PG_FUNCTION_ARGS);
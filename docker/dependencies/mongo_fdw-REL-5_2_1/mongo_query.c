@@ -31,241 +31,1726 @@
 #include "mongo_fdw.h"
 #include "mongo_query.h"
 
+#include "catalog/pg_collation.h"
 #include "catalog/pg_type.h"
 #include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
 #include "nodes/relation.h"
+#include "optimizer/clauses.h"
 #include "optimizer/var.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/date.h"
+#include "utils/jsonb.h"
 #include "utils/lsyscache.h"
 #include "utils/numeric.h"
+#include "utils/pg_locale.h"
 #include "utils/timestamp.h"
 
+/*
+ * With the legacy driver, sub-documents and arrays are built in place in their
+ * parent document, so their elements are appended to the parent.
+ */
+#ifdef META_DRIVER
+#define SUBDOCUMENT(parent, child) (child)
+#else
+#define SUBDOCUMENT(parent, child) (parent)
+#endif
+
+/*
+ * MongoComparison describes a filter clause that compares a column against a
+ * value, in terms of the MongoDB operator that evaluates it: "=" for equality,
+ * $lt, $gt, $lte, $gte and $ne for other comparisons, $in and $nin for IN and
+ * NOT IN lists, whose value is an array constant, and $regex for LIKE patterns.
+ * Other values are constants, or parameters and stable expressions that are
+ * evaluated when the scan starts. A comparison may also be on a field inside a
+ * json or jsonb column, which the field path then names, or on the time an
+ * ObjectId column holds. On array columns, "=" tests for an element, and $all
+ * and $in for all or any elements of an array constant.
+ */
+typedef struct MongoComparison
+{
+	Var *column;
+	char *fieldPath;			/* dotted path inside the column, or NULL */
+	bool objectIdTime;			/* compares the time of an ObjectId column */
+	const char *operatorName;
+	Expr *value;				/* Const, or expression without columns */
+	Oid collationId;
+} MongoComparison;
+
 /* Local functions forward declarations */
-static Expr * FindArgumentOfType(List *argumentList, NodeTag argumentType);
 static char * MongoOperatorName(const char *operatorName);
-static List * EqualityOperatorList(List *operatorList);
-static List * UniqueColumnList(List *operatorList);
-static List * ColumnOperatorList(Var *column, List *operatorList);
+static Expr * StripRelabel(Expr *expression);
+static bool MongoValueTypeSupported(Oid typeId);
+static Var * ComparedColumn(Expr *expression, char **fieldPath,
+							 bool *objectIdTime);
+static Var * JsonPathColumn(Expr *expression, StringInfo fieldPath);
+static bool AppendJsonPathKeys(StringInfo fieldPath, Const *key);
+static bool JsonPathKeyValid(const char *key);
+static bool JsonTextIsString(const char *text);
+static bool JsonPathValueSupported(Const *value);
+static bool JsonbRootScalar(Jsonb *jsonb, JsonbValue *value);
+static Const * JsonbScalarConstant(JsonbValue *value);
+static Var * JsonContainment(Expr *clause, StringInfo fieldPath,
+							 Const **constant);
+static int AppendContainedValues(BSON *document, JsonbContainer *container,
+								 StringInfo fieldName, int conditionIndex);
+static char * ColumnFieldName(Oid relationId, Var *column,
+							  const char *fieldPath);
+static MongoComparison * IdTimeComparison(Oid relationId,
+										  MongoComparison *comparison,
+										  const char *idTimeColumn);
+static bool ArrayConstantHasValues(Const *arrayConstant);
+static bool ColumnComparison(Expr *clause, MongoComparison *comparison);
+static bool ComparisonIsExact(MongoComparison *comparison);
+static bool EvaluateComparisonValue(MongoComparison *comparison,
+									ForeignScanState *scanStateNode);
+static Const * EvaluateValue(Expr *value, ForeignScanState *scanStateNode);
+static bool AppendClause(BSON *document, const char *keyName, Expr *clause,
+						 Oid relationId, ForeignScanState *scanStateNode,
+						 bool *exact);
+static void AppendComparison(BSON *document, const char *columnName,
+							 MongoComparison *comparison,
+							 ForeignScanState *scanStateNode);
+static void AppendOperator(BSON *document, MongoComparison *comparison,
+						   ForeignScanState *scanStateNode);
+static void AppendExcludedValues(BSON *document, List *comparisonList,
+								 ForeignScanState *scanStateNode);
+static void AppendObjectIdTimeRange(BSON *document, const char *columnName,
+									MongoComparison *comparison);
+static void AppendObjectIdBound(BSON *document, bool lowerBound, int64 seconds);
+static int AppendArrayValues(BSON *document, Const *arrayConstant,
+							 int valueIndex);
+static void AppendComparisonValue(BSON *document, const char *keyName,
+								  Expr *value, ForeignScanState *scanStateNode);
+static char * LikePatternRegex(const char *likePattern);
 static void AppendConstantValue(BSON *queryDocument, const char *keyName,
 								Const *constant);
-static void AppendParamValue(BSON *queryDocument, const char *keyName,
-				Param *paramNode, ForeignScanState *scanStateNode);
+static bool EncodeInt16(BSON *document, const char *keyName, Datum value,
+						Oid columnTypeId);
+static bool EncodeInt32(BSON *document, const char *keyName, Datum value,
+						Oid columnTypeId);
+static bool EncodeInt64(BSON *document, const char *keyName, Datum value,
+						Oid columnTypeId);
+static bool EncodeFloat4(BSON *document, const char *keyName, Datum value,
+						 Oid columnTypeId);
+static bool EncodeFloat8(BSON *document, const char *keyName, Datum value,
+						 Oid columnTypeId);
+static bool EncodeBool(BSON *document, const char *keyName, Datum value,
+					   Oid columnTypeId);
+static bool EncodeText(BSON *document, const char *keyName, Datum value,
+					   Oid columnTypeId);
+static bool EncodeName(BSON *document, const char *keyName, Datum value,
+					   Oid columnTypeId);
+static bool EncodeTimestamp(BSON *document, const char *keyName, Datum value,
+							Oid columnTypeId);
+static bool EncodeValue(BSON *document, const char *keyName, Datum value,
+						Oid columnTypeId);
+#ifdef META_DRIVER
+static void AppendTypedField(BSON *document, const char *keyName,
+				char *fieldPath, Oid columnTypeId);
+static void AppendTypedCount(BSON *document, const char *keyName,
+				char *fieldPath, Oid columnTypeId);
+static void AppendTypeTest(BSON *document, const char *keyName,
+				char *fieldPath, Oid columnTypeId);
+#endif
 /*
  * ApplicableOpExpressionList walks over all filter clauses that relate to this
  * foreign table, and chooses applicable clauses that we know we can translate
- * into Mongo queries. Currently, these clauses include comparison expressions
- * that have a column and a constant as arguments. For example, "o_orderdate >=
- * date '1994-01-01' + interval '1' year" is an applicable expression.
+ * into Mongo queries. These clauses include comparisons of a column against a
+ * constant, a parameter or a stable expression such as now(), IN lists, IS [NOT] NULL tests, LIKE patterns on text
+ * columns, tests for elements of array columns, and AND, OR and NOT trees of
+ * them. For example, "o_orderdate >=
+ * date '1994-01-01' + interval '1' year" and "l_shipmode IN ('MAIL', 'SHIP')
+ * OR l_quantity < 10" are applicable expressions.
+ *
+ * MongoDB may return more documents than the clauses let through, as they are
+ * rechecked locally, but never fewer; ClauseIsExact tells which clauses match
+ * exactly the same rows.
+ */
+List *
+ApplicableOpExpressionList(RelOptInfo *baserel)
+{
+	List *opExpressionList = NIL;
+	List *restrictInfoList = baserel->baserestrictinfo;
+	ListCell *restrictInfoCell = NULL;
+
+	foreach(restrictInfoCell, restrictInfoList)
+	{
+		RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(restrictInfoCell);
+		Expr *expression = restrictInfo->clause;
+		bool exact = false;
+
+		if (AppendClause(NULL, NULL, expression, InvalidOid, NULL, &exact))
+		{
+			opExpressionList = lappend(opExpressionList, expression);
+		}
+	}
+
+	return opExpressionList;
+}
+
+
+/*
+ * JoinClauseIsApplicable tells whether the given join clause compares a column
+ * of the relation for equality with an expression of other relations only. A
+ * nested loop join can then pass the value of that expression to the scan as a
+ * parameter, for each outer row, and the clause becomes a comparison with a
+ * parameter in the query document.
+ */
+bool
+JoinClauseIsApplicable(Expr *clause, RelOptInfo *baserel)
+{
+	OpExpr *opExpression = NULL;
+	Expr *leftArgument = NULL;
+	Expr *rightArgument = NULL;
+	Expr *value = NULL;
+	Var *column = NULL;
+	char *operatorName = NULL;
+
+	if (!IsA(clause, OpExpr))
+	{
+		return false;
+	}
+
+	opExpression = (OpExpr *) clause;
+	if (list_length(opExpression->args) != 2)
+	{
+		return false;
+	}
+
+	leftArgument = StripRelabel((Expr *) linitial(opExpression->args));
+	rightArgument = StripRelabel((Expr *) lsecond(opExpression->args));
+
+	if (IsA(leftArgument, Var) &&
+		((Var *) leftArgument)->varno == baserel->relid)
+	{
+		column = (Var *) leftArgument;
+		value = rightArgument;
+	}
+	else if (IsA(rightArgument, Var) &&
+			 ((Var *) rightArgument)->varno == baserel->relid &&
+			 get_commutator(opExpression->opno) != InvalidOid)
+	{
+		column = (Var *) rightArgument;
+		value = leftArgument;
+	}
+	else
+	{
+		return false;
+	}
+
+	if (column->varattno <= 0 || column->varlevelsup != 0)
+	{
+		return false;
+	}
+
+	if (bms_is_member(baserel->relid, pull_varnos((Node *) value)) ||
+		contain_volatile_functions((Node *) value) ||
+		contain_subplans((Node *) value))
+	{
+		return false;
+	}
+
+	operatorName = get_opname(opExpression->opno);
+	if (operatorName == NULL ||
+		strncmp(operatorName, EQUALITY_OPERATOR_NAME, NAMEDATALEN) != 0)
+	{
+		return false;
+	}
+
+	return MongoValueTypeSupported(exprType((Node *) value));
+}
+
+
+/*
+ * ClauseIsExact tells whether MongoDB filters documents by the given applicable
+ * clause exactly as PostgreSQL evaluates it, so that the clause need not be
+ * rechecked locally.
+ */
+bool
+ClauseIsExact(Expr *clause)
+{
+	bool exact = false;
+
+	return AppendClause(NULL, NULL, clause, InvalidOid, NULL, &exact) && exact;
+}
+
+
+/*
+ * ClauseBracketsColumn tells whether the given applicable clause is a comparison
+ * of the column with the given attribute number that MongoDB evaluates exactly.
+ * MongoDB only matches such comparisons against values in the type bracket of
+ * the compared value, that is values PostgreSQL reads as non-null values of
+ * the column's type, and orders those as PostgreSQL does.
+ */
+bool
+ClauseBracketsColumn(Expr *clause, AttrNumber columnId)
+{
+	MongoComparison comparison;
+
+	if (!ColumnComparison(clause, &comparison))
+	{
+		return false;
+	}
+
+	return (comparison.column->varattno == columnId &&
+			ComparisonIsExact(&comparison));
+}
+
+
+/*
+ * ClauseIndexField tells whether MongoDB can look up the documents the given
+ * clause matches in an index on a field, and if so returns the field's name and
+ * sets *equality if the clause compares it for equality. The clause is one of
+ * the applicable clauses or a join clause of the relation. Equality comparisons
+ * select a single value of the index key, after which the next key may narrow
+ * the lookup further; other comparisons and IN lists select ranges of values.
+ * The field is a column, or for comparisons on json paths, a field inside one.
+ */
+char *
+ClauseIndexField(Expr *clause, RelOptInfo *baserel, Oid relationId,
+				 bool *equality)
+{
+	MongoComparison comparison;
+	MongoComparison *idComparison = NULL;
+	const char *operatorName = NULL;
+
+	if (JoinClauseIsApplicable(clause, baserel))
+	{
+		OpExpr *opExpression = (OpExpr *) clause;
+		Var *column = (Var *) StripRelabel((Expr *) linitial(opExpression->args));
+
+		if (!IsA(column, Var) || column->varno != baserel->relid)
+		{
+			column = (Var *) StripRelabel((Expr *) lsecond(opExpression->args));
+		}
+
+		*equality = true;
+		return get_relid_attribute_name(relationId, column->varattno);
+	}
+
+	if (!ColumnComparison(clause, &comparison))
+	{
+		return NULL;
+	}
+
+	/* the times of ObjectIds are ranges of the index on them */
+	idComparison = IdTimeComparison(relationId, &comparison,
+									mongo_get_id_time_column(relationId));
+	if (idComparison != NULL || comparison.objectIdTime)
+	{
+		*equality = false;
+		return ColumnFieldName(relationId, (idComparison != NULL) ?
+							   idComparison->column : comparison.column, NULL);
+	}
+
+	operatorName = comparison.operatorName;
+	*equality = (strcmp(operatorName, EQUALITY_OPERATOR_NAME) == 0);
+	if (*equality || strcmp(operatorName, "$in") == 0 ||
+		strcmp(operatorName, "$lt") == 0 || strcmp(operatorName, "$lte") == 0 ||
+		strcmp(operatorName, "$gt") == 0 || strcmp(operatorName, "$gte") == 0)
+	{
+		return ColumnFieldName(relationId, comparison.column,
+							   comparison.fieldPath);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * ValueIsScanConstant tells whether the given expression has the same value
+ * for all rows of a scan, so that it can be evaluated once when the scan
+ * starts: a constant, or an expression of parameters and stable functions.
+ */
+bool
+ValueIsScanConstant(Expr *value)
+{
+	if (IsA(value, Const))
+	{
+		return true;
+	}
+
+	return (!contain_var_clause((Node *) value) &&
+			!contain_volatile_functions((Node *) value) &&
+			!contain_subplans((Node *) value));
+}
+
+
+/*
+ * StripRelabel looks through binary-compatible casts, such as those from
+ * varchar to text that PostgreSQL adds to varchar comparisons.
+ */
+static Expr *
+StripRelabel(Expr *expression)
+{
+	while (expression != NULL && IsA(expression, RelabelType))
+	{
+		expression = ((RelabelType *) expression)->arg;
+	}
+
+	return expression;
+}
+
+
+/*
+ * MongoValueTypeSupported tells whether AppenMongoValue can translate values of
+ * the given type in query documents.
+ */
+static bool
+MongoValueTypeSupported(Oid typeId)
+{
+	switch (typeId)
+	{
+		case INT2OID: case INT4OID:
+		case INT8OID: case FLOAT4OID:
+		case FLOAT8OID: case NUMERICOID:
+		case BOOLOID: case BPCHAROID:
+		case VARCHAROID: case TEXTOID:
+		case BYTEAOID: case NAMEOID:
+		case DATEOID: case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/*
+ * ComparedColumn checks whether the given expression is a column, or a field
+ * inside a json or jsonb column, and if so returns the column. For a field, it
+ * sets *fieldPath to the field's dotted path inside the column. The expression
+ * may also be the time of an ObjectId column, mongo_oid_time(_id), for which
+ * it sets *objectIdTime.
+ */
+static Var *
+ComparedColumn(Expr *expression, char **fieldPath, bool *objectIdTime)
+{
+	StringInfoData path;
+	Var *column = NULL;
+
+	*fieldPath = NULL;
+	*objectIdTime = false;
+	if (IsA(expression, Var))
+	{
+		return (Var *) expression;
+	}
+
+	if (IsA(expression, FuncExpr))
+	{
+		FuncExpr *funcExpression = (FuncExpr *) expression;
+		char *functionName = get_func_name(funcExpression->funcid);
+
+		if (functionName == NULL ||
+			strcmp(functionName, OBJECT_ID_TIME_FUNCTION_NAME) != 0 ||
+			list_length(funcExpression->args) != 1)
+		{
+			return NULL;
+		}
+
+		column = (Var *) StripRelabel((Expr *) linitial(funcExpression->args));
+		if (!IsA(column, Var) || column->vartype != NAMEOID)
+		{
+			return NULL;
+		}
+
+		*objectIdTime = true;
+		return column;
+	}
+
+	initStringInfo(&path);
+	column = JsonPathColumn(expression, &path);
+	if (column == NULL || path.len == 0)
+	{
+		pfree(path.data);
+		return NULL;
+	}
+
+	*fieldPath = path.data;
+	return column;
+}
+
+
+/*
+ * JsonPathColumn checks whether the given expression is a json or jsonb column,
+ * or a chain of the ->, ->>, #> and #>> operators on one with constant keys,
+ * such as "doc->'address'->>'city'", and if so returns the column. The keys of
+ * the chain are appended to the given path, separated by dots, which is how
+ * MongoDB names fields of embedded documents and elements of arrays.
+ */
+static Var *
+JsonPathColumn(Expr *expression, StringInfo fieldPath)
+{
+	OpExpr *opExpression = NULL;
+	char *operatorName = NULL;
+	Var *column = NULL;
+	Expr *key = NULL;
+
+	expression = StripRelabel(expression);
+	if (IsA(expression, Var))
+	{
+		column = (Var *) expression;
+		if (column->vartype != JSONOID && column->vartype != JSONBOID)
+		{
+			return NULL;
+		}
+		return column;
+	}
+
+	if (!IsA(expression, OpExpr))
+	{
+		return NULL;
+	}
+
+	opExpression = (OpExpr *) expression;
+	if (list_length(opExpression->args) != 2)
+	{
+		return NULL;
+	}
+
+	operatorName = get_opname(opExpression->opno);
+	if (operatorName == NULL ||
+		(strcmp(operatorName, "->") != 0 && strcmp(operatorName, "->>") != 0 &&
+		 strcmp(operatorName, "#>") != 0 && strcmp(operatorName, "#>>") != 0))
+	{
+		return NULL;
+	}
+
+	column = JsonPathColumn((Expr *) linitial(opExpression->args), fieldPath);
+	key = StripRelabel((Expr *) lsecond(opExpression->args));
+	if (column == NULL || !IsA(key, Const) || ((Const *) key)->constisnull ||
+		!AppendJsonPathKeys(fieldPath, (Const *) key))
+	{
+		return NULL;
+	}
+
+	return column;
+}
+
+
+/*
+ * AppendJsonPathKeys appends the key of a json operator to the given dotted
+ * path: a field name, an array index, or for #> and #>>, an array of either.
+ * The function returns false for keys MongoDB can't address this way.
+ */
+static bool
+AppendJsonPathKeys(StringInfo fieldPath, Const *key)
+{
+	switch (key->consttype)
+	{
+		case TEXTOID:
+		{
+			char *keyName = TextDatumGetCString(key->constvalue);
+
+			if (!JsonPathKeyValid(keyName))
+			{
+				return false;
+			}
+			appendStringInfo(fieldPath, "%s%s", (fieldPath->len > 0) ? "." : "",
+							 keyName);
+			return true;
+		}
+		case INT4OID:
+		{
+			int32 elementIndex = DatumGetInt32(key->constvalue);
+
+			/* negative indexes count from the end of the array */
+			if (elementIndex < 0)
+			{
+				return false;
+			}
+			appendStringInfo(fieldPath, "%s%d", (fieldPath->len > 0) ? "." : "",
+							 elementIndex);
+			return true;
+		}
+		case TEXTARRAYOID:
+		{
+			Datum *keyValues = NULL;
+			bool *keyNulls = NULL;
+			int keyCount = 0;
+			int keyIndex = 0;
+
+			deconstruct_array(DatumGetArrayTypeP(key->constvalue), TEXTOID, -1,
+							  false, 'i', &keyValues, &keyNulls, &keyCount);
+			if (keyCount == 0)
+			{
+				return false;
+			}
+
+			for (keyIndex = 0; keyIndex < keyCount; keyIndex++)
+			{
+				char *keyName = NULL;
+
+				if (keyNulls[keyIndex])
+				{
+					return false;
+				}
+
+				keyName = TextDatumGetCString(keyValues[keyIndex]);
+				if (!JsonPathKeyValid(keyName))
+				{
+					return false;
+				}
+				appendStringInfo(fieldPath, "%s%s",
+								 (fieldPath->len > 0) ? "." : "", keyName);
+			}
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+
+/*
+ * JsonPathKeyValid tells whether the given key can be a part of a dotted path,
+ * which it can't if it is empty, holds a dot, or starts like an operator.
+ */
+static bool
+JsonPathKeyValid(const char *key)
+{
+	return (key[0] != '\0' && key[0] != '$' && strchr(key, '.') == NULL);
+}
+
+
+/*
+ * JsonTextIsString tells whether the given text can only be the ->> text of a
+ * JSON string. Numbers, booleans and null, and documents and arrays, which
+ * include ObjectIds and dates, have texts of their own that PostgreSQL also
+ * compares equal to the text, but MongoDB doesn't match to a string.
+ */
+static bool
+JsonTextIsString(const char *text)
+{
+	if (text[0] != '\0' && strchr("{[-0123456789", text[0]) != NULL)
+	{
+		return false;
+	}
+
+	return (strcmp(text, "true") != 0 && strcmp(text, "false") != 0 &&
+			strcmp(text, "null") != 0);
+}
+
+
+/*
+ * JsonPathValueSupported tells whether MongoDB matches at least the documents
+ * whose field at a json path compares equal to the given text constant, or to
+ * each element of the given text array constant, as the ->> and #>> operators
+ * return them. That holds for the texts of strings, which are sent as strings.
+ * Since those documents are all matched, and more for fields inside arrays,
+ * conditions on json fields are still checked locally.
+ */
+static bool
+JsonPathValueSupported(Const *value)
+{
+	if (value->consttype == TEXTOID)
+	{
+		return JsonTextIsString(TextDatumGetCString(value->constvalue));
+	}
+	else if (value->consttype == TEXTARRAYOID)
+	{
+		Datum *elementValues = NULL;
+		bool *elementNulls = NULL;
+		int elementCount = 0;
+		int elementIndex = 0;
+
+		deconstruct_array(DatumGetArrayTypeP(value->constvalue), TEXTOID, -1,
+						  false, 'i', &elementValues, &elementNulls,
+						  &elementCount);
+		for (elementIndex = 0; elementIndex < elementCount; elementIndex++)
+		{
+			if (!elementNulls[elementIndex] &&
+				!JsonTextIsString(TextDatumGetCString(elementValues[elementIndex])))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * JsonbRootScalar sets the given value to the scalar the jsonb value holds, and
+ * returns false if it holds a document or an array instead.
+ */
+static bool
+JsonbRootScalar(Jsonb *jsonb, JsonbValue *value)
+{
+	JsonbIterator *iterator = NULL;
+
+	if (!JB_ROOT_IS_SCALAR(jsonb))
+	{
+		return false;
+	}
+
+	/* a scalar is stored as an array of one element */
+	iterator = JsonbIteratorInit(&jsonb->root);
+	while (JsonbIteratorNext(&iterator, value, true) != WJB_ELEM)
+		;
+
+	return true;
+}
+
+
+/*
+ * JsonbScalarConstant returns the given jsonb scalar as a constant that is sent
+ * as the BSON value MongoDB compares equal to it: a string, a boolean, or an
+ * integral number as a 64-bit integer, which MongoDB compares with integers and
+ * doubles alike. Other numbers may have been rounded on their way from a double
+ * to a jsonb numeric, and they and nulls return NULL.
+ */
+static Const *
+JsonbScalarConstant(JsonbValue *value)
+{
+	switch (value->type)
+	{
+		case jbvString:
+		{
+			text *textValue = cstring_to_text_with_len(value->val.string.val,
+														value->val.string.len);
+
+			return makeConst(TEXTOID, -1, DEFAULT_COLLATION_OID, -1,
+							 PointerGetDatum(textValue), false, false);
+		}
+		case jbvBool:
+			return makeConst(BOOLOID, -1, InvalidOid, 1,
+							 BoolGetDatum(value->val.boolean), false, true);
+		case jbvNumeric:
+		{
+			char *numberText = DatumGetCString(DirectFunctionCall1(numeric_out,
+										NumericGetDatum(value->val.numeric)));
+			const char *digits = numberText + (numberText[0] == '-' ? 1 : 0);
+			size_t digitCount = strspn(digits, "0123456789");
+
+			/* numeric_out prints integral values without a fraction */
+			if (digitCount == 0 || digitCount > 18 || digits[digitCount] != '\0')
+			{
+				return NULL;
+			}
+
+			return makeConst(INT8OID, -1, InvalidOid, sizeof(int64),
+							 Int64GetDatum(strtoll(numberText, NULL, 10)),
+							 false, FLOAT8PASSBYVAL);
+		}
+		default:
+			return NULL;
+	}
+}
+
+
+/*
+ * JsonContainment checks whether the given clause tests a jsonb column, or a
+ * field inside one, for containing a jsonb constant, as doc @> '{"address":
+ * {"city": "Taipei"}}' does, and if so returns the column, appends the
+ * field's path to the given one and sets *constant. On a column itself, the
+ * constant has to be a document, so that its fields have names.
+ */
+static Var *
+JsonContainment(Expr *clause, StringInfo fieldPath, Const **constant)
+{
+	OpExpr *opExpression = NULL;
+	char *operatorName = NULL;
+	Expr *container = NULL;
+	Expr *value = NULL;
+	Var *column = NULL;
+	Jsonb *jsonb = NULL;
+
+	if (!IsA(clause, OpExpr))
+	{
+		return NULL;
+	}
+
+	opExpression = (OpExpr *) clause;
+	operatorName = get_opname(opExpression->opno);
+	if (list_length(opExpression->args) != 2 || operatorName == NULL)
+	{
+		return NULL;
+	}
+
+	if (strcmp(operatorName, "@>") == 0)
+	{
+		container = (Expr *) linitial(opExpression->args);
+		value = StripRelabel((Expr *) lsecond(opExpression->args));
+	}
+	else if (strcmp(operatorName, "<@") == 0)
+	{
+		container = (Expr *) lsecond(opExpression->args);
+		value = StripRelabel((Expr *) linitial(opExpression->args));
+	}
+	else
+	{
+		return NULL;
+	}
+
+	if (!IsA(value, Const) || ((Const *) value)->consttype != JSONBOID ||
+		((Const *) value)->constisnull)
+	{
+		return NULL;
+	}
+
+	column = JsonPathColumn(container, fieldPath);
+	if (column == NULL || column->varattno <= 0 || column->vartype != JSONBOID)
+	{
+		return NULL;
+	}
+
+	jsonb = DatumGetJsonb(((Const *) value)->constvalue);
+	if (fieldPath->len == 0 && !JB_ROOT_IS_OBJECT(jsonb))
+	{
+		return NULL;
+	}
+
+	*constant = (Const *) value;
+	return column;
+}
+
+
+/*
+ * AppendContainedValues appends to the $and array being built in the document
+ * a condition {field: value} for each scalar in the given jsonb container, with
+ * the dotted name of its field, and returns the index that follows the last
+ * condition. MongoDB matches such a field also when an array holds the value,
+ * or holds documents with the field, so that it matches at least the documents
+ * that contain the container. Arrays inside arrays are left out, as MongoDB
+ * only looks into one level of arrays, and so are numbers JsonbScalarConstant
+ * can't send. With a NULL document, conditions are only counted.
+ */
+static int
+AppendContainedValues(BSON *document, JsonbContainer *container,
+					  StringInfo fieldName, int conditionIndex)
+{
+	JsonbIterator *iterator = JsonbIteratorInit(container);
+	JsonbValue value;
+	int pathLength = fieldName->len;
+	bool inArray = false;
+	bool keyValid = false;
+	int token = 0;
+
+	while ((token = JsonbIteratorNext(&iterator, &value, true)) != WJB_DONE)
+	{
+		if (token == WJB_BEGIN_ARRAY)
+		{
+			inArray = true;
+		}
+		else if (token == WJB_KEY)
+		{
+			char *keyName = pnstrdup(value.val.string.val, value.val.string.len);
+
+			fieldName->len = pathLength;
+			fieldName->data[pathLength] = '\0';
+			keyValid = JsonPathKeyValid(keyName);
+			if (keyValid)
+			{
+				appendStringInfo(fieldName, "%s%s", (pathLength > 0) ? "." : "",
+								 keyName);
+			}
+		}
+		else if ((token == WJB_VALUE && keyValid) || token == WJB_ELEM)
+		{
+			if (value.type == jbvBinary)
+			{
+				if (!inArray ||
+					(value.val.binary.data->header & JB_FARRAY) == 0)
+				{
+					conditionIndex = AppendContainedValues(document,
+														   value.val.binary.data,
+														   fieldName,
+														   conditionIndex);
+				}
+			}
+			else if (fieldName->len > 0)
+			{
+				Const *constant = NULL;
+
+				if (value.type == jbvNull)
+				{
+					constant = makeNullConst(TEXTOID, -1, InvalidOid);
+				}
+				else
+				{
+					constant = JsonbScalarConstant(&value);
+				}
+
+				if (constant != NULL)
+				{
+					if (document != NULL)
+					{
+						char conditionKey[12];
+						BSON r;
+
+						snprintf(conditionKey, sizeof(conditionKey), "%d",
+								 conditionIndex);
+						BsonAppendStartObject(document, conditionKey, &r);
+						AppendConstantValue(SUBDOCUMENT(document, &r),
+											fieldName->data, constant);
+						BsonAppendFinishObject(document, &r);
+					}
+					conditionIndex++;
+				}
+			}
+		}
+	}
+
+	fieldName->len = pathLength;
+	fieldName->data[pathLength] = '\0';
+	return conditionIndex;
+}
+
+
+/*
+ * ColumnFieldName returns the name of the field with the given path inside the
+ * given column: the column's name, followed by the path if there is one.
+ * Fields inside the __doc column, which holds the whole document, are named by
+ * their path alone.
+ */
+static char *
+ColumnFieldName(Oid relationId, Var *column, const char *fieldPath)
+{
+	char *columnName = get_relid_attribute_name(relationId, column->varattno);
+
+	if (fieldPath == NULL || fieldPath[0] == '\0')
+	{
+		return columnName;
+	}
+	else if (strcmp(columnName, "__doc") == 0)
+	{
+		return pstrdup(fieldPath);
+	}
+
+	return psprintf("%s.%s", columnName, fieldPath);
+}
+
+
+/*
+ * IdTimeComparison returns, for a comparison of the column the _id_time option
+ * names with a time, a comparison of the time of the _id column, which holds
+ * for at least the same documents, and NULL for other comparisons. The option
+ * declares that the column holds the time at which the document's _id was
+ * generated, which MongoDB can then find in the index on _id. The column and
+ * the value must be of the same type, as timestamps without time zone are
+ * taken for UTC only when they are converted from and to BSON.
+ */
+static MongoComparison *
+IdTimeComparison(Oid relationId, MongoComparison *comparison,
+				 const char *idTimeColumn)
+{
+	MongoComparison *idComparison = NULL;
+	const char *operatorName = comparison->operatorName;
+	Oid columnTypeId = comparison->column->vartype;
+	AttrNumber idColumnId = InvalidAttrNumber;
+
+	if (idTimeColumn == NULL || comparison->fieldPath != NULL ||
+		comparison->objectIdTime ||
+		(columnTypeId != TIMESTAMPOID && columnTypeId != TIMESTAMPTZOID) ||
+		exprType((Node *) comparison->value) != columnTypeId)
+	{
+		return NULL;
+	}
+
+	if (strcmp(operatorName, EQUALITY_OPERATOR_NAME) != 0 &&
+		strcmp(operatorName, "$lt") != 0 && strcmp(operatorName, "$lte") != 0 &&
+		strcmp(operatorName, "$gt") != 0 && strcmp(operatorName, "$gte") != 0)
+	{
+		return NULL;
+	}
+
+	if (strcmp(get_relid_attribute_name(relationId, comparison->column->varattno),
+			   idTimeColumn) != 0)
+	{
+		return NULL;
+	}
+
+	idColumnId = get_attnum(relationId, "_id");
+	if (idColumnId == InvalidAttrNumber)
+	{
+		return NULL;
+	}
+
+	idComparison = palloc(sizeof(MongoComparison));
+	*idComparison = *comparison;
+	idComparison->column = makeVar(comparison->column->varno, idColumnId,
+								   NAMEOID, -1, InvalidOid, 0);
+	idComparison->objectIdTime = true;
+	return idComparison;
+}
+
+
+/*
+ * ArrayConstantHasValues tells whether the given array constant holds elements
+ * other than nulls.
+ */
+static bool
+ArrayConstantHasValues(Const *arrayConstant)
+{
+	ArrayType *array = DatumGetArrayTypeP(arrayConstant->constvalue);
+	Oid elementTypeId = ARR_ELEMTYPE(array);
+	int16 typeLength = 0;
+	bool typeByValue = false;
+	char typeAlignment = 0;
+	Datum *elementValues = NULL;
+	bool *elementNulls = NULL;
+	int elementCount = 0;
+	int elementIndex = 0;
+
+	get_typlenbyvalalign(elementTypeId, &typeLength, &typeByValue, &typeAlignment);
+	deconstruct_array(array, elementTypeId, typeLength, typeByValue,
+					  typeAlignment, &elementValues, &elementNulls, &elementCount);
+
+	for (elementIndex = 0; elementIndex < elementCount; elementIndex++)
+	{
+		if (!elementNulls[elementIndex])
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * ColumnComparison checks whether the given clause compares a column against a
+ * constant or parameter value in a way MongoDB can evaluate, and if so fills in
+ * the comparison. Comparisons with the value on the left are commuted, so that
+ * "10 < l_quantity" becomes "l_quantity > 10". Fields of json and jsonb columns
+ * are only compared for equality with constants, see JsonPathValueSupported.
+ * On array columns, "'x' = ANY(tags)" becomes {tags: 'x'}, which MongoDB
+ * matches when the array holds the value, "tags @> ARRAY['a', 'b']" becomes
+ * {tags: {$all: ['a', 'b']}} and "tags && ARRAY['a', 'b']" {tags: {$in: ['a',
+ * 'b']}}.
+ */
+static bool
+ColumnComparison(Expr *clause, MongoComparison *comparison)
+{
+	Expr *leftArgument = NULL;
+	Expr *rightArgument = NULL;
+	Oid operatorId = InvalidOid;
+	char *operatorName = NULL;
+	Oid valueTypeId = InvalidOid;
+	Var *column = NULL;
+	char *fieldPath = NULL;
+	bool objectIdTime = false;
+	bool elementTest = false;
+
+	if (IsA(clause, OpExpr))
+	{
+		OpExpr *opExpression = (OpExpr *) clause;
+
+		if (list_length(opExpression->args) != 2)
+		{
+			return false;
+		}
+
+		leftArgument = StripRelabel((Expr *) linitial(opExpression->args));
+		rightArgument = StripRelabel((Expr *) lsecond(opExpression->args));
+		operatorId = opExpression->opno;
+		comparison->collationId = opExpression->inputcollid;
+
+		if (ComparedColumn(leftArgument, &fieldPath, &objectIdTime) == NULL &&
+			ComparedColumn(rightArgument, &fieldPath, &objectIdTime) != NULL)
+		{
+			Expr *argument = leftArgument;
+
+			leftArgument = rightArgument;
+			rightArgument = argument;
+			operatorId = get_commutator(operatorId);
+			if (operatorId == InvalidOid)
+			{
+				return false;
+			}
+		}
+	}
+	else if (IsA(clause, ScalarArrayOpExpr))
+	{
+		ScalarArrayOpExpr *arrayExpression = (ScalarArrayOpExpr *) clause;
+
+		if (list_length(arrayExpression->args) != 2)
+		{
+			return false;
+		}
+
+		leftArgument = StripRelabel((Expr *) linitial(arrayExpression->args));
+		rightArgument = (Expr *) lsecond(arrayExpression->args);
+		operatorId = arrayExpression->opno;
+		comparison->collationId = arrayExpression->inputcollid;
+
+		/* a value compared with the elements of an array column */
+		if (!IsA(leftArgument, Var) && IsA(StripRelabel(rightArgument), Var))
+		{
+			Expr *argument = leftArgument;
+
+			leftArgument = StripRelabel(rightArgument);
+			rightArgument = argument;
+			elementTest = true;
+		}
+	}
+	else
+	{
+		return false;
+	}
+
+	column = ComparedColumn(leftArgument, &fieldPath, &objectIdTime);
+	if (column == NULL || !ValueIsScanConstant(rightArgument))
+	{
+		return false;
+	}
+
+	/* we skip system columns and whole-row references */
+	if (column->varattno <= 0)
+	{
+		return false;
+	}
+
+	operatorName = get_opname(operatorId);
+	if (operatorName == NULL)
+	{
+		return false;
+	}
+
+	valueTypeId = exprType((Node *) rightArgument);
+	comparison->operatorName = NULL;
+
+	if (objectIdTime)
+	{
+		/*
+		 * The time is sent as a range of ObjectIds, see AppendObjectIdTimeRange.
+		 * Other values than timestamptz are converted in the session's time
+		 * zone, which we don't follow.
+		 */
+		if (IsA(clause, OpExpr) && valueTypeId == TIMESTAMPTZOID)
+		{
+			if (strncmp(operatorName, EQUALITY_OPERATOR_NAME, NAMEDATALEN) == 0)
+			{
+				comparison->operatorName = EQUALITY_OPERATOR_NAME;
+			}
+			else if (strncmp(operatorName, "<>", NAMEDATALEN) != 0)
+			{
+				comparison->operatorName = MongoOperatorName(operatorName);
+			}
+		}
+	}
+	else if (fieldPath != NULL)
+	{
+		bool equality = (strncmp(operatorName, EQUALITY_OPERATOR_NAME,
+								 NAMEDATALEN) == 0);
+
+		if (!equality || !IsA(rightArgument, Const) ||
+			((Const *) rightArgument)->constisnull)
+		{
+			return false;
+		}
+
+		if (IsA(clause, ScalarArrayOpExpr))
+		{
+			if (((ScalarArrayOpExpr *) clause)->useOr &&
+				JsonPathValueSupported((Const *) rightArgument))
+			{
+				comparison->operatorName = "$in";
+			}
+		}
+		else if (valueTypeId == JSONBOID)
+		{
+			/* the jsonb scalar is sent as the value it holds */
+			JsonbValue scalarValue;
+
+			if (JsonbRootScalar(DatumGetJsonb(((Const *) rightArgument)->constvalue),
+									   &scalarValue))
+			{
+				rightArgument = (Expr *) JsonbScalarConstant(&scalarValue);
+				if (rightArgument != NULL)
+				{
+					comparison->operatorName = EQUALITY_OPERATOR_NAME;
+				}
+			}
+		}
+		else if (JsonPathValueSupported((Const *) rightArgument))
+		{
+			comparison->operatorName = EQUALITY_OPERATOR_NAME;
+		}
+	}
+	else if (type_is_array(column->vartype))
+	{
+		if (elementTest)
+		{
+			if (((ScalarArrayOpExpr *) clause)->useOr &&
+				strncmp(operatorName, EQUALITY_OPERATOR_NAME, NAMEDATALEN) == 0 &&
+				MongoValueTypeSupported(valueTypeId))
+			{
+				comparison->operatorName = EQUALITY_OPERATOR_NAME;
+			}
+		}
+		else if (IsA(clause, OpExpr) && IsA(rightArgument, Const) &&
+				 !((Const *) rightArgument)->constisnull &&
+				 MongoValueTypeSupported(get_element_type(valueTypeId)))
+		{
+			/* $all with no values matches no document, but @> holds */
+			if (strncmp(operatorName, "@>", NAMEDATALEN) == 0 &&
+				ArrayConstantHasValues((Const *) rightArgument))
+			{
+				comparison->operatorName = "$all";
+			}
+			else if (strncmp(operatorName, "&&", NAMEDATALEN) == 0)
+			{
+				comparison->operatorName = "$in";
+			}
+		}
+	}
+	else if (IsA(clause, ScalarArrayOpExpr))
+	{
+		ScalarArrayOpExpr *arrayExpression = (ScalarArrayOpExpr *) clause;
+
+		/*
+		 * We only send IN and NOT IN lists of constants, that is = ANY and
+		 * <> ALL, as MongoDB has no equivalent for other array comparisons.
+		 */
+		if (!IsA(rightArgument, Const) || ((Const *) rightArgument)->constisnull ||
+			!MongoValueTypeSupported(get_element_type(valueTypeId)))
+		{
+			return false;
+		}
+
+		if (arrayExpression->useOr &&
+			strncmp(operatorName, EQUALITY_OPERATOR_NAME, NAMEDATALEN) == 0)
+		{
+			comparison->operatorName = "$in";
+		}
+		else if (!arrayExpression->useOr &&
+				 strncmp(operatorName, "<>", NAMEDATALEN) == 0)
+		{
+			comparison->operatorName = "$nin";
+		}
+	}
+	else if (strncmp(operatorName, "~~", NAMEDATALEN) == 0)
+	{
+		/* LIKE is only sent for text columns, where it compares characters */
+		if ((column->vartype == TEXTOID || column->vartype == VARCHAROID) &&
+			valueTypeId == TEXTOID && IsA(rightArgument, Const) &&
+			!((Const *) rightArgument)->constisnull)
+		{
+			comparison->operatorName = "$regex";
+		}
+	}
+	else if (MongoValueTypeSupported(valueTypeId))
+	{
+		/*
+		 * We don't push down comparisons with array values, since conditional
+		 * operators for arrays in MongoDB aren't properly defined. For example,
+		 * {similar_products : [ "B0009S4IJW", "6301964144" ]} finds results
+		 * that are equal to the array, but {similar_products: {$gte: [
+		 * "B0009S4IJW", "6301964144" ]}} returns an empty set.
+		 */
+		if (strncmp(operatorName, EQUALITY_OPERATOR_NAME, NAMEDATALEN) == 0)
+		{
+			comparison->operatorName = EQUALITY_OPERATOR_NAME;
+		}
+		else
+		{
+			comparison->operatorName = MongoOperatorName(operatorName);
+		}
+	}
+
+	if (comparison->operatorName == NULL)
+	{
+		return false;
+	}
+
+	comparison->column = column;
+	comparison->fieldPath = fieldPath;
+	comparison->objectIdTime = objectIdTime;
+	comparison->value = rightArgument;
+	return true;
+}
+
+
+/*
+ * ComparisonIsExact tells whether MongoDB matches exactly those documents for
+ * which the given comparison holds. This is not the case for <> and NOT IN,
+ * which MongoDB also matches for missing fields; for range comparisons of text
+ * outside the C collation, as MongoDB compares strings bytewise; for values
+ * of another type than the column's, which are converted before they are sent;
+ * for fields inside json columns and array columns, as MongoDB also matches a
+ * field that holds the value itself instead of an array; and for the times of
+ * ObjectIds, whose ranges are widened to whole seconds. A comparison with a
+ * null value holds for no row, and is sent as one that matches no document.
  */
-List *
-ApplicableOpExpressionList(RelOptInfo *baserel)
+static bool
+ComparisonIsExact(MongoComparison *comparison)
 {
-	List *opExpressionList = NIL;
-	List *restrictInfoList = baserel->baserestrictinfo;
-	ListCell *restrictInfoCell = NULL;
+	const char *operatorName = comparison->operatorName;
+	Oid columnTypeId = comparison->column->vartype;
+	Oid valueTypeId = exprType((Node *) comparison->value);
+	bool equalsOperator = false;
+
+	if (comparison->fieldPath != NULL || comparison->objectIdTime ||
+		type_is_array(columnTypeId) ||
+		strcmp(operatorName, "$ne") == 0 || strcmp(operatorName, "$nin") == 0)
+	{
+		return false;
+	}
+	else if (strcmp(operatorName, "$regex") == 0)
+	{
+		return true;
+	}
+	else if (strcmp(operatorName, "$in") == 0)
+	{
+		valueTypeId = get_element_type(valueTypeId);
+		equalsOperator = true;
+	}
+	else if (strcmp(operatorName, EQUALITY_OPERATOR_NAME) == 0)
+	{
+		equalsOperator = true;
+	}
 
-	foreach(restrictInfoCell, restrictInfoList)
+	switch (columnTypeId)
 	{
-		RestrictInfo *restrictInfo = (RestrictInfo *) lfirst(restrictInfoCell);
-		Expr *expression = restrictInfo->clause;
-		NodeTag expressionType = 0;
+		case INT2OID: case INT4OID:
+		case INT8OID: case FLOAT4OID:
+		case FLOAT8OID: case NUMERICOID:
+			return (valueTypeId == INT2OID || valueTypeId == INT4OID ||
+					valueTypeId == INT8OID || valueTypeId == FLOAT4OID ||
+					valueTypeId == FLOAT8OID || valueTypeId == NUMERICOID);
+		case TIMESTAMPOID: case TIMESTAMPTZOID:
+			return (valueTypeId == columnTypeId);
+		case NAMEOID:
+			return (equalsOperator && valueTypeId == NAMEOID);
+		case TEXTOID: case VARCHAROID:
+			return ((valueTypeId == TEXTOID || valueTypeId == VARCHAROID) &&
+					(equalsOperator || lc_collate_is_c(comparison->collationId)));
+		default:
+			return false;
+	}
+}
 
-		OpExpr *opExpression = NULL;
-		char *operatorName = NULL;
-		char *mongoOperatorName = NULL;
-		List *argumentList = NIL;
-		Var *column = NULL;
-		Const *constant = NULL;
-		bool equalsOperator = false;
-		bool constantIsArray = false;
-		Param *paramNode = NULL;
 
-		/* we only support operator expressions */
-		expressionType = nodeTag(expression);
-		if (expressionType != T_OpExpr)
+/*
+ * EvaluateComparisonValue replaces a value of the given comparison that is only
+ * known at execution by a constant holding its current value. The function
+ * returns false if the value is null, as the comparison then holds for no row.
+ * Without a scan state, values are left as they are.
+ */
+static bool
+EvaluateComparisonValue(MongoComparison *comparison,
+						ForeignScanState *scanStateNode)
+{
+	if (!IsA(comparison->value, Const))
+	{
+		if (scanStateNode == NULL)
 		{
-			continue;
+			return true;
 		}
+		comparison->value = (Expr *) EvaluateValue(comparison->value,
+												   scanStateNode);
+	}
+
+	return !((Const *) comparison->value)->constisnull;
+}
 
-		opExpression = (OpExpr *) expression;
-		operatorName = get_opname(opExpression->opno);
 
-		/* we only support =, <, >, <=, >=, and <> operators */
-		if (strncmp(operatorName, EQUALITY_OPERATOR_NAME, NAMEDATALEN) == 0)
+/*
+ * EvaluateValue evaluates the given expression, which has the same value for
+ * all rows of the scan, and returns that value as a constant.
+ */
+static Const *
+EvaluateValue(Expr *value, ForeignScanState *scanStateNode)
+{
+	ExprState *valueState = NULL;
+	Datum valueDatum = 0;
+	bool isNull = false;
+	int16 typeLength = 0;
+	bool typeByValue = false;
+
+	if (IsA(value, Const))
+	{
+		return (Const *) value;
+	}
+
+	valueState = ExecInitExpr(value, (PlanState *) scanStateNode);
+#if PG_VERSION_NUM >= 100000
+	valueDatum = ExecEvalExpr(valueState, scanStateNode->ss.ps.ps_ExprContext,
+							  &isNull);
+#else
+	valueDatum = ExecEvalExpr(valueState, scanStateNode->ss.ps.ps_ExprContext,
+							  &isNull, NULL);
+#endif
+
+	get_typlenbyval(exprType((Node *) value), &typeLength, &typeByValue);
+	return makeConst(exprType((Node *) value), exprTypmod((Node *) value),
+					 exprCollation((Node *) value), typeLength, valueDatum,
+					 isNull, typeByValue);
+}
+
+
+/*
+ * AppendClause appends to the given document, under the given key, a query
+ * document that matches at least the documents for which the given clause
+ * holds, and tells whether it matches exactly those. With a NULL document, the
+ * function only checks whether it can translate the clause. IS NULL becomes
+ * {column: null}, which matches null values and missing fields alike, and IS
+ * NOT NULL {column: {$ne: null}}; AND, OR and NOT become $and, $or and $nor.
+ * Containment of a jsonb constant becomes an $and of its fields' values, see
+ * AppendContainedValues. The function returns false for clauses it cannot
+ * translate.
+ */
+static bool
+AppendClause(BSON *document, const char *keyName, Expr *clause,
+			 Oid relationId, ForeignScanState *scanStateNode, bool *exact)
+{
+	MongoComparison comparison;
+	StringInfoData fieldPath;
+	Const *containedValue = NULL;
+	Var *containerColumn = NULL;
+
+	if (ColumnComparison(clause, &comparison))
+	{
+		*exact = ComparisonIsExact(&comparison);
+		if (document != NULL)
 		{
-			equalsOperator = true;
+			char *fieldName = ColumnFieldName(relationId, comparison.column,
+											  comparison.fieldPath);
+			BSON r;
+
+			BsonAppendStartObject(document, (char *) keyName, &r);
+			AppendComparison(SUBDOCUMENT(document, &r), fieldName,
+							 &comparison, scanStateNode);
+			BsonAppendFinishObject(document, &r);
 		}
+		return true;
+	}
 
-		mongoOperatorName = MongoOperatorName(operatorName);
-		if (!equalsOperator && mongoOperatorName == NULL)
+	initStringInfo(&fieldPath);
+	containerColumn = JsonContainment(clause, &fieldPath, &containedValue);
+	if (containerColumn != NULL)
+	{
+		Jsonb *jsonb = DatumGetJsonb(containedValue->constvalue);
+		StringInfoData fieldName;
+		BSON r;
+		BSON t;
+
+		/* the column's name doesn't change the count of conditions */
+		*exact = false;
+		if (document == NULL)
 		{
-			continue;
+			return (AppendContainedValues(NULL, &jsonb->root, &fieldPath, 0) > 0);
 		}
 
-		/*
-		 * We only support simple binary operators that compare a column against
-		 * a constant. If the expression is a tree, we don't recurse into it.
-		 */
-		argumentList = opExpression->args;
-		column = (Var *) FindArgumentOfType(argumentList, T_Var);
-		constant = (Const *) FindArgumentOfType(argumentList, T_Const);
-		paramNode = (Param *) FindArgumentOfType(argumentList, T_Param);
+		initStringInfo(&fieldName);
+		appendStringInfoString(&fieldName, ColumnFieldName(relationId,
+														   containerColumn,
+														   fieldPath.data));
+
+		BsonAppendStartObject(document, (char *) keyName, &r);
+		BsonAppendStartArray(SUBDOCUMENT(document, &r), "$and", &t);
+		AppendContainedValues(SUBDOCUMENT(SUBDOCUMENT(document, &r), &t),
+							  &jsonb->root, &fieldName, 0);
+		BsonAppendFinishArray(SUBDOCUMENT(document, &r), &t);
+		BsonAppendFinishObject(document, &r);
+		return true;
+	}
+	else if (IsA(clause, NullTest))
+	{
+		NullTest *nullTest = (NullTest *) clause;
+		Var *column = (Var *) StripRelabel(nullTest->arg);
 
-		/*
-		 * We don't push down operators where the constant is an array, since
-		 * conditional operators for arrays in MongoDB aren't properly defined.
-		 * For example, {similar_products : [ "B0009S4IJW", "6301964144" ]}
-		 * finds results that are equal to the array, but {similar_products:
-		 * {$gte: [ "B0009S4IJW", "6301964144" ]}} returns an empty set.
-		 */
-		if (constant != NULL)
+		if (nullTest->argisrow || !IsA(column, Var) || column->varattno <= 0)
+		{
+			return false;
+		}
+
+		/* PostgreSQL also reads values of another type than the column's as null */
+		*exact = false;
+		if (document != NULL)
 		{
-			Oid constantArrayTypeId = get_element_type(constant->consttype);
-			if (constantArrayTypeId != InvalidOid)
+			char *columnName = get_relid_attribute_name(relationId,
+														column->varattno);
+			BSON r;
+			BSON t;
+
+			BsonAppendStartObject(document, (char *) keyName, &r);
+			if (nullTest->nulltesttype == IS_NULL)
+			{
+				BsonAppendNull(SUBDOCUMENT(document, &r), columnName);
+			}
+			else
 			{
-				constantIsArray = true;
+				BsonAppendStartObject(SUBDOCUMENT(document, &r), columnName, &t);
+				BsonAppendNull(SUBDOCUMENT(SUBDOCUMENT(document, &r), &t), "$ne");
+				BsonAppendFinishObject(SUBDOCUMENT(document, &r), &t);
 			}
+			BsonAppendFinishObject(document, &r);
 		}
+		return true;
+	}
+	else if (IsA(clause, BoolExpr))
+	{
+		BoolExpr *boolExpression = (BoolExpr *) clause;
+		List *argumentList = NIL;
+		ListCell *argumentCell = NULL;
+		bool argumentsExact = true;
+		char *mongoOperatorName = NULL;
 
-		if (column != NULL && constant != NULL && !constantIsArray)
+		foreach(argumentCell, boolExpression->args)
 		{
-			opExpressionList = lappend(opExpressionList, opExpression);
+			Expr *argument = (Expr *) lfirst(argumentCell);
+			bool argumentExact = false;
+
+			if (AppendClause(NULL, NULL, argument, relationId, NULL,
+							 &argumentExact))
+			{
+				argumentList = lappend(argumentList, argument);
+				argumentsExact = argumentsExact && argumentExact;
+			}
+			else if (boolExpression->boolop == AND_EXPR)
+			{
+				/* leaving out a conjunct only lets more documents through */
+				argumentsExact = false;
+			}
+			else
+			{
+				return false;
+			}
 		}
 
-		if (column != NULL && paramNode != NULL)
+		if (argumentList == NIL)
 		{
-			opExpressionList = lappend(opExpressionList, opExpression);
+			return false;
 		}
-	}
 
-	return opExpressionList;
-}
+		switch (boolExpression->boolop)
+		{
+			case AND_EXPR:
+				mongoOperatorName = "$and";
+				*exact = argumentsExact;
+				break;
+			case OR_EXPR:
+				mongoOperatorName = "$or";
+				*exact = argumentsExact;
+				break;
+			case NOT_EXPR:
+				/*
+				 * Negating a document that lets more documents through would
+				 * let fewer through. And where the argument is null, MongoDB
+				 * matches the negation while PostgreSQL doesn't.
+				 */
+				if (!argumentsExact)
+				{
+					return false;
+				}
+				mongoOperatorName = "$nor";
+				*exact = false;
+				break;
+			default:
+				return false;
+		}
 
+		if (document != NULL)
+		{
+			BSON r;
+			BSON t;
+			int argumentIndex = 0;
 
-/*
- * FindArgumentOfType walks over the given argument list, looks for an argument
- * with the given type, and returns the argument if it is found.
- */
-static Expr *
-FindArgumentOfType(List *argumentList, NodeTag argumentType)
-{
-	Expr *foundArgument = NULL;
-	ListCell *argumentCell = NULL;
+			BsonAppendStartObject(document, (char *) keyName, &r);
+			BsonAppendStartArray(SUBDOCUMENT(document, &r), mongoOperatorName, &t);
+			foreach(argumentCell, argumentList)
+			{
+				Expr *argument = (Expr *) lfirst(argumentCell);
+				bool argumentExact = false;
+				char argumentKey[12];
 
-	foreach(argumentCell, argumentList)
-	{
-		Expr *argument = (Expr *) lfirst(argumentCell);
-		if (nodeTag(argument) == argumentType)
-		{
-			foundArgument = argument;
-			break;
+				snprintf(argumentKey, sizeof(argumentKey), "%d", argumentIndex++);
+				AppendClause(SUBDOCUMENT(SUBDOCUMENT(document, &r), &t), argumentKey,
+							 argument, relationId, scanStateNode, &argumentExact);
+			}
+			BsonAppendFinishArray(SUBDOCUMENT(document, &r), &t);
+			BsonAppendFinishObject(document, &r);
 		}
+		return true;
 	}
 
-	return foundArgument;
+	return false;
 }
 
 
 /*
- * QueryDocument takes in the applicable operator expressions for a relation and
- * converts these expressions into equivalent queries in MongoDB. For now, this
- * function can only transform simple comparison expressions, and returns these
- * transformed expressions in a BSON document. For example, simple expressions
+ * QueryDocument takes in the applicable clauses for a relation and converts
+ * them into an equivalent query in MongoDB. For example, simple expressions
  * "l_shipdate >= date '1994-01-01' AND l_shipdate < date '1995-01-01'" become
  * "l_shipdate: { $gte: new Date(757382400000), $lt: new Date(788918400000) }".
+ * Comparisons that repeat an operator on a column, and clauses other than
+ * comparisons, go into a top-level $and array. So do the ranges of ObjectIds
+ * that comparisons of their times become, including those derived from the
+ * comparisons of the column the _id_time option names, which stay as well.
  */
 BSON *
 QueryDocument(Oid relationId, List *opExpressionList, ForeignScanState *scanStateNode)
 {
-	List *equalityOperatorList = NIL;
-	List *comparisonOperatorList = NIL;
-	List *columnList = NIL;
-	ListCell *equalityOperatorCell = NULL;
-	ListCell *columnCell = NULL;
+	List *comparisonList = NIL;
+	List *fieldNameList = NIL;
+	List *deferredList = NIL;
+	List *conjunctList = NIL;
+	ListCell *opExpressionCell = NULL;
+	ListCell *fieldNameCell = NULL;
 	BSON *queryDocument = NULL;
+	char *idTimeColumn = mongo_get_id_time_column(relationId);
 
 	queryDocument = BsonCreate();
-	/*
-	 * We distinguish between equality expressions and others since we need to
-	 * insert the latter (<, >, <=, >=, <>) as separate sub-documents into the
-	 * BSON query object.
-	 */
-	equalityOperatorList = EqualityOperatorList(opExpressionList);
-	comparisonOperatorList = list_difference(opExpressionList, equalityOperatorList);
 
-	/* append equality expressions to the query */
-	foreach(equalityOperatorCell, equalityOperatorList)
+	foreach(opExpressionCell, opExpressionList)
 	{
-		OpExpr *equalityOperator = (OpExpr *) lfirst(equalityOperatorCell);
-		Oid columnId = InvalidOid;
-		char *columnName = NULL;
-		Const *constant = NULL;
-		Param *paramNode = NULL;
+		Expr *clause = (Expr *) lfirst(opExpressionCell);
+		MongoComparison *comparison = palloc0(sizeof(MongoComparison));
+		MongoComparison *idComparison = NULL;
+		char *fieldName = NULL;
 
-		List *argumentList = equalityOperator->args;
-		Var *column = (Var *) FindArgumentOfType(argumentList, T_Var);
-		constant = (Const *) FindArgumentOfType(argumentList, T_Const);
-		paramNode = (Param *) FindArgumentOfType(argumentList, T_Param);
+		if (ColumnComparison(clause, comparison))
+		{
+			/* a comparison with null matches nothing, by itself in $and */
+			if (!EvaluateComparisonValue(comparison, scanStateNode) ||
+				comparison->objectIdTime)
+			{
+				deferredList = lappend(deferredList, comparison);
+				continue;
+			}
 
-		columnId = column->varattno;
-		columnName = get_relid_attribute_name(relationId, columnId);
+			idComparison = IdTimeComparison(relationId, comparison,
+											idTimeColumn);
+			if (idComparison != NULL)
+			{
+				deferredList = lappend(deferredList, idComparison);
+			}
 
-		if (constant != NULL)
-			AppendConstantValue(queryDocument, columnName, constant);
+			fieldName = ColumnFieldName(relationId, comparison->column,
+										comparison->fieldPath);
+			comparisonList = lappend(comparisonList, comparison);
+			fieldNameList = list_append_unique(fieldNameList,
+											   makeString(fieldName));
+		}
 		else
-			AppendParamValue(queryDocument, columnName, paramNode, scanStateNode);
+		{
+			pfree(comparison);
+			conjunctList = lappend(conjunctList, clause);
+		}
 	}
 
 	/*
-	 * For comparison expressions, we need to group them by their columns and
-	 * append all expressions that correspond to a column as one sub-document.
+	 * For comparison expressions, we need to group them by their fields and
+	 * append all expressions that correspond to a field as one sub-document.
 	 * Otherwise, even when we have two expressions to define the upper- and
 	 * lower-bound of a range, Mongo uses only one of these expressions during
-	 * an index search.
+	 * an index search. A field that is only compared for equality is appended
+	 * as is.
 	 */
-	columnList = UniqueColumnList(comparisonOperatorList);
-
-	/* append comparison expressions, grouped by columns, to the query */
-	foreach(columnCell, columnList)
+	foreach(fieldNameCell, fieldNameList)
 	{
-		Var *column = (Var *) lfirst(columnCell);
-		Oid columnId = InvalidOid;
-		char *columnName = NULL;
-		List *columnOperatorList = NIL;
-		ListCell *columnOperatorCell = NULL;
+		char *columnName = strVal(lfirst(fieldNameCell));
+		List *columnComparisonList = NIL;
+		List *excludedList = NIL;
+		List *operatorNameList = NIL;
+		ListCell *comparisonCell = NULL;
 		BSON r;
 
-		columnId = column->varattno;
-		columnName = get_relid_attribute_name(relationId, columnId);
+		foreach(comparisonCell, comparisonList)
+		{
+			MongoComparison *comparison = (MongoComparison *) lfirst(comparisonCell);
+
+			if (strcmp(ColumnFieldName(relationId, comparison->column,
+									   comparison->fieldPath), columnName) == 0)
+			{
+				columnComparisonList = lappend(columnComparisonList, comparison);
+			}
+		}
 
-		/* find all expressions that correspond to the column */
-		columnOperatorList = ColumnOperatorList(column, comparisonOperatorList);
+		if (list_length(columnComparisonList) == 1)
+		{
+			MongoComparison *comparison = linitial(columnComparisonList);
 
-		/* for comparison expressions, start a sub-document */
-		BsonAppendStartObject(queryDocument, columnName, &r);
+			if (strcmp(comparison->operatorName, EQUALITY_OPERATOR_NAME) == 0)
+			{
+				AppendComparisonValue(queryDocument, columnName,
+									  comparison->value, scanStateNode);
+				continue;
+			}
+		}
 
-		foreach(columnOperatorCell, columnOperatorList)
+		BsonAppendStartObject(queryDocument, columnName, &r);
+		foreach(comparisonCell, columnComparisonList)
 		{
-			OpExpr *columnOperator = (OpExpr *) lfirst(columnOperatorCell);
-			char *operatorName = NULL;
-			char *mongoOperatorName = NULL;
+			MongoComparison *comparison = (MongoComparison *) lfirst(comparisonCell);
+			const char *operatorName = comparison->operatorName;
 
-			List *argumentList = columnOperator->args;
-			Const *constant = (Const *) FindArgumentOfType(argumentList, T_Const);
+			/* values the column must differ from all go into one $nin list */
+			if (strcmp(operatorName, "$ne") == 0 ||
+				strcmp(operatorName, "$nin") == 0)
+			{
+				excludedList = lappend(excludedList, comparison);
+				continue;
+			}
 
-			operatorName = get_opname(columnOperator->opno);
-			mongoOperatorName = MongoOperatorName(operatorName);
-#ifdef META_DRIVER
-			AppendConstantValue(&r, mongoOperatorName, constant);
-#else
-			AppendConstantValue(queryDocument, mongoOperatorName, constant);
-#endif
+			/* equality becomes a single-valued $in next to other operators */
+			if (strcmp(operatorName, EQUALITY_OPERATOR_NAME) == 0)
+			{
+				operatorName = "$in";
+			}
+
+			/* a document can't hold an operator twice */
+			if (list_member(operatorNameList, makeString((char *) operatorName)))
+			{
+				deferredList = lappend(deferredList, comparison);
+				continue;
+			}
+
+			operatorNameList = lappend(operatorNameList,
+									   makeString((char *) operatorName));
+			AppendOperator(SUBDOCUMENT(queryDocument, &r), comparison,
+						   scanStateNode);
+		}
+
+		if (excludedList != NIL)
+		{
+			AppendExcludedValues(SUBDOCUMENT(queryDocument, &r), excludedList,
+								 scanStateNode);
 		}
 		BsonAppendFinishObject(queryDocument, &r);
 	}
 
+	if (deferredList != NIL || conjunctList != NIL)
+	{
+		ListCell *deferredCell = NULL;
+		ListCell *conjunctCell = NULL;
+		int conjunctIndex = 0;
+		char conjunctKey[12];
+		BSON t;
+
+		BsonAppendStartArray(queryDocument, "$and", &t);
+		foreach(deferredCell, deferredList)
+		{
+			MongoComparison *comparison = (MongoComparison *) lfirst(deferredCell);
+			char *columnName = ColumnFieldName(relationId, comparison->column,
+											   comparison->fieldPath);
+			BSON r;
+
+			snprintf(conjunctKey, sizeof(conjunctKey), "%d", conjunctIndex++);
+			BsonAppendStartObject(SUBDOCUMENT(queryDocument, &t), conjunctKey, &r);
+			AppendComparison(SUBDOCUMENT(SUBDOCUMENT(queryDocument, &t), &r),
+							 columnName, comparison, scanStateNode);
+			BsonAppendFinishObject(SUBDOCUMENT(queryDocument, &t), &r);
+		}
+		foreach(conjunctCell, conjunctList)
+		{
+			Expr *conjunct = (Expr *) lfirst(conjunctCell);
+			bool exact = false;
+
+			snprintf(conjunctKey, sizeof(conjunctKey), "%d", conjunctIndex++);
+			AppendClause(SUBDOCUMENT(queryDocument, &t), conjunctKey, conjunct,
+						 relationId, scanStateNode, &exact);
+		}
+		BsonAppendFinishArray(queryDocument, &t);
+	}
+
 	if (!BsonFinish(queryDocument))
 	{
 #ifdef META_DRIVER
@@ -281,6 +1766,68 @@ QueryDocument(Oid relationId, List *opExpressionList, ForeignScanState *scanStat
 }
 
 
+/*
+ * OrderedQueryDocument wraps the given query document into one that also asks
+ * MongoDB to sort the matching documents by the columns of the sort list, and
+ * to use the index with the keys of the hint list, if either list isn't NIL.
+ * It has the form {$query: {...}, $orderby: {...}, $hint: {...}} that both
+ * drivers understand. The function takes over the given document.
+ */
+BSON *
+OrderedQueryDocument(BSON *queryDocument, List *sortList, List *hintList)
+{
+	BSON *orderedDocument = BsonCreate();
+	ListCell *sortCell = NULL;
+	ListCell *hintCell = NULL;
+	BSON r;
+
+	BsonAppendBson(orderedDocument, "$query", queryDocument);
+	if (sortList != NIL)
+	{
+		BsonAppendStartObject(orderedDocument, "$orderby", &r);
+		foreach(sortCell, sortList)
+		{
+			List *sortEntry = (List *) lfirst(sortCell);
+			char *columnName = strVal(linitial(sortEntry));
+			int direction = intVal(lsecond(sortEntry));
+
+			BsonAppendInt32(SUBDOCUMENT(orderedDocument, &r), columnName,
+							direction);
+		}
+		BsonAppendFinishObject(orderedDocument, &r);
+	}
+
+	/* the hint names the index by its key pattern */
+	if (hintList != NIL)
+	{
+		BsonAppendStartObject(orderedDocument, "$hint", &r);
+		foreach(hintCell, hintList)
+		{
+			List *keyEntry = (List *) lfirst(hintCell);
+
+			BsonAppendInt32(SUBDOCUMENT(orderedDocument, &r),
+							strVal(linitial(keyEntry)),
+							intVal(lsecond(keyEntry)));
+		}
+		BsonAppendFinishObject(orderedDocument, &r);
+	}
+
+	if (!BsonFinish(orderedDocument))
+	{
+#ifdef META_DRIVER
+		ereport(ERROR, (errmsg("could not create document for query"),
+						errhint("BSON flags: %d", orderedDocument->flags)));
+#else
+		ereport(ERROR, (errmsg("could not create document for query"),
+						errhint("BSON error: %d", orderedDocument->err)));
+#endif
+	}
+
+	BsonDestroy(queryDocument);
+	return orderedDocument;
+}
+
+
 /*
  * MongoOperatorName takes in the given PostgreSQL comparison operator name, and
  * returns its equivalent in MongoDB.
@@ -312,110 +1859,332 @@ MongoOperatorName(const char *operatorName)
 
 
 /*
- * EqualityOperatorList finds the equality (=) operators in the given list, and
- * returns these operators in a new list.
+ * AppendComparison appends the given comparison on the column with the given
+ * name to the document, as {column: value} for equality and as {column:
+ * {operator: value}} otherwise. A comparison with a null value becomes
+ * {column: {$in: []}}, which matches no document.
  */
-static List *
-EqualityOperatorList(List *operatorList)
+static void
+AppendComparison(BSON *document, const char *columnName,
+				 MongoComparison *comparison, ForeignScanState *scanStateNode)
 {
-	List *equalityOperatorList = NIL;
-	ListCell *operatorCell = NULL;
+	BSON r;
+	BSON t;
+
+	if (!EvaluateComparisonValue(comparison, scanStateNode))
+	{
+		BsonAppendStartObject(document, (char *) columnName, &r);
+		BsonAppendStartArray(SUBDOCUMENT(document, &r), "$in", &t);
+		BsonAppendFinishArray(SUBDOCUMENT(document, &r), &t);
+		BsonAppendFinishObject(document, &r);
+		return;
+	}
 
-	foreach(operatorCell, operatorList)
+	if (comparison->objectIdTime)
 	{
-		OpExpr *operator = (OpExpr *) lfirst(operatorCell);
-		char *operatorName = NULL;
+		AppendObjectIdTimeRange(document, columnName, comparison);
+		return;
+	}
 
-		operatorName = get_opname(operator->opno);
-		if (strncmp(operatorName, EQUALITY_OPERATOR_NAME, NAMEDATALEN) == 0)
+	if (strcmp(comparison->operatorName, EQUALITY_OPERATOR_NAME) == 0)
+	{
+		AppendComparisonValue(document, columnName, comparison->value,
+							  scanStateNode);
+		return;
+	}
+
+	BsonAppendStartObject(document, (char *) columnName, &r);
+	AppendOperator(SUBDOCUMENT(document, &r), comparison, scanStateNode);
+	BsonAppendFinishObject(document, &r);
+}
+
+
+/*
+ * AppendOperator appends the operator and value of the given comparison to the
+ * column's sub-document. Equality becomes a single-valued $in list, which
+ * MongoDB treats the same, and LIKE patterns become anchored regular
+ * expressions.
+ */
+static void
+AppendOperator(BSON *document, MongoComparison *comparison,
+			   ForeignScanState *scanStateNode)
+{
+	const char *operatorName = comparison->operatorName;
+	BSON t;
+
+	if (strcmp(operatorName, EQUALITY_OPERATOR_NAME) == 0)
+	{
+		BsonAppendStartArray(document, "$in", &t);
+		AppendComparisonValue(SUBDOCUMENT(document, &t), "0", comparison->value,
+							  scanStateNode);
+		BsonAppendFinishArray(document, &t);
+	}
+	else if (strcmp(operatorName, "$in") == 0 || strcmp(operatorName, "$nin") == 0 ||
+			 strcmp(operatorName, "$all") == 0)
+	{
+		BsonAppendStartArray(document, operatorName, &t);
+		AppendArrayValues(SUBDOCUMENT(document, &t), (Const *) comparison->value, 0);
+		BsonAppendFinishArray(document, &t);
+	}
+	else if (strcmp(operatorName, "$regex") == 0)
+	{
+		Const *pattern = (Const *) comparison->value;
+		char *regex = LikePatternRegex(TextDatumGetCString(pattern->constvalue));
+
+		BsonAppendRegex(document, "$regex", regex, "s");
+	}
+	else
+	{
+		AppendComparisonValue(document, operatorName, comparison->value,
+							  scanStateNode);
+	}
+}
+
+
+/*
+ * AppendObjectIdTimeRange appends the given comparison of the time of an
+ * ObjectId column as a range of ObjectIds: the first four bytes of an ObjectId
+ * hold the seconds since the Unix epoch at which it was generated, and
+ * ObjectIds compare bytewise. The range is widened to whole seconds, so that it
+ * also holds the documents of a comparison of the _id_time column, whose times
+ * have the fractions of a second ObjectIds leave out. Nothing is appended for
+ * a value that isn't a constant.
+ */
+static void
+AppendObjectIdTimeRange(BSON *document, const char *columnName,
+						MongoComparison *comparison)
+{
+	const char *operatorName = comparison->operatorName;
+	Timestamp valueTimestamp = 0;
+	int64 floorSeconds = 0;
+	int64 ceilSeconds = 0;
+	BSON r;
+
+	/* a value that is not known as a constant leaves the comparison local */
+	if (!IsA(comparison->value, Const))
+		return;
+
+	valueTimestamp = DatumGetTimestamp(((Const *) comparison->value)->constvalue);
+	if (TIMESTAMP_IS_NOBEGIN(valueTimestamp))
+	{
+		floorSeconds = ceilSeconds = -1;
+	}
+	else if (TIMESTAMP_IS_NOEND(valueTimestamp))
+	{
+		floorSeconds = ceilSeconds = (int64) PG_UINT32_MAX + 1;
+	}
+	else
+	{
+		int64 valueMicroSecs = valueTimestamp + POSTGRES_TO_UNIX_EPOCH_USECS;
+
+		/* division truncates toward zero, also for times before 1970 */
+		floorSeconds = valueMicroSecs / USECS_PER_SEC;
+		if (valueMicroSecs % USECS_PER_SEC < 0)
 		{
-			equalityOperatorList = lappend(equalityOperatorList, operator);
+			floorSeconds--;
 		}
+		ceilSeconds = floorSeconds +
+					  ((valueMicroSecs % USECS_PER_SEC != 0) ? 1 : 0);
 	}
 
-	return equalityOperatorList;
+	BsonAppendStartObject(document, (char *) columnName, &r);
+	if (strcmp(operatorName, "$lt") != 0 && strcmp(operatorName, "$lte") != 0)
+	{
+		AppendObjectIdBound(SUBDOCUMENT(document, &r), true, floorSeconds);
+	}
+	if (strcmp(operatorName, "$gt") != 0 && strcmp(operatorName, "$gte") != 0)
+	{
+		AppendObjectIdBound(SUBDOCUMENT(document, &r), false,
+							(strcmp(operatorName, "$lt") == 0) ?
+							ceilSeconds : floorSeconds + 1);
+	}
+	BsonAppendFinishObject(document, &r);
 }
 
 
 /*
- * UniqueColumnList walks over the given operator list, and extracts the column
- * argument in each operator. The function then de-duplicates extracted columns,
- * and returns them in a new list.
+ * AppendObjectIdBound appends the lower bound of ObjectIds generated at the
+ * given second or later, or the upper bound of those generated before it.
+ * Seconds ObjectIds can't hold give bounds that let all or none of them pass.
  */
-static List *
-UniqueColumnList(List *operatorList)
+static void
+AppendObjectIdBound(BSON *document, bool lowerBound, int64 seconds)
 {
-	List *uniqueColumnList = NIL;
-	ListCell *operatorCell = NULL;
+	const char *operatorName = lowerBound ? "$gte" : "$lt";
+	bson_oid_t objectId;
 
-	foreach(operatorCell, operatorList)
+	memset(objectId.bytes, 0, sizeof(objectId.bytes));
+	if (seconds > (int64) PG_UINT32_MAX)
 	{
-		OpExpr *operator = (OpExpr *) lfirst(operatorCell);
-		List *argumentList = operator->args;
-		Var *column = (Var *) FindArgumentOfType(argumentList, T_Var);
-
-		/* list membership is determined via column's equal() function */
-		uniqueColumnList = list_append_unique(uniqueColumnList, column);
+		memset(objectId.bytes, 0xff, sizeof(objectId.bytes));
+		operatorName = lowerBound ? "$gt" : "$lte";
+	}
+	else if (seconds > 0)
+	{
+		objectId.bytes[0] = (seconds >> 24) & 0xff;
+		objectId.bytes[1] = (seconds >> 16) & 0xff;
+		objectId.bytes[2] = (seconds >> 8) & 0xff;
+		objectId.bytes[3] = seconds & 0xff;
 	}
 
-	return uniqueColumnList;
+	BsonAppendOid(document, operatorName, &objectId);
 }
 
 
 /*
- * ColumnOperatorList finds all expressions that correspond to the given column,
- * and returns them in a new list.
+ * AppendExcludedValues appends the values of the given <> and NOT IN
+ * comparisons on a column as a single $nin list.
  */
-static List *
-ColumnOperatorList(Var *column, List *operatorList)
+static void
+AppendExcludedValues(BSON *document, List *comparisonList,
+					 ForeignScanState *scanStateNode)
 {
-	List *columnOperatorList = NIL;
-	ListCell *operatorCell = NULL;
+	ListCell *comparisonCell = NULL;
+	int valueIndex = 0;
+	BSON t;
+
+	BsonAppendStartArray(document, "$nin", &t);
+	foreach(comparisonCell, comparisonList)
+	{
+		MongoComparison *comparison = (MongoComparison *) lfirst(comparisonCell);
+
+		if (strcmp(comparison->operatorName, "$nin") == 0)
+		{
+			valueIndex = AppendArrayValues(SUBDOCUMENT(document, &t),
+										   (Const *) comparison->value,
+										   valueIndex);
+		}
+		else
+		{
+			char valueKey[12];
+
+			snprintf(valueKey, sizeof(valueKey), "%d", valueIndex++);
+			AppendComparisonValue(SUBDOCUMENT(document, &t), valueKey,
+								  comparison->value, scanStateNode);
+		}
+	}
+	BsonAppendFinishArray(document, &t);
+}
 
-	foreach(operatorCell, operatorList)
+
+/*
+ * AppendArrayValues appends the elements of the given array constant to the
+ * array being built in the document, keyed from the given index on, and
+ * returns the index that follows the last element. Null elements are left
+ * out, as they never compare equal or unequal to a value.
+ */
+static int
+AppendArrayValues(BSON *document, Const *arrayConstant, int valueIndex)
+{
+	ArrayType *array = DatumGetArrayTypeP(arrayConstant->constvalue);
+	Oid elementTypeId = ARR_ELEMTYPE(array);
+	int16 typeLength = 0;
+	bool typeByValue = false;
+	char typeAlignment = 0;
+	Datum *elementValues = NULL;
+	bool *elementNulls = NULL;
+	int elementCount = 0;
+	int elementIndex = 0;
+
+	get_typlenbyvalalign(elementTypeId, &typeLength, &typeByValue, &typeAlignment);
+	deconstruct_array(array, elementTypeId, typeLength, typeByValue,
+					  typeAlignment, &elementValues, &elementNulls, &elementCount);
+
+	for (elementIndex = 0; elementIndex < elementCount; elementIndex++)
 	{
-		OpExpr *operator = (OpExpr *) lfirst(operatorCell);
-		List *argumentList = operator->args;
+		char valueKey[12];
 
-		Var *foundColumn = (Var *) FindArgumentOfType(argumentList, T_Var);
-		if (equal(column, foundColumn))
+		if (elementNulls[elementIndex])
 		{
-			columnOperatorList = lappend(columnOperatorList, operator);
+			continue;
 		}
+
+		snprintf(valueKey, sizeof(valueKey), "%d", valueIndex++);
+		AppenMongoValue(document, valueKey, elementValues[elementIndex], false,
+						elementTypeId);
 	}
 
-	return columnOperatorList;
+	pfree(elementValues);
+	pfree(elementNulls);
+
+	return valueIndex;
+}
+
+
+/*
+ * AppendComparisonValue appends the given value to the query document under
+ * the given key. Values only known at execution have been evaluated by then;
+ * documents built without a scan state leave them out.
+ */
+static void
+AppendComparisonValue(BSON *document, const char *keyName, Expr *value,
+					  ForeignScanState *scanStateNode)
+{
+	if (IsA(value, Const))
+	{
+		AppendConstantValue(document, keyName, (Const *) value);
+	}
 }
 
-static void
-AppendParamValue(BSON *queryDocument, const char *keyName, Param *paramNode,
-		ForeignScanState *scanStateNode)
-{
-	ExprState	*param_expr;
-	Datum		param_value;
-	bool		isNull;
-	ExprContext	*econtext;
 
-	if (scanStateNode == NULL)
-		return;
+/*
+ * LikePatternRegex translates the given LIKE pattern into a regular expression
+ * anchored at the start of the string, so that MongoDB can use an index for a
+ * pattern with a literal prefix. The expression is only anchored at the end if
+ * the pattern doesn't end with %, and is meant for the "s" option, with which
+ * "." also matches newlines as _ does.
+ */
+static char *
+LikePatternRegex(const char *likePattern)
+{
+	StringInfoData regex;
+	const char *patternChar = NULL;
+	bool anchoredAtEnd = true;
 
-	econtext = scanStateNode->ss.ps.ps_ExprContext;
+	initStringInfo(&regex);
+	appendStringInfoChar(&regex, '^');
 
-	/* Prepare for parameter expression evaluation */
-	param_expr = ExecInitExpr((Expr *) paramNode, (PlanState *)scanStateNode);
+	for (patternChar = likePattern; *patternChar != '\0'; patternChar++)
+	{
+		if (*patternChar == '%')
+		{
+			if (patternChar[strspn(patternChar, "%")] == '\0')
+			{
+				anchoredAtEnd = false;
+				break;
+			}
+			appendStringInfoString(&regex, ".*");
+		}
+		else if (*patternChar == '_')
+		{
+			appendStringInfoChar(&regex, '.');
+		}
+		else
+		{
+			/* a backslash makes the next character literal */
+			if (*patternChar == '\\' && patternChar[1] != '\0')
+			{
+				patternChar++;
+			}
 
-	/* Evaluate the parameter expression */
-#if PG_VERSION_NUM >= 100000
-	param_value = ExecEvalExpr(param_expr, econtext, &isNull);
-#else
-	param_value = ExecEvalExpr(param_expr, econtext, &isNull, NULL);
-#endif
+			if (strchr("\\^$.|?*+()[]{}", *patternChar) != NULL)
+			{
+				appendStringInfoChar(&regex, '\\');
+			}
+			appendStringInfoChar(&regex, *patternChar);
+		}
+	}
 
+	/* $ would also match before a trailing newline */
+	if (anchoredAtEnd)
+	{
+		appendStringInfoString(&regex, "\\z");
+	}
 
-	AppenMongoValue(queryDocument, keyName, param_value, isNull,
-				paramNode->paramtype);
+	return regex.data;
 }
 
+
 /*
  * AppendConstantValue appends to the query document the key name and constant
  * value. The function translates the constant value from its PostgreSQL type to
@@ -637,6 +2406,7 @@ AppenMongoValue(BSON *queryDocument, const char *keyName, Datum value, bool isnu
 			break;
 		}
 		case JSONOID:
+		case JSONBOID:
 		{
 			char *outputString = NULL;
 			Oid outputFunctionId = InvalidOid;
@@ -673,6 +2443,129 @@ AppenMongoValue(BSON *queryDocument, const char *keyName, Datum value, bool isnu
 }
 
 
+/*
+ * ColumnEncoderLookup returns the function that appends values of the given
+ * column type to documents. The common scalar types have encoders of their own,
+ * which do what AppenMongoValue does without looking up the type's output
+ * function for each value; the values of other types go through AppenMongoValue.
+ */
+ColumnEncoder
+ColumnEncoderLookup(Oid columnTypeId)
+{
+	switch (columnTypeId)
+	{
+		case INT2OID:
+			return EncodeInt16;
+		case INT4OID:
+			return EncodeInt32;
+		case INT8OID:
+			return EncodeInt64;
+		case FLOAT4OID:
+			return EncodeFloat4;
+		case FLOAT8OID:
+			return EncodeFloat8;
+		case BOOLOID:
+			return EncodeBool;
+		case BPCHAROID:
+		case VARCHAROID:
+		case TEXTOID:
+			return EncodeText;
+		case NAMEOID:
+			return EncodeName;
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return EncodeTimestamp;
+		default:
+			return EncodeValue;
+	}
+}
+
+
+static bool
+EncodeInt16(BSON *document, const char *keyName, Datum value, Oid columnTypeId)
+{
+	return BsonAppendInt32(document, keyName, (int) DatumGetInt16(value));
+}
+
+
+static bool
+EncodeInt32(BSON *document, const char *keyName, Datum value, Oid columnTypeId)
+{
+	return BsonAppendInt32(document, keyName, DatumGetInt32(value));
+}
+
+
+static bool
+EncodeInt64(BSON *document, const char *keyName, Datum value, Oid columnTypeId)
+{
+	return BsonAppendInt64(document, keyName, DatumGetInt64(value));
+}
+
+
+static bool
+EncodeFloat4(BSON *document, const char *keyName, Datum value, Oid columnTypeId)
+{
+	return BsonAppendDouble(document, keyName, (double) DatumGetFloat4(value));
+}
+
+
+static bool
+EncodeFloat8(BSON *document, const char *keyName, Datum value, Oid columnTypeId)
+{
+	return BsonAppendDouble(document, keyName, DatumGetFloat8(value));
+}
+
+
+static bool
+EncodeBool(BSON *document, const char *keyName, Datum value, Oid columnTypeId)
+{
+	return BsonAppendBool(document, keyName, DatumGetBool(value));
+}
+
+
+/*
+ * EncodeText appends the string of a text, varchar or bpchar value, which is
+ * what the output functions of these types return.
+ */
+static bool
+EncodeText(BSON *document, const char *keyName, Datum value, Oid columnTypeId)
+{
+	return BsonAppendUTF8(document, keyName, TextDatumGetCString(value));
+}
+
+
+/*
+ * EncodeName appends the ObjectId a NAME value holds in hexadecimal.
+ */
+static bool
+EncodeName(BSON *document, const char *keyName, Datum value, Oid columnTypeId)
+{
+	bson_oid_t bsonObjectId;
+
+	memset(bsonObjectId.bytes, 0, sizeof(bsonObjectId.bytes));
+	BsonOidFromString(&bsonObjectId, NameStr(*DatumGetName(value)));
+	return BsonAppendOid(document, keyName, &bsonObjectId);
+}
+
+
+static bool
+EncodeTimestamp(BSON *document, const char *keyName, Datum value,
+				Oid columnTypeId)
+{
+	Timestamp valueTimestamp = DatumGetTimestamp(value);
+	int64 valueMicroSecs = valueTimestamp + POSTGRES_TO_UNIX_EPOCH_USECS;
+
+	return BsonAppendDate(document, keyName, valueMicroSecs / 1000);
+}
+
+
+static bool
+EncodeValue(BSON *document, const char *keyName, Datum value, Oid columnTypeId)
+{
+	return AppenMongoValue(document, keyName, value, false, columnTypeId);
+}
+
+
 /*
  * ColumnList takes in the planner's information about this foreign table. The
  * function then finds all columns needed for query execution, including those
@@ -740,3 +2633,475 @@ ColumnList(RelOptInfo *baserel)
 
 	return columnList;
 }
+
+
+/*
+ * ProjectionDocument takes in the list of columns needed for query execution,
+ * and builds the fields document that limits the returned documents to these
+ * columns. Nested columns are projected by their dotted path. A column whose
+ * path lies within another projected column is left out, as newer MongoDB
+ * servers reject overlapping paths. The function returns NULL when the whole
+ * document is needed, which is the case for the __doc column.
+ *
+ * When the query hints an index, the keys of which are in the hint list, _id is
+ * left out unless it is one of the columns, so that MongoDB can answer the
+ * query from an index that holds all the columns but not _id.
+ */
+BSON *
+ProjectionDocument(Oid relationId, List *columnList, List *hintList)
+{
+	List     *pathList = NIL;
+	ListCell *columnCell = NULL;
+	ListCell *pathCell = NULL;
+	BSON     *fieldsDocument = NULL;
+
+	foreach(columnCell, columnList)
+	{
+		Var  *column = (Var *) lfirst(columnCell);
+		char *columnName = get_relid_attribute_name(relationId, column->varattno);
+
+		if (strcmp(columnName, "__doc") == 0)
+			return NULL;
+
+		pathList = lappend(pathList, columnName);
+	}
+
+	fieldsDocument = BsonCreate();
+
+	/*
+	 * If no columns are needed, we ask for just _id, which we get back anyway,
+	 * or for the first key of the hinted index.
+	 */
+	if (pathList == NIL && hintList != NIL)
+		pathList = list_make1(strVal(linitial((List *) linitial(hintList))));
+	else if (pathList == NIL)
+		pathList = list_make1("_id");
+
+	foreach(pathCell, pathList)
+	{
+		char     *path = (char *) lfirst(pathCell);
+		ListCell *otherCell = NULL;
+		bool     covered = false;
+
+		foreach(otherCell, pathList)
+		{
+			char *otherPath = (char *) lfirst(otherCell);
+			int   otherLength = strlen(otherPath);
+
+			if (otherCell != pathCell &&
+				strncmp(path, otherPath, otherLength) == 0 &&
+				path[otherLength] == '.')
+			{
+				covered = true;
+				break;
+			}
+		}
+
+		if (!covered)
+			BsonAppendInt32(fieldsDocument, path, 1);
+	}
+
+	if (hintList != NIL)
+	{
+		bool idNeeded = false;
+
+		foreach(pathCell, pathList)
+		{
+			if (strcmp((char *) lfirst(pathCell), "_id") == 0)
+				idNeeded = true;
+		}
+
+		if (!idNeeded)
+			BsonAppendInt32(fieldsDocument, "_id", 0);
+	}
+
+	BsonFinish(fieldsDocument);
+
+	return fieldsDocument;
+}
+
+
+#ifdef META_DRIVER
+/*
+ * UpdateDocument builds the update document of an UPDATE that runs on the
+ * server: {$set: {column: value, ...}} for the given attribute numbers of the
+ * updated columns and their new values, which are evaluated now.
+ */
+BSON *
+UpdateDocument(Oid relationId, List *columnIdList, List *valueList,
+			   ForeignScanState *scanStateNode)
+{
+	BSON *updateDocument = BsonCreate();
+	ListCell *columnIdCell = NULL;
+	ListCell *valueCell = NULL;
+	BSON setDocument;
+
+	BsonAppendStartObject(updateDocument, "$set", &setDocument);
+	forboth(columnIdCell, columnIdList, valueCell, valueList)
+	{
+		AttrNumber columnId = (AttrNumber) lfirst_int(columnIdCell);
+		char *columnName = get_relid_attribute_name(relationId, columnId);
+		Const *value = EvaluateValue((Expr *) lfirst(valueCell), scanStateNode);
+
+		AppendConstantValue(&setDocument, columnName, value);
+	}
+	BsonAppendFinishObject(updateDocument, &setDocument);
+
+	if (!BsonFinish(updateDocument))
+	{
+		ereport(ERROR, (errmsg("could not create document for update"),
+						errhint("BSON flags: %d", updateDocument->flags)));
+	}
+
+	return updateDocument;
+}
+
+
+/*
+ * AggregatePipeline builds the aggregation pipeline of a pushed down
+ * aggregation: a $match stage built from the applicable operator expressions,
+ * followed by a $group stage that computes the entries of the aggregate list.
+ * The i-th entry is returned as field "fi", in the _id sub-document for GROUP
+ * BY columns. Sums and averages also return "ni", the number of values they
+ * were computed from, since $sum gives 0 where PostgreSQL gives null.
+ *
+ * MongoDB compares and groups values of any type, while PostgreSQL reads
+ * values of other types than the column's as null. So we only let values of
+ * the column's type into groups and aggregates, and treat others as null.
+ */
+BSON *
+AggregatePipeline(Oid relationId, List *opExpressionList, List *aggregateList,
+				  ForeignScanState *scanStateNode)
+{
+	BSON *pipelineDocument = BsonCreate();
+	BSON stageArray;
+	BSON stageDocument;
+	BSON groupDocument;
+	BSON keyDocument;
+	char *stageKey = "0";
+	char fieldName[NAMEDATALEN];
+	bool grouped = false;
+	ListCell *aggregateCell = NULL;
+	int entryIndex = 0;
+
+	BsonAppendStartArray(pipelineDocument, "pipeline", &stageArray);
+
+	if (opExpressionList != NIL)
+	{
+		BSON *queryDocument = QueryDocument(relationId, opExpressionList,
+											scanStateNode);
+
+		BsonAppendStartObject(&stageArray, stageKey, &stageDocument);
+		BsonAppendBson(&stageDocument, "$match", queryDocument);
+		BsonAppendFinishObject(&stageArray, &stageDocument);
+		BsonDestroy(queryDocument);
+		stageKey = "1";
+	}
+
+	BsonAppendStartObject(&stageArray, stageKey, &stageDocument);
+	BsonAppendStartObject(&stageDocument, "$group", &groupDocument);
+
+	/* GROUP BY columns make up the group key */
+	foreach(aggregateCell, aggregateList)
+	{
+		List *aggregateEntry = (List *) lfirst(aggregateCell);
+		MongoAggregateKind kind = intVal(linitial(aggregateEntry));
+		char *fieldPath = psprintf("$%s", strVal(lsecond(aggregateEntry)));
+		Oid columnTypeId = intVal(lthird(aggregateEntry));
+
+		if (kind == MONGO_AGGREGATE_GROUP)
+		{
+			if (!grouped)
+				BsonAppendStartObject(&groupDocument, "_id", &keyDocument);
+			grouped = true;
+
+			snprintf(fieldName, NAMEDATALEN, "f%d", entryIndex);
+			AppendTypedField(&keyDocument, fieldName, fieldPath, columnTypeId);
+		}
+		entryIndex++;
+	}
+
+	if (grouped)
+		BsonAppendFinishObject(&groupDocument, &keyDocument);
+	else
+		BsonAppendNull(&groupDocument, "_id");
+
+	/* and aggregates are computed over each group */
+	entryIndex = 0;
+	foreach(aggregateCell, aggregateList)
+	{
+		List *aggregateEntry = (List *) lfirst(aggregateCell);
+		MongoAggregateKind kind = intVal(linitial(aggregateEntry));
+		char *fieldPath = psprintf("$%s", strVal(lsecond(aggregateEntry)));
+		Oid columnTypeId = intVal(lthird(aggregateEntry));
+		BSON accumulatorDocument;
+
+		snprintf(fieldName, NAMEDATALEN, "f%d", entryIndex);
+		switch (kind)
+		{
+			case MONGO_AGGREGATE_COUNT_STAR:
+			{
+				BsonAppendStartObject(&groupDocument, fieldName, &accumulatorDocument);
+				BsonAppendInt32(&accumulatorDocument, "$sum", 1);
+				BsonAppendFinishObject(&groupDocument, &accumulatorDocument);
+				break;
+			}
+			case MONGO_AGGREGATE_COUNT:
+			{
+				AppendTypedCount(&groupDocument, fieldName, fieldPath, columnTypeId);
+				break;
+			}
+			case MONGO_AGGREGATE_SUM:
+			case MONGO_AGGREGATE_AVG:
+			{
+				/* $sum skips values that are not numbers */
+				BsonAppendStartObject(&groupDocument, fieldName, &accumulatorDocument);
+				BsonAppendUTF8(&accumulatorDocument, "$sum", fieldPath);
+				BsonAppendFinishObject(&groupDocument, &accumulatorDocument);
+
+				snprintf(fieldName, NAMEDATALEN, "n%d", entryIndex);
+				AppendTypedCount(&groupDocument, fieldName, fieldPath, columnTypeId);
+				break;
+			}
+			case MONGO_AGGREGATE_MIN:
+			case MONGO_AGGREGATE_MAX:
+			{
+				/* $min and $max skip nulls */
+				BsonAppendStartObject(&groupDocument, fieldName, &accumulatorDocument);
+				AppendTypedField(&accumulatorDocument,
+								 kind == MONGO_AGGREGATE_MIN ? "$min" : "$max",
+								 fieldPath, columnTypeId);
+				BsonAppendFinishObject(&groupDocument, &accumulatorDocument);
+				break;
+			}
+			default:
+				break;
+		}
+		entryIndex++;
+	}
+
+	BsonAppendFinishObject(&stageDocument, &groupDocument);
+	BsonAppendFinishObject(&stageArray, &stageDocument);
+	BsonAppendFinishArray(pipelineDocument, &stageArray);
+
+	if (!BsonFinish(pipelineDocument))
+	{
+		ereport(ERROR, (errmsg("could not create document for aggregation"),
+						errhint("BSON flags: %d", pipelineDocument->flags)));
+	}
+
+	return pipelineDocument;
+}
+
+
+/*
+ * RangeQueryDocument returns a query document that matches the documents of the
+ * given query whose _id falls into the given range of those the split points
+ * delimit. With n split points, range 0 holds the _id values below the first
+ * point, range i those from point i - 1 up to point i, and range n those from
+ * the last point on. Since MongoDB only compares values of one BSON type, the
+ * _id values of other types than the points' fall into none of these, so range
+ * n + 1 holds them.
+ */
+BSON *
+RangeQueryDocument(BSON *queryDocument, const BSON *splitPoints,
+				   int splitPointCount, int rangeIndex)
+{
+	BSON *rangeDocument = BsonCreate();
+	BSON andArray;
+	BSON idDocument;
+	BSON boundDocument;
+	bson_iter_t lowerPoint;
+	bson_iter_t upperPoint;
+	char pointKey[12];
+
+	Assert(splitPointCount > 0 && rangeIndex <= splitPointCount + 1);
+
+	BsonAppendStartArray(rangeDocument, "$and", &andArray);
+	BsonAppendBson(&andArray, "0", queryDocument);
+
+	if (rangeIndex <= splitPointCount)
+	{
+		BsonAppendStartObject(&andArray, "1", &idDocument);
+		BsonAppendStartObject(&idDocument, "_id", &boundDocument);
+		if (rangeIndex > 0)
+		{
+			snprintf(pointKey, sizeof(pointKey), "%d", rangeIndex - 1);
+			if (bson_iter_init_find(&lowerPoint, splitPoints, pointKey))
+				bson_append_iter(&boundDocument, "$gte", -1, &lowerPoint);
+		}
+		if (rangeIndex < splitPointCount)
+		{
+			snprintf(pointKey, sizeof(pointKey), "%d", rangeIndex);
+			if (bson_iter_init_find(&upperPoint, splitPoints, pointKey))
+				bson_append_iter(&boundDocument, "$lt", -1, &upperPoint);
+		}
+		BsonAppendFinishObject(&idDocument, &boundDocument);
+		BsonAppendFinishObject(&andArray, &idDocument);
+	}
+	else
+	{
+		BSON norDocument;
+		BSON norArray;
+		BSON lowerDocument;
+		BSON upperDocument;
+
+		bson_iter_init_find(&lowerPoint, splitPoints, "0");
+		upperPoint = lowerPoint;
+
+		BsonAppendStartObject(&andArray, "1", &norDocument);
+		BsonAppendStartArray(&norDocument, "$nor", &norArray);
+
+		BsonAppendStartObject(&norArray, "0", &lowerDocument);
+		BsonAppendStartObject(&lowerDocument, "_id", &boundDocument);
+		bson_append_iter(&boundDocument, "$lt", -1, &lowerPoint);
+		BsonAppendFinishObject(&lowerDocument, &boundDocument);
+		BsonAppendFinishObject(&norArray, &lowerDocument);
+
+		BsonAppendStartObject(&norArray, "1", &upperDocument);
+		BsonAppendStartObject(&upperDocument, "_id", &boundDocument);
+		bson_append_iter(&boundDocument, "$gte", -1, &upperPoint);
+		BsonAppendFinishObject(&upperDocument, &boundDocument);
+		BsonAppendFinishObject(&norArray, &upperDocument);
+
+		BsonAppendFinishArray(&norDocument, &norArray);
+		BsonAppendFinishObject(&andArray, &norDocument);
+	}
+
+	BsonAppendFinishArray(rangeDocument, &andArray);
+
+	if (!BsonFinish(rangeDocument))
+	{
+		ereport(ERROR, (errmsg("could not create document for query"),
+						errhint("BSON flags: %d", rangeDocument->flags)));
+	}
+
+	return rangeDocument;
+}
+
+
+/*
+ * AppendTypedField appends an expression that evaluates to the value of the
+ * given field if it has the BSON type of the column type, and to null if not.
+ */
+static void
+AppendTypedField(BSON *document, const char *keyName, char *fieldPath,
+				 Oid columnTypeId)
+{
+	BSON condDocument;
+	BSON condArray;
+
+	BsonAppendStartObject(document, (char *) keyName, &condDocument);
+	BsonAppendStartArray(&condDocument, "$cond", &condArray);
+	AppendTypeTest(&condArray, "0", fieldPath, columnTypeId);
+	BsonAppendUTF8(&condArray, "1", fieldPath);
+	BsonAppendNull(&condArray, "2");
+	BsonAppendFinishArray(&condDocument, &condArray);
+	BsonAppendFinishObject(document, &condDocument);
+}
+
+
+/*
+ * AppendTypedCount appends an accumulator that counts the values of the given
+ * field that have the BSON type of the column type.
+ */
+static void
+AppendTypedCount(BSON *document, const char *keyName, char *fieldPath,
+				 Oid columnTypeId)
+{
+	BSON sumDocument;
+	BSON condDocument;
+	BSON condArray;
+
+	BsonAppendStartObject(document, (char *) keyName, &sumDocument);
+	BsonAppendStartObject(&sumDocument, "$sum", &condDocument);
+	BsonAppendStartArray(&condDocument, "$cond", &condArray);
+	AppendTypeTest(&condArray, "0", fieldPath, columnTypeId);
+	BsonAppendInt32(&condArray, "1", 1);
+	BsonAppendInt32(&condArray, "2", 0);
+	BsonAppendFinishArray(&condDocument, &condArray);
+	BsonAppendFinishObject(&sumDocument, &condDocument);
+	BsonAppendFinishObject(document, &sumDocument);
+}
+
+
+/*
+ * AppendTypeTest appends an expression that is true if the given field has the
+ * BSON type PostgreSQL reads into the column type. Aggregation expressions have
+ * no type operator before MongoDB 3.4, so we test that the value falls within
+ * the values of that type in MongoDB's ordering of BSON types:
+ *
+ *   missing < null < numbers < strings < documents < arrays < binary data
+ *     < object ids < booleans < dates < timestamps < regular expressions
+ */
+static void
+AppendTypeTest(BSON *document, const char *keyName, char *fieldPath,
+			   Oid columnTypeId)
+{
+	BSON andDocument;
+	BSON andArray;
+	BSON lowerDocument;
+	BSON lowerArray;
+	BSON upperDocument;
+	BSON upperArray;
+	bool numberType = false;
+	bool stringType = false;
+
+	switch (columnTypeId)
+	{
+		case INT2OID: case INT4OID:
+		case INT8OID: case FLOAT4OID:
+		case FLOAT8OID: case NUMERICOID:
+			numberType = true;
+			break;
+		case TEXTOID: case VARCHAROID:
+			stringType = true;
+			break;
+		default:
+			/* dates */
+			break;
+	}
+
+	BsonAppendStartObject(document, (char *) keyName, &andDocument);
+	BsonAppendStartArray(&andDocument, "$and", &andArray);
+
+	BsonAppendStartObject(&andArray, "0", &lowerDocument);
+	BsonAppendStartArray(&lowerDocument, stringType ? "$gte" : "$gt", &lowerArray);
+	BsonAppendUTF8(&lowerArray, "0", fieldPath);
+	if (numberType)
+		BsonAppendNull(&lowerArray, "1");
+	else if (stringType)
+		BsonAppendUTF8(&lowerArray, "1", "");
+	else
+		BsonAppendBool(&lowerArray, "1", true);
+	BsonAppendFinishArray(&lowerDocument, &lowerArray);
+	BsonAppendFinishObject(&andArray, &lowerDocument);
+
+	BsonAppendStartObject(&andArray, "1", &upperDocument);
+	BsonAppendStartArray(&upperDocument, "$lt", &upperArray);
+	BsonAppendUTF8(&upperArray, "0", fieldPath);
+	if (numberType)
+	{
+		BsonAppendUTF8(&upperArray, "1", "");
+	}
+	else if (stringType)
+	{
+		BSON literalDocument;
+		BSON emptyDocument;
+
+		BsonAppendStartObject(&upperArray, "1", &literalDocument);
+		BsonAppendStartObject(&literalDocument, "$literal", &emptyDocument);
+		BsonAppendFinishObject(&literalDocument, &emptyDocument);
+		BsonAppendFinishObject(&upperArray, &literalDocument);
+	}
+	else
+	{
+		bson_append_timestamp(&upperArray, "1", -1, 0, 0);
+	}
+	BsonAppendFinishArray(&upperDocument, &upperArray);
+	BsonAppendFinishObject(&andArray, &upperDocument);
+
+	BsonAppendFinishArray(&andDocument, &andArray);
+	BsonAppendFinishObject(document, &andDocument);
+}
+#endif
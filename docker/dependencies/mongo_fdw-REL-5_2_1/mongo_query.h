@@ -22,5 +22,6 @@
 #define NUMERICARRAY_OID 1231
 
 bool AppenMongoValue(BSON *queryDocument, const char *keyName, Datum	value, bool isnull, Oid id);
+ColumnEncoder ColumnEncoderLookup(Oid columnTypeId);
 
 #endif /* MONGO_QUERY_H */
@@ -109,15 +109,23 @@ MongoDelete(MONGO_CONN* conn, char* database, char *collection, BSON* b)
 
 
 MONGO_CURSOR*
-MongoCursorCreate(MONGO_CONN* conn, char* database, char *collection, BSON* q)
+MongoCursorCreate(MONGO_CONN* conn, char* database, char *collection, BSON* q,
+                  BSON *fields, int limit, int batchSize, bool *exhaust)
 {
 	MONGO_CURSOR* c;
 	char qual[QUAL_STRING_LEN];
 
+	/* the legacy driver has neither batch sizes nor exhaust cursors */
+	*exhaust = false;
+
 	snprintf (qual, QUAL_STRING_LEN, "%s.%s", database, collection);
 	c = mongo_cursor_alloc();
 	mongo_cursor_init(c, conn , qual);
 	mongo_cursor_set_query(c, q);
+	if (fields)
+		mongo_cursor_set_fields(c, fields);
+	if (limit > 0)
+		mongo_cursor_set_limit(c, limit);
 	return c;
 }
 
@@ -158,6 +166,25 @@ BsonDestroy(BSON *b)
 	bson_dealloc(b);
 }
 
+void
+BsonReinit(BSON *b)
+{
+	bson_destroy(b);
+	bson_init(b);
+}
+
+const char*
+BsonData(const BSON *b)
+{
+	return bson_data(b);
+}
+
+int
+BsonSize(const BSON *b)
+{
+	return bson_size(b);
+}
+
 bool
 BsonIterInit(BSON_ITERATOR *it, BSON *b)
 {
@@ -313,6 +340,12 @@ BsonAppendDate(BSON *b, const char* key, time_t v)
 	return (bson_append_date(b, key, v) == MONGO_OK);
 }
 
+bool
+BsonAppendRegex(BSON *b, const char* key, const char *pattern, const char *options)
+{
+	return (bson_append_regex(b, key, pattern, options) == MONGO_OK);
+}
+
 
 bool BsonAppendStartArray(BSON *b, const char* key, BSON* c)
 {
@@ -445,6 +478,38 @@ MongoAggregateCount(MONGO_CONN* conn, const char* database, const char* collecti
 }
 
 
+/*
+ * Read the document count and average document size of the collection with the
+ * collStats command. Returns false if the command fails.
+ */
+bool
+MongoCollectionStats(MONGO_CONN* conn, const char* database, const char* collection,
+                     double *count, double *avgObjSize)
+{
+	bson command;
+	bson reply;
+	bson_iterator it;
+	bool ret = false;
+
+	bson_init(&command);
+	bson_append_string(&command, "collStats", collection);
+	bson_finish(&command);
+
+	if (mongo_run_command(conn, database, &command, &reply) == MONGO_OK)
+	{
+		*count = 0;
+		*avgObjSize = 0;
+		if (bson_find(&it, &reply, "count") != BSON_EOO)
+			*count = bson_iterator_double(&it);
+		if (bson_find(&it, &reply, "avgObjSize") != BSON_EOO)
+			*avgObjSize = bson_iterator_double(&it);
+		bson_destroy(&reply);
+		ret = true;
+	}
+	bson_destroy(&command);
+	return ret;
+}
+
 void BsonIteratorFromBuffer(BSON_ITERATOR * i, const char * buffer)
 {
 	bson_iterator_from_buffer(i, buffer);
@@ -506,4 +571,10 @@ BsonAsJson(const BSON* bsonDocument)
 	elog (ERROR, "Full document retrival only available in MongoC meta driver");
 }
 
+Datum
+BsonAsJsonb(const BSON* bsonDocument)
+{
+	elog (ERROR, "Full document retrival only available in MongoC meta driver");
+}
+
 
@@ -43,14 +43,50 @@ void MongoDisconnect(MONGO_CONN* conn);
 bool MongoInsert(MONGO_CONN* conn, char* database, char *collection, BSON* b);
 bool MongoUpdate(MONGO_CONN* conn, char* database, char *collection, BSON* b, BSON* op);
 bool MongoDelete(MONGO_CONN* conn, char* database, char *collection, BSON* b);
-MONGO_CURSOR* MongoCursorCreate(MONGO_CONN* conn, char* database, char *collection, BSON* q);
+MONGO_CURSOR* MongoCursorCreate(MONGO_CONN* conn, char* database, char *collection, BSON* q,
+    BSON *fields, int limit, int batchSize, bool *exhaust);
+#ifdef META_DRIVER
+MONGO_CURSOR* MongoAggregateCursorCreate(MONGO_CONN* conn, char* database, char *collection,
+    BSON* pipeline, int batchSize);
+BSON* MongoSplitPoints(MONGO_CONN* conn, const char* database, const char* collection,
+    int rangeCount, int *pointCount);
+BSON* MongoCollectionIndexes(MONGO_CONN* conn, const char* database, const char* collection);
+char* MongoExplainQuery(MONGO_CONN* conn, const char* database, const char* collection,
+    const BSON* query, const BSON* fields, int limit);
+MONGO_BULK* MongoBulkCreate(MONGO_CONN* conn, char* database, char *collection, bool ordered,
+    const char *writeConcern, bool journal);
+void MongoBulkInsert(MONGO_BULK* bulk, BSON* b);
+void MongoBulkUpdate(MONGO_BULK* bulk, BSON* q, BSON* u);
+void MongoBulkRemove(MONGO_BULK* bulk, BSON* q);
+double MongoBulkExecute(MONGO_BULK* bulk);
+void MongoBulkDestroy(MONGO_BULK* bulk);
+struct MongoFile* MongoFileOpen(const char* filename);
+void MongoFileClose(struct MongoFile* file);
+size_t MongoFileSize(struct MongoFile* file);
+void MongoFileSeek(struct MongoFile* file, size_t start, size_t end);
+const BSON* MongoFileNext(struct MongoFile* file);
+BSON* MongoFileSplitPoints(struct MongoFile* file, int rangeCount, int *pointCount);
+MONGO_MATCHER* MongoMatcherCreate(const BSON* query);
+bool MongoMatcherMatch(MONGO_MATCHER* matcher, const BSON* document);
+void MongoMatcherDestroy(MONGO_MATCHER* matcher);
+#endif
 const BSON* MongoCursorBson(MONGO_CURSOR* c);
 bool MongoCursorNext(MONGO_CURSOR* c, BSON* b);
 void MongoCursorDestroy(MONGO_CURSOR* c);
+#ifdef META_DRIVER
+struct MongoCursorPrefetch* MongoCursorPrefetchStart(MONGO_CURSOR* c);
+bool MongoCursorPrefetchFinish(struct MongoCursorPrefetch* prefetch);
+void MongoCursorPrefetchAbandon(struct MongoCursorPrefetch* prefetch, MONGO_CONN* conn);
+#endif
 double MongoAggregateCount(MONGO_CONN* conn, const char* database, const char* collection, const BSON* b);
+bool MongoCollectionStats(MONGO_CONN* conn, const char* database, const char* collection,
+    double *count, double *avgObjSize);
 
 BSON* BsonCreate(void);
 void BsonDestroy(BSON *b);
+void BsonReinit(BSON *b);
+const char* BsonData(const BSON *b);
+int BsonSize(const BSON *b);
 
 bool BsonIterInit(BSON_ITERATOR *it, BSON *b);
 bool BsonIterSubObject(BSON_ITERATOR *it, BSON *b);
@@ -90,6 +126,7 @@ bool BsonAppendDouble(BSON *b, const char* key, double v);
 bool BsonAppendUTF8(BSON *b, const char* key, char *v);
 bool BsonAppendBinary(BSON *b, const char* key, char *v, size_t len);
 bool BsonAppendDate(BSON *b, const char* key, time_t v);
+bool BsonAppendRegex(BSON *b, const char* key, const char *pattern, const char *options);
 bool BsonAppendStartArray(BSON *b, const char* key, BSON* c);
 bool BsonAppendFinishArray(BSON *b, BSON *c);
 bool BsonAppendStartObject(BSON* b, char *key, BSON *r);
@@ -100,6 +137,10 @@ bool JsonToBsonAppendElement(BSON *bb , const char *k , struct json_object *v);
 json_object *JsonTokenerPrase(char * s);
 
 char* BsonAsJson(const BSON* bsonDocument);
+Datum BsonAsJsonb(const BSON* bsonDocument);
+#ifdef META_DRIVER
+Datum BsonIterJsonb(BSON_ITERATOR *iter);
+#endif
 
 void BsonToJsonStringValue(StringInfo output, BSON_ITERATOR *iter, bool isArray);
 void DumpJsonObject(StringInfo output, BSON_ITERATOR *iter);
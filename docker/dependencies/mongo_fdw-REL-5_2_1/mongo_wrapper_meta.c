@@ -17,9 +17,64 @@
 
 
 #include "postgres.h"
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <mongoc.h>
 #include "mongo_wrapper.h"
 
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#if PG_VERSION_NUM >= 100000
+#include "pgstat.h"
+#endif
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/builtins.h"
+#include "utils/jsonb.h"
+
+static JsonbValue * BsonToJsonbContainer(JsonbParseState **state,
+										 BSON_ITERATOR *iter, bool isArray);
+static void BsonToJsonbValue(JsonbParseState **state, BSON_ITERATOR *iter,
+							 int token);
+static void JsonbPushKey(JsonbParseState **state, const char *key);
+static void JsonbPushString(JsonbParseState **state, int token,
+							const char *value, int length);
+static void JsonbPushNumeric(JsonbParseState **state, int token,
+							 Datum numeric);
+static bool MongoServerIsMongos(MONGO_CONN *conn);
+static void * MongoCursorPrefetchRun(void *arg);
+
+/*
+ * First fetch of a cursor running in a thread of its own. The thread only
+ * calls into the driver, and into PostgreSQL only to set the backend's latch,
+ * which is safe from a signal handler and so from another thread too. It is
+ * the only user of the cursor and its client until the fetch is done.
+ */
+struct MongoCursorPrefetch
+{
+	pthread_t        thread;
+	pthread_mutex_t  lock;		/* protects done and abandoned */
+	MONGO_CURSOR    *cursor;
+	MONGO_CONN      *conn;		/* client of an abandoned fetch */
+	Latch           *latch;		/* latch of the backend waiting for it */
+	bool             found;		/* the fetch returned a document */
+	bool             done;		/* the fetch is over */
+	bool             abandoned;	/* the thread cleans up after itself */
+};
+
+/* latch set by the signal handlers of cancel, die and statement_timeout */
+#if PG_VERSION_NUM >= 90500
+#define MONGO_BACKEND_LATCH MyLatch
+#else
+#define MONGO_BACKEND_LATCH (&MyProc->procLatch)
+#endif
+
 /*
  * Connect to MongoDB server using Host/ip and Port number.
  */
@@ -162,19 +217,159 @@ MongoDelete(MONGO_CONN* conn, char* database, char *collection, BSON* b)
 	return true;
 }
 
+/*
+ * Build the write concern of the write_concern and journal options, or return
+ * NULL to keep the one of the client.  'w' is a node count, "majority" or the
+ * name of a tag set of the replica set.
+ */
+static mongoc_write_concern_t*
+MongoWriteConcernCreate(const char *w, bool journal)
+{
+	mongoc_write_concern_t *writeConcern = NULL;
+
+	if (w == NULL && !journal)
+		return NULL;
+
+	writeConcern = mongoc_write_concern_new();
+	if (w != NULL)
+	{
+		if (isdigit((unsigned char) w[0]))
+			mongoc_write_concern_set_w(writeConcern, atoi(w));
+		else if (strcmp(w, "majority") == 0)
+			mongoc_write_concern_set_wmajority(writeConcern, 0);
+		else
+			mongoc_write_concern_set_wtag(writeConcern, w);
+	}
+	if (journal)
+		mongoc_write_concern_set_journal(writeConcern, true);
+
+	return writeConcern;
+}
+
+/*
+ * Start a bulk write against the given collection.  Writes queued with
+ * MongoBulkInsert, MongoBulkUpdate and MongoBulkRemove are sent to the server
+ * by MongoBulkExecute.
+ */
+MONGO_BULK*
+MongoBulkCreate(MONGO_CONN* conn, char* database, char *collection, bool ordered,
+                const char *writeConcern, bool journal)
+{
+	mongoc_collection_t    *c = NULL;
+	mongoc_write_concern_t *wc = NULL;
+	MONGO_BULK             *bulk = NULL;
+
+	c = mongoc_client_get_collection(conn, database, collection);
+	wc = MongoWriteConcernCreate(writeConcern, journal);
+
+	/* the bulk operation keeps its own copies of both */
+	bulk = mongoc_collection_create_bulk_operation(c, ordered, wc);
+	if (wc)
+		mongoc_write_concern_destroy(wc);
+	mongoc_collection_destroy(c);
+	return bulk;
+}
+
+/*
+ * Queue the insertion of document 'b'; the bulk write copies it.
+ */
+void
+MongoBulkInsert(MONGO_BULK* bulk, BSON* b)
+{
+	mongoc_bulk_operation_insert(bulk, b);
+}
+
+/*
+ * Queue the update of all documents that match query 'q' by update document 'u'.
+ */
+void
+MongoBulkUpdate(MONGO_BULK* bulk, BSON* q, BSON* u)
+{
+	mongoc_bulk_operation_update(bulk, q, u, false);
+}
+
+/*
+ * Queue the removal of all documents that match query 'q'.
+ */
+void
+MongoBulkRemove(MONGO_BULK* bulk, BSON* q)
+{
+	mongoc_bulk_operation_remove(bulk, q);
+}
+
+/*
+ * Send the queued writes to the server in as few round trips as it allows,
+ * and destroy the bulk write. Returns the number of documents inserted,
+ * matched by updates or removed, which is 0 for unacknowledged writes.
+ */
+double
+MongoBulkExecute(MONGO_BULK* bulk)
+{
+	static const char *countFields[] = { "nInserted", "nMatched", "nRemoved", "nUpserted" };
+	bson_t       reply;
+	bson_error_t error;
+	bson_iter_t  it;
+	uint32_t     r;
+	double       count = 0;
+	int          i;
+
+	r = mongoc_bulk_operation_execute(bulk, &reply, &error);
+	for (i = 0; r != 0 && i < lengthof(countFields); i++)
+	{
+		if (bson_iter_init_find(&it, &reply, countFields[i]) &&
+			BSON_ITER_HOLDS_INT32(&it))
+			count += bson_iter_int32(&it);
+	}
+	bson_destroy(&reply);
+	mongoc_bulk_operation_destroy(bulk);
+	if (r == 0)
+		ereport(ERROR, (errmsg("failed to write to mongo collection"),
+						errhint("Mongo error: \"%s\"", error.message)));
+	return count;
+}
+
+/*
+ * Throw the queued writes of a bulk write away.
+ */
+void
+MongoBulkDestroy(MONGO_BULK* bulk)
+{
+	if (bulk)
+		mongoc_bulk_operation_destroy(bulk);
+}
+
 /*
  * Performs a query against the configured MongoDB server and return
  * cursor which can be destroyed by calling mongoc_cursor_current.
  */
 MONGO_CURSOR*
-MongoCursorCreate(MONGO_CONN* conn, char* database, char *collection, BSON* q)
+MongoCursorCreate(MONGO_CONN* conn, char* database, char *collection, BSON* q,
+                  BSON *fields, int limit, int batchSize, bool *exhaust)
 {
 	mongoc_collection_t *c = NULL;
 	MONGO_CURSOR *cur = NULL;
 	bson_error_t error;
+	mongoc_query_flags_t flags = MONGOC_QUERY_SLAVE_OK;
+
+	/* exhaust cursors can't have a limit, nor go through mongos */
+	if (*exhaust && (limit > 0 || MongoServerIsMongos(conn)))
+		*exhaust = false;
+	if (*exhaust)
+		flags |= MONGOC_QUERY_EXHAUST;
 
 	c = mongoc_client_get_collection (conn, database, collection);
-	cur = mongoc_collection_find(c, MONGOC_QUERY_SLAVE_OK, 0, 0, 0, q, NULL, NULL);
+	cur = mongoc_collection_find(c, flags, 0, limit, batchSize, q, fields, NULL);
+
+	/*
+	 * The driver refuses exhaust cursors on some topologies, in which case we
+	 * quietly fall back to a regular cursor.
+	 */
+	if (cur && *exhaust && mongoc_cursor_error(cur, &error))
+	{
+		mongoc_cursor_destroy(cur);
+		*exhaust = false;
+		cur = mongoc_collection_find(c, MONGOC_QUERY_SLAVE_OK, 0, limit, batchSize, q, fields, NULL);
+	}
 	mongoc_cursor_error(cur, &error);
 	if (!cur)
 		ereport(ERROR, (errmsg("failed to create cursor"),
@@ -184,6 +379,65 @@ MongoCursorCreate(MONGO_CONN* conn, char* database, char *collection, BSON* q)
 	return cur;
 }
 
+/*
+ * Tell whether the client talks to mongos, which refuses exhaust cursors. The
+ * driver only knows once it has discovered the topology, which it does when
+ * the first batch of a cursor is read, so we ask the server. A server that
+ * can't be asked is taken for mongos.
+ */
+static bool
+MongoServerIsMongos(MONGO_CONN *conn)
+{
+	bson_t       command;
+	bson_t       reply;
+	bson_iter_t  it;
+	bson_error_t error;
+	bool         mongos = true;
+
+	bson_init(&command);
+	BSON_APPEND_INT32(&command, "isMaster", 1);
+	if (mongoc_client_command_simple(conn, "admin", &command, NULL, &reply, &error))
+		mongos = bson_iter_init_find(&it, &reply, "msg") &&
+				 BSON_ITER_HOLDS_UTF8(&it) &&
+				 strcmp(bson_iter_utf8(&it, NULL), "isdbgrid") == 0;
+	else
+		elog(DEBUG1, "isMaster failed: %s", error.message);
+
+	bson_destroy(&reply);
+	bson_destroy(&command);
+	return mongos;
+}
+
+
+/*
+ * Runs an aggregation pipeline against the configured MongoDB server and
+ * returns a cursor over its result documents.
+ */
+MONGO_CURSOR*
+MongoAggregateCursorCreate(MONGO_CONN* conn, char* database, char *collection,
+                           BSON* pipeline, int batchSize)
+{
+	mongoc_collection_t *c = NULL;
+	MONGO_CURSOR *cur = NULL;
+	BSON *opts = NULL;
+
+	if (batchSize > 0)
+	{
+		opts = BsonCreate();
+		BsonAppendInt32(opts, "batchSize", batchSize);
+	}
+
+	c = mongoc_client_get_collection (conn, database, collection);
+	cur = mongoc_collection_aggregate(c, MONGOC_QUERY_SLAVE_OK, pipeline, opts, NULL);
+	if (!cur)
+		ereport(ERROR, (errmsg("failed to create aggregation cursor")));
+
+	if (opts)
+		BsonDestroy(opts);
+	mongoc_collection_destroy(c);
+	return cur;
+}
+
 
 /*
  * Destroy cursor created by calling MongoCursorCreate function.
@@ -214,6 +468,151 @@ MongoCursorNext(MONGO_CURSOR* c, BSON *b)
 }
 
 
+/*
+ * Start fetching the first document of the cursor in the background. The
+ * cursor and its client must not be touched until MongoCursorPrefetchFinish
+ * returns. Returns NULL if no thread could be started, in which case the
+ * caller just fetches as usual.
+ */
+struct MongoCursorPrefetch*
+MongoCursorPrefetchStart(MONGO_CURSOR* c)
+{
+	struct MongoCursorPrefetch *prefetch = NULL;
+	sigset_t blockedSignals;
+	sigset_t savedSignals;
+	int      rc = 0;
+
+	/* the thread may outlive the query's memory, if the query fails */
+	prefetch = bson_malloc0(sizeof(struct MongoCursorPrefetch));
+	prefetch->cursor = c;
+	prefetch->latch = MONGO_BACKEND_LATCH;
+	pthread_mutex_init(&prefetch->lock, NULL);
+
+	/* signals are for the backend's own thread, so the new one blocks them all */
+	sigfillset(&blockedSignals);
+	pthread_sigmask(SIG_SETMASK, &blockedSignals, &savedSignals);
+	rc = pthread_create(&prefetch->thread, NULL, MongoCursorPrefetchRun, prefetch);
+	pthread_sigmask(SIG_SETMASK, &savedSignals, NULL);
+
+	if (rc != 0)
+	{
+		elog(DEBUG1, "could not start fetching in the background: %s", strerror(rc));
+		pthread_mutex_destroy(&prefetch->lock);
+		bson_free(prefetch);
+		return NULL;
+	}
+	return prefetch;
+}
+
+
+/*
+ * Wait for the first fetch started by MongoCursorPrefetchStart, and return
+ * what MongoCursorNext would have returned for it. The document is then the
+ * current one of the cursor. The wait is on the backend's latch, so that a
+ * cancel request or statement_timeout interrupts it; the fetch is then left
+ * to the transaction callbacks, which abandon it.
+ */
+bool
+MongoCursorPrefetchFinish(struct MongoCursorPrefetch* prefetch)
+{
+	bool found = false;
+
+	for (;;)
+	{
+		bool done = false;
+		int  rc = 0;
+
+		pthread_mutex_lock(&prefetch->lock);
+		done = prefetch->done;
+		pthread_mutex_unlock(&prefetch->lock);
+		if (done)
+			break;
+
+#if PG_VERSION_NUM >= 100000
+		rc = WaitLatch(prefetch->latch, WL_LATCH_SET | WL_POSTMASTER_DEATH, -1L,
+					   PG_WAIT_EXTENSION);
+#else
+		rc = WaitLatch(prefetch->latch, WL_LATCH_SET | WL_POSTMASTER_DEATH, -1L);
+#endif
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		ResetLatch(prefetch->latch);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	pthread_join(prefetch->thread, NULL);
+	found = prefetch->found;
+	pthread_mutex_destroy(&prefetch->lock);
+	bson_free(prefetch);
+
+	return found;
+}
+
+
+/*
+ * Give up on a fetch started by MongoCursorPrefetchStart, without waiting for
+ * it, when the query that started it has failed. The cursor and its client
+ * conn are destroyed once the fetch is over, by its thread if it is still
+ * running, so neither may be used again.
+ */
+void
+MongoCursorPrefetchAbandon(struct MongoCursorPrefetch* prefetch, MONGO_CONN* conn)
+{
+	bool done = false;
+
+	pthread_mutex_lock(&prefetch->lock);
+	done = prefetch->done;
+	if (!done)
+	{
+		prefetch->conn = conn;
+		prefetch->abandoned = true;
+	}
+	pthread_mutex_unlock(&prefetch->lock);
+
+	if (!done)
+	{
+		pthread_detach(prefetch->thread);
+		return;
+	}
+
+	pthread_join(prefetch->thread, NULL);
+	pthread_mutex_destroy(&prefetch->lock);
+	mongoc_cursor_destroy(prefetch->cursor);
+	mongoc_client_destroy(conn);
+	bson_free(prefetch);
+}
+
+
+static void *
+MongoCursorPrefetchRun(void *arg)
+{
+	struct MongoCursorPrefetch *prefetch = (struct MongoCursorPrefetch *) arg;
+	const BSON *document = NULL;
+	bool        abandoned = false;
+
+	prefetch->found = mongoc_cursor_next(prefetch->cursor, &document);
+
+	pthread_mutex_lock(&prefetch->lock);
+	prefetch->done = true;
+	abandoned = prefetch->abandoned;
+	pthread_mutex_unlock(&prefetch->lock);
+
+	if (!abandoned)
+	{
+		SetLatch(prefetch->latch);
+		return NULL;
+	}
+
+	/* nobody waits for this fetch anymore, so clean up after it */
+	mongoc_cursor_destroy(prefetch->cursor);
+	mongoc_client_destroy(prefetch->conn);
+	pthread_mutex_destroy(&prefetch->lock);
+	bson_free(prefetch);
+	return NULL;
+}
+
+
 /*
  * Allocates a new bson_t structure, and also initialize the bson
  * object. After that point objects can be appended to that bson
@@ -238,6 +637,30 @@ BsonDestroy(BSON *b)
 	bson_destroy(b);
 }
 
+/*
+ * Empty the document, keeping its buffer for the next one built in it.
+ */
+void
+BsonReinit(BSON *b)
+{
+	bson_reinit(b);
+}
+
+/*
+ * Return the data of the document, and its size in bytes.
+ */
+const char*
+BsonData(const BSON *b)
+{
+	return (const char *) bson_get_data(b);
+}
+
+int
+BsonSize(const BSON *b)
+{
+	return (int) b->len;
+}
+
 
 /*
  * Initialize the bson Iterator.
@@ -260,24 +683,36 @@ BsonIterSubObject(BSON_ITERATOR *it, BSON *b)
 	return true;
 }
 
+/*
+ * The numeric accessors convert between the numeric BSON types, as the legacy
+ * driver's do; bson_iter_int32() and friends return 0 for any other type.
+ */
 int32_t
 BsonIterInt32(BSON_ITERATOR *it)
 {
-	return bson_iter_int32(it);
+	return (int32_t) bson_iter_as_int64(it);
 }
 
 
 int64_t
 BsonIterInt64(BSON_ITERATOR *it)
 {
-	return bson_iter_int64(it);
+	return bson_iter_as_int64(it);
 }
 
 
 double
 BsonIterDouble(BSON_ITERATOR *it)
 {
-	return bson_iter_double(it);
+	switch (bson_iter_type(it))
+	{
+		case BSON_TYPE_INT32:
+		case BSON_TYPE_INT64:
+		case BSON_TYPE_BOOL:
+			return (double) bson_iter_as_int64(it);
+		default:
+			return bson_iter_double(it);
+	}
 }
 
 
@@ -422,6 +857,12 @@ BsonAppendDate(BSON *b, const char* key, time_t v)
 	return bson_append_date_time(b, key, strlen(key), v);
 }
 
+bool
+BsonAppendRegex(BSON *b, const char* key, const char *pattern, const char *options)
+{
+	return bson_append_regex(b, key, strlen(key), pattern, options);
+}
+
 
 bool
 BsonAppendBson(BSON* b, char *key, BSON* c)
@@ -576,6 +1017,584 @@ MongoAggregateCount(MONGO_CONN* conn, const char* database, const char* collecti
 	return count;
 }
 
+/*
+ * Read the document count and average document size of the collection with the
+ * collStats command. Returns false if the command fails.
+ */
+bool
+MongoCollectionStats(MONGO_CONN* conn, const char* database, const char* collection,
+                     double *count, double *avgObjSize)
+{
+	mongoc_collection_t *c = NULL;
+	BSON                 reply;
+	bson_error_t         error;
+	bson_iter_t          it;
+	bool                 ret = false;
+
+	c = mongoc_client_get_collection(conn, database, collection);
+	ret = mongoc_collection_stats(c, NULL, &reply, &error);
+	if (ret)
+	{
+		*count = 0;
+		*avgObjSize = 0;
+		if (bson_iter_init_find(&it, &reply, "count"))
+			*count = BsonIterDouble(&it);
+		if (bson_iter_init_find(&it, &reply, "avgObjSize"))
+			*avgObjSize = BsonIterDouble(&it);
+	}
+	else
+		elog(DEBUG1, "collStats failed for \"%s.%s\": %s", database, collection, error.message);
+
+	bson_destroy(&reply);
+	mongoc_collection_destroy(c);
+	return ret;
+}
+
+/*
+ * Read the indexes of the collection with the listIndexes command, and return
+ * their key patterns as a document with keys "0", "1", ... Sparse and partial
+ * indexes are left out, as they don't hold every document, and so are those
+ * with a collation, which string comparisons of queries don't use. Returns
+ * NULL if the command fails.
+ */
+BSON*
+MongoCollectionIndexes(MONGO_CONN* conn, const char* database, const char* collection)
+{
+	mongoc_collection_t *c = NULL;
+	mongoc_cursor_t     *cursor = NULL;
+	const BSON          *doc = NULL;
+	BSON                *indexes = NULL;
+	bson_error_t         error;
+	bson_iter_t          it;
+	char                 key[12];
+	int                  indexCount = 0;
+
+	c = mongoc_client_get_collection(conn, database, collection);
+	cursor = mongoc_collection_find_indexes(c, &error);
+	if (cursor == NULL)
+	{
+		elog(DEBUG1, "listIndexes failed for \"%s.%s\": %s", database, collection, error.message);
+		mongoc_collection_destroy(c);
+		return NULL;
+	}
+
+	indexes = BsonCreate();
+	while (mongoc_cursor_next(cursor, &doc))
+	{
+		if ((bson_iter_init_find(&it, doc, "sparse") && bson_iter_as_bool(&it)) ||
+			bson_iter_init_find(&it, doc, "partialFilterExpression") ||
+			bson_iter_init_find(&it, doc, "collation"))
+			continue;
+
+		if (!bson_iter_init_find(&it, doc, "key") || !BSON_ITER_HOLDS_DOCUMENT(&it))
+			continue;
+
+		snprintf(key, sizeof(key), "%d", indexCount++);
+		bson_append_iter(indexes, key, -1, &it);
+	}
+
+	if (mongoc_cursor_error(cursor, &error))
+	{
+		elog(DEBUG1, "listIndexes failed for \"%s.%s\": %s", database, collection, error.message);
+		BsonDestroy(indexes);
+		indexes = NULL;
+	}
+
+	mongoc_cursor_destroy(cursor);
+	mongoc_collection_destroy(c);
+	return indexes;
+}
+
+/*
+ * Run the explain command for a find with the given query document, which may
+ * wrap its filter in $query along with $orderby and $hint, and return the plan
+ * the server chose as JSON, or NULL if the command fails. The caller frees the
+ * string with bson_free.
+ */
+char*
+MongoExplainQuery(MONGO_CONN* conn, const char* database, const char* collection,
+                  const BSON* query, const BSON* fields, int limit)
+{
+	BSON                 command;
+	BSON                 find;
+	BSON                 reply;
+	BSON                 plan;
+	bson_error_t         error;
+	bson_iter_t          it;
+	bson_iter_t          planIter;
+	const uint8_t       *planData = NULL;
+	uint32_t             planLength = 0;
+	char                *planString = NULL;
+
+	bson_init(&command);
+	bson_append_document_begin(&command, "explain", -1, &find);
+	BSON_APPEND_UTF8(&find, "find", collection);
+	if (bson_iter_init_find(&it, query, "$query"))
+	{
+		bson_iter_init(&it, query);
+		while (bson_iter_next(&it))
+		{
+			const char *key = bson_iter_key(&it);
+
+			if (strcmp(key, "$query") == 0)
+				bson_append_iter(&find, "filter", -1, &it);
+			else if (strcmp(key, "$orderby") == 0)
+				bson_append_iter(&find, "sort", -1, &it);
+			else if (strcmp(key, "$hint") == 0)
+				bson_append_iter(&find, "hint", -1, &it);
+		}
+	}
+	else
+		BSON_APPEND_DOCUMENT(&find, "filter", query);
+	if (fields != NULL)
+		BSON_APPEND_DOCUMENT(&find, "projection", fields);
+	if (limit > 0)
+		BSON_APPEND_INT64(&find, "limit", limit);
+	bson_append_document_end(&command, &find);
+
+	if (mongoc_client_command_simple(conn, database, &command, NULL, &reply, &error))
+	{
+		if (bson_iter_init(&it, &reply) &&
+			bson_iter_find_descendant(&it, "queryPlanner.winningPlan", &planIter) &&
+			BSON_ITER_HOLDS_DOCUMENT(&planIter))
+		{
+			bson_iter_document(&planIter, &planLength, &planData);
+			if (bson_init_static(&plan, planData, planLength))
+				planString = bson_as_json(&plan, NULL);
+		}
+	}
+	else
+		elog(DEBUG1, "explain failed for \"%s.%s\": %s", database, collection, error.message);
+
+	bson_destroy(&reply);
+	bson_destroy(&command);
+	return planString;
+}
+
+/*
+ * Append the _id of the given document to the split points, unless it is of
+ * another BSON type than the first split point, numbers counting as one type.
+ */
+static void
+MongoSplitPointAppend(BSON *splitPoints, const BSON *document,
+                      bson_type_t *pointType, int *pointCount)
+{
+	bson_iter_t  it;
+	bson_type_t  type;
+	char         key[12];
+
+	if (!bson_iter_init_find(&it, document, "_id"))
+		return;
+
+	type = bson_iter_type(&it);
+	if (type == BSON_TYPE_INT32 || type == BSON_TYPE_INT64)
+		type = BSON_TYPE_DOUBLE;
+
+	if (*pointCount == 0)
+		*pointType = type;
+	else if (type != *pointType)
+		return;
+
+	snprintf(key, sizeof(key), "%d", (*pointCount)++);
+	bson_append_iter(splitPoints, key, -1, &it);
+}
+
+/*
+ * Find ascending _id values that split the collection into about rangeCount
+ * ranges of similar size, and return them as a document with keys "0", "1",
+ * ..., setting *pointCount to their number. We ask the server with the
+ * splitVector command, which walks the _id index but needs the clusterManager
+ * role and doesn't run on mongos, and otherwise take the boundaries of a
+ * random sample of _id values. Returns NULL if neither works.
+ */
+BSON*
+MongoSplitPoints(MONGO_CONN* conn, const char* database, const char* collection,
+                 int rangeCount, int *pointCount)
+{
+	mongoc_collection_t *c = NULL;
+	mongoc_cursor_t     *cursor = NULL;
+	const BSON          *doc = NULL;
+	BSON                *command = NULL;
+	BSON                *pipeline = NULL;
+	BSON                *splitPoints = NULL;
+	BSON                 reply;
+	BSON                 r;
+	BSON                 t;
+	BSON                 s;
+	bson_error_t         error;
+	bson_iter_t          it;
+	bson_iter_t          keys;
+	bson_type_t          pointType = BSON_TYPE_EOD;
+	double               count = 0;
+	double               avgObjSize = 0;
+	double               chunkSize = 0;
+	char                *ns = NULL;
+	int                  docIndex = 0;
+
+	*pointCount = 0;
+	if (rangeCount < 2 ||
+		!MongoCollectionStats(conn, database, collection, &count, &avgObjSize) ||
+		count < rangeCount)
+		return NULL;
+
+	/* splitVector splits chunks at half of their maximum size */
+	ns = psprintf("%s.%s", database, collection);
+	chunkSize = Max(2.0 * count * Max(avgObjSize, 1.0) / rangeCount, 1.0);
+
+	command = BsonCreate();
+	BsonAppendUTF8(command, "splitVector", ns);
+	BsonAppendStartObject(command, "keyPattern", &r);
+	BsonAppendInt32(&r, "_id", 1);
+	BsonAppendFinishObject(command, &r);
+	BsonAppendInt64(command, "maxChunkSizeBytes", (int64_t) chunkSize);
+	BsonFinish(command);
+
+	splitPoints = BsonCreate();
+	if (mongoc_client_command_simple(conn, database, command, NULL, &reply, &error))
+	{
+		if (bson_iter_init_find(&it, &reply, "splitKeys") &&
+			BSON_ITER_HOLDS_ARRAY(&it) && bson_iter_recurse(&it, &keys))
+		{
+			while (bson_iter_next(&keys))
+			{
+				const uint8_t *data = NULL;
+				uint32_t       len = 0;
+				BSON           key;
+
+				if (!BSON_ITER_HOLDS_DOCUMENT(&keys))
+					continue;
+				bson_iter_document(&keys, &len, &data);
+				if (bson_init_static(&key, data, len))
+					MongoSplitPointAppend(splitPoints, &key, &pointType, pointCount);
+			}
+		}
+	}
+	else
+		elog(DEBUG1, "splitVector failed for \"%s\": %s", ns, error.message);
+	bson_destroy(&reply);
+	BsonDestroy(command);
+
+	if (*pointCount > 0)
+		return splitPoints;
+
+	/* fall back to every MONGO_SPLIT_SAMPLE_FACTOR-th of sorted sample _ids */
+	pipeline = BsonCreate();
+	BsonAppendStartArray(pipeline, "pipeline", &t);
+	BsonAppendStartObject(&t, "0", &r);
+	BsonAppendStartObject(&r, "$sample", &s);
+	BsonAppendInt32(&s, "size", rangeCount * MONGO_SPLIT_SAMPLE_FACTOR);
+	BsonAppendFinishObject(&r, &s);
+	BsonAppendFinishObject(&t, &r);
+	BsonAppendStartObject(&t, "1", &r);
+	BsonAppendStartObject(&r, "$project", &s);
+	BsonAppendInt32(&s, "_id", 1);
+	BsonAppendFinishObject(&r, &s);
+	BsonAppendFinishObject(&t, &r);
+	BsonAppendStartObject(&t, "2", &r);
+	BsonAppendStartObject(&r, "$sort", &s);
+	BsonAppendInt32(&s, "_id", 1);
+	BsonAppendFinishObject(&r, &s);
+	BsonAppendFinishObject(&t, &r);
+	BsonAppendFinishArray(pipeline, &t);
+	BsonFinish(pipeline);
+
+	c = mongoc_client_get_collection(conn, database, collection);
+	cursor = mongoc_collection_aggregate(c, MONGOC_QUERY_SLAVE_OK, pipeline, NULL, NULL);
+	while (cursor && mongoc_cursor_next(cursor, &doc))
+	{
+		if (++docIndex % MONGO_SPLIT_SAMPLE_FACTOR == 0)
+			MongoSplitPointAppend(splitPoints, doc, &pointType, pointCount);
+	}
+	if (cursor && mongoc_cursor_error(cursor, &error))
+	{
+		elog(DEBUG1, "could not sample _id values of \"%s\": %s", ns, error.message);
+		*pointCount = 0;
+	}
+
+	if (cursor)
+		mongoc_cursor_destroy(cursor);
+	mongoc_collection_destroy(c);
+	BsonDestroy(pipeline);
+	pfree(ns);
+
+	if (*pointCount == 0)
+	{
+		BsonDestroy(splitPoints);
+		return NULL;
+	}
+	return splitPoints;
+}
+
+/* bytes read from a mongodump file at a time, at least */
+#define MONGO_FILE_BUFFER_SIZE 65536
+
+/*
+ * A mongodump file being read. Its documents are read into a buffer with
+ * plain read() calls, as the scan moves through the byte range being scanned,
+ * and each is returned where it lies in the buffer without being copied again.
+ * The file may be changed or truncated while it is read: a document that ends
+ * past the end of the file raises an error.
+ */
+struct MongoFile
+{
+	char          *filename;
+	int            fd;			/* the open file, -1 once closed */
+	size_t         size;		/* its size when it was opened */
+	char          *buffer;		/* bytes read from the file */
+	size_t         bufferSize;	/* space allocated for them */
+	size_t         bufferStart;	/* where they start in the file */
+	size_t         bufferLength;	/* how many were read */
+	size_t         offset;		/* next document of the range being read */
+	size_t         rangeEnd;	/* where that range ends */
+	BSON           document;	/* the document returned last */
+};
+
+static const char * MongoFileRead(struct MongoFile *file, size_t offset,
+								  size_t length);
+
+/*
+ * Open the given mongodump file for reading. The file is closed by
+ * MongoFileClose, or at the end of the transaction if the query fails before.
+ */
+struct MongoFile*
+MongoFileOpen(const char *filename)
+{
+	struct MongoFile *file = NULL;
+	struct stat       fileStat;
+	int               fd = -1;
+
+	fd = OpenTransientFile((char *) filename, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		ereport(ERROR, (errcode_for_file_access(),
+						errmsg("could not open file \"%s\": %m", filename)));
+
+	if (fstat(fd, &fileStat) < 0)
+		ereport(ERROR, (errcode_for_file_access(),
+						errmsg("could not stat file \"%s\": %m", filename)));
+
+	file = palloc0(sizeof(struct MongoFile));
+	file->filename = pstrdup(filename);
+	file->fd = fd;
+	file->size = (size_t) fileStat.st_size;
+	file->bufferSize = MONGO_FILE_BUFFER_SIZE;
+	file->buffer = palloc(file->bufferSize);
+
+	return file;
+}
+
+void
+MongoFileClose(struct MongoFile *file)
+{
+	if (file->fd >= 0)
+		CloseTransientFile(file->fd);
+	file->fd = -1;
+
+	if (file->buffer != NULL)
+		pfree(file->buffer);
+	file->buffer = NULL;
+}
+
+size_t
+MongoFileSize(struct MongoFile *file)
+{
+	return file->size;
+}
+
+/*
+ * Start reading the documents from byte start of the file up to byte end,
+ * which must both be where documents start, or the end of the file.
+ */
+void
+MongoFileSeek(struct MongoFile *file, size_t start, size_t end)
+{
+	file->offset = start;
+	file->rangeEnd = Min(end, file->size);
+}
+
+/*
+ * Return the next document of the range being read, or NULL after its last
+ * one. The document stays valid until the next call.
+ */
+const BSON*
+MongoFileNext(struct MongoFile *file)
+{
+	const char *data = NULL;
+	int32_t     len = 0;
+
+	if (file->offset >= file->rangeEnd)
+		return NULL;
+
+	if (file->rangeEnd - file->offset >= sizeof(int32_t))
+	{
+		memcpy(&len, MongoFileRead(file, file->offset, sizeof(int32_t)),
+			   sizeof(int32_t));
+		len = BSON_UINT32_FROM_LE(len);
+	}
+
+	if (len >= 5 && (size_t) len <= file->rangeEnd - file->offset)
+		data = MongoFileRead(file, file->offset, len);
+
+	if (data == NULL ||
+		!bson_init_static(&file->document, (const uint8_t *) data, len))
+		ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED),
+						errmsg("invalid BSON document in file \"%s\" at offset %lu",
+							   file->filename, (unsigned long) file->offset)));
+
+	file->offset += len;
+	return &file->document;
+}
+
+/*
+ * Return the length bytes of the file from the given offset, reading them
+ * into the buffer unless they are there already. The bytes of the buffer
+ * from offset on are kept, and the file is read on from where it was last
+ * read, or from offset when it is elsewhere. The bytes stay valid until the
+ * next call.
+ */
+static const char *
+MongoFileRead(struct MongoFile *file, size_t offset, size_t length)
+{
+	size_t bufferEnd = file->bufferStart + file->bufferLength;
+
+	if (offset >= file->bufferStart && offset + length <= bufferEnd)
+		return file->buffer + (offset - file->bufferStart);
+
+	if (offset >= file->bufferStart && offset <= bufferEnd)
+	{
+		file->bufferLength = bufferEnd - offset;
+		memmove(file->buffer, file->buffer + (offset - file->bufferStart),
+				file->bufferLength);
+	}
+	else
+	{
+		if (lseek(file->fd, (off_t) offset, SEEK_SET) < 0)
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not seek in file \"%s\": %m",
+								   file->filename)));
+		file->bufferLength = 0;
+	}
+	file->bufferStart = offset;
+
+	if (length > file->bufferSize)
+	{
+		file->bufferSize = length;
+		file->buffer = repalloc(file->buffer, file->bufferSize);
+	}
+
+	while (file->bufferLength < length)
+	{
+		ssize_t readLength = read(file->fd, file->buffer + file->bufferLength,
+								  file->bufferSize - file->bufferLength);
+
+		if (readLength < 0 && errno == EINTR)
+			continue;
+		if (readLength < 0)
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not read file \"%s\": %m",
+								   file->filename)));
+		if (readLength == 0)
+			ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED),
+							errmsg("unexpected end of file \"%s\" at offset %lu",
+								   file->filename,
+								   (unsigned long) (offset + file->bufferLength))));
+
+		file->bufferLength += readLength;
+	}
+
+	return file->buffer;
+}
+
+/*
+ * Find the offsets of documents that split the file into about rangeCount
+ * ranges of similar size, and return them as a document with keys "0", "1",
+ * ..., setting *pointCount to their number. Only the length of each document
+ * is read on the way, skipping ahead in the file past large documents.
+ * Returns NULL for files too small to split.
+ */
+BSON*
+MongoFileSplitPoints(struct MongoFile *file, int rangeCount, int *pointCount)
+{
+	BSON   *splitPoints = NULL;
+	size_t  rangeSize = 0;
+	size_t  nextSplit = 0;
+	size_t  offset = 0;
+	char    key[12];
+
+	*pointCount = 0;
+	if (rangeCount < 2 || file->size == 0)
+		return NULL;
+
+	rangeSize = Max(file->size / rangeCount, 1);
+	nextSplit = rangeSize;
+	splitPoints = BsonCreate();
+
+	while (file->size - offset >= sizeof(int32_t))
+	{
+		int32_t len = 0;
+
+		memcpy(&len, MongoFileRead(file, offset, sizeof(int32_t)),
+			   sizeof(int32_t));
+		len = BSON_UINT32_FROM_LE(len);
+
+		/* the scan of the range reports a broken document */
+		if (len < 5 || (size_t) len > file->size - offset)
+			break;
+
+		offset += len;
+		if (offset >= nextSplit && offset < file->size)
+		{
+			snprintf(key, sizeof(key), "%d", (*pointCount)++);
+			bson_append_int64(splitPoints, key, -1, (int64_t) offset);
+			nextSplit = offset + rangeSize;
+		}
+	}
+
+	if (*pointCount > 0)
+		return splitPoints;
+
+	BsonDestroy(splitPoints);
+	return NULL;
+}
+
+/*
+ * mongoc_matcher_t evaluates a query document against documents we hold, as
+ * far as it understands its operators. The driver deprecates it, in favor of
+ * running queries on the server, which a file scan has none of.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+/*
+ * Create a matcher for the given query document, or return NULL if it uses
+ * operators the matcher doesn't know.
+ */
+MONGO_MATCHER*
+MongoMatcherCreate(const BSON* query)
+{
+	MONGO_MATCHER *matcher = NULL;
+	bson_error_t   error;
+
+	matcher = mongoc_matcher_new(query, &error);
+	if (matcher == NULL)
+		elog(DEBUG1, "could not match documents with the query: %s", error.message);
+
+	return matcher;
+}
+
+bool
+MongoMatcherMatch(MONGO_MATCHER* matcher, const BSON* document)
+{
+	return mongoc_matcher_match(matcher, document);
+}
+
+void
+MongoMatcherDestroy(MONGO_MATCHER* matcher)
+{
+	mongoc_matcher_destroy(matcher);
+}
+
+#pragma GCC diagnostic pop
+
 void
 BsonIteratorFromBuffer(BSON_ITERATOR *i, const char * buffer)
 {
@@ -667,3 +1686,321 @@ BsonAsJson(const BSON* bsonDocument)
 {
 	return bson_as_json(bsonDocument, NULL);
 }
+
+/*
+ * BsonAsJsonb converts the given BSON document to a jsonb value. Instead of
+ * printing the document as JSON text and parsing that back in, the document is
+ * walked and its values are pushed into a jsonb builder directly. Special BSON
+ * types are converted the way BsonAsJson converts them.
+ */
+Datum
+BsonAsJsonb(const BSON* bsonDocument)
+{
+	JsonbParseState *state = NULL;
+	JsonbValue      *result = NULL;
+	BSON_ITERATOR   iter;
+
+	if (!bson_iter_init(&iter, bsonDocument))
+		elog(ERROR, "failed to initialize BSON iterator");
+
+	result = BsonToJsonbContainer(&state, &iter, false);
+	return PointerGetDatum(JsonbValueToJsonb(result));
+}
+
+/*
+ * BsonIterJsonb converts the document or array the iterator points to into a
+ * jsonb value, as BsonAsJsonb does.
+ */
+Datum
+BsonIterJsonb(BSON_ITERATOR *iter)
+{
+	JsonbParseState *state = NULL;
+	JsonbValue      *result = NULL;
+	BSON_ITERATOR   child;
+
+	if (!bson_iter_recurse(iter, &child))
+		elog(ERROR, "failed to initialize BSON iterator");
+
+	result = BsonToJsonbContainer(&state, &child, BSON_ITER_HOLDS_ARRAY(iter));
+	return PointerGetDatum(JsonbValueToJsonb(result));
+}
+
+/*
+ * BsonToJsonbContainer pushes the elements the iterator walks over as a jsonb
+ * object or array, and returns the container once it is complete. Keys and
+ * strings point into the BSON buffer, which must outlive the builder.
+ */
+static JsonbValue *
+BsonToJsonbContainer(JsonbParseState **state, BSON_ITERATOR *iter, bool isArray)
+{
+	check_stack_depth();
+
+	pushJsonbValue(state, isArray ? WJB_BEGIN_ARRAY : WJB_BEGIN_OBJECT, NULL);
+
+	while (bson_iter_next(iter))
+	{
+		if (!isArray)
+			JsonbPushKey(state, bson_iter_key(iter));
+
+		BsonToJsonbValue(state, iter, isArray ? WJB_ELEM : WJB_VALUE);
+	}
+
+	return pushJsonbValue(state, isArray ? WJB_END_ARRAY : WJB_END_OBJECT, NULL);
+}
+
+/*
+ * BsonToJsonbValue pushes the value the iterator points to as the next value
+ * or element of the jsonb container being built. Special BSON datatypes are
+ * converted to objects using "Strict MongoDB Extended JSON".
+ */
+static void
+BsonToJsonbValue(JsonbParseState **state, BSON_ITERATOR *iter, int token)
+{
+	JsonbValue value;
+	uint32_t   length = 0;
+
+	switch (bson_iter_type(iter))
+	{
+		case BSON_TYPE_DOCUMENT:
+		case BSON_TYPE_ARRAY:
+		{
+			BSON_ITERATOR child;
+
+			if (!bson_iter_recurse(iter, &child))
+				elog(ERROR, "failed to initialize BSON iterator");
+
+			BsonToJsonbContainer(state, &child, BSON_ITER_HOLDS_ARRAY(iter));
+			break;
+		}
+		case BSON_TYPE_UTF8:
+		{
+			const char *string = bson_iter_utf8(iter, &length);
+
+			JsonbPushString(state, token, string, length);
+			break;
+		}
+		case BSON_TYPE_SYMBOL:
+		{
+			const char *symbol = bson_iter_symbol(iter, &length);
+
+			JsonbPushString(state, token, symbol, length);
+			break;
+		}
+		case BSON_TYPE_CODE:
+		{
+			const char *code = bson_iter_code(iter, &length);
+
+			JsonbPushString(state, token, code, length);
+			break;
+		}
+		case BSON_TYPE_CODEWSCOPE:
+		{
+			const uint8_t *scope = NULL;
+			uint32_t      scopeLength = 0;
+			const char    *code = bson_iter_codewscope(iter, &length,
+													   &scopeLength, &scope);
+
+			JsonbPushString(state, token, code, length);
+			break;
+		}
+		case BSON_TYPE_INT32:
+			JsonbPushNumeric(state, token,
+							 DirectFunctionCall1(int4_numeric,
+									Int32GetDatum(bson_iter_int32(iter))));
+			break;
+		case BSON_TYPE_INT64:
+			JsonbPushNumeric(state, token,
+							 DirectFunctionCall1(int8_numeric,
+									Int64GetDatum(bson_iter_int64(iter))));
+			break;
+		case BSON_TYPE_DOUBLE:
+		{
+			double number = bson_iter_double(iter);
+
+			/* JSON has no numbers for these, so write them as to_jsonb does */
+			if (isnan(number))
+				JsonbPushString(state, token, "NaN", 3);
+			else if (isinf(number))
+				JsonbPushString(state, token, number > 0 ? "Infinity" : "-Infinity",
+								number > 0 ? 8 : 9);
+			else
+				JsonbPushNumeric(state, token,
+								 DirectFunctionCall1(float8_numeric,
+													 Float8GetDatum(number)));
+			break;
+		}
+		case BSON_TYPE_BOOL:
+			value.type = jbvBool;
+			value.val.boolean = bson_iter_bool(iter);
+			pushJsonbValue(state, token, &value);
+			break;
+		case BSON_TYPE_NULL:
+			value.type = jbvNull;
+			pushJsonbValue(state, token, &value);
+			break;
+		case BSON_TYPE_UNDEFINED:
+			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+			JsonbPushKey(state, "$undefined");
+			value.type = jbvBool;
+			value.val.boolean = true;
+			pushJsonbValue(state, WJB_VALUE, &value);
+			pushJsonbValue(state, WJB_END_OBJECT, NULL);
+			break;
+		case BSON_TYPE_OID:
+		{
+			char *oidString = palloc(25);
+
+			bson_oid_to_string(bson_iter_oid(iter), oidString);
+
+			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+			JsonbPushKey(state, "$oid");
+			JsonbPushString(state, WJB_VALUE, oidString, 24);
+			pushJsonbValue(state, WJB_END_OBJECT, NULL);
+			break;
+		}
+		case BSON_TYPE_BINARY:
+		{
+			const uint8_t  *binary = NULL;
+			bson_subtype_t subtype;
+			bytea          *bytes = NULL;
+			char           *encoded = NULL;
+			char           *read = NULL;
+			char           *write = NULL;
+
+			bson_iter_binary(iter, &subtype, &length, &binary);
+			bytes = (bytea *) palloc(length + VARHDRSZ);
+			SET_VARSIZE(bytes, length + VARHDRSZ);
+			memcpy(VARDATA(bytes), binary, length);
+
+			/* base64 encoding breaks lines, which extended JSON doesn't */
+			encoded = TextDatumGetCString(DirectFunctionCall2(binary_encode,
+										  PointerGetDatum(bytes),
+										  CStringGetTextDatum("base64")));
+			for (read = write = encoded; *read != '\0'; read++)
+			{
+				if (*read != '\n')
+					*write++ = *read;
+			}
+			*write = '\0';
+
+			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+			JsonbPushKey(state, "$type");
+			JsonbPushString(state, WJB_VALUE, psprintf("%02x", subtype), 2);
+			JsonbPushKey(state, "$binary");
+			JsonbPushString(state, WJB_VALUE, encoded, strlen(encoded));
+			pushJsonbValue(state, WJB_END_OBJECT, NULL);
+			break;
+		}
+		case BSON_TYPE_DATE_TIME:
+			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+			JsonbPushKey(state, "$date");
+			JsonbPushNumeric(state, WJB_VALUE,
+							 DirectFunctionCall1(int8_numeric,
+									Int64GetDatum(bson_iter_date_time(iter))));
+			pushJsonbValue(state, WJB_END_OBJECT, NULL);
+			break;
+		case BSON_TYPE_REGEX:
+		{
+			const char *options = NULL;
+			const char *regex = bson_iter_regex(iter, &options);
+
+			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+			JsonbPushKey(state, "$regex");
+			JsonbPushString(state, WJB_VALUE, regex, strlen(regex));
+			JsonbPushKey(state, "$options");
+			JsonbPushString(state, WJB_VALUE, options, strlen(options));
+			pushJsonbValue(state, WJB_END_OBJECT, NULL);
+			break;
+		}
+		case BSON_TYPE_TIMESTAMP:
+		{
+			uint32_t timestamp = 0;
+			uint32_t increment = 0;
+
+			bson_iter_timestamp(iter, &timestamp, &increment);
+
+			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+			JsonbPushKey(state, "$timestamp");
+			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+			JsonbPushKey(state, "t");
+			JsonbPushNumeric(state, WJB_VALUE,
+							 DirectFunctionCall1(int8_numeric,
+												 Int64GetDatum(timestamp)));
+			JsonbPushKey(state, "i");
+			JsonbPushNumeric(state, WJB_VALUE,
+							 DirectFunctionCall1(int8_numeric,
+												 Int64GetDatum(increment)));
+			pushJsonbValue(state, WJB_END_OBJECT, NULL);
+			pushJsonbValue(state, WJB_END_OBJECT, NULL);
+			break;
+		}
+		case BSON_TYPE_DBPOINTER:
+		{
+			const char       *collection = NULL;
+			const bson_oid_t *oid = NULL;
+
+			bson_iter_dbpointer(iter, &length, &collection, &oid);
+
+			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+			JsonbPushKey(state, "$ref");
+			JsonbPushString(state, WJB_VALUE, collection, length);
+			if (oid != NULL)
+			{
+				char *oidString = palloc(25);
+
+				bson_oid_to_string(oid, oidString);
+				JsonbPushKey(state, "$id");
+				JsonbPushString(state, WJB_VALUE, oidString, 24);
+			}
+			pushJsonbValue(state, WJB_END_OBJECT, NULL);
+			break;
+		}
+		case BSON_TYPE_MINKEY:
+		case BSON_TYPE_MAXKEY:
+			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+			JsonbPushKey(state, bson_iter_type(iter) == BSON_TYPE_MINKEY ?
+						 "$minKey" : "$maxKey");
+			JsonbPushNumeric(state, WJB_VALUE,
+							 DirectFunctionCall1(int4_numeric, Int32GetDatum(1)));
+			pushJsonbValue(state, WJB_END_OBJECT, NULL);
+			break;
+		default:
+			ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+							errmsg("cannot convert BSON type to jsonb"),
+							errhint("BSON type: %d", (int) bson_iter_type(iter))));
+			break;
+	}
+}
+
+static void
+JsonbPushKey(JsonbParseState **state, const char *key)
+{
+	JsonbPushString(state, WJB_KEY, key, strlen(key));
+}
+
+/*
+ * Strings and keys are converted from UTF-8 to the server encoding, which also
+ * checks that they are valid, as for text columns.
+ */
+static void
+JsonbPushString(JsonbParseState **state, int token, const char *value,
+				int length)
+{
+	JsonbValue string;
+	char      *serverValue = pg_any_to_server(value, length, PG_UTF8);
+
+	string.type = jbvString;
+	string.val.string.val = serverValue;
+	string.val.string.len = (serverValue == value) ? length : strlen(serverValue);
+	pushJsonbValue(state, token, &string);
+}
+
+static void
+JsonbPushNumeric(JsonbParseState **state, int token, Datum numeric)
+{
+	JsonbValue number;
+
+	number.type = jbvNumeric;
+	number.val.numeric = DatumGetNumeric(numeric);
+	pushJsonbValue(state, token, &number);
+}
@@ -42,6 +42,7 @@
 #include "miscadmin.h"
 
 static char * mongo_get_option_value(Oid foreignTableId, const char *optionName);
+static MongoProjectionMode mongo_parse_projection(const char *value);
 
 /*
  * Validate the generic options given to a FOREIGN DATA WRAPPER, SERVER,
@@ -103,6 +104,77 @@ mongo_fdw_validator(PG_FUNCTION_ARGS)
 			int32 portNumber = pg_atoi(optionValue, sizeof(int32), 0);
 			(void) portNumber;
 		}
+		/* projection must be auto or a boolean */
+		else if (strncmp(optionName, OPTION_NAME_PROJECTION, NAMEDATALEN) == 0)
+		{
+			(void) mongo_parse_projection(defGetString(optionDef));
+		}
+		/* _id_time names a column */
+		else if (strncmp(optionName, OPTION_NAME_ID_TIME, NAMEDATALEN) == 0)
+		{
+			if (defGetString(optionDef)[0] == '\0')
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+								errmsg("\"%s\" must name a column",
+									   OPTION_NAME_ID_TIME)));
+		}
+#ifdef META_DRIVER
+		/* batch_size must be a non-negative integer */
+		else if (strncmp(optionName, OPTION_NAME_BATCH_SIZE, NAMEDATALEN) == 0)
+		{
+			char *optionValue = defGetString(optionDef);
+			int32 batchSize = pg_atoi(optionValue, sizeof(int32), 0);
+
+			if (batchSize < 0)
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+								errmsg("\"%s\" must be a non-negative integer",
+									   OPTION_NAME_BATCH_SIZE)));
+		}
+		/*
+		 * prefetch, async, rescan_cache, remote_explain, ordered and journal
+		 * must be booleans
+		 */
+		else if (strncmp(optionName, OPTION_NAME_PREFETCH, NAMEDATALEN) == 0 ||
+				 strncmp(optionName, OPTION_NAME_ASYNC, NAMEDATALEN) == 0 ||
+				 strncmp(optionName, OPTION_NAME_RESCAN_CACHE, NAMEDATALEN) == 0 ||
+				 strncmp(optionName, OPTION_NAME_REMOTE_EXPLAIN, NAMEDATALEN) == 0 ||
+				 strncmp(optionName, OPTION_NAME_ORDERED, NAMEDATALEN) == 0 ||
+				 strncmp(optionName, OPTION_NAME_JOURNAL, NAMEDATALEN) == 0)
+		{
+			(void) defGetBoolean(optionDef);
+		}
+		/* insert_batch_size must be a positive integer */
+		else if (strncmp(optionName, OPTION_NAME_INSERT_BATCH_SIZE, NAMEDATALEN) == 0)
+		{
+			char *optionValue = defGetString(optionDef);
+			int32 insertBatchSize = pg_atoi(optionValue, sizeof(int32), 0);
+
+			if (insertBatchSize < 1)
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+								errmsg("\"%s\" must be a positive integer",
+									   OPTION_NAME_INSERT_BATCH_SIZE)));
+		}
+		/* write_concern must be a non-negative integer, "majority" or a tag */
+		else if (strncmp(optionName, OPTION_NAME_WRITE_CONCERN, NAMEDATALEN) == 0)
+		{
+			char *optionValue = defGetString(optionDef);
+
+			/* a leading digit makes it a count, which pg_atoi checks */
+			if (isdigit((unsigned char) optionValue[0]))
+				(void) pg_atoi(optionValue, sizeof(int32), 0);
+			else if (optionValue[0] == '\0' || optionValue[0] == '-')
+				ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+								errmsg("\"%s\" must be a non-negative integer, \"majority\" or a tag name",
+									   OPTION_NAME_WRITE_CONCERN)));
+		}
+		/* as with file_fdw, only superusers may have the server read files */
+		else if (strncmp(optionName, OPTION_NAME_FILENAME, NAMEDATALEN) == 0)
+		{
+			if (!superuser())
+				ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+								errmsg("only superuser can change option \"%s\"",
+									   OPTION_NAME_FILENAME)));
+		}
+#endif
 	}
 	PG_RETURN_VOID();
 }
@@ -152,6 +224,8 @@ mongo_get_options(Oid foreignTableId)
 	char                    *collectionName = NULL;
 	char                    *svr_username= NULL;
 	char                    *svr_password= NULL;
+	char                    *projectionName = NULL;
+	MongoProjectionMode     projection = MONGO_PROJECTION_AUTO;
 #ifdef META_DRIVER
 	char                    *readPreference = NULL;
 	char                    *authenticationDatabase = NULL;
@@ -163,6 +237,24 @@ mongo_get_options(Oid foreignTableId)
  	char 										*ca_dir = NULL;
  	char 										*crl_file = NULL;
  	bool 										weak_cert_validation = false;
+	char                    *batchSizeName = NULL;
+	int32                   batchSize = DEFAULT_BATCH_SIZE;
+	char                    *prefetchName = NULL;
+	bool                    prefetch = false;
+	char                    *asyncName = NULL;
+	bool                    async = false;
+	char                    *rescanCacheName = NULL;
+	bool                    rescanCache = false;
+	char                    *remoteExplainName = NULL;
+	bool                    remoteExplain = false;
+	char                    *insertBatchSizeName = NULL;
+	int32                   insertBatchSize = DEFAULT_INSERT_BATCH_SIZE;
+	char                    *orderedName = NULL;
+	bool                    ordered = true;
+	char                    *writeConcern = NULL;
+	char                    *journalName = NULL;
+	bool                    journal = false;
+	char                    *filename = NULL;
 
 	readPreference = mongo_get_option_value(foreignTableId, OPTION_NAME_READ_PREFERENCE);
 	authenticationDatabase = mongo_get_option_value(foreignTableId, OPTION_NAME_AUTHENTICATION_DATABASE);
@@ -174,6 +266,42 @@ mongo_get_options(Oid foreignTableId)
 	ca_dir = mongo_get_option_value(foreignTableId, OPTION_NAME_CA_DIR);
 	crl_file = mongo_get_option_value(foreignTableId, OPTION_NAME_CRL_FILE);
 	weak_cert_validation = mongo_get_option_value(foreignTableId, OPTION_NAME_WEAK_CERT);
+
+	batchSizeName = mongo_get_option_value(foreignTableId, OPTION_NAME_BATCH_SIZE);
+	if (batchSizeName != NULL)
+		batchSize = pg_atoi(batchSizeName, sizeof(int32), 0);
+
+	prefetchName = mongo_get_option_value(foreignTableId, OPTION_NAME_PREFETCH);
+	if (prefetchName != NULL)
+		(void) parse_bool(prefetchName, &prefetch);
+
+	asyncName = mongo_get_option_value(foreignTableId, OPTION_NAME_ASYNC);
+	if (asyncName != NULL)
+		(void) parse_bool(asyncName, &async);
+
+	rescanCacheName = mongo_get_option_value(foreignTableId, OPTION_NAME_RESCAN_CACHE);
+	if (rescanCacheName != NULL)
+		(void) parse_bool(rescanCacheName, &rescanCache);
+
+	remoteExplainName = mongo_get_option_value(foreignTableId, OPTION_NAME_REMOTE_EXPLAIN);
+	if (remoteExplainName != NULL)
+		(void) parse_bool(remoteExplainName, &remoteExplain);
+
+	insertBatchSizeName = mongo_get_option_value(foreignTableId, OPTION_NAME_INSERT_BATCH_SIZE);
+	if (insertBatchSizeName != NULL)
+		insertBatchSize = pg_atoi(insertBatchSizeName, sizeof(int32), 0);
+
+	orderedName = mongo_get_option_value(foreignTableId, OPTION_NAME_ORDERED);
+	if (orderedName != NULL)
+		(void) parse_bool(orderedName, &ordered);
+
+	writeConcern = mongo_get_option_value(foreignTableId, OPTION_NAME_WRITE_CONCERN);
+
+	journalName = mongo_get_option_value(foreignTableId, OPTION_NAME_JOURNAL);
+	if (journalName != NULL)
+		(void) parse_bool(journalName, &journal);
+
+	filename = mongo_get_option_value(foreignTableId, OPTION_NAME_FILENAME);
 #endif
 
 	addressName = mongo_get_option_value(foreignTableId, OPTION_NAME_ADDRESS);
@@ -197,6 +325,10 @@ mongo_get_options(Oid foreignTableId)
 	svr_username = mongo_get_option_value(foreignTableId, OPTION_NAME_USERNAME);
 	svr_password = mongo_get_option_value(foreignTableId, OPTION_NAME_PASSWORD);
 
+	projectionName = mongo_get_option_value(foreignTableId, OPTION_NAME_PROJECTION);
+	if (projectionName != NULL)
+		projection = mongo_parse_projection(projectionName);
+
 	options = (MongoFdwOptions *) palloc0(sizeof(MongoFdwOptions));
 
 	options->svr_address = addressName;
@@ -205,6 +337,7 @@ mongo_get_options(Oid foreignTableId)
 	options->collectionName = collectionName;
 	options->svr_username = svr_username;
 	options->svr_password = svr_password;
+	options->projection = projection;
 
 #ifdef META_DRIVER
 	options->readPreference = readPreference;
@@ -217,6 +350,16 @@ mongo_get_options(Oid foreignTableId)
 	options->ca_dir = ca_dir;
 	options->crl_file = crl_file;
 	options->weak_cert_validation = weak_cert_validation;
+	options->batch_size = batchSize;
+	options->prefetch = prefetch;
+	options->async = async;
+	options->rescan_cache = rescanCache;
+	options->remote_explain = remoteExplain;
+	options->insert_batch_size = insertBatchSize;
+	options->ordered = ordered;
+	options->write_concern = writeConcern;
+	options->journal = journal;
+	options->filename = filename;
 #endif
 
 	return options;
@@ -233,6 +376,29 @@ mongo_free_options(MongoFdwOptions *options)
 	}
 }
 
+/*
+ * mongo_get_id_time_column returns the name of the column the _id_time option
+ * of the given foreign table names, or NULL if the table has no such option.
+ * Only the table's own options are read, so that building a query document
+ * needn't look up the user mapping.
+ */
+char *
+mongo_get_id_time_column(Oid foreignTableId)
+{
+	ForeignTable *foreignTable = GetForeignTable(foreignTableId);
+	ListCell     *optionCell = NULL;
+
+	foreach(optionCell, foreignTable->options)
+	{
+		DefElem *optionDef = (DefElem *) lfirst(optionCell);
+
+		if (strncmp(optionDef->defname, OPTION_NAME_ID_TIME, NAMEDATALEN) == 0)
+			return defGetString(optionDef);
+	}
+
+	return NULL;
+}
+
 /*
  * mongo_get_option_value walks over foreign table and foreign server options, and
  * looks for the option with the given name. If found, the function returns the
@@ -269,3 +435,24 @@ mongo_get_option_value(Oid foreignTableId, const char *optionName)
 	}
 	return optionValue;
 }
+
+/*
+ * mongo_parse_projection parses the value of the projection option, which is
+ * either auto or a boolean.
+ */
+static MongoProjectionMode
+mongo_parse_projection(const char *value)
+{
+	bool projection = false;
+
+	if (pg_strcasecmp(value, "auto") == 0)
+		return MONGO_PROJECTION_AUTO;
+
+	if (!parse_bool(value, &projection))
+		ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						errmsg("invalid value for option \"%s\": \"%s\"",
+							   OPTION_NAME_PROJECTION, value),
+						errhint("Valid values are auto, on and off.")));
+
+	return projection ? MONGO_PROJECTION_ON : MONGO_PROJECTION_OFF;
+}
@@ -134,6 +134,110 @@ execute test_where_pd(9);
 DELETE FROM test_numbers;
 DROP FOREIGN TABLE test_numbers;
 
+-- scan options test
+CREATE FOREIGN TABLE country_batches (
+_id NAME,
+name VARCHAR
+) SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'countries', batch_size '1', prefetch 'true');
+SELECT name FROM country_batches;
+ALTER FOREIGN TABLE country_batches OPTIONS (SET prefetch 'false', ADD async 'true');
+SELECT name FROM country_batches;
+ALTER FOREIGN TABLE country_batches OPTIONS (SET batch_size '-1');
+
+-- projection push down test
+CREATE FOREIGN TABLE country_fields (
+_id NAME,
+name VARCHAR,
+population INTEGER
+) SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'countries', projection 'on');
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_fields;
+SELECT name, population FROM country_fields;
+
+-- aggregate push down test
+CREATE FOREIGN TABLE country_stats (
+_id NAME,
+name VARCHAR COLLATE "C",
+population INTEGER,
+hdi FLOAT
+) SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'countries', projection 'false');
+EXPLAIN (COSTS FALSE) SELECT count(*) FROM country_stats WHERE population > 10000000;
+SELECT count(*) FROM country_stats WHERE population > 10000000;
+SELECT count(*), min(population), max(population), sum(hdi) FROM country_stats;
+
+-- ORDER BY and LIMIT push down test
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name, population FROM country_stats WHERE population > 0 ORDER BY population DESC LIMIT 2;
+SELECT name, population FROM country_stats WHERE population > 0 ORDER BY population DESC LIMIT 2;
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_stats ORDER BY name;
+SELECT name FROM country_stats ORDER BY name;
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_stats WHERE population > 10000000 LIMIT 1;
+
+-- LIKE, IN and IS NULL push down test
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_stats WHERE name LIKE 'Pol%';
+SELECT name FROM country_stats WHERE name LIKE 'Pol%';
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_stats WHERE population IN (3560000, 38540000) OR hdi IS NULL;
+SELECT name FROM country_stats WHERE population IN (3560000, 38540000) OR hdi IS NULL ORDER BY name;
+
+-- char column test
+CREATE FOREIGN TABLE country_codes (
+_id NAME,
+name CHAR(10),
+capital CHAR(3)
+) SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'countries');
+SELECT name, octet_length(name) FROM country_codes;
+SELECT capital FROM country_codes;
+
+-- parameterized path test
+SET enable_hashjoin TO off;
+SET enable_mergejoin TO off;
+SELECT s.name, e."lastElections.type" FROM country_stats s JOIN country_elections e ON e._id = s._id ORDER BY s.name;
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+
+-- json path push down test
+CREATE FOREIGN TABLE country_docs (
+_id NAME,
+name VARCHAR,
+"lastElections" JSONB
+) SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'countries', projection 'false');
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_docs WHERE "lastElections"->>'type' = 'presedential';
+SELECT name FROM country_docs WHERE "lastElections"->>'type' = 'presedential';
+
+-- array push down test
+CREATE FOREIGN TABLE country_exports (
+_id NAME,
+name VARCHAR,
+"mainExports" TEXT[]
+) SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'countries', projection 'false');
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_exports WHERE 'Reception apparatus for television' = ANY ("mainExports");
+SELECT name FROM country_exports WHERE 'Reception apparatus for television' = ANY ("mainExports");
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_exports WHERE "mainExports" @> ARRAY['Sunflower seeds, whether or not broken'];
+SELECT name FROM country_exports WHERE "mainExports" @> ARRAY['Sunflower seeds, whether or not broken'];
+SELECT name FROM country_exports WHERE "mainExports" && ARRAY['Reception apparatus for television', 'Wine of fresh grapes, including fortified wines'] ORDER BY name;
+
+-- ObjectId time test
+SELECT mongo_oid_time('5381ccf9d6d81c8e8bf0434f');
+SELECT mongo_oid_time('5381ccf9');
+SELECT name, mongo_oid_time(_id) FROM country_stats ORDER BY name;
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_stats WHERE mongo_oid_time(_id) >= '2014-05-25 10:59:05+00' AND mongo_oid_time(_id) < '2014-05-25 10:59:06+00';
+SELECT name FROM country_stats WHERE mongo_oid_time(_id) >= '2014-05-25 10:59:05+00' AND mongo_oid_time(_id) < '2014-05-25 10:59:06+00' ORDER BY name;
+SELECT name FROM country_stats WHERE mongo_oid_time(_id) < '2014-05-25 10:59:05+00';
+CREATE FOREIGN TABLE country_times (
+_id NAME,
+name VARCHAR,
+"lastElections.date" TIMESTAMP
+) SERVER mongo_server OPTIONS (database 'mongo_fdw_regress', collection 'countries', projection 'false', _id_time 'lastElections.date');
+EXPLAIN (VERBOSE, COSTS FALSE) SELECT name FROM country_times WHERE "lastElections.date" >= '2014-05-25';
+SELECT name FROM country_times WHERE "lastElections.date" >= '2014-05-25';
+ALTER FOREIGN TABLE country_times OPTIONS (SET _id_time '');
+
+DROP FOREIGN TABLE country_batches;
+DROP FOREIGN TABLE country_fields;
+DROP FOREIGN TABLE country_stats;
+DROP FOREIGN TABLE country_codes;
+DROP FOREIGN TABLE country_docs;
+DROP FOREIGN TABLE country_exports;
+DROP FOREIGN TABLE country_times;
+
 DROP FOREIGN TABLE test_json;
 DROP FOREIGN TABLE test_jsonb;
 DROP FOREIGN TABLE test_text;
@@ -146,3 +250,10 @@ DROP FOREIGN TABLE country_elections;
 DROP FOREIGN TABLE main_exports;
 DROP USER MAPPING FOR postgres SERVER mongo_server;
 DROP EXTENSION mongo_fdw CASCADE;
+
+-- extension update test
+CREATE EXTENSION mongo_fdw VERSION '1.1';
+ALTER EXTENSION mongo_fdw UPDATE TO '1.2';
+SELECT extversion FROM pg_extension WHERE extname = 'mongo_fdw';
+SELECT mongo_oid_time('5381ccf9d6d81c8e8bf04351');
+DROP EXTENSION mongo_fdw;